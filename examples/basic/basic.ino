@@ -35,6 +35,10 @@ void setup() {
   // Birth, LWT, and discovery messages are optional and will be sent whenever the
   // client connects with the MQTT broker.
 
+  // Fallback brokers are used when the broker above is unreachable, preferring whichever
+  // responds fastest.
+  // mqttLooped.addBroker(new IPAddress(127,0,0,2), 1883);
+
   // A birth message simply announces that your service is online.
   mqttLooped.setBirth("your/topic/status", "online");
 
@@ -0,0 +1,481 @@
+// Microbenchmarks for the packet builders and parsers in MQTT_Looped.
+//
+// No network is required: packets are read from and written to an in-memory transport, so
+// results only reflect the cost of building, framing and routing packets. Results are printed to
+// Serial as nanoseconds per operation and bytes written per operation.
+#include <MQTT_Looped.h>
+
+// Iterations per measurement.
+#define BENCH_ITERATIONS 2000
+
+// Time an idle connection is measured for, in ms.
+#define BENCH_IDLE_MS 2000
+
+// Most subscriptions routed through, each holding a MAXBUFFERSIZE copy of its last message.
+#if defined(__linux__) || defined(__APPLE__) || defined(ARDUINO_ARCH_ESP32)
+#define BENCH_SUBSCRIPTIONS 64
+#elif defined(ARDUINO_ARCH_ESP8266) || defined(ARDUINO_ARCH_RP2040)
+#define BENCH_SUBSCRIPTIONS 16
+#elif defined(ARDUINO_ARCH_SAMD)
+#define BENCH_SUBSCRIPTIONS 8
+#else
+#define BENCH_SUBSCRIPTIONS 2
+#endif
+
+// Heap allocations made with new, counted to check the steady state doesn't allocate. Build
+// with MQTT_STATIC_ALLOC to get 0 from setup on, too.
+volatile uint32_t allocations = 0;
+
+void* operator new(size_t size) {
+  allocations++;
+  return malloc(size);
+}
+void* operator new[](size_t size) {
+  allocations++;
+  return malloc(size);
+}
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Transport that reads from a fixed in-memory packet and discards writes.
+ */
+class MemoryTransport : public MQTTTransport {
+  public:
+    void load(const uint8_t* data, uint16_t len) {
+      this->data = data;
+      this->len = len;
+      this->pos = 0;
+    }
+    bool connect(IPAddress, uint16_t) override { return true; }
+    bool connected(void) override { return true; }
+    uint8_t status(void) override { return 0; }
+    int available(void) override { return this->len - this->pos; }
+    int read(uint8_t* buf, size_t size) override {
+      uint16_t n = this->len - this->pos;
+      if (n > size) {
+        n = size;
+      }
+      memcpy(buf, this->data + this->pos, n);
+      this->pos += n;
+      this->copied += n;
+      return n;
+    }
+    size_t write(const uint8_t* /*buf*/, size_t size) override { return size; }
+    bool isOpen(void) override { return true; }
+    void close(void) override {}
+    bool closed(void) override { return true; }
+
+    // Bytes read out of it so far.
+    uint32_t copied = 0;
+
+  private:
+    const uint8_t* data = nullptr;
+    uint16_t len = 0;
+    uint16_t pos = 0;
+};
+
+MemoryTransport transport;
+IPAddress broker(127, 0, 0, 1);
+MQTT_Looped mqttLooped(&transport, &broker, 1883, "mqtt_user", "mqtt_pass", "benchmark");
+
+// Keeps results observable so the compiler can't drop the work being timed.
+volatile uint32_t sink;
+
+// Topic and payload source text, sliced to length per run.
+const char* text =
+  "abcdefghijklmnopqrstuvwxyz/abcdefghijklmnopqrstuvwxyz/abcdefghijklmnopqrstuvwxyz/"
+  "abcdefghijklmnopqrstuvwxyz/abcdefghijklmnopqrstuvwxyz/abcdefghijklmnopqrstuvwxyz/"
+  "abcdefghijklmnopqrstuvwxyz/abcdefghijklmnopqrstuvwxyz/abcdefghijklmnopqrstuvwxyz/"
+  "abcdefghijklmnopqrstuvwxyz/";
+
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Bytes of buf one run of op writes. It runs twice, over two fill patterns, and a byte
+ *        counts if either run changed it.
+ */
+template<typename Op>
+uint32_t bytesWritten(uint8_t* buf, uint16_t size, Op op) {
+  static uint8_t first[MAXBUFFERSIZE];
+  memset(buf, 0x55, size);
+  op();
+  memcpy(first, buf, size);
+  memset(buf, 0xAA, size);
+  op();
+  uint32_t n = 0;
+  for (uint16_t i = 0; i < size; i++) {
+    n += first[i] != 0x55 || buf[i] != 0xAA;
+  }
+  return n;
+}
+
+/**
+ * @brief Print a single result line.
+ */
+void report(const char* name, uint16_t a, uint16_t b, uint32_t elapsed_us, uint32_t written) {
+  Serial.print(name);
+  if (a) {
+    Serial.print('/');
+    Serial.print(a);
+  }
+  if (b) {
+    Serial.print('/');
+    Serial.print(b);
+  }
+  Serial.print(F("\t"));
+  Serial.print((uint32_t)((uint64_t)elapsed_us * 1000 / BENCH_ITERATIONS));
+  Serial.print(F(" ns/op\t"));
+  Serial.print(written);
+  Serial.println(F(" bytes/op"));
+}
+
+/**
+ * @brief Has access to MQTT_Looped internals.
+ */
+class MQTT_LoopedBenchmark {
+  public:
+    static void connectPacket(MQTT_Looped& m) {
+      uint32_t bytes = 0;
+      uint32_t start = micros();
+      for (uint16_t i = 0; i < BENCH_ITERATIONS; i++) {
+        bytes += m.connectPacket();
+      }
+      uint32_t elapsed = micros() - start;
+      sink = bytes;
+      report("connectPacket", 0, 0, elapsed, bytesWritten(m.buffer, sizeof(m.buffer), [&m]() {
+        m.connectPacket();
+      }));
+    }
+
+    static void publishPacket(MQTT_Looped& m, uint16_t topiclen, uint16_t payloadlen) {
+      char topic[128];
+      memcpy(topic, text, topiclen);
+      topic[topiclen] = '\0';
+      uint32_t bytes = 0;
+      uint32_t start = micros();
+      for (uint16_t i = 0; i < BENCH_ITERATIONS; i++) {
+        bytes += m.publishPacket(topic, (uint8_t*)text, payloadlen, 0, false);
+      }
+      uint32_t elapsed = micros() - start;
+      sink = bytes;
+      report("publishPacket", topiclen, payloadlen, elapsed, bytesWritten(m.buffer, sizeof(m.buffer), [&]() {
+        m.publishPacket(topic, (uint8_t*)text, payloadlen, 0, false);
+      }));
+    }
+
+    static void subscribePacket(MQTT_Looped& m, uint16_t topiclen) {
+      char topic[128];
+      memcpy(topic, text, topiclen);
+      topic[topiclen] = '\0';
+      uint32_t bytes = 0;
+      uint32_t start = micros();
+      for (uint16_t i = 0; i < BENCH_ITERATIONS; i++) {
+        bytes += m.subscribePacket(topic, 0);
+      }
+      uint32_t elapsed = micros() - start;
+      sink = bytes;
+      report("subscribePacket", topiclen, 0, elapsed, bytesWritten(m.buffer, sizeof(m.buffer), [&]() {
+        m.subscribePacket(topic, 0);
+      }));
+    }
+
+    static void stringprint(MQTT_Looped& m, uint16_t len) {
+      char s[128];
+      memcpy(s, text, len);
+      s[len] = '\0';
+      uint32_t bytes = 0;
+      uint32_t start = micros();
+      for (uint16_t i = 0; i < BENCH_ITERATIONS; i++) {
+        bytes += ::stringprint(m.buffer, s) - m.buffer;
+      }
+      uint32_t elapsed = micros() - start;
+      sink = bytes;
+      report("stringprint", len, 0, elapsed, bytesWritten(m.buffer, sizeof(m.buffer), [&]() {
+        ::stringprint(m.buffer, s);
+      }));
+    }
+
+    static void packetAdditionalLen(void) {
+      uint32_t acc = 0;
+      uint32_t start = micros();
+      for (uint16_t i = 0; i < BENCH_ITERATIONS; i++) {
+        acc += ::packetAdditionalLen((uint32_t)i * 1103);
+      }
+      sink = acc;
+      // Only computes a length.
+      report("packetAdditionalLen", 0, 0, micros() - start, 0);
+    }
+
+    /**
+     * @brief Publish a sensor reading with 4 fields, formatted as JSON text and encoded in place
+     *        as CBOR. Also reports the length of each packet.
+     */
+    static void sensorPayload(MQTT_Looped& m) {
+      const char* topic = "home/sensor/livingroom/state";
+      mqtt_topic_ref_t ref = {
+        .topic = topic,
+        .len = (uint16_t)strlen(topic),
+        .progmem = false,
+        .encoded = nullptr,
+      };
+      auto json = [&m, topic](uint16_t i) -> uint16_t {
+        String json = String("{\"temp\":") + String(21.5f + i % 8) + ",\"hum\":" + String(40 + i % 16)
+          + ",\"pres\":" + String(1013.25f) + ",\"batt\":" + String(3.7f) + "}";
+        return m.publishPacket(topic, (uint8_t*)json.c_str(), json.length(), 0, false);
+      };
+      uint32_t bytes = 0;
+      uint32_t start = micros();
+      for (uint16_t i = 0; i < BENCH_ITERATIONS; i++) {
+        bytes += json(i);
+      }
+      uint32_t elapsed = micros() - start;
+      sink = bytes;
+      report("sensorJson", 0, 0, elapsed, bytesWritten(m.buffer, sizeof(m.buffer), [&json]() { json(0); }));
+      Serial.print(F("\tpacket bytes: "));
+      Serial.println(bytes / BENCH_ITERATIONS);
+
+      auto cbor = [&m, &ref](uint16_t i) -> uint16_t {
+        uint8_t* payload = m.publishPayload(ref.len, 0);
+        MQTTCborWriter cbor(payload, m.buffer + sizeof(m.buffer) - payload);
+        cbor.map(4);
+        cbor.key("temp");
+        cbor.number(21.5f + i % 8);
+        cbor.key("hum");
+        cbor.uint(40 + i % 16);
+        cbor.key("pres");
+        cbor.number(1013.25f);
+        cbor.key("batt");
+        cbor.number(3.7f);
+        return m.publishHeaders(ref, payload, cbor.length(), 0, false);
+      };
+      bytes = 0;
+      start = micros();
+      for (uint16_t i = 0; i < BENCH_ITERATIONS; i++) {
+        bytes += cbor(i);
+      }
+      elapsed = micros() - start;
+      sink = bytes;
+      report("sensorCbor", 0, 0, elapsed, bytesWritten(m.buffer, sizeof(m.buffer), [&cbor]() { cbor(0); }));
+      Serial.print(F("\tpacket bytes: "));
+      Serial.println(bytes / BENCH_ITERATIONS);
+    }
+
+    /**
+     * @brief Frame a publish packet from the in-memory client, also reporting how many
+     *        readFullPacket() steps each packet takes. Bytes written are those read out of the
+     *        transport. With MQTT_COROUTINES, readFullPacket() is the coroutine, and the switch
+     *        based state machine is timed too.
+     */
+    static void readFullPacket(MQTT_Looped& m, uint16_t topiclen, uint16_t payloadlen) {
+      uint8_t packet[MAXBUFFERSIZE];
+      char topic[128];
+      memcpy(topic, text, topiclen);
+      topic[topiclen] = '\0';
+      uint16_t len = m.publishPacket(topic, (uint8_t*)text, payloadlen, 0, false);
+      memcpy(packet, m.publish_start, len);
+
+      uint32_t steps = 0;
+      uint32_t bytes = 0;
+      transport.copied = 0;
+      uint32_t start = micros();
+      for (uint16_t i = 0; i < BENCH_ITERATIONS; i++) {
+        transport.load(packet, len);
+        do {
+          m.readFullPacket();
+          steps++;
+        } while (m.read_packet_jump_to != -1);
+        bytes += m.full_packet_len;
+      }
+      sink = bytes;
+      report("readFullPacket", topiclen, payloadlen, micros() - start, transport.copied / BENCH_ITERATIONS);
+      Serial.print(F("\tsteps/op: "));
+      Serial.println(steps / BENCH_ITERATIONS);
+
+#if MQTT_COROUTINES
+      // Same packet through the switch based state machine, for comparison.
+      steps = 0;
+      bytes = 0;
+      transport.copied = 0;
+      start = micros();
+      for (uint16_t i = 0; i < BENCH_ITERATIONS; i++) {
+        transport.load(packet, len);
+        do {
+          m.readFullPacketSteps();
+          steps++;
+        } while (m.read_packet_jump_to != -1);
+        bytes += m.full_packet_len;
+      }
+      sink = bytes;
+      report("readFullPacketSteps", topiclen, payloadlen, micros() - start, transport.copied / BENCH_ITERATIONS);
+      Serial.print(F("\tsteps/op: "));
+      Serial.println(steps / BENCH_ITERATIONS);
+#endif
+    }
+
+    /**
+     * @brief Route a publish packet to the last of `count` subscriptions. Bytes written are
+     *        those copied into the subscription.
+     */
+    static void handleSubscriptionPacket(MQTT_Looped& m, uint16_t count) {
+      static char topics[BENCH_SUBSCRIPTIONS][12];
+      while (m.mqttSubs.size() < count) {
+        char* t = topics[m.mqttSubs.size()];
+        snprintf(t, sizeof(topics[0]), "bench/%u", (unsigned)m.mqttSubs.size());
+        if (!m.onMqtt(t, [](char*, uint16_t){})) {
+          return; // over MQTT_MAX_SUBSCRIPTIONS
+        }
+      }
+      MQTTSubscribe* target = m.mqttSubs.back();
+      uint8_t packet[MAXBUFFERSIZE];
+      uint16_t len = m.publishPacket(target->topic, (uint8_t*)text, 8, 0, false);
+      memcpy(packet, m.publish_start, len);
+
+      auto route = [&]() {
+        memcpy(m.buffer, packet, len);
+        m.full_packet_len = len;
+        m.handleSubscriptionPacket();
+        target->new_message = false;
+      };
+      uint32_t bytes = 0;
+      uint32_t start = micros();
+      for (uint16_t i = 0; i < BENCH_ITERATIONS; i++) {
+        route();
+        bytes += len + target->datalen;
+      }
+      uint32_t elapsed = micros() - start;
+      sink = bytes;
+      report("handleSubscriptionPacket", count, 0, elapsed, bytesWritten(target->lastread, sizeof(target->lastread), route));
+    }
+
+    /**
+     * @brief Keep an idle connection for BENCH_IDLE_MS, first calling loop() back to back, then
+     *        sleeping until msUntilNextDeadline() between calls. Reports loop() calls and time
+     *        spent awake over the whole period.
+     */
+    static void idle(MQTT_Looped& m) {
+      transport.load(nullptr, 0);
+      for (bool sleep : { false, true }) {
+        m.status = MQTT_LOOPED_STATUS_OKAY;
+        m.last_con_verify.start();
+        uint32_t calls = 0;
+        uint32_t busy_us = 0;
+        uint32_t start = millis();
+        while (millis() - start < BENCH_IDLE_MS) {
+          uint32_t t = micros();
+          uint32_t wait = sleep && !m.ioPending() ? m.msUntilNextDeadline() : 0;
+          busy_us += micros() - t;
+          if (wait > 0) {
+            uint32_t left = BENCH_IDLE_MS - (millis() - start);
+            delay(wait < left ? wait : left);
+          }
+          t = micros();
+          m.loop();
+          busy_us += micros() - t;
+          calls++;
+        }
+        Serial.print(sleep ? F("idleSleep") : F("idleSpin"));
+        Serial.print(F("\t"));
+        Serial.print(calls);
+        Serial.print(F(" loops\t"));
+        Serial.print(busy_us);
+        Serial.println(F(" us awake"));
+      }
+    }
+
+    /**
+     * @brief Run a connection in steady state: receive a publish on a subscribed topic, then
+     *        publish text, numbers, JSON and CBOR, once per iteration. Reports heap allocations
+     *        made with new during setup and over all iterations, which should be 0.
+     */
+    static void steadyState(MQTT_Looped& m) {
+      uint32_t before = allocations;
+      static uint32_t received = 0;
+      m.onMqtt("bench/steady/set", [](char*, uint16_t) { received++; });
+      const MQTTTopic* topic = m.registerTopic("bench/steady", "count");
+      m.setChangeFilter("bench/steady/temp", 60000, 0.1);
+      uint32_t setup = allocations - before;
+
+      uint8_t packet[MAXBUFFERSIZE];
+      uint16_t len = m.publishPacket("bench/steady/set", (uint8_t*)text, 8, 0, false);
+      memcpy(packet, m.publish_start, len);
+
+      before = allocations;
+      for (uint16_t i = 0; i < BENCH_ITERATIONS; i++) {
+        transport.load(packet, len);
+        m.status = MQTT_LOOPED_STATUS_OKAY;
+        m.last_con_verify.start();
+        for (uint8_t j = 0; j < 8; j++) {
+          m.loop();
+        }
+        m.status = MQTT_LOOPED_STATUS_OKAY;
+        m.mqttSendMessage("bench/steady/state", "on");
+        m.mqttSendMessage("bench/steady/temp", 21.5f + i % 4);
+        if (topic != nullptr) {
+          m.mqttSendMessage(topic, (uint32_t)i);
+        }
+        m.mqttSendJson("bench/steady/json", [i](MQTTJsonWriter& json) {
+          json.beginObject();
+          json.key("i");
+          json.uint(i);
+          json.endObject();
+        });
+        m.mqttSendCbor("bench/steady/cbor", [i](MQTTCborWriter& cbor) {
+          cbor.map(1);
+          cbor.key("i");
+          cbor.uint(i);
+        });
+      }
+      Serial.print(F("steadyState\t"));
+      Serial.print(setup);
+      Serial.print(F(" allocs in setup\t"));
+      Serial.print(allocations - before);
+      Serial.print(F(" allocs in "));
+      Serial.print(received);
+      Serial.println(F(" iterations"));
+    }
+
+    static void run(MQTT_Looped& m) {
+      steadyState(m);
+      connectPacket(m);
+      for (uint16_t topiclen : { 16, 48, 96 }) {
+        for (uint16_t payloadlen : { 4, 64, 256 }) {
+          if (topiclen + payloadlen + 8 > MAXBUFFERSIZE) continue;
+          publishPacket(m, topiclen, payloadlen);
+        }
+      }
+      sensorPayload(m);
+      for (uint16_t topiclen : { 16, 48, 96 }) {
+        subscribePacket(m, topiclen);
+      }
+      for (uint16_t len : { 8, 32, 96 }) {
+        stringprint(m, len);
+      }
+      packetAdditionalLen();
+      for (uint16_t payloadlen : { 4, 64, 256 }) {
+        if (48 + payloadlen + 8 > MAXBUFFERSIZE) continue;
+        readFullPacket(m, 48, payloadlen);
+      }
+      for (uint16_t count : { 1, 8, 32, 64 }) {
+        if (count > BENCH_SUBSCRIPTIONS) continue;
+        handleSubscriptionPacket(m, count);
+      }
+      idle(m);
+    }
+};
+
+// -------------------------------------------------------------------------------------------------
+
+void setup() {
+  Serial.begin(115200);
+  while (!Serial);
+  Serial.println(F("MQTT_Looped benchmark"));
+  MQTT_LoopedBenchmark::run(mqttLooped);
+  Serial.println(F("done"));
+}
+
+void loop() {}
@@ -0,0 +1,422 @@
+// Fleet load generator: runs many MQTT_Looped clients in one process against a local broker.
+//
+// Every client connects at once (a reconnect storm), subscribes, sends its birth message and
+// discoveries, then publishes telemetry on a fixed schedule. Each client subscribes to its own
+// state topic, so every publish comes back through the broker and its round trip is measured.
+//
+// Meant for a Linux host, built with an Arduino-on-Linux core (e.g. EpoxyDuino), where clients
+// are spread over worker threads each driven by epoll. It also builds for ESP32 (select() instead
+// of epoll), where lwIP limits the fleet to a handful of sockets.
+//
+// Built with MQTT_TLS, clients connect over TLS instead. Halfway through, every connection is
+// dropped, so the second storm resumes the sessions from the first and the report compares full
+// and resumed handshake times.
+#include <MQTT_Looped.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <unistd.h>
+#else
+#include <sys/select.h>
+#endif
+
+// Broker to load.
+#define FLEET_BROKER IPAddress(127, 0, 0, 1)
+#define FLEET_USER ""
+#define FLEET_PASS ""
+#if MQTT_TLS
+#define FLEET_PORT 8883
+// Name on the broker's certificate, and the CA that signed it.
+#define FLEET_HOST "localhost"
+#define FLEET_CA_FILE "ca.crt"
+#else
+#define FLEET_PORT 1883
+#endif
+
+#ifdef __linux__
+#define FLEET_CLIENTS 2000
+#define FLEET_THREADS 4
+#else
+#define FLEET_CLIENTS 8
+#define FLEET_THREADS 1
+#endif
+
+// Seconds to run after starting the storm.
+#define FLEET_DURATION 120
+
+// Telemetry publish interval per client, ms. Clients are phase shifted across the interval.
+#define FLEET_PUBLISH_INTERVAL 5000
+
+// Discovery messages per client.
+#define FLEET_DISCOVERIES 4
+
+// -------------------------------------------------------------------------------------------------
+
+#ifdef __linux__
+/**
+ * @brief Transport keeping its socket in its worker's epoll set from connect() to close(), so a
+ *        reconnect that gets the same fd number back is registered again.
+ */
+class FleetTransport : public MQTTTransportPosix {
+  public:
+    // Worker's epoll set, and the client's index.
+    int ep = -1;
+    uint16_t index = 0;
+
+    bool connect(IPAddress address, uint16_t port) override {
+      if (!MQTTTransportPosix::connect(address, port)) {
+        return false;
+      }
+      struct epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.u32 = this->index;
+      epoll_ctl(this->ep, EPOLL_CTL_ADD, this->fd(), &ev);
+      return true;
+    }
+
+    void close(void) override {
+      if (this->fd() >= 0) {
+        epoll_ctl(this->ep, EPOLL_CTL_DEL, this->fd(), nullptr);
+      }
+      MQTTTransportPosix::close();
+    }
+};
+#else
+typedef MQTTTransportPosix FleetTransport;
+#endif
+
+/**
+ * @brief Counters and samples collected by one worker.
+ */
+struct FleetStats {
+  uint32_t published = 0;
+  uint32_t received = 0;
+  uint32_t commands = 0;
+  std::vector<uint32_t> latency_us;
+};
+
+/**
+ * @brief One simulated device.
+ */
+struct FleetClient {
+  FleetTransport transport;
+#if MQTT_TLS
+  MQTTTransportTls* tls;
+#endif
+  // transport, or tls over it.
+  MQTTTransport* io;
+  MQTT_Looped* mqtt;
+  FleetStats* stats;
+  char id[16];
+  char state_topic[32];
+  char set_topic[32];
+  char discovery_topics[FLEET_DISCOVERIES][48];
+  uint32_t connected_at = 0;
+  uint32_t next_publish = 0;
+  // Time it next needs a loop, unless data comes in first.
+  uint32_t wake_at = 0;
+};
+
+IPAddress broker = FLEET_BROKER;
+FleetClient clients[FLEET_CLIENTS];
+FleetStats stats[FLEET_THREADS];
+std::atomic<bool> running(true);
+uint32_t storm_start;
+#ifdef __linux__
+// One epoll set per worker.
+int epolls[FLEET_THREADS];
+#endif
+#if MQTT_TLS
+// One per worker, as the random number generator isn't thread safe.
+MQTTTlsConfig tls_configs[FLEET_THREADS];
+std::atomic<bool> dropped(false);
+#endif
+
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Configure a client's topics, birth, will, discoveries and subscriptions.
+ */
+void setupClient(FleetClient& c, uint16_t i, FleetStats* s) {
+  c.stats = s;
+#ifdef __linux__
+  c.transport.ep = epolls[i % FLEET_THREADS];
+  c.transport.index = i;
+#endif
+  snprintf(c.id, sizeof(c.id), "fleet-%04u", i);
+  snprintf(c.state_topic, sizeof(c.state_topic), "fleet/%s/state", c.id);
+  snprintf(c.set_topic, sizeof(c.set_topic), "fleet/%s/set", c.id);
+#if MQTT_TLS
+  c.tls = new MQTTTransportTls(&c.transport, &tls_configs[i % FLEET_THREADS], FLEET_HOST);
+  c.io = c.tls;
+#else
+  c.io = &c.transport;
+#endif
+  c.mqtt = new MQTT_Looped(c.io, &broker, FLEET_PORT, FLEET_USER, FLEET_PASS, c.id);
+  c.mqtt->setBirth(c.state_topic, "online");
+  c.mqtt->setWill(c.state_topic, "offline");
+  // Discovery payloads are built when sent, so they aren't kept per client.
+  FleetClient* cp = &c;
+  for (uint8_t d = 0; d < FLEET_DISCOVERIES; d++) {
+    snprintf(c.discovery_topics[d], sizeof(c.discovery_topics[0]), "homeassistant/sensor/%s/%u/config", c.id, d);
+    c.mqtt->addDiscovery(c.discovery_topics[d], [cp, d](MQTTJsonWriter& json) {
+      char uniq_id[24];
+      snprintf(uniq_id, sizeof(uniq_id), "%s-%u", cp->id, d);
+      json.beginObject();
+      json.key("name");
+      json.string(uniq_id);
+      json.key("stat_t");
+      json.string(cp->state_topic);
+      json.key("uniq_id");
+      json.string(uniq_id);
+      json.endObject();
+    }, 0, true);
+  }
+  // Echo of our own telemetry: payload is the send time in micros.
+  c.mqtt->onMqtt(c.state_topic, [cp](char* payload, uint16_t len) {
+    if (len == 0 || payload[0] < '0' || payload[0] > '9') {
+      return; // birth/will
+    }
+    uint32_t sent = strtoul(payload, nullptr, 10);
+    cp->stats->received++;
+    cp->stats->latency_us.push_back(micros() - sent);
+  });
+  c.mqtt->onMqtt(c.set_topic, [cp](char*, uint16_t) {
+    cp->stats->commands++;
+  });
+  c.next_publish = millis() + (uint32_t)i * FLEET_PUBLISH_INTERVAL / FLEET_CLIENTS;
+}
+
+/**
+ * @brief Run one client's loop and its publish schedule, and note when it next needs a loop.
+ */
+void tickClient(FleetClient& c) {
+  c.mqtt->loop();
+  bool connected = c.mqtt->mqttIsConnected();
+  if (connected && c.connected_at == 0) {
+    c.connected_at = millis() - storm_start;
+  }
+  if (connected && (int32_t)(millis() - c.next_publish) >= 0 && !c.mqtt->mqttIsActive()) {
+    c.next_publish += FLEET_PUBLISH_INTERVAL;
+    c.mqtt->mqttSendMessage(c.state_topic, (uint32_t)micros());
+    c.stats->published++;
+  }
+  uint32_t wait = c.mqtt->msUntilNextDeadline();
+  if (connected) {
+    int32_t publish = c.next_publish - millis();
+    wait = std::min(wait, (uint32_t)std::max(publish, (int32_t)0));
+  }
+  c.wake_at = millis() + wait;
+}
+
+/**
+ * @brief Worker: drives every FLEET_THREADS-th client. Clients with pending input are looped
+ *        until their packet has been handled, then clients whose next deadline has come are.
+ */
+void worker(uint8_t w) {
+#if MQTT_TLS
+  bool dropped_here = false;
+#endif
+#ifdef __linux__
+  int ep = epolls[w];
+  struct epoll_event events[64];
+#endif
+  while (running) {
+#ifdef __linux__
+    int n = epoll_wait(ep, events, 64, 1);
+    for (int e = 0; e < n; e++) {
+      FleetClient& c = clients[events[e].data.u32];
+      // Reading a packet takes a few loops; a closed socket is readable with nothing available,
+      // and the first loop notices it.
+      tickClient(c);
+      for (uint8_t k = 1; k < 8 && c.io->available(); k++) {
+        tickClient(c);
+      }
+    }
+#else
+    fd_set rfds;
+    FD_ZERO(&rfds);
+    int maxfd = -1;
+    for (uint16_t i = w; i < FLEET_CLIENTS; i += FLEET_THREADS) {
+      int fd = clients[i].transport.fd();
+      if (fd >= 0) {
+        FD_SET(fd, &rfds);
+        maxfd = std::max(maxfd, fd);
+      }
+    }
+    struct timeval tv = { 0, 1000 };
+    if (maxfd >= 0 && select(maxfd + 1, &rfds, nullptr, nullptr, &tv) > 0) {
+      for (uint16_t i = w; i < FLEET_CLIENTS; i += FLEET_THREADS) {
+        int fd = clients[i].transport.fd();
+        if (fd < 0 || !FD_ISSET(fd, &rfds)) {
+          continue;
+        }
+        tickClient(clients[i]);
+        for (uint8_t k = 1; k < 8 && clients[i].io->available(); k++) {
+          tickClient(clients[i]);
+        }
+      }
+    }
+#endif
+#if MQTT_TLS
+    // Drop every connection once, so they reconnect with the sessions they have.
+    if (dropped && !dropped_here) {
+      for (uint16_t i = w; i < FLEET_CLIENTS; i += FLEET_THREADS) {
+        clients[i].io->close();
+        clients[i].wake_at = millis();
+      }
+      dropped_here = true;
+    }
+#endif
+    uint32_t now = millis();
+    for (uint16_t i = w; i < FLEET_CLIENTS; i += FLEET_THREADS) {
+      if ((int32_t)(now - clients[i].wake_at) >= 0) {
+        tickClient(clients[i]);
+      }
+    }
+  }
+}
+
+// -------------------------------------------------------------------------------------------------
+
+void report(void) {
+  std::vector<uint32_t> connect_ms;
+  FleetStats total;
+  for (uint16_t i = 0; i < FLEET_CLIENTS; i++) {
+    if (clients[i].connected_at) {
+      connect_ms.push_back(clients[i].connected_at);
+    }
+  }
+  for (uint8_t w = 0; w < FLEET_THREADS; w++) {
+    total.published += stats[w].published;
+    total.received += stats[w].received;
+    total.commands += stats[w].commands;
+    total.latency_us.insert(total.latency_us.end(), stats[w].latency_us.begin(), stats[w].latency_us.end());
+  }
+  std::sort(connect_ms.begin(), connect_ms.end());
+  std::sort(total.latency_us.begin(), total.latency_us.end());
+#if MQTT_TLS
+  mqtt_tls_stats_t tls = {};
+  for (uint16_t i = 0; i < FLEET_CLIENTS; i++) {
+    const mqtt_tls_stats_t* t = clients[i].tls->getStats();
+    tls.full += t->full;
+    tls.resumed += t->resumed;
+    tls.failed += t->failed;
+    tls.full_ms += t->full_ms;
+    tls.resumed_ms += t->resumed_ms;
+  }
+#endif
+
+  auto pct = [](std::vector<uint32_t>& v, uint8_t p) -> uint32_t {
+    return v.empty() ? 0 : v[(v.size() - 1) * p / 100];
+  };
+
+  Serial.print(F("clients connected:\t"));
+  Serial.print(connect_ms.size());
+  Serial.print('/');
+  Serial.println(FLEET_CLIENTS);
+  Serial.print(F("connect storm ms:\tp50 "));
+  Serial.print(pct(connect_ms, 50));
+  Serial.print(F("\tp95 "));
+  Serial.print(pct(connect_ms, 95));
+  Serial.print(F("\tall "));
+  Serial.println(connect_ms.empty() ? 0 : connect_ms.back());
+  Serial.print(F("published:\t\t"));
+  Serial.print(total.published);
+  Serial.print(F("\t("));
+  Serial.print(total.published / FLEET_DURATION);
+  Serial.println(F("/s)"));
+  Serial.print(F("received:\t\t"));
+  Serial.println(total.received);
+  Serial.print(F("latency us:\t\tp50 "));
+  Serial.print(pct(total.latency_us, 50));
+  Serial.print(F("\tp90 "));
+  Serial.print(pct(total.latency_us, 90));
+  Serial.print(F("\tp99 "));
+  Serial.print(pct(total.latency_us, 99));
+  Serial.print(F("\tmax "));
+  Serial.println(total.latency_us.empty() ? 0 : total.latency_us.back());
+#if MQTT_TLS
+  Serial.print(F("tls full handshakes:\t"));
+  Serial.print(tls.full);
+  Serial.print(F("\tavg ms "));
+  Serial.println(tls.full ? tls.full_ms / tls.full : 0);
+  Serial.print(F("tls resumed:\t\t"));
+  Serial.print(tls.resumed);
+  Serial.print(F("\tavg ms "));
+  Serial.println(tls.resumed ? tls.resumed_ms / tls.resumed : 0);
+  Serial.print(F("tls failed:\t\t"));
+  Serial.println(tls.failed);
+#endif
+}
+
+#if MQTT_TLS
+/**
+ * @brief Read the CA certificate and set up each worker's TLS config.
+ */
+bool setupTls(void) {
+  static char ca[8192];
+  FILE* f = fopen(FLEET_CA_FILE, "r");
+  if (f == nullptr) {
+    Serial.println(F("Can't open " FLEET_CA_FILE));
+    return false;
+  }
+  ca[fread(ca, 1, sizeof(ca) - 1, f)] = '\0';
+  fclose(f);
+  for (auto& config : tls_configs) {
+    if (!config.begin(ca)) {
+      return false;
+    }
+  }
+  return true;
+}
+#endif
+
+void setup() {
+  Serial.begin(115200);
+  // On ESP32, bring up WiFi here (WiFi.begin()) and wait for it before starting the storm.
+#if MQTT_TLS
+  if (!setupTls()) {
+    return;
+  }
+#endif
+#ifdef __linux__
+  for (auto& ep : epolls) {
+    ep = epoll_create1(0);
+  }
+#endif
+  for (uint16_t i = 0; i < FLEET_CLIENTS; i++) {
+    setupClient(clients[i], i, &stats[i % FLEET_THREADS]);
+  }
+  Serial.print(F("Starting "));
+  Serial.print(FLEET_CLIENTS);
+  Serial.println(F(" clients"));
+  storm_start = millis();
+  std::vector<std::thread> threads;
+  for (uint8_t w = 0; w < FLEET_THREADS; w++) {
+    threads.emplace_back(worker, w);
+  }
+#if MQTT_TLS
+  delay(FLEET_DURATION * 500UL);
+  dropped = true;
+  delay(FLEET_DURATION * 500UL);
+#else
+  delay(FLEET_DURATION * 1000UL);
+#endif
+  running = false;
+  for (auto& t : threads) {
+    t.join();
+  }
+#ifdef __linux__
+  for (int ep : epolls) {
+    close(ep);
+  }
+#endif
+  report();
+}
+
+void loop() {}
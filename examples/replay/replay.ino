@@ -0,0 +1,118 @@
+// Replays a capture of a connection through MQTT_Looped, as a repeatable benchmark.
+//
+// Captures are recorded on the device by wrapping its transport:
+//
+//   MQTTStorageFile captureFile("/spiffs/capture.mqc", 262144);
+//   MQTTTransportCapture capture(&transport, &captureFile);
+//   MQTT_Looped mqttLooped(&capture, &broker, 1883, user, pass, "device");
+//
+// and played back here, once with the original timing and once as fast as MQTT_Looped reads it.
+// Set up the client as the device was, so it writes what the device wrote. Reports loop() calls,
+// time spent in loop(), how long inbound data waited to be read, calls to new, and bytes written
+// that differ from the capture.
+//
+// Runs on Linux and macOS hosts (built with an Arduino-on-Linux core such as EpoxyDuino), where
+// the capture is taken from $MQTT_CAPTURE, and on ESP32.
+#include <MQTT_Looped.h>
+
+#define REPLAY_FILE "/spiffs/capture.mqc"
+
+// Largest capture read.
+#define REPLAY_MAX_BYTES (16UL * 1024 * 1024)
+
+// Give up on a replay after this long, ms.
+#define REPLAY_TIMEOUT 600000
+
+// Calls to new, counted over each replay. Allocations made with malloc() directly, e.g. by the
+// core or the storage, aren't counted.
+volatile uint32_t new_calls = 0;
+
+void* operator new(size_t size) {
+  new_calls++;
+  return malloc(size);
+}
+void* operator new[](size_t size) {
+  new_calls++;
+  return malloc(size);
+}
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+
+IPAddress broker(127, 0, 0, 1);
+
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Set up the client as the device that made the capture was.
+ *
+ * @param mqtt
+ */
+void setupClient(MQTT_Looped& mqtt) {
+  mqtt.onMqtt("home/livingroom/set", [](char*, uint16_t) {});
+}
+
+/**
+ * @brief Play the capture once and print the results.
+ *
+ * @param path
+ * @param timed keep the original timing
+ */
+void replay(const char* path, bool timed) {
+  MQTTStorageFile file(path, REPLAY_MAX_BYTES);
+  MQTTTransportReplay transport(&file, timed);
+  MQTT_Looped mqtt(&transport, &broker, 1883, "", "", "device");
+  setupClient(mqtt);
+
+  uint32_t loops = 0;
+  uint32_t busy_us = 0;
+  uint32_t before = new_calls;
+  uint32_t start = millis();
+  while (!transport.done() && millis() - start < REPLAY_TIMEOUT) {
+    uint32_t t = micros();
+    mqtt.loop();
+    busy_us += micros() - t;
+    loops++;
+  }
+  uint32_t elapsed = millis() - start;
+
+  const mqtt_replay_stats_t* stats = transport.getStats();
+  Serial.print(timed ? F("timed") : F("fast"));
+  Serial.print(transport.done() ? F("\tms ") : F("\ttimed out, ms "));
+  Serial.print(elapsed);
+  Serial.print(F("\tloops "));
+  Serial.print(loops);
+  Serial.print(F("\tin loop us "));
+  Serial.print(busy_us);
+  Serial.print(F("\tnew calls "));
+  Serial.println(new_calls - before);
+  Serial.print(F("\tconnections "));
+  Serial.print(stats->connections);
+  Serial.print(F("\tbytes in "));
+  Serial.print(stats->in_bytes);
+  Serial.print(F(" out "));
+  Serial.print(stats->out_bytes);
+  Serial.print(F("\tmismatched "));
+  Serial.print(stats->mismatched);
+  Serial.print(F("\tstalls "));
+  Serial.println(stats->stalls);
+  Serial.print(F("\tread latency us avg "));
+  Serial.print(stats->records ? stats->latency_total / stats->records : 0);
+  Serial.print(F(" max "));
+  Serial.println(stats->latency_max);
+}
+
+void setup() {
+  Serial.begin(115200);
+  const char* path = REPLAY_FILE;
+#if defined(__linux__) || defined(__APPLE__)
+  if (getenv("MQTT_CAPTURE") != nullptr) {
+    path = getenv("MQTT_CAPTURE");
+  }
+#endif
+  replay(path, true);
+  replay(path, false);
+}
+
+void loop() {}
@@ -0,0 +1,180 @@
+// A day of keepalives and broker restarts, simulated on a virtual clock in well under a second.
+//
+// The broker is simulated in memory: it answers CONNECT, SUBSCRIBE and PINGREQ, restarts every
+// BROKER_UPTIME, dropping the connection, and refuses connections for BROKER_DOWNTIME after. Time
+// only moves when the client has nothing to do, straight to its next deadline, so the same run
+// gives the same counts every time.
+//
+// Runs on Linux and macOS hosts (built with an Arduino-on-Linux core such as EpoxyDuino).
+#include <MQTT_Looped.h>
+
+#include <algorithm>
+
+// Simulated time, ms.
+#define SIM_DURATION (24UL * 60 * 60 * 1000)
+
+// Time between broker restarts, and how long it stays down, ms.
+#define BROKER_UPTIME (60UL * 60 * 1000)
+#define BROKER_DOWNTIME 30000
+
+// Shortest and longest step of the clock per loop, ms. Each loop takes some time, even when the
+// client is busy, e.g. retrying a refused connection; deadlines it doesn't report still come around.
+#define SIM_MIN_STEP 1
+#define SIM_MAX_STEP 1000
+
+// -------------------------------------------------------------------------------------------------
+
+MQTTVirtualClock simClock;
+
+/**
+ * @brief Transport with a minimal broker behind it that restarts on a schedule, MQTT 3.1.1 and QoS 0
+ *        only.
+ */
+class RestartingTransport : public MQTTTransport {
+  public:
+    uint32_t connects = 0;
+    uint32_t refused = 0;
+    uint32_t drops = 0;
+    uint32_t pings = 0;
+
+    bool connect(IPAddress, uint16_t) override {
+      if (!this->up()) {
+        this->refused++;
+        return false;
+      }
+      this->connects++;
+      this->session = this->restarts();
+      this->rx_len = 0;
+      this->tx_len = 0;
+      this->tx_pos = 0;
+      this->open = true;
+      return true;
+    }
+    bool connected(void) override {
+      if (this->open && this->session != this->restarts()) {
+        this->open = false;
+        this->drops++;
+      }
+      return this->open;
+    }
+    uint8_t status(void) override { return 0; }
+    int available(void) override { return this->connected() ? this->tx_len - this->tx_pos : 0; }
+    int read(uint8_t* buf, size_t size) override {
+      size_t n = std::min(size, (size_t)this->available());
+      memcpy(buf, this->tx + this->tx_pos, n);
+      this->tx_pos += n;
+      return n;
+    }
+    size_t write(const uint8_t* buf, size_t size) override {
+      if (!this->connected()) {
+        return 0;
+      }
+      size = std::min(size, sizeof(this->rx) - this->rx_len);
+      memcpy(this->rx + this->rx_len, buf, size);
+      this->rx_len += size;
+      this->handle();
+      return size;
+    }
+    bool isOpen(void) override { return this->open; }
+    void close(void) override { this->open = false; }
+    bool closed(void) override { return true; }
+
+  private:
+    bool open = false;
+    uint32_t session = 0;
+    uint8_t rx[512];
+    uint16_t rx_len = 0;
+    uint8_t tx[512];
+    uint16_t tx_len = 0;
+    uint16_t tx_pos = 0;
+
+    uint32_t restarts(void) { return mqttMillis() / BROKER_UPTIME; }
+    bool up(void) { return mqttMillis() % BROKER_UPTIME >= BROKER_DOWNTIME; }
+
+    /**
+     * @brief Answer each complete packet written so far.
+     */
+    void handle(void) {
+      static const uint8_t connack[] = { MQTT_CTRL_CONNECTACK << 4, 2, 0, 0 };
+      static const uint8_t pingresp[] = { MQTT_CTRL_PINGRESP << 4, 0 };
+      while (this->rx_len >= 2) {
+        uint32_t remaining;
+        const uint8_t* body = decodeVarint(this->rx + 1, this->rx + this->rx_len, &remaining);
+        if (body == nullptr || body + remaining > this->rx + this->rx_len) {
+          return; // not all here yet
+        }
+        uint16_t len = body - this->rx + remaining;
+        switch (this->rx[0] >> 4) {
+          case MQTT_CTRL_CONNECT:
+            this->reply(connack, sizeof(connack));
+            break;
+          case MQTT_CTRL_SUBSCRIBE: {
+            uint8_t suback[] = { MQTT_CTRL_SUBACK << 4, 3, body[0], body[1], 0 };
+            this->reply(suback, sizeof(suback));
+            break;
+          }
+          case MQTT_CTRL_PINGREQ:
+            this->pings++;
+            this->reply(pingresp, sizeof(pingresp));
+            break;
+        }
+        memmove(this->rx, this->rx + len, this->rx_len - len);
+        this->rx_len -= len;
+      }
+    }
+
+    void reply(const uint8_t* buf, uint16_t len) {
+      // Move what hasn't been read yet to the front.
+      memmove(this->tx, this->tx + this->tx_pos, this->tx_len - this->tx_pos);
+      this->tx_len -= this->tx_pos;
+      this->tx_pos = 0;
+      if (this->tx_len + len <= sizeof(this->tx)) {
+        memcpy(this->tx + this->tx_len, buf, len);
+        this->tx_len += len;
+      }
+    }
+};
+
+IPAddress broker(127, 0, 0, 1);
+
+void setup() {
+  Serial.begin(115200);
+  mqttSetClock(&simClock);
+
+  RestartingTransport transport;
+  MQTT_Looped mqtt(&transport, &broker, 1883, "", "", "simulated");
+  mqtt.onMqtt("home/livingroom/set", [](char*, uint16_t) {});
+
+  uint32_t loops = 0;
+  uint32_t offline = 0;
+  uint32_t start = millis();
+  while (mqttMillis() < SIM_DURATION) {
+    mqtt.loop();
+    loops++;
+    uint32_t step = mqtt.ioPending() ? 0 : mqtt.msUntilNextDeadline();
+    step = std::max((uint32_t)SIM_MIN_STEP, std::min(step, (uint32_t)SIM_MAX_STEP));
+    offline += mqtt.mqttIsConnected() ? 0 : step;
+    simClock.advance(step);
+  }
+  uint32_t wall = millis() - start;
+  mqttSetClock(nullptr);
+
+  Serial.print(F("simulated ms "));
+  Serial.print(SIM_DURATION);
+  Serial.print(F("\twall ms "));
+  Serial.print(wall);
+  Serial.print(F("\tloops "));
+  Serial.println(loops);
+  Serial.print(F("connects "));
+  Serial.print(transport.connects);
+  Serial.print(F("\trefused "));
+  Serial.print(transport.refused);
+  Serial.print(F("\tdrops "));
+  Serial.print(transport.drops);
+  Serial.print(F("\tpings "));
+  Serial.print(transport.pings);
+  Serial.print(F("\toffline ms "));
+  Serial.println(offline);
+}
+
+void loop() {}
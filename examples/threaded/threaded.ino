@@ -0,0 +1,274 @@
+// Single-threaded versus threaded MQTT_Looped: throughput, round-trip latency, and how long the
+// application's loop is held up by the network.
+//
+// The broker is simulated in memory: it answers CONNECT, SUBSCRIBE and PINGREQ, and echoes every
+// publish back, so each one makes a round trip. Writes to it take LINK_WRITE_US, like a slow
+// SPI link to a WiFi module, which is what stalls the application when both share a thread.
+//
+// Runs on Linux and macOS hosts (built with an Arduino-on-Linux core such as EpoxyDuino), where
+// the engine is a std::thread, and on ESP32, where it is a task on the other core. The threaded
+// mode needs a core of its own to pull ahead; on one core the two threads take turns.
+#include <MQTT_Looped.h>
+
+#include <algorithm>
+
+// Messages per mode.
+#if defined(__linux__) || defined(__APPLE__)
+#define BENCH_MESSAGES 20000
+#else
+#define BENCH_MESSAGES 2000
+#endif
+
+// Publishes awaiting their echo, at most.
+#define BENCH_WINDOW 8
+
+// Application work per loop, us.
+#define APP_WORK_US 20
+
+// Time each write to the network takes, us.
+#define LINK_WRITE_US 100
+
+// Time after connecting before starting, ms.
+#define BENCH_SETTLE 500
+
+// Give up on a mode after this long, ms.
+#define BENCH_TIMEOUT 60000
+
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Transport with a minimal broker behind it, MQTT 3.1.1 and QoS 0 only.
+ */
+class LoopbackTransport : public MQTTTransport {
+  public:
+    bool connect(IPAddress, uint16_t) override {
+      this->rx_len = 0;
+      this->tx_len = 0;
+      this->tx_pos = 0;
+      this->open = true;
+      return true;
+    }
+    bool connected(void) override { return this->open; }
+    uint8_t status(void) override { return 0; }
+    int available(void) override { return this->tx_len - this->tx_pos; }
+    int read(uint8_t* buf, size_t size) override {
+      size_t n = std::min(size, (size_t)(this->tx_len - this->tx_pos));
+      memcpy(buf, this->tx + this->tx_pos, n);
+      this->tx_pos += n;
+      return n;
+    }
+    size_t write(const uint8_t* buf, size_t size) override {
+      delayMicroseconds(LINK_WRITE_US);
+      size = std::min(size, sizeof(this->rx) - this->rx_len);
+      memcpy(this->rx + this->rx_len, buf, size);
+      this->rx_len += size;
+      this->handle();
+      return size;
+    }
+    bool isOpen(void) override { return this->open; }
+    void close(void) override { this->open = false; }
+    bool closed(void) override { return true; }
+
+  private:
+    bool open = false;
+    uint8_t rx[1024];
+    uint16_t rx_len = 0;
+    uint8_t tx[4096];
+    uint16_t tx_len = 0;
+    uint16_t tx_pos = 0;
+
+    /**
+     * @brief Answer each complete packet written so far.
+     */
+    void handle(void) {
+      static const uint8_t connack[] = { MQTT_CTRL_CONNECTACK << 4, 2, 0, 0 };
+      static const uint8_t pingresp[] = { MQTT_CTRL_PINGRESP << 4, 0 };
+      while (this->rx_len >= 2) {
+        uint32_t remaining;
+        const uint8_t* body = decodeVarint(this->rx + 1, this->rx + this->rx_len, &remaining);
+        if (body == nullptr || body + remaining > this->rx + this->rx_len) {
+          return; // not all here yet
+        }
+        uint16_t len = body - this->rx + remaining;
+        switch (this->rx[0] >> 4) {
+          case MQTT_CTRL_CONNECT:
+            this->reply(connack, sizeof(connack));
+            break;
+          case MQTT_CTRL_SUBSCRIBE: {
+            uint8_t suback[] = { MQTT_CTRL_SUBACK << 4, 3, body[0], body[1], 0 };
+            this->reply(suback, sizeof(suback));
+            break;
+          }
+          case MQTT_CTRL_PINGREQ:
+            this->reply(pingresp, sizeof(pingresp));
+            break;
+          case MQTT_CTRL_PUBLISH:
+            this->reply(this->rx, len);
+            break;
+        }
+        memmove(this->rx, this->rx + len, this->rx_len - len);
+        this->rx_len -= len;
+      }
+    }
+
+    void reply(const uint8_t* buf, uint16_t len) {
+      // Move what hasn't been read yet to the front.
+      memmove(this->tx, this->tx + this->tx_pos, this->tx_len - this->tx_pos);
+      this->tx_len -= this->tx_pos;
+      this->tx_pos = 0;
+      if (this->tx_len + len <= sizeof(this->tx)) {
+        memcpy(this->tx + this->tx_len, buf, len);
+        this->tx_len += len;
+      }
+    }
+};
+
+IPAddress broker(127, 0, 0, 1);
+const char* topic = "bench/echo";
+
+uint32_t latency_us[BENCH_MESSAGES];
+uint32_t received;
+
+/**
+ * @brief Echo of our own publish: payload is the send time in micros.
+ */
+void onEcho(char* payload, uint16_t) {
+  if (received < BENCH_MESSAGES) {
+    latency_us[received++] = micros() - strtoul(payload, nullptr, 10);
+  }
+}
+
+/**
+ * @brief Busy work standing in for the application.
+ */
+void work(void) {
+  uint32_t start = micros();
+  while (micros() - start < APP_WORK_US) {}
+}
+
+/**
+ * @brief Print a mode's results.
+ *
+ * @param name
+ * @param elapsed_us from first publish to last echo
+ * @param stall_us longest application loop, less its own work
+ */
+void report(const char* name, uint32_t elapsed_us, uint32_t stall_us) {
+  std::sort(latency_us, latency_us + received);
+  auto pct = [](uint8_t p) -> uint32_t {
+    return received ? latency_us[(received - 1) * p / 100] : 0;
+  };
+  Serial.print(name);
+  Serial.print(F("\tmsgs/s "));
+  Serial.print((uint32_t)((uint64_t)received * 1000000 / (elapsed_us ? elapsed_us : 1)));
+  Serial.print(F("\tlatency us p50 "));
+  Serial.print(pct(50));
+  Serial.print(F(" p99 "));
+  Serial.print(pct(99));
+  Serial.print(F("\tapp stall us max "));
+  Serial.println(stall_us);
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Application and MQTT_Looped::loop() on one thread.
+ */
+void singleThreaded(void) {
+  LoopbackTransport transport;
+  MQTT_Looped mqtt(&transport, &broker, 1883, "", "", "single");
+  mqtt.onMqtt(topic, onEcho);
+  while (!mqtt.mqttIsConnected()) {
+    mqtt.loop();
+  }
+  // Give CONNACK and SUBACK time to come back.
+  uint32_t began = millis();
+  while (millis() - began < BENCH_SETTLE) {
+    mqtt.loop();
+  }
+  received = 0;
+  uint32_t sent = 0;
+  uint32_t stall = 0;
+  began = millis();
+  uint32_t start = micros();
+  while (received < BENCH_MESSAGES && millis() - began < BENCH_TIMEOUT) {
+    uint32_t t = micros();
+    if (sent < BENCH_MESSAGES && sent - received < BENCH_WINDOW && !mqtt.mqttIsActive()) {
+      mqtt.mqttSendMessage(topic, (uint32_t)micros());
+      sent++;
+    }
+    mqtt.loop();
+    stall = std::max(stall, (uint32_t)(micros() - t));
+    work();
+  }
+  report("single", micros() - start, stall);
+}
+
+#if defined(ARDUINO_ARCH_ESP32)
+void engineTask(void* arg) {
+  MQTTThreaded* threaded = (MQTTThreaded*)arg;
+  while (true) {
+    if (!threaded->run()) {
+      vTaskDelay(1);
+    }
+  }
+}
+#endif
+
+/**
+ * @brief Application on this thread, MQTT_Looped on the engine.
+ */
+void threaded(void) {
+  LoopbackTransport transport;
+  MQTT_Looped mqtt(&transport, &broker, 1883, "", "", "threaded");
+  MQTTThreaded threaded(&mqtt);
+  threaded.onMqtt(topic, onEcho);
+#if defined(ARDUINO_ARCH_ESP32)
+  threaded.begin();
+  TaskHandle_t task;
+  xTaskCreatePinnedToCore(engineTask, "mqtt", 8192, &threaded, 1, &task, 0);
+#else
+  threaded.start();
+#endif
+  while (!threaded.connected()) {
+    delay(1);
+  }
+  delay(BENCH_SETTLE);
+  received = 0;
+  uint32_t sent = 0;
+  uint32_t stall = 0;
+  uint32_t began = millis();
+  uint32_t start = micros();
+  char payload[12];
+  while (received < BENCH_MESSAGES && millis() - began < BENCH_TIMEOUT) {
+    uint32_t t = micros();
+    if (sent < BENCH_MESSAGES && sent - received < BENCH_WINDOW) {
+      snprintf(payload, sizeof(payload), "%lu", (unsigned long)micros());
+      sent += threaded.publish(topic, payload);
+    }
+    threaded.poll();
+    stall = std::max(stall, (uint32_t)(micros() - t));
+    work();
+  }
+  uint32_t elapsed = micros() - start;
+#if defined(ARDUINO_ARCH_ESP32)
+  vTaskDelete(task);
+#else
+  threaded.stop();
+#endif
+  report("threaded", elapsed, stall);
+  mqtt_thread_stats_t stats;
+  threaded.getStats(&stats);
+  Serial.print(F("threaded\tqueue full "));
+  Serial.print(stats.queue_full);
+  Serial.print(F("\treceive full "));
+  Serial.println(stats.receive_full);
+}
+
+void setup() {
+  Serial.begin(115200);
+  singleThreaded();
+  threaded();
+}
+
+void loop() {}
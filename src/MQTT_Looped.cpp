@@ -1,36 +1,105 @@
 #include "MQTT_Looped.h"
+#include <math.h>
+
+#if MQTT_CLOCK
+MQTTClock* mqtt_clock = nullptr;
+#endif
+
+template <size_t looped, size_t subscribe>
+bool mqttLayoutMatchesLibrary(void) {
+  return true;
+}
+template bool mqttLayoutMatchesLibrary<sizeof(MQTT_Looped), sizeof(MQTTSubscribe)>(void);
 
 // -------------------------------------- SUBSCRIPTION CLASS ---------------------------------------
 
-MQTTSubscribe::MQTTSubscribe(const char* topic, uint8_t qos) : topic(topic), qos(qos) {};
+MQTTSubscribe::MQTTSubscribe(const char* topic, uint8_t qos)
+  : topic(topic),
+    topiclen(strlen(topic)),
+    wildcard(strpbrk(topic, "+#") != nullptr),
+    qos(qos)
+{}
+
+#if MQTT_PACKET_CACHE
+MQTTSubscribe::~MQTTSubscribe() {
+  delete[] this->packet;
+}
+#endif
 
 void MQTTSubscribe::setCallback(mqttcallback_t cb) {
   this->callback = cb;
 }
 
+// ----------------------------------------- TOPIC CLASS -------------------------------------------
+
+MQTTTopic::MQTTTopic(const char* prefix, const char* suffix) {
+  uint16_t prefixlen = strlen(prefix);
+  uint16_t suffixlen = strlen(suffix);
+  // Join with a `/` unless the prefix is empty or already ends with one.
+  bool slash = prefixlen > 0 && prefix[prefixlen - 1] != '/';
+  this->topiclen = prefixlen + slash + suffixlen;
+#if !MQTT_STATIC_ALLOC
+  this->encoded = new uint8_t[2 + this->topiclen + 1];
+#endif
+  uint8_t* p = this->encoded;
+  p[0] = this->topiclen >> 8;
+  p[1] = this->topiclen & 0xFF;
+  p += 2;
+  memcpy(p, prefix, prefixlen);
+  p += prefixlen;
+  if (slash) {
+    p[0] = '/';
+    p++;
+  }
+  memcpy(p, suffix, suffixlen);
+  p[suffixlen] = '\0';
+}
+
+uint16_t MQTTTopic::length(const char* prefix, const char* suffix) {
+  uint16_t prefixlen = strlen(prefix);
+  bool slash = prefixlen > 0 && prefix[prefixlen - 1] != '/';
+  return prefixlen + slash + strlen(suffix);
+}
+
 // ------------------------------------------ MAIN CLASS -------------------------------------------
 
 MQTT_Looped::MQTT_Looped(
-  WiFiClient* client,
-  const char* ssid,
-  const char* wifi_pass,
+  MQTTTransport* transport,
   IPAddress* mqtt_server,
   uint16_t port,
   const char* mqtt_user,
   const char* mqtt_pass,
   const char* mqtt_client_id
-) : wifiClient(client),
-    ssid(ssid),
-    wifi_pass(wifi_pass),
-    mqtt_server(mqtt_server),
-    port(port),
+) : transport(transport),
     mqtt_client_id(mqtt_client_id),
     mqtt_user(mqtt_user),
     mqtt_pass(mqtt_pass)
 {
-  // Create a pointer to `_sock` private property of wifiClient.
-  // @todo Abstract away from WiFi client.
-  this->_sock = &(this->wifiClient->*robbed<WiFiClientSock>::ptr);
+  this->addBroker(mqtt_server, port);
+}
+
+MQTT_Looped::~MQTT_Looped() {
+  if (this->owns_transport) {
+    delete this->transport;
+  }
+}
+
+bool MQTT_Looped::addBroker(IPAddress* mqtt_server, uint16_t port) {
+  return this->endpoints.push_back({
+    .address = mqtt_server,
+    .port = port,
+    .failures = 0,
+    .failed_at = 0,
+    .conack_latency = 0,
+  });
+}
+
+void MQTT_Looped::setFailoverThreshold(uint8_t failures) {
+  this->failover_threshold = failures > 0 ? failures : 1;
+}
+
+const mqtt_endpoint_t* MQTT_Looped::getBroker(void) {
+  return &this->endpoints.at(this->endpoint);
 }
 
 mqtt_looped_status_t MQTT_Looped::getStatus(void) {
@@ -45,6 +114,12 @@ void MQTT_Looped::loop(void) {
   //   DEBUG_PRINT(F("MQTT_Looped: "));
   //   DEBUG_PRINTLN(this->status);
   // }
+  // Finish sending a packet the transport couldn't take all of before anything else, reads
+  // included, uses the buffer.
+  if (this->sendPending()) {
+    this->continueSend();
+    return;
+  }
   switch (this->status) {
     case MQTT_LOOPED_STATUS_INIT:
     case MQTT_LOOPED_STATUS_WIFI_OFFLINE:
@@ -115,16 +190,40 @@ void MQTT_Looped::loop(void) {
       // Keep looping until we read a specific packet or we time out.
       this->readFullPacketSearch();
       return;
+    case MQTT_LOOPED_STATUS_MQTT_PUBLISHED:
+      // Check the PUBACK, then carry on with whatever published.
+      this->handlePubAck();
+      return;
     case MQTT_LOOPED_STATUS_SUBSCRIPTION_PACKET_READ:
       // If we've read a subscription packet, process the contents.
       this->handleSubscriptionPacket();
       return;
     case MQTT_LOOPED_STATUS_OKAY:
       // Verify connection every so often.
-      if (millis() - this->last_con_verify > MQTT_VERIFY_TIMEOUT) {
+      if (this->last_con_verify.expired(MQTT_VERIFY_TIMEOUT)) {
         this->verifyConnection();
         return;
       }
+      // Keep QoS 2 handshakes moving.
+      if (this->retryQos2()) {
+        return;
+      }
+      // Send subscription changes made while connected.
+      if (this->sendSubscriptionOps()) {
+        return;
+      }
+      // Send a publish held back by the rate limiter, if its turn has come.
+      if (this->flushRateQueue()) {
+        return;
+      }
+      // Catch up on publishes stored while offline.
+      if (this->replayOffline()) {
+        return;
+      }
+      // Send a publish queued from an interrupt handler or another task.
+      if (this->drainPublishQueue()) {
+        return;
+      }
       // If there's any read subscription to process, process one and loop.
       if (this->processSubscriptionQueue()) {
         return;
@@ -142,9 +241,12 @@ void MQTT_Looped::loop(void) {
 // ---------------------------- CONNECTION LOOP - CLOSE SOCKET, RESTART ----------------------------
 
 bool MQTT_Looped::closeConnection(bool wifi_connected) {
-  if (*this->_sock != NO_SOCKET_AVAIL) {
+  // Whatever wasn't sent is lost with the connection.
+  this->send_len = 0;
+  this->send_tail_len = 0;
+  if (this->transport->isOpen()) {
     DEBUG_PRINTLN(F("Closing socket..."));
-    ServerDrv::stopClient(*this->_sock);
+    this->transport->close();
     // In either loop, the next step is to wait for the socket to close.
     this->status = wifi_connected ? MQTT_LOOPED_STATUS_MQTT_CLOSING_SOCKET : MQTT_LOOPED_STATUS_WIFI_CLOSING_SOCKET;
     return false;
@@ -156,13 +258,10 @@ bool MQTT_Looped::closeConnection(bool wifi_connected) {
 }
 
 bool MQTT_Looped::closeSocket(bool wifi_connected) {
-  // @todo Abstract away from WiFi client.
-  if (wifiClient->status() != CLOSED) {
+  if (!this->transport->closed()) {
     DEBUG_PRINTLN(F("Socket closing..."));
     return false;
   }
-  WiFiSocketBuffer.close(*_sock);
-  *this->_sock = NO_SOCKET_AVAIL;
   DEBUG_PRINTLN(F("Socket closed"));
   // In WiFi loop, connection is ready to begin.
   // In MQTT loop, connection was closed and needs to reconnect.
@@ -179,9 +278,7 @@ bool MQTT_Looped::wifiSetup(void) {
   }
   // Connect
   LOG_PRINT(F("Connecting WiFi... "));
-  LOG_PRINT(this->ssid);
-  int8_t ret = WiFiDrv::wifiSetPassphrase(this->ssid, strlen(this->ssid), this->wifi_pass, strlen(this->wifi_pass));
-  if (ret == WL_SUCCESS) {
+  if (this->transport->linkBegin()) {
     LOG_PRINTLN(F("...ready"));
     this->status = MQTT_LOOPED_STATUS_WIFI_READY;
     this->attempts = 0;
@@ -202,28 +299,18 @@ bool MQTT_Looped::wifiConnect(void) {
     return false;
   }
   // Loop and wait here until the WiFi chip connects.
-  int8_t wifiStatus = WiFiDrv::getConnectionStatus();
-  switch (wifiStatus) {
-    case WL_CONNECTED:
+  switch (this->transport->linkStatus()) {
+    case MQTT_TRANSPORT_LINK_UP:
       this->status = MQTT_LOOPED_STATUS_WIFI_CONNECTED;
       LOG_PRINTLN(F("WiFi connected"));
       return true; // yay
-    case WL_IDLE_STATUS:
-    case WL_NO_SSID_AVAIL:
-    case WL_SCAN_COMPLETED:
+    case MQTT_TRANSPORT_LINK_WAITING:
       // do nothing, wait...we might be here a few seconds...
       return false;
-    case WL_FAILURE:
-    case WL_AP_FAILED:
-    case WL_CONNECT_FAILED:
-    case WL_CONNECTION_LOST:
-      this->status = MQTT_LOOPED_STATUS_WIFI_OFFLINE;
-      LOG_PRINTLN(F("Connection failure"));
-      return false;
+    case MQTT_TRANSPORT_LINK_FAILED:
     default:
       this->status = MQTT_LOOPED_STATUS_WIFI_OFFLINE;
-      LOG_PRINT(F("Connection failure, unknown failure: "));
-      LOG_PRINTLN(String(wifiStatus));
+      LOG_PRINTLN(F("Connection failure"));
       return false;
   }
 }
@@ -232,47 +319,90 @@ bool MQTT_Looped::wifiConnect(void) {
 
 bool MQTT_Looped::mqttConnect(void) {
   // We're reconnecting, so close the old connection first if open.
-  if (*this->_sock != NO_SOCKET_AVAIL) {
+  if (this->transport->isOpen()) {
     if (!this->closeConnection(true)) {
       return false;
     }
   }
 
-  // Get a socket and confirm or restart.
-  *this->_sock = ServerDrv::getSocket();
-  if (*this->_sock == NO_SOCKET_AVAIL) {
+  // Get a socket and connect to server, or restart.
+  this->selectEndpoint();
+  mqtt_endpoint_t* e = &this->endpoints.at(this->endpoint);
+  DEBUG_PRINT(F("Connecting to server #"));
+  DEBUG_PRINTLN(this->endpoint);
+  if (!this->transport->connect(*e->address, e->port)) {
     // failure, flag to start over
     DEBUG_PRINTLN(F("No Socket available"));
     this->status = MQTT_LOOPED_STATUS_MQTT_OFFLINE;
     return false;
   }
-  DEBUG_PRINT(F("Connecting on socket "));
-  DEBUG_PRINTLN(*this->_sock);
-
-  // Connect to server.
   this->status = MQTT_LOOPED_STATUS_MQTT_CONNECTING;
-  DEBUG_PRINTLN(F("Connecting to server..."));
-  ServerDrv::startClient(uint32_t(*this->mqtt_server), this->port, *this->_sock);
-  this->timer = millis();
+  this->timer.start();
   return false;
 }
 
+void MQTT_Looped::selectEndpoint(void) {
+  uint8_t count = this->endpoints.size();
+  uint8_t best = 0;
+  uint32_t best_latency = 0;
+  bool found = false;
+  // Start from the current endpoint so ties (e.g. no latency measured yet) keep it.
+  for (uint8_t i = 0; i < count; i++) {
+    uint8_t n = (this->endpoint + i) % count;
+    mqtt_endpoint_t* e = &this->endpoints.at(n);
+    if (e->failures >= this->failover_threshold) {
+      if (mqttMillis() - e->failed_at < MQTT_FAILOVER_RECOVERY) {
+        continue;
+      }
+      // Give it another chance; one more failure skips it again.
+      e->failures = this->failover_threshold - 1;
+    }
+    uint32_t latency = e->conack_latency ? e->conack_latency : UINT32_MAX;
+    if (!found || latency < best_latency) {
+      found = true;
+      best = n;
+      best_latency = latency;
+    }
+  }
+  // Everything is down, reset and move on to the next endpoint.
+  if (!found) {
+    for (auto & e : this->endpoints) {
+      e.failures = 0;
+    }
+    best = (this->endpoint + 1) % count;
+  }
+  if (best != this->endpoint) {
+    LOG_PRINT(F("Switching to MQTT server #"));
+    LOG_PRINTLN(best);
+  }
+  this->endpoint = best;
+}
+
+void MQTT_Looped::endpointFailed(void) {
+  mqtt_endpoint_t* e = &this->endpoints.at(this->endpoint);
+  if (e->failures < 255) {
+    e->failures++;
+  }
+  if (e->failures == this->failover_threshold) {
+    DEBUG_PRINTLN(F("MQTT server marked down"));
+    e->failed_at = mqttMillis();
+  }
+}
+
 bool MQTT_Looped::waitOnConnection(void) {
-  if (this->wifiClient->connected()) {
+  if (this->transport->connected()) {
     LOG_PRINT(F("Connected to MQTT server, status: "));
-    // @todo Abstract away from WiFi client.
-    LOG_PRINTLN(this->wifiClient->status());
+    LOG_PRINTLN(this->transport->status());
     this->status = MQTT_LOOPED_STATUS_MQTT_CONNECTION_WAIT;
-    this->timer = millis(); // start for next wait
+    this->timer.start(); // start for next wait
     return true;
   }
   // If we've waited long enough, give up and start over.
-  if (millis() - this->timer > 4000) {
+  if (this->timer.expired(MQTT_CONNECT_TIMEOUT)) {
     LOG_PRINT(F("Connection to MQTT server failed, status: "));
-    // @todo Abstract away from WiFi client.
-    LOG_PRINTLN(this->wifiClient->status());
+    LOG_PRINTLN(this->transport->status());
+    this->endpointFailed();
     this->status = MQTT_LOOPED_STATUS_MQTT_OFFLINE;
-    this->timer = 0;
     return false;
   }
   // Keep waiting...
@@ -280,9 +410,8 @@ bool MQTT_Looped::waitOnConnection(void) {
 }
 
 bool MQTT_Looped::waitAfterConnection(void) {
-  if (millis() - this->timer > 3000) {
+  if (this->timer.expired(MQTT_CONNECTION_WAIT)) {
     this->status = MQTT_LOOPED_STATUS_MQTT_CONNECTION_SUCCESS;
-    this->timer = 0;
     return true;
   }
   return false;
@@ -292,19 +421,33 @@ bool MQTT_Looped::mqttConnectBroker() {
   LOG_PRINT(F("MQTT connecting to broker..."));
   // Check attempts.
   this->attempts++;
-  if (this->attempts >= 5 || !this->wifiClient->connected()) {
+  if (this->attempts >= 5 || !this->transport->connected()) {
     DEBUG_PRINTLN(F("error"));
+    this->endpointFailed();
     this->status = MQTT_LOOPED_STATUS_MQTT_ERRORS;
     this->attempts = 0;
     return false;
   }
-  // Construct and send connect packet.
+  // Construct and send connect packet, or resend the one built last time.
+#if MQTT_PACKET_CACHE
+  if (this->connect_packet == nullptr) {
+    this->connect_packet_len = this->connectPacket();
+    this->connect_packet = new uint8_t[this->connect_packet_len];
+    memcpy(this->connect_packet, this->buffer, this->connect_packet_len);
+  }
+  uint8_t* packet = this->connect_packet;
+  uint8_t len = this->connect_packet_len;
+#else
+  uint8_t* packet = this->buffer;
   uint8_t len = this->connectPacket();
-  if (!this->sendPacket(this->buffer, len)) {
+#endif
+  if (!this->sendPacket(packet, len)) {
     DEBUG_PRINTLN(F("err send packet"));
     // If we err here, we try again and fail after n attempts.
     return false;
   }
+  // Time the CONNACK.
+  this->timer.start();
   // Read connect response packet and verify it
   this->status = MQTT_LOOPED_STATUS_READING_CONACK_PACKET;
   DEBUG_PRINTLN(F("Reading conack"));
@@ -313,32 +456,67 @@ bool MQTT_Looped::mqttConnectBroker() {
 
 bool MQTT_Looped::confirmConnectToBroker() {
   this->readFullPacket();
-  // Wait until a full packet read attempt is complete,
-  if (this->read_packet_jump_to != -1) {
+  // Wait until a full packet read attempt is complete, unless the connection failed,
+  if (this->read_packet_jump_to != -1 || this->status == MQTT_LOOPED_STATUS_MQTT_ERRORS) {
     return false;
   }
   // Then try to process what was read:
+#if MQTT_PROTOCOL_LEVEL == 5
+  if (this->full_packet_len < 5) {
+#else
   if (this->full_packet_len != 4) {
+#endif
     DEBUG_PRINT(F("err read packet.."));
     this->status = MQTT_LOOPED_STATUS_MQTT_MISSING_CONACK;
     return false;
   }
+#if MQTT_PROTOCOL_LEVEL == 5
+  // Fixed header, flags, reason code, properties.
+  const uint8_t* end = this->buffer + this->full_packet_len;
+  uint32_t remaining, proplen;
+  const uint8_t* p = decodeVarint(this->buffer + 1, end, &remaining);
+  const uint8_t* props = p && end - p >= 3 ? decodeVarint(p + 2, end, &proplen) : nullptr;
+  if ((this->buffer[0] != (MQTT_CTRL_CONNECTACK << 4)) || props == nullptr || props + proplen > end) {
+#else
+  const uint8_t* p = this->buffer + 2;
   if ((this->buffer[0] != (MQTT_CTRL_CONNECTACK << 4)) || (this->buffer[1] != 2)) {
+#endif
     DEBUG_PRINT(F("err read buf.."));
     this->status = MQTT_LOOPED_STATUS_MQTT_MISSING_CONACK;
     return false;
   }
-  if (this->buffer[3] != 0) {
+  if (p[1] != 0) {
+    // Connection refused by the broker, retrying the same endpoint won't help.
     DEBUG_PRINT(F("buffer ret: "));
-    DEBUG_PRINT(this->buffer[3]);
+    DEBUG_PRINT(p[1]);
     DEBUG_PRINT(F(".."));
-    if (!this->buffer[3] == 1) {
-      this->status = MQTT_LOOPED_STATUS_MQTT_MISSING_CONACK;
-      return false;
-    }
+    this->attempts = 0;
+    this->endpointFailed();
+    this->status = MQTT_LOOPED_STATUS_MQTT_ERRORS;
+    return false;
   }
 
   LOG_PRINTLN(F("success"));
+  // Endpoint is healthy, update its latency.
+  mqtt_endpoint_t* e = &this->endpoints.at(this->endpoint);
+  uint32_t latency = this->timer.elapsed() + 1;
+  e->conack_latency = e->conack_latency ? (e->conack_latency * 3 + latency) / 4 : latency;
+  e->failures = 0;
+  // Clean session: the broker has dropped any QoS 2 state, so do we.
+  memset(this->qos2_inflight, 0, sizeof(this->qos2_inflight));
+  // A replayed publish that wasn't acknowledged is sent again.
+  this->offline_acking = 0;
+  this->resetSubscriptionOps();
+  // Discoveries are sent again from the first, even if a connection dropped halfway through.
+  this->discovery_counter = 0;
+#if MQTT_PROTOCOL_LEVEL == 5
+  // Aliases are per connection; the broker says how many of ours it accepts.
+  this->resetTopicAliases();
+  uint16_t alias_max;
+  if (findProperty(props, proplen, MQTT_PROP_TOPIC_ALIAS_MAXIMUM, &alias_max)) {
+    this->alias_out_max = alias_max < MQTT_TOPIC_ALIAS_MAX ? alias_max : MQTT_TOPIC_ALIAS_MAX;
+  }
+#endif
   this->status = MQTT_LOOPED_STATUS_MQTT_CONNECTION_CONFIRMED;
   return true;
 }
@@ -357,7 +535,7 @@ bool MQTT_Looped::mqttSubscribe(void) {
 
   // Check connection & number of attempts.
   // If we're consistently failing, let's... start over?
-  if (!this->wifiClient->connected() || this->attempts > 3) {
+  if (!this->transport->connected() || this->attempts > 3) {
     DEBUG_PRINTLN(F("..sub failed"));
     this->attempts = 0;
     this->subscription_counter = 0;
@@ -367,10 +545,16 @@ bool MQTT_Looped::mqttSubscribe(void) {
   this->attempts++;
 
   // Find the next subscription to process or return if we finished.
+  if (this->subscription_counter >= this->mqttSubs.size()) {
+    this->subscription_counter = 0;
+    this->status = MQTT_LOOPED_STATUS_MQTT_SUBSCRIBED;
+    return true; // none at all
+  }
   MQTTSubscribe* sub;
   do {
     sub = this->mqttSubs.at(this->subscription_counter);
-    if (sub && sub->topic != nullptr) {
+    // Skipping those only waiting for their callbacks to finish before being freed.
+    if (sub && sub->topic != nullptr && sub->op != MQTT_SUB_REMOVE) {
       break; // found
     }
     if (!this->mqttSubscribeInc()) {
@@ -381,9 +565,26 @@ bool MQTT_Looped::mqttSubscribe(void) {
   // Subscribe
   LOG_PRINT(F("MQTT subscribing: "));
   LOG_PRINTLN(sub->topic);
-  // Construct and send subscription packet.
-  uint8_t len = this->subscribePacket(sub->topic, 0);
-  if (!this->sendPacket(this->buffer, len)) {
+  // Construct and send subscription packet, or resend the one built last time with a new id.
+  this->subscribe_packet_id = this->packet_id_counter;
+#if MQTT_PACKET_CACHE
+  if (sub->packet == nullptr) {
+    sub->packet_len = this->subscribePacket(sub->topic, sub->qos);
+    sub->packet = new uint8_t[sub->packet_len];
+    memcpy(sub->packet, this->buffer, sub->packet_len);
+  } else {
+    sub->packet[2] = (this->packet_id_counter >> 8) & 0xFF;
+    sub->packet[3] = this->packet_id_counter & 0xFF;
+    // increment the packet id, skipping 0
+    this->packet_id_counter = this->packet_id_counter + 1 + (this->packet_id_counter + 1 == 0);
+  }
+  uint8_t* packet = sub->packet;
+  uint8_t len = sub->packet_len;
+#else
+  uint8_t* packet = this->buffer;
+  uint8_t len = this->subscribePacket(sub->topic, sub->qos);
+#endif
+  if (!this->sendPacket(packet, len)) {
     DEBUG_PRINTLN(F("..error sending packet"));
     this->status = MQTT_LOOPED_STATUS_MQTT_SUBSCRIPTION_FAIL;
     return false;
@@ -404,12 +605,18 @@ bool MQTT_Looped::mqttSubscribeInc(void) {
 }
 
 bool MQTT_Looped::mqttAnnounce(void) {
-  if (this->birth_msg.first != "") {
+  if (this->birth.topic) {
     LOG_PRINTLN(F("Announcing.."));
     // QoS is 0, so we don't wait on a puback.
-    if (!this->mqttPublish(this->birth_msg.first, this->birth_msg.second, false, 0)) {
+    bool sent;
+    if (this->birth.progmem) {
+      sent = this->mqttPublish((const __FlashStringHelper*)this->birth.topic, (const __FlashStringHelper*)this->birth.payload, false, 0);
+    } else {
+      sent = this->mqttPublish(this->birth.topic, this->birth.payload, false, 0);
+    }
+    if (!sent) {
       LOG_PRINTLN(F("failed"));
-      if (!this->wifiClient->connected()) {
+      if (!this->transport->connected()) {
         DEBUG_PRINTLN(F("offline"));
         this->status = MQTT_LOOPED_STATUS_MQTT_OFFLINE;
       }
@@ -433,23 +640,63 @@ bool MQTT_Looped::sendDiscoveries(void) {
   LOG_PRINT(F("Sending discovery: "));
   // Send at current counter, then inc and return, wait for next loop.
   auto d = this->discoveries.at(this->discovery_counter);
-  LOG_PRINTLN(d->topic);
-  if (!this->mqttPublish(d->topic, d->payload)) {
+  if (d->progmem) {
+    LOG_PRINTLN((const __FlashStringHelper*)d->topic);
+  } else {
+    LOG_PRINTLN(d->topic);
+  }
+  bool sent;
+  bool too_large = false;
+  if (d->payload && d->progmem) {
+    sent = this->mqttPublish((const __FlashStringHelper*)d->topic, (const __FlashStringHelper*)d->payload, d->retain, d->qos);
+  } else if (d->payload) {
+    sent = this->mqttPublish(d->topic, d->payload, d->retain, d->qos);
+  } else {
+    sent = this->mqttPublish(d->topic, [d, &too_large](uint8_t* buf, uint16_t size) -> int32_t {
+      MQTTJsonWriter json(buf, size);
+      d->build(json);
+      too_large = json.overflow();
+      return too_large ? -1 : json.length();
+    }, d->retain, d->qos, d->progmem);
+  }
+  if (too_large) {
+    // Won't fit next time either, move on.
+    LOG_PRINTLN(F("discovery too large for buffer"));
+    this->discovery_counter++;
+    return false;
+  }
+  if (!sent) {
     LOG_PRINTLN(F("error sending discovery"));
-    if (!this->wifiClient->connected()) {
+    if (!this->transport->connected()) {
       this->discovery_counter = 0;
       this->status = MQTT_LOOPED_STATUS_MQTT_OFFLINE;
     }
     return false;
   }
-  this->status = MQTT_LOOPED_STATUS_SENDING_DISCOVERY;
   this->discovery_counter++;
+  // QoS 1 waits for its PUBACK first, see handlePubAck().
+  if (this->status == MQTT_LOOPED_STATUS_OKAY) {
+    this->status = MQTT_LOOPED_STATUS_SENDING_DISCOVERY;
+  }
   return true;
 }
 
 bool MQTT_Looped::processSubscriptionQueue(void) {
   for (auto & sub : this->mqttSubs) {
     if (sub->new_message) {
+#if MQTT_EXECUTOR
+      if (this->executor != nullptr) {
+        sub->deferred.fetch_add(1, std::memory_order_relaxed);
+        if (!this->executor->post(sub, (const char*)sub->lastread, sub->datalen)) {
+          // No room, offered again next loop. Nothing more is read until it's taken, since the
+          // next message would overwrite it.
+          sub->deferred.fetch_sub(1, std::memory_order_relaxed);
+          return true;
+        }
+        sub->new_message = false;
+        return true;
+      }
+#endif
       sub->callback((char *)sub->lastread, sub->datalen);
       sub->new_message = false;
       return true; // only read one
@@ -473,6 +720,89 @@ bool MQTT_Looped::verifyConnection(void) {
   return true;
 }
 
+uint32_t MQTT_Looped::msUntilNextDeadline(void) {
+  // The rest of a packet is tried again every loop.
+  if (this->sendPending()) {
+    return 0;
+  }
+  switch (this->status) {
+    case MQTT_LOOPED_STATUS_MQTT_CONNECTION_WAIT:
+      return this->timer.remaining(MQTT_CONNECTION_WAIT);
+    case MQTT_LOOPED_STATUS_READING_CONACK_PACKET:
+    case MQTT_LOOPED_STATUS_READING_SUB_PACKET:
+    case MQTT_LOOPED_STATUS_READING_SUBACK_PACKET:
+    case MQTT_LOOPED_STATUS_READING_PUBACK_PACKET:
+    case MQTT_LOOPED_STATUS_READING_PING_PACKET: {
+      // Between steps of a packet, e.g. after a zero length body, the next loop carries on.
+      bool waiting = this->read_packet_jump_to > 0 && this->reading_packet;
+#if MQTT_COROUTINES
+      // The coroutine is only ever suspended waiting on data.
+      waiting = waiting || (this->read_packet_jump_to > 0 && this->read_task);
+#endif
+      if (!waiting) {
+        return 0;
+      }
+      // Waiting on data, without it nothing happens until the read times out.
+      uint32_t wait = this->read_packet_timer.remaining(MQTT_READ_PACKET_TIMEOUT);
+      if (this->read_packet_search) {
+        uint32_t search = this->read_packet_search_timer.remaining(MQTT_READ_PACKET_SEARCH_TIMEOUT);
+        wait = search < wait ? search : wait;
+      }
+      return wait;
+    }
+    case MQTT_LOOPED_STATUS_OKAY: {
+      for (auto & sub : this->mqttSubs) {
+        if (sub->new_message) {
+          return 0;
+        }
+      }
+      // Next ping, QoS 2 retry, subscription change, held back publish or stored publish.
+      uint32_t wait = this->last_con_verify.remaining(MQTT_VERIFY_TIMEOUT);
+      for (auto & sub : this->mqttSubs) {
+        if (sub->op == MQTT_SUB_IDLE) {
+          continue;
+        }
+        if (sub->op == MQTT_SUB_REMOVE || sub->op_packet_id == 0) {
+          return 0;
+        }
+        uint32_t retry = sub->op_sent_at.remaining(MQTT_SUBSCRIBE_RETRY_TIMEOUT);
+        wait = retry < wait ? retry : wait;
+      }
+      for (auto & slot : this->qos2_inflight) {
+        if (slot.state != MQTT_QOS2_FREE) {
+          uint32_t retry = mqttRemaining(slot.timer, MQTT_QOS2_RETRY_TIMEOUT);
+          wait = retry < wait ? retry : wait;
+        }
+      }
+#if MQTT_RATE_QUEUE_LEN > 0
+      for (auto & q : this->rate_queue) {
+        if (q.seq != 0) {
+          uint32_t turn = this->rateWait(q.limit);
+          wait = turn < wait ? turn : wait;
+        }
+      }
+#endif
+      if (!this->offline.empty()) {
+        uint32_t turn = this->offline_timer.remaining(this->offline_interval);
+        wait = turn < wait ? turn : wait;
+      }
+#if MQTT_PUBLISH_QUEUE_LEN > 0
+      if (this->publish_queue.front() != nullptr) {
+        return 0;
+      }
+#endif
+      return wait;
+    }
+    default:
+      // Connecting, or in the middle of something.
+      return 0;
+  }
+}
+
+bool MQTT_Looped::ioPending(void) {
+  return this->transport->available() > 0;
+}
+
 bool MQTT_Looped::wifiIsConnected(void) {
   return (int)this->status >= (int)MQTT_LOOPED_STATUS_WIFI_CONNECTED;
 }
@@ -487,8 +817,116 @@ bool MQTT_Looped::mqttIsActive(void) {
 
 // ------------------------------------------- MESSAGING -------------------------------------------
 
+/**
+ * @brief Payload writer copying a C string, cut off if it doesn't fit.
+ */
+static mqttpayload_t stringPayload(const char* payload) {
+  return [payload](uint8_t* buf, uint16_t size) -> int32_t {
+    uint16_t len = strlen(payload);
+    if (len > size) {
+      len = size; // cut it off
+    }
+    memcpy(buf, payload, len);
+    return len;
+  };
+}
+
+/**
+ * @brief Payload writer formatting a float with 2 decimals like String does, only once it's
+ *        actually sent, and without String's heap allocation.
+ */
+static mqttpayload_t numberPayload(float payload) {
+  return [payload](uint8_t* buf, uint16_t size) -> int32_t {
+    if (isnan(payload) || isinf(payload)) {
+      const char* s = isnan(payload) ? "nan" : payload > 0 ? "inf" : "-inf";
+      uint16_t len = strlen(s);
+      if (len > size) {
+        return -1;
+      }
+      memcpy(buf, s, len);
+      return len;
+    }
+    MQTTJsonWriter w(buf, size);
+    w.number(payload, 2);
+    return w.overflow() ? -1 : w.length();
+  };
+}
+
+/**
+ * @brief Payload writer formatting an unsigned integer, only once it's actually sent.
+ */
+static mqttpayload_t numberPayload(uint32_t payload) {
+  return [payload](uint8_t* buf, uint16_t size) -> int32_t {
+    MQTTJsonWriter w(buf, size);
+    w.uint(payload);
+    return w.overflow() ? -1 : w.length();
+  };
+}
+
+/**
+ * @brief FNV-1a hash of a payload.
+ */
+static uint32_t payloadHash(const uint8_t* payload, uint16_t len) {
+  uint32_t h = 2166136261UL;
+  for (uint16_t i = 0; i < len; i++) {
+    h ^= payload[i];
+    h *= 16777619UL;
+  }
+  return h;
+}
+
+/**
+ * @brief Topic reference for a C string or flash topic.
+ */
+static mqtt_topic_ref_t topicRef(const char* topic, bool progmem) {
+  return {
+    .topic = topic,
+    .len = (uint16_t)(progmem ? strlen_P(topic) : strlen(topic)),
+    .progmem = progmem,
+    .encoded = nullptr,
+  };
+}
+
+/**
+ * @brief Add the tokens earned since the last refill.
+ */
+static void rateRefill(mqtt_rate_limit_t* limit) {
+  uint32_t now = mqttMillis();
+  if (limit->tokens >= limit->burst) {
+    limit->refilled = now;
+    return;
+  }
+  uint32_t earned = (now - limit->refilled) / limit->interval;
+  if (earned == 0) {
+    return;
+  }
+  if (earned >= (uint32_t)(limit->burst - limit->tokens)) {
+    limit->tokens = limit->burst;
+    limit->refilled = now;
+    return;
+  }
+  limit->tokens += earned;
+  limit->refilled += earned * limit->interval;
+}
+
 void MQTT_Looped::setBirth(const char* topic, const char* payload) {
-  this->birth_msg = { topic, payload };
+  this->birth = {
+    .topic = topic,
+    .payload = payload,
+    .qos = 0,
+    .retain = false,
+    .progmem = false,
+  };
+}
+
+void MQTT_Looped::setBirth(const __FlashStringHelper* topic, const __FlashStringHelper* payload) {
+  this->birth = {
+    .topic = (const char*)topic,
+    .payload = (const char*)payload,
+    .qos = 0,
+    .retain = false,
+    .progmem = true,
+  };
 }
 
 bool MQTT_Looped::setWill(const char* topic, const char* payload, uint8_t qos, bool retain) {
@@ -496,104 +934,1077 @@ bool MQTT_Looped::setWill(const char* topic, const char* payload, uint8_t qos, b
     DEBUG_PRINTLN(F("Error: will defined after connect"));
     return false;
   }
+  this->forgetConnectPacket();
   this->will = {
     .topic = topic,
     .payload = payload,
     .qos = qos,
     .retain = retain,
+    .progmem = false,
+  };
+  return true;
+}
+
+bool MQTT_Looped::setWill(const __FlashStringHelper* topic, const __FlashStringHelper* payload, uint8_t qos, bool retain) {
+  if (this->mqttIsConnected()) {
+    DEBUG_PRINTLN(F("Error: will defined after connect"));
+    return false;
+  }
+  this->forgetConnectPacket();
+  this->will = {
+    .topic = (const char*)topic,
+    .payload = (const char*)payload,
+    .qos = qos,
+    .retain = retain,
+    .progmem = true,
   };
   return true;
 }
 
-void MQTT_Looped::addDiscovery(const char* topic, const char* payload, uint8_t qos, bool retain) {
+void MQTT_Looped::forgetConnectPacket(void) {
+#if MQTT_PACKET_CACHE
+  delete[] this->connect_packet;
+  this->connect_packet = nullptr;
+#endif
+}
+
+bool MQTT_Looped::addDiscovery(const char* topic, const char* payload, uint8_t qos, bool retain) {
   if (this->mqttIsConnected()) {
     DEBUG_PRINTLN(F("Error: discovery added after connect"));
-    return;
+    return false;
   }
-  this->discoveries.push_back(new mqtt_message_t{
+  return this->pushDiscovery({
     .topic = topic,
     .payload = payload,
+    .build = nullptr,
     .qos = qos,
     .retain = retain,
+    .progmem = false,
   });
 }
 
-void MQTT_Looped::onMqtt(const char* topic, mqttcallback_t callback) {
-  MQTTSubscribe* sub = new MQTTSubscribe(topic);
-  sub->setCallback(callback);
-  this->mqttSubs.push_back(sub);
+bool MQTT_Looped::addDiscovery(const char* topic, mqttjson_t build, uint8_t qos, bool retain) {
+  if (this->mqttIsConnected()) {
+    DEBUG_PRINTLN(F("Error: discovery added after connect"));
+    return false;
+  }
+  return this->pushDiscovery({
+    .topic = topic,
+    .payload = nullptr,
+    .build = build,
+    .qos = qos,
+    .retain = retain,
+    .progmem = false,
+  });
 }
 
-void MQTT_Looped::mqttSendMessage(const char* topic, const char* payload, bool retain, uint8_t qos) {
-  // If not connected OR if in the middle of something.
-  if (!this->mqttIsConnected() || this->mqttIsActive()) {
-    return;
+bool MQTT_Looped::addDiscovery(const __FlashStringHelper* topic, const __FlashStringHelper* payload, uint8_t qos, bool retain) {
+  if (this->mqttIsConnected()) {
+    DEBUG_PRINTLN(F("Error: discovery added after connect"));
+    return false;
   }
-  if (!this->wifiClient->connected()) {
-    this->status = MQTT_LOOPED_STATUS_MQTT_OFFLINE;
-    return;
+  return this->pushDiscovery({
+    .topic = (const char*)topic,
+    .payload = (const char*)payload,
+    .build = nullptr,
+    .qos = qos,
+    .retain = retain,
+    .progmem = true,
+  });
+}
+
+bool MQTT_Looped::addDiscovery(const __FlashStringHelper* topic, mqttjson_t build, uint8_t qos, bool retain) {
+  if (this->mqttIsConnected()) {
+    DEBUG_PRINTLN(F("Error: discovery added after connect"));
+    return false;
   }
-  LOG_PRINT(F("MQTT publishing to "));
-  LOG_PRINTLN(topic);
-  if (!this->mqttPublish(topic, payload, retain, qos)) {
-    LOG_PRINTLN(F("Error publishing"));
+  return this->pushDiscovery({
+    .topic = (const char*)topic,
+    .payload = nullptr,
+    .build = build,
+    .qos = qos,
+    .retain = retain,
+    .progmem = true,
+  });
+}
+
+bool MQTT_Looped::pushDiscovery(const mqtt_discovery_t& discovery) {
+  mqtt_discovery_t* d = this->discovery_pool.create(discovery);
+  if (d == nullptr) {
+    DEBUG_PRINTLN(F("Error: too many discoveries"));
+    return false;
   }
+  return this->discoveries.push_back(d);
 }
 
-void MQTT_Looped::mqttSendMessage(const char* topic, String payload, bool retain, uint8_t qos) {
-  this->mqttSendMessage(topic, payload.c_str(), retain, qos);
+bool MQTT_Looped::onMqtt(const char* topic, mqttcallback_t callback, uint8_t qos) {
+  return this->subscribe(topic, callback, qos);
 }
 
-void MQTT_Looped::mqttSendMessage(const char* topic, float payload, bool retain, uint8_t qos) {
-  this->mqttSendMessage(topic, String(payload).c_str(), retain, qos);
+const MQTTTopic* MQTT_Looped::registerTopic(const char* prefix, const char* suffix) {
+#if MQTT_STATIC_ALLOC
+  if (MQTTTopic::length(prefix, suffix) >= MQTT_MAX_TOPIC_LEN) {
+    DEBUG_PRINTLN(F("Error: registered topic too long"));
+    return nullptr;
+  }
+#endif
+  return this->topic_pool.create(prefix, suffix);
 }
 
-void MQTT_Looped::mqttSendMessage(const char* topic, uint32_t payload, bool retain, uint8_t qos) {
-  this->mqttSendMessage(topic, String(payload).c_str(), retain, qos);
+#if MQTT_LAST_VALUE_SLOTS > 0
+const mqtt_last_value_t* MQTT_Looped::getLastValue(const char* topic) {
+  return this->last_values.get(topic);
 }
+#endif
 
-bool MQTT_Looped::mqttPublish(const char* topic, const char* payload, bool retain, uint8_t qos) {
-  if (this->status != MQTT_LOOPED_STATUS_MQTT_PUBLISHED) {
-    uint8_t* data = (uint8_t *)payload;
-    uint16_t bLen = strlen(payload);
-    // Construct and send publish packet.
-    uint16_t len = this->publishPacket(topic, data, bLen, qos, retain);
-    if (!this->sendPacket(this->buffer, len)) {
-      return false;
+bool MQTT_Looped::mqttSendMessage(const char* topic, const char* payload, bool retain, uint8_t qos) {
+  return this->mqttSendMessage(topic, stringPayload(payload), retain, qos);
+}
+
+bool MQTT_Looped::mqttSendMessage(const __FlashStringHelper* topic, const __FlashStringHelper* payload, bool retain, uint8_t qos) {
+  return this->mqttSend(topicRef((const char*)topic, true), this->flashPayload((const char*)payload), retain, qos);
+}
+
+bool MQTT_Looped::mqttSendMessage(const __FlashStringHelper* topic, const char* payload, bool retain, uint8_t qos) {
+  return this->mqttSend(topicRef((const char*)topic, true), stringPayload(payload), retain, qos);
+}
+
+bool MQTT_Looped::mqttSendMessage(const char* topic, String payload, bool retain, uint8_t qos) {
+  return this->mqttSendMessage(topic, payload.c_str(), retain, qos);
+}
+
+bool MQTT_Looped::mqttSendMessage(const char* topic, float payload, bool retain, uint8_t qos) {
+  mqtt_number_t number = { .integer = false, .number = payload, .uint = 0 };
+  return this->mqttSend(topicRef(topic, false), numberPayload(payload), retain, qos, &number);
+}
+
+bool MQTT_Looped::mqttSendMessage(const char* topic, uint32_t payload, bool retain, uint8_t qos) {
+  mqtt_number_t number = { .integer = true, .number = 0, .uint = payload };
+  return this->mqttSend(topicRef(topic, false), numberPayload(payload), retain, qos, &number);
+}
+
+bool MQTT_Looped::mqttSendMessage(const MQTTTopic* topic, const char* payload, bool retain, uint8_t qos) {
+  return this->mqttSendMessage(topic, stringPayload(payload), retain, qos);
+}
+
+bool MQTT_Looped::mqttSendMessage(const MQTTTopic* topic, String payload, bool retain, uint8_t qos) {
+  return this->mqttSendMessage(topic, payload.c_str(), retain, qos);
+}
+
+bool MQTT_Looped::mqttSendMessage(const MQTTTopic* topic, float payload, bool retain, uint8_t qos) {
+  mqtt_number_t number = { .integer = false, .number = payload, .uint = 0 };
+  return this->mqttSend(topic->ref(), numberPayload(payload), retain, qos, &number);
+}
+
+bool MQTT_Looped::mqttSendMessage(const MQTTTopic* topic, uint32_t payload, bool retain, uint8_t qos) {
+  mqtt_number_t number = { .integer = true, .number = 0, .uint = payload };
+  return this->mqttSend(topic->ref(), numberPayload(payload), retain, qos, &number);
+}
+
+bool MQTT_Looped::mqttSendMessage(const MQTTTopic* topic, mqttpayload_t payload, bool retain, uint8_t qos) {
+  return this->mqttSend(topic->ref(), payload, retain, qos);
+}
+
+bool MQTT_Looped::mqttSendMessage(const char* topic, mqttpayload_t payload, bool retain, uint8_t qos) {
+  return this->mqttSend(topicRef(topic, false), payload, retain, qos);
+}
+
+bool MQTT_Looped::mqttSend(const mqtt_topic_ref_t& topic, mqttpayload_t payload, bool retain, uint8_t qos, const mqtt_number_t* number) {
+  if (this->mqttCanSend()) {
+    return this->sendOrStore(topic, payload, retain, qos, number, nullptr);
+  } else if (this->offline.enabled()) {
+    // Stored until it can be sent. Connected but busy, buffer may hold a packet being read, so the
+    // payload is written on the stack.
+    uint8_t store[sizeof(this->buffer)];
+    return this->sendOrStore(topic, payload, retain, qos, number, store);
+  }
+  return false;
+}
+
+bool MQTT_Looped::sendOrStore(const mqtt_topic_ref_t& topic, mqttpayload_t payload, bool retain, uint8_t qos, const mqtt_number_t* number, uint8_t* store) {
+  uint8_t* buf = store != nullptr ? store : this->buffer;
+  int16_t limit = this->findTopicOptions(topic);
+  bool filtered = limit >= 0 && this->topic_options[limit].filter;
+  uint32_t hash = 0;
+  uint16_t hashed = 0;
+  if (filtered) {
+    bool changed;
+    if (number != nullptr) {
+      changed = this->valueChanged(limit, number, 0, 0);
+    } else {
+      // Write the payload once to compare it with the last one. Whatever is left in flash after
+      // it can't change.
+      this->publish_tail_len = 0;
+      int32_t len = payload(buf, sizeof(this->buffer));
+      if (len < 0) {
+        // Can't be compared, nor sent.
+        filtered = false;
+        changed = true;
+      } else {
+        hash = payloadHash(buf, len);
+        hashed = len;
+        changed = this->valueChanged(limit, nullptr, hash, hashed);
+      }
     }
-    this->attempts = 0;
-    // If QoS is 0, skip waiting for puback.
-    if (qos == 0) {
-      this->status = MQTT_LOOPED_STATUS_OKAY;
+    if (!changed) {
+      DEBUG_PRINTLN(F("Unchanged, suppressed"));
       return true;
     }
-    this->status = MQTT_LOOPED_STATUS_READING_PUBACK_PACKET;
-    return true;
   }
-  else if (qos > 0) {
-    DEBUG_PRINT(F("Publish QOS1+ reply:\t"));
-    DEBUG_PRINTBUFFER(this->buffer, this->full_packet_len);
-    if (this->full_packet_len != 4) {
-      this->attempts++;
-      DEBUG_PRINTLN(F("Error reading puback"));
-      if (this->attempts > 3) {
-        this->status = MQTT_LOOPED_STATUS_MQTT_ERRORS;
-        this->attempts = 0;
-      }
-      return false;
+  // The last value only moves on once this one is on its way.
+  bool sent;
+  if (store != nullptr) {
+    sent = this->offlineStore(topic, payload, retain, qos, limit, store);
+  }
+  // Once anything is held back, later publishes queue behind it so it gets its turn; one that
+  // can't be queued is dropped rather than sent ahead of it.
+  else if (!this->rateAvailable(limit) || this->rateQueued()) {
+    sent = this->rateEnqueue(topic, payload, retain, qos, limit);
+    if (!sent) {
+      DEBUG_PRINTLN(F("Rate limited, dropped"));
+      this->publish_stats.rate_dropped++;
+      return true; // counted
+    }
+  } else {
+    LOG_PRINT(F("MQTT publishing to "));
+    if (topic.progmem) {
+      LOG_PRINTLN((const __FlashStringHelper*)topic.topic);
+    } else {
+      LOG_PRINTLN(topic.topic);
     }
+    this->rateTake(limit);
+    sent = this->mqttPublish(topic, payload, retain, qos);
+    if (!sent) {
+      LOG_PRINTLN(F("Error publishing"));
+    }
+  }
+  if (sent && filtered) {
+    this->valuePublished(limit, number, hash, hashed);
+  }
+  return sent;
+}
 
-    uint16_t packnum = this->buffer[2];
-    packnum <<= 8;
+mqttpayload_t MQTT_Looped::flashPayload(const char* payload) {
+  return [this, payload](uint8_t* buf, uint16_t size) -> int32_t {
+    uint16_t len = strlen_P(payload);
+    uint16_t n = len < size ? len : size;
+    memcpy_P(buf, payload, n);
+    // Whatever doesn't fit is streamed out of flash after the packet.
+    this->publish_tail = payload + n;
+    this->publish_tail_len = len - n;
+    return n;
+  };
+}
+
+// ----------------------------------------- SUBSCRIPTIONS -----------------------------------------
+
+bool MQTT_Looped::subscribe(const char* topic, mqttcallback_t callback, uint8_t qos) {
+  MQTTSubscribe* sub;
+  int16_t i = this->findSubscription(topic);
+  if (i >= 0) {
+    // Already known, maybe on its way out: take it over.
+    sub = this->mqttSubs[i];
+#if MQTT_EXECUTOR
+    // The executor runs sub->callback, which can't be swapped out from under it.
+    if (sub->deferred.load(std::memory_order_acquire) > 0) {
+      DEBUG_PRINTLN(F("Error: subscription callbacks still to run"));
+      return false;
+    }
+#endif
+    if (sub->qos == qos && (sub->op == MQTT_SUB_IDLE || sub->op == MQTT_SUB_SUBSCRIBE)) {
+      sub->setCallback(callback);
+      return true;
+    }
+    sub->qos = qos;
+#if MQTT_PACKET_CACHE
+    delete[] sub->packet;
+    sub->packet = nullptr;
+#endif
+  } else {
+    if (this->mqttSubs.full() || (sub = this->sub_pool.create(topic, qos)) == nullptr) {
+      DEBUG_PRINTLN(F("Error: too many subscriptions"));
+      return false;
+    }
+    this->mqttSubs.push_back(sub);
+  }
+  sub->setCallback(callback);
+  // Before connecting, mqttSubscribe() takes care of it.
+  sub->op = this->mqttIsConnected() ? MQTT_SUB_SUBSCRIBE : MQTT_SUB_IDLE;
+  sub->op_packet_id = 0;
+  return true;
+}
+
+bool MQTT_Looped::unsubscribe(const char* topic) {
+  int16_t i = this->findSubscription(topic);
+  if (i < 0) {
+    return false;
+  }
+  MQTTSubscribe* sub = this->mqttSubs[i];
+  if (sub->op == MQTT_SUB_UNSUBSCRIBE || sub->op == MQTT_SUB_REMOVE) {
+    return true;
+  }
+  // Freed from loop(), so this is safe inside the subscription's own callback.
+  sub->op = sub->op == MQTT_SUB_SUBSCRIBE && sub->op_packet_id == 0 ? MQTT_SUB_REMOVE : MQTT_SUB_UNSUBSCRIBE;
+  sub->op_packet_id = 0;
+  sub->new_message = false;
+  return true;
+}
+
+bool MQTT_Looped::subscriptionsPending(void) {
+  for (auto & sub : this->mqttSubs) {
+    if (sub->op != MQTT_SUB_IDLE) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int16_t MQTT_Looped::findSubscription(const char* topic) {
+  for (uint16_t i = 0; i < this->mqttSubs.size(); i++) {
+    if (strcmp(this->mqttSubs[i]->topic, topic) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+bool MQTT_Looped::removeSubscription(uint16_t i) {
+  MQTTSubscribe* sub = this->mqttSubs[i];
+#if MQTT_EXECUTOR
+  if (sub->deferred.load(std::memory_order_acquire) > 0) {
+    sub->op = MQTT_SUB_REMOVE;
+    sub->op_packet_id = 0;
+    return false;
+  }
+#endif
+  this->mqttSubs.erase(i);
+  this->sub_pool.destroy(sub);
+  // Keep mqttSubscribe() on the same subscription.
+  if (i < this->subscription_counter) {
+    this->subscription_counter--;
+  }
+  return true;
+}
+
+#if MQTT_EXECUTOR
+void MQTT_Looped::setExecutor(MQTTExecutor* executor) {
+  this->executor = executor;
+}
+#endif
+
+void MQTT_Looped::resetSubscriptionOps(void) {
+  for (uint16_t i = this->mqttSubs.size(); i-- > 0;) {
+    MQTTSubscribe* sub = this->mqttSubs[i];
+    if (sub->op == MQTT_SUB_UNSUBSCRIBE || sub->op == MQTT_SUB_REMOVE) {
+      this->removeSubscription(i);
+    } else {
+      sub->op = MQTT_SUB_IDLE;
+      sub->op_packet_id = 0;
+    }
+  }
+}
+
+bool MQTT_Looped::sendSubscriptionOps(void) {
+  for (uint16_t i = 0; i < this->mqttSubs.size(); i++) {
+    MQTTSubscribe* sub = this->mqttSubs[i];
+    if (sub->op == MQTT_SUB_IDLE) {
+      continue;
+    }
+    if (sub->op == MQTT_SUB_REMOVE) {
+      if (this->removeSubscription(i)) {
+        return true;
+      }
+      continue; // callbacks still to run
+    }
+    if (sub->op_packet_id != 0 && !sub->op_sent_at.expired(MQTT_SUBSCRIBE_RETRY_TIMEOUT)) {
+      continue; // waiting on the ack
+    }
+    // A resend gets a new id, so a late ack for the old one is ignored.
+    uint16_t packet_id = this->packet_id_counter;
+    uint8_t len;
+    if (sub->op == MQTT_SUB_SUBSCRIBE) {
+      LOG_PRINT(F("MQTT subscribing: "));
+      len = this->subscribePacket(sub->topic, sub->qos);
+    } else {
+      LOG_PRINT(F("MQTT unsubscribing: "));
+      len = this->unsubscribePacket(sub->topic);
+    }
+    LOG_PRINTLN(sub->topic);
+    if (!this->sendPacket(this->buffer, len)) {
+      return true; // sendPacket has set the status
+    }
+    sub->op_packet_id = packet_id;
+    sub->op_sent_at.start();
+    return true;
+  }
+  return false;
+}
+
+bool MQTT_Looped::handleSubAck(uint16_t len) {
+  if (len < 4) {
+    return false;
+  }
+  uint8_t type = this->buffer[0] >> 4;
+  uint16_t packet_id = this->buffer[2] << 8 | this->buffer[3];
+  for (uint16_t i = 0; i < this->mqttSubs.size(); i++) {
+    MQTTSubscribe* sub = this->mqttSubs[i];
+    if (sub->op_packet_id != packet_id || sub->op == MQTT_SUB_IDLE) {
+      continue;
+    }
+    if (type == MQTT_CTRL_UNSUBACK && sub->op == MQTT_SUB_UNSUBSCRIBE) {
+      DEBUG_PRINT(F("Unsubscribed: "));
+      DEBUG_PRINTLN(sub->topic);
+      this->removeSubscription(i);
+      return true;
+    }
+    if (type == MQTT_CTRL_SUBACK && sub->op == MQTT_SUB_SUBSCRIBE) {
+      // The return code for our one topic is last; 0x80 and up is a failure.
+      if (this->buffer[len - 1] >= 0x80) {
+        LOG_PRINT(F("Subscription refused: "));
+        LOG_PRINTLN(sub->topic);
+      }
+      sub->op = MQTT_SUB_IDLE;
+      sub->op_packet_id = 0;
+      return true;
+    }
+  }
+  DEBUG_PRINT(F("Unmatched ack: "));
+  DEBUG_PRINTLN(packet_id);
+  return false;
+}
+
+// ------------------------------------------ RATE LIMIT -------------------------------------------
+
+void MQTT_Looped::setRateLimit(uint32_t interval, uint8_t burst) {
+  this->rate_limit = {
+    .interval = interval,
+    .burst = burst > 0 ? burst : (uint8_t)1,
+    .tokens = burst > 0 ? burst : (uint8_t)1,
+    .refilled = mqttMillis(),
+  };
+}
+
+bool MQTT_Looped::setRateLimit(const char* topic, uint32_t interval, uint8_t burst) {
+  mqtt_topic_options_t* o = this->topicOptions(topic);
+  if (o == nullptr) {
+    return false;
+  }
+  o->limit = {
+    .interval = interval,
+    .burst = burst > 0 ? burst : (uint8_t)1,
+    .tokens = burst > 0 ? burst : (uint8_t)1,
+    .refilled = mqttMillis(),
+  };
+  return true;
+}
+
+bool MQTT_Looped::setRateLimit(const MQTTTopic* topic, uint32_t interval, uint8_t burst) {
+  return this->setRateLimit(topic->c_str(), interval, burst);
+}
+
+bool MQTT_Looped::setChangeFilter(const char* topic, uint32_t heartbeat, float absolute, float relative) {
+  mqtt_topic_options_t* o = this->topicOptions(topic);
+  if (o == nullptr) {
+    return false;
+  }
+  o->filter = true;
+  o->heartbeat = heartbeat;
+  o->absolute = absolute;
+  o->relative = relative;
+  return true;
+}
+
+bool MQTT_Looped::setChangeFilter(const MQTTTopic* topic, uint32_t heartbeat, float absolute, float relative) {
+  return this->setChangeFilter(topic->c_str(), heartbeat, absolute, relative);
+}
+
+bool MQTT_Looped::setOfflineCompact(const char* topic) {
+  mqtt_topic_options_t* o = this->topicOptions(topic);
+  if (o == nullptr) {
+    return false;
+  }
+  o->compact = true;
+  return true;
+}
+
+bool MQTT_Looped::setOfflineCompact(const MQTTTopic* topic) {
+  return this->setOfflineCompact(topic->c_str());
+}
+
+const mqtt_topic_options_t* MQTT_Looped::getTopicOptions(const char* topic) {
+  int16_t i = this->findTopicOptions(topicRef(topic, false));
+  return i >= 0 ? &this->topic_options[i] : nullptr;
+}
+
+const mqtt_publish_stats_t* MQTT_Looped::getPublishStats(void) {
+#if MQTT_PUBLISH_QUEUE_LEN > 0
+  this->publish_stats.queue_full = this->publish_queue.dropped();
+#endif
+  return &this->publish_stats;
+}
+
+mqtt_topic_options_t* MQTT_Looped::topicOptions(const char* topic) {
+  int16_t i = this->findTopicOptions(topicRef(topic, false));
+  if (i >= 0) {
+    return &this->topic_options[i];
+  }
+  mqtt_topic_options_t o = {};
+  o.topic = topic;
+  o.topiclen = strlen(topic);
+  if (!this->topic_options.push_back(o)) {
+    DEBUG_PRINTLN(F("Error: too many topic options"));
+    return nullptr;
+  }
+  return &this->topic_options.back();
+}
+
+bool MQTT_Looped::valueChanged(int16_t options, const mqtt_number_t* number, uint32_t hash, uint16_t len) {
+  mqtt_topic_options_t* o = &this->topic_options[options];
+  bool changed = !o->has_last || o->last_numeric != (number != nullptr)
+    || (o->heartbeat > 0 && mqttMillis() - o->last_at >= o->heartbeat);
+  if (number != nullptr && number->integer && o->last_number.integer) {
+    // Whole numbers differ exactly, a float can't tell large ones apart.
+    uint32_t last = o->last_number.uint;
+    uint32_t change = number->uint > last ? number->uint - last : last - number->uint;
+    changed = changed || !(change <= o->absolute || change <= o->relative * last);
+  } else if (number != nullptr) {
+    float value = number->integer ? number->uint : number->number;
+    float last = o->last_number.integer ? o->last_number.uint : o->last_number.number;
+    // NaN compares false either way, so counts as a change.
+    float change = fabsf(value - last);
+    changed = changed || !(change <= o->absolute || change <= o->relative * fabsf(last));
+  } else {
+    changed = changed || hash != o->last_hash || len != o->last_len;
+  }
+  if (!changed) {
+    o->suppressed++;
+    this->publish_stats.suppressed++;
+  }
+  return changed;
+}
+
+void MQTT_Looped::valuePublished(int16_t options, const mqtt_number_t* number, uint32_t hash, uint16_t len) {
+  mqtt_topic_options_t* o = &this->topic_options[options];
+  if (number != nullptr) {
+    o->last_number = *number;
+  } else {
+    o->last_hash = hash;
+    o->last_len = len;
+  }
+  o->has_last = true;
+  o->last_numeric = number != nullptr;
+  o->last_at = mqttMillis();
+}
+
+int16_t MQTT_Looped::findTopicOptions(const mqtt_topic_ref_t& topic) {
+  for (uint16_t i = 0; i < this->topic_options.size(); i++) {
+    const mqtt_topic_options_t* r = &this->topic_options[i];
+    if (r->topiclen != topic.len) {
+      continue;
+    }
+    int cmp = topic.progmem ? strncmp_P(r->topic, topic.topic, topic.len) : memcmp(r->topic, topic.topic, topic.len);
+    if (cmp == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+bool MQTT_Looped::rateAvailable(int16_t limit) {
+  if (this->rate_limit.interval > 0) {
+    rateRefill(&this->rate_limit);
+    if (this->rate_limit.tokens == 0) {
+      return false;
+    }
+  }
+  if (limit >= 0 && this->topic_options[limit].limit.interval > 0) {
+    mqtt_rate_limit_t* l = &this->topic_options[limit].limit;
+    rateRefill(l);
+    if (l->tokens == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void MQTT_Looped::rateTake(int16_t limit) {
+  if (this->rate_limit.interval > 0 && this->rate_limit.tokens > 0) {
+    this->rate_limit.tokens--;
+  }
+  if (limit >= 0 && this->topic_options[limit].limit.interval > 0 && this->topic_options[limit].limit.tokens > 0) {
+    this->topic_options[limit].limit.tokens--;
+  }
+}
+
+uint32_t MQTT_Looped::rateWait(int16_t limit) {
+  uint32_t wait = 0;
+  mqtt_rate_limit_t* limits[2] = {
+    &this->rate_limit,
+    limit >= 0 ? &this->topic_options[limit].limit : nullptr,
+  };
+  for (mqtt_rate_limit_t* l : limits) {
+    if (l == nullptr || l->interval == 0) {
+      continue;
+    }
+    rateRefill(l);
+    if (l->tokens > 0) {
+      continue;
+    }
+    uint32_t elapsed = mqttMillis() - l->refilled;
+    uint32_t w = elapsed < l->interval ? l->interval - elapsed : 0;
+    wait = w > wait ? w : wait;
+  }
+  return wait;
+}
+
+bool MQTT_Looped::rateQueued(void) {
+#if MQTT_RATE_QUEUE_LEN > 0
+  for (uint8_t i = 0; i < MQTT_RATE_QUEUE_LEN; i++) {
+    if (this->rate_queue[i].seq != 0) {
+      return true;
+    }
+  }
+#endif
+  return false;
+}
+
+bool MQTT_Looped::rateEnqueue(const mqtt_topic_ref_t& topic, mqttpayload_t payload, bool retain, uint8_t qos, int16_t limit) {
+#if MQTT_RATE_QUEUE_LEN > 0
+  if (topic.len >= MQTT_RATE_TOPIC_LEN) {
+    return false;
+  }
+  // Same topic already waiting, or else a free slot.
+  mqtt_queued_t* slot = nullptr;
+  bool coalesce = false;
+  for (uint8_t i = 0; i < MQTT_RATE_QUEUE_LEN; i++) {
+    mqtt_queued_t* q = &this->rate_queue[i];
+    if (q->seq == 0) {
+      if (slot == nullptr) {
+        slot = q;
+      }
+      continue;
+    }
+    if (q->topiclen == topic.len) {
+      int cmp = topic.progmem ? strncmp_P(q->topic, topic.topic, topic.len) : memcmp(q->topic, topic.topic, topic.len);
+      if (cmp == 0) {
+        slot = q;
+        coalesce = true;
+        break;
+      }
+    }
+  }
+  if (slot == nullptr) {
+    return false;
+  }
+  // Write the payload into buffer first, so one that doesn't fit leaves a queued value intact.
+  uint16_t room = MQTT_RATE_PAYLOAD_LEN < sizeof(this->buffer) ? MQTT_RATE_PAYLOAD_LEN : sizeof(this->buffer);
+  this->publish_tail_len = 0;
+  int32_t len = payload(this->buffer, room);
+  if (len < 0 || this->publish_tail_len > 0) {
+    return false;
+  }
+  if (coalesce) {
+    DEBUG_PRINTLN(F("Rate limited, replaced queued value"));
+    this->publish_stats.rate_coalesced++;
+  } else {
+    DEBUG_PRINTLN(F("Rate limited, queued"));
+    if (topic.progmem) {
+      memcpy_P(slot->topic, topic.topic, topic.len);
+    } else {
+      memcpy(slot->topic, topic.topic, topic.len);
+    }
+    slot->topic[topic.len] = '\0';
+    slot->topiclen = topic.len;
+    slot->seq = ++this->rate_queue_seq;
+    this->publish_stats.rate_queued++;
+  }
+  memcpy(slot->payload, this->buffer, len);
+  slot->len = len;
+  slot->qos = qos;
+  slot->retain = retain;
+  slot->limit = limit;
+  return true;
+#else
+  (void)topic;
+  (void)payload;
+  (void)retain;
+  (void)qos;
+  (void)limit;
+  return false;
+#endif
+}
+
+bool MQTT_Looped::flushRateQueue(void) {
+#if MQTT_RATE_QUEUE_LEN > 0
+  mqtt_queued_t* next = nullptr;
+  for (uint8_t i = 0; i < MQTT_RATE_QUEUE_LEN; i++) {
+    mqtt_queued_t* q = &this->rate_queue[i];
+    if (q->seq != 0 && (next == nullptr || q->seq < next->seq) && this->rateAvailable(q->limit)) {
+      next = q;
+    }
+  }
+  if (next == nullptr || !this->mqttCanSend()) {
+    return false;
+  }
+  LOG_PRINT(F("MQTT publishing queued to "));
+  LOG_PRINTLN(next->topic);
+  this->rateTake(next->limit);
+  mqtt_topic_ref_t ref = {
+    .topic = next->topic,
+    .len = next->topiclen,
+    .progmem = false,
+    .encoded = nullptr,
+  };
+  bool sent = this->mqttPublish(ref, [next](uint8_t* buf, uint16_t size) -> int32_t {
+    if (next->len > size) {
+      return -1;
+    }
+    memcpy(buf, next->payload, next->len);
+    return next->len;
+  }, next->retain, next->qos);
+  if (!sent) {
+    LOG_PRINTLN(F("Error publishing"));
+    // Connection lost: sent once it's back. Otherwise it can't be sent at all.
+    if (!this->mqttIsConnected()) {
+      return true;
+    }
+    this->publish_stats.rate_dropped++;
+  }
+  next->seq = 0;
+  return true;
+#else
+  return false;
+#endif
+}
+
+// ---------------------------------------- OFFLINE STORE ------------------------------------------
+
+void MQTT_Looped::setOfflineStorage(MQTTStorage* storage, uint32_t interval) {
+  this->offline.begin(storage);
+  this->offline_interval = interval;
+}
+
+const mqtt_offline_stats_t* MQTT_Looped::getOfflineStats(void) {
+  return &this->offline.stats;
+}
+
+bool MQTT_Looped::offlineStore(const mqtt_topic_ref_t& topic, mqttpayload_t payload, bool retain, uint8_t qos, int16_t options, uint8_t* buf) {
+  char t[MQTT_OFFLINE_TOPIC_LEN];
+  if (topic.len >= MQTT_OFFLINE_TOPIC_LEN) {
+    DEBUG_PRINTLN(F("Offline, topic too long to store"));
+    this->offline.stats.dropped++;
+    return false;
+  }
+  if (topic.progmem) {
+    memcpy_P(t, topic.topic, topic.len);
+  } else {
+    memcpy(t, topic.topic, topic.len);
+  }
+  this->publish_tail_len = 0;
+  int32_t len = payload(buf, sizeof(this->buffer));
+  if (len < 0 || this->publish_tail_len > 0) {
+    DEBUG_PRINTLN(F("Offline, payload too large to store"));
+    this->offline.stats.dropped++;
+    return false;
+  }
+  bool compact = options >= 0 && this->topic_options[options].compact;
+  if (!this->offline.push(t, topic.len, buf, len, qos, retain, compact)) {
+    return false;
+  }
+  DEBUG_PRINTLN(F("Offline, stored"));
+  return true;
+}
+
+bool MQTT_Looped::replayOffline(void) {
+  if (!this->offline.enabled() || this->offline.empty() || this->offline_acking != 0 ||
+      !this->offline_timer.expired(this->offline_interval)) {
+    return false;
+  }
+  // Captured as a single reference, so std::function doesn't allocate.
+  struct {
+    MQTTOfflineQueue* queue;
+    mqtt_offline_record_t rec;
+    bool fits;
+  } r = { &this->offline, {}, true };
+  mqtt_offline_record_t& rec = r.rec;
+  if (!this->offline.front(&rec) || !this->mqttCanSend()) {
+    return false;
+  }
+  this->offline_timer.start();
+  LOG_PRINT(F("MQTT publishing stored to "));
+  LOG_PRINTLN(rec.topic);
+  uint16_t packet_id = this->packet_id_counter;
+  mqtt_topic_ref_t ref = {
+    .topic = rec.topic,
+    .len = rec.topiclen,
+    .progmem = false,
+    .encoded = nullptr,
+  };
+  bool sent = this->mqttPublish(ref, [&r](uint8_t* buf, uint16_t size) -> int32_t {
+    if (r.rec.len > size) {
+      r.fits = false;
+      return -1;
+    }
+    return r.queue->readPayload(r.rec, buf) ? r.rec.len : -1;
+  }, rec.retain, rec.qos);
+  if (sent && rec.qos > 0) {
+    // Kept until the broker has it, in case the connection drops first.
+    this->offline_acking = packet_id;
+  } else if (sent) {
+    this->offline.stats.replayed++;
+    this->offline.pop();
+  } else if (!r.fits) {
+    // Never going to fit, don't hold up the rest.
+    LOG_PRINTLN(F("Stored publish too large, dropped"));
+    this->offline.stats.dropped++;
+    this->offline.pop();
+  } else {
+    // Kept for the next try.
+    LOG_PRINTLN(F("Error publishing"));
+  }
+  return true;
+}
+
+void MQTT_Looped::offlineAcked(uint16_t packet_id) {
+  if (this->offline_acking == 0 || this->offline_acking != packet_id) {
+    return;
+  }
+  this->offline_acking = 0;
+  this->offline.stats.replayed++;
+  this->offline.pop();
+}
+
+// ---------------------------------------- PUBLISH QUEUE ------------------------------------------
+
+#if MQTT_PUBLISH_QUEUE_LEN > 0
+bool MQTT_ISR_ATTR MQTT_Looped::mqttQueueMessage(const char* topic, const uint8_t* payload, uint16_t len, bool retain, uint8_t qos) {
+  return this->queueMessage(topic, nullptr, MQTT_PENDING_BYTES, payload, len, retain, qos);
+}
+
+bool MQTT_ISR_ATTR MQTT_Looped::mqttQueueMessage(const char* topic, const char* payload, bool retain, uint8_t qos) {
+  // Bounded, unlike strlen().
+  uint16_t len = strnlen(payload, MQTT_PUBLISH_QUEUE_PAYLOAD_LEN + 1);
+  return this->queueMessage(topic, nullptr, MQTT_PENDING_BYTES, payload, len, retain, qos);
+}
+
+bool MQTT_ISR_ATTR MQTT_Looped::mqttQueueMessage(const char* topic, float payload, bool retain, uint8_t qos) {
+  return this->queueMessage(topic, nullptr, MQTT_PENDING_FLOAT, &payload, sizeof(payload), retain, qos);
+}
+
+bool MQTT_ISR_ATTR MQTT_Looped::mqttQueueMessage(const char* topic, uint32_t payload, bool retain, uint8_t qos) {
+  return this->queueMessage(topic, nullptr, MQTT_PENDING_UINT, &payload, sizeof(payload), retain, qos);
+}
+
+bool MQTT_ISR_ATTR MQTT_Looped::mqttQueueMessage(const MQTTTopic* topic, const char* payload, bool retain, uint8_t qos) {
+  uint16_t len = strnlen(payload, MQTT_PUBLISH_QUEUE_PAYLOAD_LEN + 1);
+  return this->queueMessage(nullptr, topic, MQTT_PENDING_BYTES, payload, len, retain, qos);
+}
+
+bool MQTT_ISR_ATTR MQTT_Looped::mqttQueueMessage(const MQTTTopic* topic, float payload, bool retain, uint8_t qos) {
+  return this->queueMessage(nullptr, topic, MQTT_PENDING_FLOAT, &payload, sizeof(payload), retain, qos);
+}
+
+bool MQTT_ISR_ATTR MQTT_Looped::mqttQueueMessage(const MQTTTopic* topic, uint32_t payload, bool retain, uint8_t qos) {
+  return this->queueMessage(nullptr, topic, MQTT_PENDING_UINT, &payload, sizeof(payload), retain, qos);
+}
+
+bool MQTT_ISR_ATTR MQTT_Looped::queueMessage(const char* topic, const MQTTTopic* registered, uint8_t type, const void* payload, uint16_t len, bool retain, uint8_t qos) {
+  if (len > MQTT_PUBLISH_QUEUE_PAYLOAD_LEN) {
+    return false;
+  }
+  uint32_t ticket;
+  mqtt_pending_t* p = this->publish_queue.reserve(&ticket);
+  if (p == nullptr) {
+    return false;
+  }
+  p->topic = topic;
+  p->registered = registered;
+  p->type = type;
+  p->qos = qos;
+  p->retain = retain;
+  if (type == MQTT_PENDING_BYTES) {
+    memcpy(p->payload, payload, len);
+    p->len = len;
+  } else {
+    memcpy(&p->integer, payload, sizeof(p->integer));
+    p->len = 0;
+  }
+  this->publish_queue.commit(ticket);
+  return true;
+}
+#endif
+
+bool MQTT_Looped::drainPublishQueue(void) {
+#if MQTT_PUBLISH_QUEUE_LEN > 0
+  mqtt_pending_t* p = this->publish_queue.front();
+  if (p == nullptr || !this->mqttCanSend()) {
+    return false;
+  }
+  // Waits its turn for a QoS 2 slot rather than fail.
+  if (p->qos == 2 && this->findQos2(0, MQTT_QOS2_FREE) == nullptr) {
+    return false;
+  }
+  // Measured here rather than by the producer, which may be an interrupt handler.
+  mqtt_topic_ref_t ref = p->registered != nullptr ? p->registered->ref() : topicRef(p->topic, false);
+  bool taken;
+  switch (p->type) {
+    case MQTT_PENDING_FLOAT: {
+      mqtt_number_t number = { .integer = false, .number = p->number, .uint = 0 };
+      taken = this->mqttSend(ref, numberPayload(p->number), p->retain, p->qos, &number);
+      break;
+    }
+    case MQTT_PENDING_UINT: {
+      mqtt_number_t number = { .integer = true, .number = 0, .uint = p->integer };
+      taken = this->mqttSend(ref, numberPayload(p->integer), p->retain, p->qos, &number);
+      break;
+    }
+    default:
+      // The slot stays put until popped, so the payload is copied straight from it.
+      taken = this->mqttSend(ref, [p](uint8_t* buf, uint16_t size) -> int32_t {
+        if (p->len > size) {
+          return -1;
+        }
+        memcpy(buf, p->payload, p->len);
+        return p->len;
+      }, p->retain, p->qos);
+  }
+  // Lost with the connection, it's sent on the next one, like flushRateQueue() does. Any other
+  // failure, e.g. too long for the buffer, would only fail again.
+  if (!taken && !this->mqttIsConnected()) {
+    return true;
+  }
+  if (!taken) {
+    DEBUG_PRINTLN(F("Queued publish failed, dropped"));
+    this->publish_stats.queue_dropped++;
+  }
+  this->publish_queue.pop();
+  return true;
+#else
+  return false;
+#endif
+}
+
+// ------------------------------------------ PUBLISHING -------------------------------------------
+
+bool MQTT_Looped::mqttCanSend(void) {
+  // If not connected OR if in the middle of something.
+  if (!this->mqttIsConnected() || this->mqttIsActive() || this->sendPending()) {
+    return false;
+  }
+  if (!this->transport->connected()) {
+    this->status = MQTT_LOOPED_STATUS_MQTT_OFFLINE;
+    return false;
+  }
+  return true;
+}
+
+bool MQTT_Looped::mqttPublish(const char* topic, const char* payload, bool retain, uint8_t qos) {
+  return this->mqttPublish(topic, stringPayload(payload), retain, qos);
+}
+
+bool MQTT_Looped::mqttPublish(const __FlashStringHelper* topic, const __FlashStringHelper* payload, bool retain, uint8_t qos) {
+  return this->mqttPublish((const char*)topic, this->flashPayload((const char*)payload), retain, qos, true);
+}
+
+bool MQTT_Looped::mqttPublish(const char* topic, mqttpayload_t payload, bool retain, uint8_t qos, bool progmem) {
+  return this->mqttPublish(topicRef(topic, progmem), payload, retain, qos);
+}
+
+bool MQTT_Looped::mqttPublish(const mqtt_topic_ref_t& topic, mqttpayload_t payload, bool retain, uint8_t qos) {
+  // QoS 2 needs a slot to track the handshake.
+  mqtt_inflight_t* slot = nullptr;
+  if (qos == 2) {
+    slot = this->findQos2(0, MQTT_QOS2_FREE);
+    if (slot == nullptr) {
+      DEBUG_PRINTLN(F("Too many QoS 2 publishes in flight"));
+      return false;
+    }
+  }
+  uint16_t packet_id = this->packet_id_counter;
+  // Write the payload in place, then construct the rest of the packet around it and send.
+  uint8_t* data = this->publishPayload(topic.len, qos);
+  if (data == nullptr) {
+    DEBUG_PRINTLN(F("Topic too long"));
+    return false;
+  }
+  this->publish_tail_len = 0;
+  int32_t bLen = payload(data, this->buffer + sizeof(this->buffer) - data);
+  if (bLen < 0) {
+    DEBUG_PRINTLN(F("Payload too large"));
+    return false;
+  }
+  uint16_t tail_len = this->publish_tail_len;
+  uint16_t len = this->publishHeaders(topic, data, bLen + tail_len, qos, retain);
+  // QoS 2 keeps the whole packet until the PUBREC, to resend if it's lost.
+  if (qos == 2) {
+    if (len > sizeof(slot->packet)) {
+      DEBUG_PRINTLN(F("Too long to keep for QoS 2"));
+      return false;
+    }
+    memcpy(slot->packet, this->publish_start, len - tail_len);
+    if (tail_len > 0) {
+      memcpy_P(slot->packet + len - tail_len, this->publish_tail, tail_len);
+    }
+    slot->len = len;
+  }
+  if (!this->sendPacket(this->publish_start, len - tail_len, this->publish_tail, tail_len)) {
+    return false;
+  }
+#if MQTT_PROTOCOL_LEVEL == 5
+  this->registerTopicAlias(topic);
+#endif
+  this->attempts = 0;
+  // If QoS is 0, skip waiting for puback.
+  if (qos == 0) {
+    this->status = MQTT_LOOPED_STATUS_OKAY;
+    return true;
+  }
+  // If QoS is 2, the handshake completes over later loops, see handleQos2Packet().
+  if (qos == 2) {
+    slot->packet_id = packet_id;
+    slot->state = MQTT_QOS2_AWAITING_PUBREC;
+    slot->timer = mqttMillis();
+    this->status = MQTT_LOOPED_STATUS_OKAY;
+    return true;
+  }
+  this->status = MQTT_LOOPED_STATUS_READING_PUBACK_PACKET;
+  return true;
+}
+
+bool MQTT_Looped::handlePubAck(void) {
+  DEBUG_PRINT(F("Publish QOS1 reply:\t"));
+  DEBUG_PRINTBUFFER(this->buffer, this->full_packet_len);
+  // MQTT 5 may append a reason code and properties.
+  bool acked = this->full_packet_len >= 4 && this->buffer[0] >> 4 == MQTT_CTRL_PUBACK;
+  if (acked) {
+    uint16_t packnum = this->buffer[2];
+    packnum <<= 8;
     packnum |= this->buffer[3];
+    this->offlineAcked(packnum);
     // we increment the packet_id_counter right after publishing so inc here too to match
     packnum = packnum + 1 + (packnum + 1 == 0); // Skip zero
     if (packnum != this->packet_id_counter) {
       DEBUG_PRINTLN(F("Error publishing"));
     }
+    this->attempts = 0;
+  } else {
+    // Several PUBACKs missing in a row, the connection is likely gone.
+    this->attempts++;
+    DEBUG_PRINTLN(F("Error reading puback"));
   }
-  this->status = MQTT_LOOPED_STATUS_OKAY;
-  return true;
+  // A replayed publish this was the wait for, still not acknowledged, goes again on its next turn.
+  uint16_t after_replayed = this->offline_acking + 1 + (this->offline_acking + 1 == 0);
+  if (this->offline_acking != 0 && after_replayed == this->packet_id_counter) {
+    this->offline_acking = 0;
+  }
+  if (this->attempts > 3) {
+    this->status = MQTT_LOOPED_STATUS_MQTT_ERRORS;
+    this->attempts = 0;
+    return false;
+  }
+  // Discoveries go on with the next one.
+  this->status = this->discovery_counter > 0 ? MQTT_LOOPED_STATUS_SENDING_DISCOVERY : MQTT_LOOPED_STATUS_OKAY;
+  return acked;
 }
 
 // -------------------------------------- PACKET PROCESSING ----------------------------------------
@@ -601,11 +2012,11 @@ bool MQTT_Looped::mqttPublish(const char* topic, const char* payload, bool retai
 void MQTT_Looped::readFullPacketSearch(void) {
   // Start timer.
   if (!this->read_packet_search) {
-    this->read_packet_search_timer = millis();
+    this->read_packet_search_timer.start();
     this->read_packet_search = true;
   }
   // Check timeout.
-  if (this->read_packet_search && millis() - this->read_packet_search_timer > MQTT_READ_PACKET_SEARCH_TIMEOUT) {
+  if (this->read_packet_search && this->read_packet_search_timer.expired(MQTT_READ_PACKET_SEARCH_TIMEOUT)) {
     DEBUG_PRINTLN(F("Search timed out.."));
     this->read_packet_search = false;
     // If we were trying to subscribe and we got nothing, assume it failed.
@@ -618,6 +2029,7 @@ void MQTT_Looped::readFullPacketSearch(void) {
     }
     // If we published and waited for a response, we didn't get one, go back to that loop.
     else if (this->status == MQTT_LOOPED_STATUS_READING_PUBACK_PACKET) {
+      this->full_packet_len = 0;
       this->status = MQTT_LOOPED_STATUS_MQTT_PUBLISHED;
     }
     // If we were sent a ping and got nothing, assume the connection should be reset.
@@ -633,6 +2045,10 @@ void MQTT_Looped::readFullPacketSearch(void) {
   }
   // Read a full packet.
   this->readFullPacket();
+  if (this->status == MQTT_LOOPED_STATUS_MQTT_ERRORS) {
+    this->read_packet_search = false;
+    return; // connection failed
+  }
   // If the readFullPacket loop has come back around to -1, the start, we've either finished
   // reading a full packet or something borked and we were kicked out of the loop.
   if (this->read_packet_jump_to == -1) {
@@ -655,11 +2071,22 @@ void MQTT_Looped::readFullPacketSearch(void) {
         return;
       // Looking for the following:
       case MQTT_CTRL_SUBACK:
-        if (this->status == MQTT_LOOPED_STATUS_READING_SUBACK_PACKET) {
+        // Only the ack for the subscribe just sent ends the wait; a late one for an earlier try, or
+        // one for a change made while connected, doesn't.
+        if (this->status == MQTT_LOOPED_STATUS_READING_SUBACK_PACKET && this->full_packet_len >= 4 &&
+            (this->buffer[2] << 8 | this->buffer[3]) == this->subscribe_packet_id) {
           this->read_packet_search = false;
           this->status = MQTT_LOOPED_STATUS_MQTT_SUBSCRIBING;
+        } else {
+          // Otherwise keep looking.
+          this->handleSubAck(this->full_packet_len);
+          this->full_packet_len = 0;
         }
         return;
+      case MQTT_CTRL_UNSUBACK:
+        this->handleSubAck(this->full_packet_len);
+        this->full_packet_len = 0;
+        return;
       case MQTT_CTRL_PUBACK:
         if (this->status == MQTT_LOOPED_STATUS_READING_PUBACK_PACKET) {
           this->read_packet_search = false;
@@ -672,22 +2099,30 @@ void MQTT_Looped::readFullPacketSearch(void) {
           this->status = MQTT_LOOPED_STATUS_OKAY;
         }
         return;
+      // Part of a QoS 2 handshake, answer it and keep looking:
+      case MQTT_CTRL_PUBREC:
+      case MQTT_CTRL_PUBREL:
+      case MQTT_CTRL_PUBCOMP:
+        this->handleQos2Packet(this->full_packet_len);
+        this->full_packet_len = 0;
+        return;
       // Not looking for the following, but process if we read it:
       case MQTT_CTRL_PUBLISH:
         this->read_packet_search = false;
         this->status = MQTT_LOOPED_STATUS_SUBSCRIPTION_PACKET_READ;
         return;
+      // MQTT 5 brokers announce why they close the connection:
+      case MQTT_CTRL_DISCONNECT:
+        LOG_PRINTLN(F("Disconnected by broker"));
+        this->read_packet_search = false;
+        this->status = MQTT_LOOPED_STATUS_MQTT_ERRORS;
+        return;
       // Not looking for these:
       case MQTT_CTRL_CONNECTACK:  // not relevant here
       case MQTT_CTRL_CONNECT:     // send only
-      case MQTT_CTRL_DISCONNECT:  // send only
       case MQTT_CTRL_PINGREQ:     // send only
       case MQTT_CTRL_SUBSCRIBE:   // send only
-      case MQTT_CTRL_UNSUBSCRIBE: // unused
-      case MQTT_CTRL_UNSUBACK:    // unused
-      case MQTT_CTRL_PUBREC:      // unused
-      case MQTT_CTRL_PUBREL:      // unused
-      case MQTT_CTRL_PUBCOMP:     // unused
+      case MQTT_CTRL_UNSUBSCRIBE: // send only
         DEBUG_PRINT(F("unexpected packet: "));
         DEBUG_PRINTLN(packetType);
         this->full_packet_len = 0;
@@ -701,9 +2136,14 @@ void MQTT_Looped::readFullPacketSearch(void) {
 }
 
 void MQTT_Looped::lookForSubPacket(void) {
+  // Nothing has arrived, so there's nothing to wait on.
+  if (this->read_packet_jump_to == -1 && this->transport->available() <= 0) {
+    this->status = MQTT_LOOPED_STATUS_OKAY;
+    return;
+  }
   this->readFullPacket(); // loop once...
-  // when done,
-  if (this->read_packet_jump_to == -1) {
+  // when done, unless the connection failed,
+  if (this->read_packet_jump_to == -1 && this->status != MQTT_LOOPED_STATUS_MQTT_ERRORS) {
     if (this->full_packet_len > 0) {
       this->status = MQTT_LOOPED_STATUS_SUBSCRIPTION_PACKET_READ;
     } else {
@@ -712,9 +2152,28 @@ void MQTT_Looped::lookForSubPacket(void) {
   }
 }
 
-void MQTT_Looped::readFullPacket(void) {
+void MQTT_Looped::readFullPacket(void) {
+#if MQTT_COROUTINES
+  if (!this->read_task && this->read_packet_jump_to == -1) {
+    this->read_task = this->readFullPacketTask();
+  }
+  // If out of frames, the state machine reads this packet instead.
+  if (this->read_task) {
+    this->read_packet_jump_to = 1; // reading
+    this->read_task.resume();
+    if (this->read_task.done()) {
+      this->read_task.reset();
+      this->read_packet_jump_to = -1;
+    }
+    return;
+  }
+#endif
+  this->readFullPacketSteps();
+}
+
+void MQTT_Looped::readFullPacketSteps(void) {
   // Check we haven't timed out.
-  if (this->read_packet_jump_to > 0 && millis() - this->read_packet_timer > MQTT_READ_PACKET_TIMEOUT) {
+  if (this->read_packet_jump_to > 0 && this->read_packet_timer.expired(MQTT_READ_PACKET_TIMEOUT)) {
     this->read_packet_jump_to = -1; // giving up, reset timer next time
     this->reading_packet = false; // reset individual read
     // If we didn't find a sub packet, that's fine.
@@ -728,7 +2187,7 @@ void MQTT_Looped::readFullPacket(void) {
     DEBUG_PRINT(F(", status: "));
     DEBUG_PRINTLN(this->status);
     // If offline, flag to connect; if connected, flag to reset connection.
-    // if (!this->wifiClient->connected()) {
+    // if (!this->transport->connected()) {
     //   DEBUG_PRINT(F("offline.."));
     //   this->status = MQTT_LOOPED_STATUS_MQTT_OFFLINE;
     // }
@@ -743,7 +2202,7 @@ void MQTT_Looped::readFullPacket(void) {
   switch (this->read_packet_jump_to) {
     case -1:
       // start timer
-      this->read_packet_timer = millis();
+      this->read_packet_timer.start();
       this->read_packet_jump_to++;
     case 0:
       // Save input
@@ -818,7 +2277,7 @@ void MQTT_Looped::readFullPacket(void) {
     case 6:
       // done
       this->full_packet_len = (this->read_packet_pbuf - this->read_packet_buf) + this->read_packet_len;
-      this->last_con_verify = millis();
+      this->last_con_verify.start();
       this->read_packet_jump_to = -1; // read, reset timer next time
       return;
     default:
@@ -829,9 +2288,92 @@ void MQTT_Looped::readFullPacket(void) {
   }
 }
 
+#if MQTT_COROUTINES
+void* MQTTTask::promise_type::operator new(size_t size, MQTT_Looped& owner) noexcept {
+  return owner.frame_pool.alloc(size);
+}
+
+MQTTTask MQTT_Looped::readFullPacketTask(void) {
+  uint8_t* p = this->buffer;
+  uint16_t got = 0;
+  int8_t read;
+  this->full_packet_len = 0;
+  this->read_packet_timer.start();
+  // Packet type.
+  while ((read = this->readBytes(p, 1, &got)) == 0) {
+    co_await MQTTYield{};
+  }
+  if (read < 0) {
+    co_return;
+  }
+  DEBUG_PRINT(F("Packet Type:\t"));
+  DEBUG_PRINTBUFFER(p, 1);
+  p++;
+  // Remaining length, a byte at a time.
+  uint32_t value = 0;
+  uint32_t multiplier = 1;
+  uint8_t encodedByte;
+  do {
+    got = 0;
+    while ((read = this->readBytes(p, 1, &got)) == 0) {
+      co_await MQTTYield{};
+    }
+    if (read < 0) {
+      co_return;
+    }
+    encodedByte = *p++;
+    value += (encodedByte & 0x7F) * multiplier;
+    multiplier *= 128;
+    if (multiplier > (128UL * 128UL * 128UL)) {
+      DEBUG_PRINT(F("Malformed packet len\n"));
+      co_return;
+    }
+  } while (encodedByte & 0x80);
+  DEBUG_PRINT(F("Packet Length:\t"));
+  DEBUG_PRINTLN(value);
+  uint16_t room = MAXBUFFERSIZE - (p - this->buffer) - 1;
+  if (value > room) {
+    DEBUG_PRINTLN(F("Packet too big for buffer"));
+    value = room;
+  }
+  // Variable header and payload.
+  got = 0;
+  while ((read = this->readBytes(p, value, &got)) == 0) {
+    co_await MQTTYield{};
+  }
+  if (read < 0) {
+    co_return;
+  }
+  DEBUG_PRINT(F("Read packet:\t"));
+  DEBUG_PRINTBUFFER(p, value);
+  this->full_packet_len = (p - this->buffer) + value;
+  this->last_con_verify.start();
+}
+
+int8_t MQTT_Looped::readBytes(uint8_t* p, uint16_t len, uint16_t* got) {
+  if (*got >= len) {
+    return 1;
+  }
+  int n = this->transport->read(p + *got, len - *got);
+  if (n < 0) {
+    // The connection failed, reading on won't help.
+    DEBUG_PRINTLN(F("read error"));
+    this->status = MQTT_LOOPED_STATUS_MQTT_ERRORS;
+    return -1;
+  }
+  if (n == 0) {
+    return this->read_packet_timer.expired(MQTT_READ_PACKET_TIMEOUT) ? -1 : 0;
+  }
+  // there's data still coming in, reset the timer
+  this->read_packet_timer.start();
+  *got += n;
+  return *got >= len ? 1 : 0;
+}
+#endif
+
 bool MQTT_Looped::readPacket(void) {
   // If we're out of read time, call it and move on.
-  if (this->reading_packet && millis() - this->read_packet_timer > MQTT_READ_PACKET_TIMEOUT) {
+  if (this->reading_packet && this->read_packet_timer.expired(MQTT_READ_PACKET_TIMEOUT)) {
     DEBUG_PRINTLN();
     this->reading_packet = false;
     return true; // done! <<< success?
@@ -840,24 +2382,31 @@ bool MQTT_Looped::readPacket(void) {
   if (!this->reading_packet) {
     this->read_packet_len = 0;
     this->reading_packet = true;
-    this->read_packet_timer = millis();
+    this->read_packet_timer.start();
   }
   // handle zero-length packets
   if (this->read_packet_maxlen == 0) {
     this->reading_packet = false;
     return true;
   }
-  // see if there is any data pending
-  if (!this->wifiClient->available()) {
+  // read as much of the packet as is pending
+  int n = this->transport->read(this->read_packet_pbuf + this->read_packet_len, this->read_packet_maxlen - this->read_packet_len);
+  if (n < 0) {
+    // The connection failed, reading on won't help.
+    DEBUG_PRINTLN(F("read error"));
+    this->reading_packet = false;
+    this->read_packet_jump_to = -1;
+    this->full_packet_len = 0;
+    this->status = MQTT_LOOPED_STATUS_MQTT_ERRORS;
+    return false;
+  }
+  if (n == 0) {
     DEBUG_PRINT("-");
     return false; // wait for it...
   }
   // there's data still coming in, reset the timer
-  this->read_packet_timer = millis();
-  // read packet
-  char c = this->wifiClient->read();
-  this->read_packet_pbuf[this->read_packet_len] = c;
-  this->read_packet_len++;
+  this->read_packet_timer.start();
+  this->read_packet_len += n;
   if (this->read_packet_len < this->read_packet_maxlen) {
     DEBUG_PRINT(".");
     return false;
@@ -870,7 +2419,7 @@ bool MQTT_Looped::readPacket(void) {
 }
 
 bool MQTT_Looped::handleSubscriptionPacket() {
-  uint16_t i, topiclen, datalen;
+  uint16_t topiclen, datalen;
   uint16_t len = this->full_packet_len;
   this->full_packet_len = 0;
 
@@ -889,117 +2438,302 @@ bool MQTT_Looped::handleSubscriptionPacket() {
   if (len < 3) {
     return false;
   }
-  if ((this->buffer[0] & 0xF0) != (MQTT_CTRL_PUBLISH) << 4) {
+  if ((this->buffer[0] & 0xF0) == (MQTT_CTRL_DISCONNECT) << 4) {
+    LOG_PRINTLN(F("Disconnected by broker"));
+    this->status = MQTT_LOOPED_STATUS_MQTT_ERRORS;
     return false;
   }
+  if ((this->buffer[0] >> 4) == MQTT_CTRL_SUBACK || (this->buffer[0] >> 4) == MQTT_CTRL_UNSUBACK) {
+    return this->handleSubAck(len);
+  }
+  if ((this->buffer[0] & 0xF0) != (MQTT_CTRL_PUBLISH) << 4) {
+    // QoS 2 handshake packets arrive here as well.
+    return this->handleQos2Packet(len);
+  }
 
-  // Parse out length of packet.
-  // NOTE: This includes data in the variable header and the payload.
-  uint16_t remainingLen = len - 4; // subtract the 4 header bytes
-  uint16_t const topicoffset = packetAdditionalLen(remainingLen);
-  uint16_t const topicstart = topicoffset + 4;
+  // Skip the fixed header.
+  // NOTE: Remaining length includes data in the variable header and the payload.
+  const uint8_t* end = this->buffer + len;
+  uint32_t remainingLen;
+  const uint8_t* p = decodeVarint(this->buffer + 1, end, &remainingLen);
+  if (p == nullptr || end - p < 2) {
+    return false;
+  }
 
-  topiclen = int((this->buffer[2 + topicoffset]) << 8 | this->buffer[3 + topicoffset]);
+  topiclen = p[0] << 8 | p[1];
+  const char* topic = (const char *)p + 2;
+  p += 2 + topiclen;
   DEBUG_PRINT(F("Looking for subscription len "));
   DEBUG_PRINTLN(topiclen);
 
+  uint8_t qos = (this->buffer[0] >> 1) & 0x3;
+  uint16_t packetid = 0;
+  if (qos > 0) {
+    if (end - p < 2) {
+      return false;
+    }
+    packetid = p[0];
+    packetid <<= 8;
+    packetid |= p[1];
+    p += 2;
+  }
+  if (p > end) {
+    return false;
+  }
+
+#if MQTT_PROTOCOL_LEVEL == 5
+  // Properties: resolve or learn a topic alias.
+  uint32_t proplen;
+  const uint8_t* props = decodeVarint(p, end, &proplen);
+  if (props == nullptr || props + proplen > end) {
+    return false;
+  }
+  p = props + proplen;
+  uint16_t alias;
+  if (findProperty(props, proplen, MQTT_PROP_TOPIC_ALIAS, &alias)) {
+    if (alias == 0 || alias > MQTT_TOPIC_ALIAS_MAX) {
+      DEBUG_PRINTLN(F("Bad topic alias"));
+      return false;
+    }
+    char* a = this->alias_in[alias - 1];
+    if (topiclen > 0) {
+      if (topiclen < MQTT_TOPIC_ALIAS_LEN) {
+        memcpy(a, topic, topiclen);
+        a[topiclen] = '\0';
+      }
+    } else {
+      topic = a;
+      topiclen = strlen(a);
+      if (topiclen == 0) {
+        DEBUG_PRINTLN(F("Unknown topic alias"));
+        return false;
+      }
+    }
+  }
+#endif
+  const uint8_t* payload = p;
+
+  // QoS 2 is delivered once: a retransmit of a publish we haven't been released from yet is
+  // only acknowledged again.
+  if (qos == 2) {
+    if (this->findQos2(packetid, MQTT_QOS2_AWAITING_PUBREL) != nullptr) {
+      DEBUG_PRINTLN(F("Duplicate QoS 2 publish"));
+      return this->sendAck(MQTT_CTRL_PUBREC << 4, packetid);
+    }
+    mqtt_inflight_t* slot = this->findQos2(0, MQTT_QOS2_FREE);
+    if (slot == nullptr) {
+      // No PUBREC, so the broker will send it again.
+      DEBUG_PRINTLN(F("Too many QoS 2 publishes in flight"));
+      return false;
+    }
+    slot->packet_id = packetid;
+    slot->state = MQTT_QOS2_AWAITING_PUBREL;
+    slot->timer = mqttMillis();
+  }
+
   // Find subscription associated with this packet.
   MQTTSubscribe* thisSub = nullptr;
   for (auto & sub : mqttSubs) {
-    // Skip this subscription if its name length isn't the same as the received topic name.
-    if (strlen(sub->topic) != topiclen)
+    // Unsubscribed, even if the broker hasn't caught up yet.
+    if (sub->op == MQTT_SUB_UNSUBSCRIBE || sub->op == MQTT_SUB_REMOVE)
       continue;
-    // Stop if the subscription topic matches the received topic. Be careful
-    // to make comparison case insensitive.
-    if (strncasecmp((char *)this->buffer + topicstart, sub->topic, topiclen) == 0) {
-      DEBUG_PRINT(F("Found sub #"));
-      DEBUG_PRINTLN(i);
-      if (sub->new_message) {
-        DEBUG_PRINTLN(F("Lost previous message"));
-      } else {
-        sub->new_message = true;
-      }
-      thisSub = sub;
-      break;
+    if (sub->wildcard) {
+      if (!topicMatches(sub->topic, topic, topiclen))
+        continue;
+    } else {
+      // Skip this subscription if its name length isn't the same as the received topic name.
+      if (sub->topiclen != topiclen)
+        continue;
+      // Skip unless the subscription topic matches the received topic. Be careful
+      // to make comparison case insensitive.
+      if (strncasecmp(topic, sub->topic, topiclen) != 0)
+        continue;
+    }
+    DEBUG_PRINT(F("Found sub: "));
+    DEBUG_PRINTLN(sub->topic);
+    if (sub->new_message) {
+      DEBUG_PRINTLN(F("Lost previous message"));
+    } else {
+      sub->new_message = true;
     }
+    thisSub = sub;
+    break;
   }
-  if (thisSub == nullptr) {
-    return false; // matching sub not found ???
+
+  if (thisSub != nullptr) {
+    // zero out the old data
+    memset(thisSub->lastread, 0, MAXBUFFERSIZE);
+
+    datalen = end - payload;
+    if (datalen >= MAXBUFFERSIZE) {
+      datalen = MAXBUFFERSIZE - 1; // cut it off
+    }
+    // extract out just the data, into the subscription object itself
+    memmove(thisSub->lastread, payload, datalen);
+    thisSub->datalen = datalen;
+    DEBUG_PRINT(F("Data len: "));
+    DEBUG_PRINTLN(datalen);
+    DEBUG_PRINT(F("Data: "));
+    DEBUG_PRINTLN((char *)thisSub->lastread);
+#if MQTT_LAST_VALUE_SLOTS > 0
+    this->last_values.put(topic, topiclen, thisSub->lastread, datalen);
+#endif
   }
 
-  uint8_t packet_id_len = 0;
-  uint16_t packetid = 0;
-  // Check if it is QoS 1. QoS 2 is unsupported.
-  if ((this->buffer[0] & 0x6) == 0x2) {
-    packet_id_len = 2;
-    packetid = this->buffer[topiclen + topicstart];
-    packetid <<= 8;
-    packetid |= this->buffer[topiclen + topicstart + 1];
+  // Acknowledge even without a matching sub so the broker doesn't keep resending.
+  if ((MQTT_PROTOCOL_LEVEL > 3) && qos == 1) {
+    this->sendAck(MQTT_CTRL_PUBACK << 4, packetid);
+  } else if (qos == 2) {
+    this->sendAck(MQTT_CTRL_PUBREC << 4, packetid);
   }
 
-  // zero out the old data
-  memset(thisSub->lastread, 0, MAXBUFFERSIZE);
+  return thisSub != nullptr;
+}
 
-  datalen = len - topiclen - packet_id_len - topicstart;
-  if (datalen > MAXBUFFERSIZE) {
-    datalen = MAXBUFFERSIZE - 1; // cut it off
+bool MQTT_Looped::handleQos2Packet(uint16_t len) {
+  if (len < 4) {
+    return false;
+  }
+  uint8_t packetType = this->buffer[0] >> 4;
+  uint16_t packetid = this->buffer[2];
+  packetid <<= 8;
+  packetid |= this->buffer[3];
+  mqtt_inflight_t* slot;
+  switch (packetType) {
+    case MQTT_CTRL_PUBREC:
+      // Our publish arrived; release it. A repeated PUBREC means our PUBREL was lost.
+      slot = this->findQos2(packetid, MQTT_QOS2_AWAITING_PUBREC);
+      if (slot == nullptr) {
+        slot = this->findQos2(packetid, MQTT_QOS2_AWAITING_PUBCOMP);
+      }
+      if (slot != nullptr) {
+        slot->state = MQTT_QOS2_AWAITING_PUBCOMP;
+        slot->timer = mqttMillis();
+      }
+      this->offlineAcked(packetid);
+      return this->sendAck(MQTT_CTRL_PUBREL << 4 | 0x2, packetid);
+    case MQTT_CTRL_PUBCOMP:
+      // Outbound handshake complete.
+      slot = this->findQos2(packetid, MQTT_QOS2_AWAITING_PUBCOMP);
+      if (slot == nullptr) {
+        return false;
+      }
+      slot->state = MQTT_QOS2_FREE;
+      return true;
+    case MQTT_CTRL_PUBREL:
+      // Inbound handshake complete, the packet id may be reused for a new message.
+      slot = this->findQos2(packetid, MQTT_QOS2_AWAITING_PUBREL);
+      if (slot != nullptr) {
+        slot->state = MQTT_QOS2_FREE;
+      }
+      return this->sendAck(MQTT_CTRL_PUBCOMP << 4, packetid);
+    default:
+      DEBUG_PRINT(F("unexpected packet: "));
+      DEBUG_PRINTLN(packetType);
+      return false;
   }
-  // extract out just the data, into the subscription object itself
-  memmove(thisSub->lastread, this->buffer + topicstart + topiclen + packet_id_len, datalen);
-  thisSub->datalen = datalen;
-  DEBUG_PRINT(F("Data len: "));
-  DEBUG_PRINTLN(datalen);
-  DEBUG_PRINT(F("Data: "));
-  DEBUG_PRINTLN((char *)thisSub->lastread);
+}
 
-  if ((MQTT_PROTOCOL_LEVEL > 3) && (this->buffer[0] & 0x6) == 0x2) {
-    uint8_t ackpacket[4];
+mqtt_inflight_t* MQTT_Looped::findQos2(uint16_t packet_id, mqtt_qos2_state_t state) {
+  for (auto & slot : this->qos2_inflight) {
+    if (slot.state == state && (state == MQTT_QOS2_FREE || slot.packet_id == packet_id)) {
+      return &slot;
+    }
+  }
+  return nullptr;
+}
 
-    // Construct and send puback packet.
-    ackpacket[0] = MQTT_CTRL_PUBACK << 4;
-    ackpacket[1] = 2;
-    ackpacket[2] = packetid >> 8;
-    ackpacket[3] = packetid;
-    if (!this->sendPacket(ackpacket, 4)) {
-      DEBUG_PRINT(F("Failed"));
+bool MQTT_Looped::retryQos2(void) {
+  for (auto & slot : this->qos2_inflight) {
+    if (slot.state == MQTT_QOS2_FREE || mqttMillis() - slot.timer < MQTT_QOS2_RETRY_TIMEOUT) {
+      continue;
+    }
+    slot.timer = mqttMillis();
+    switch (slot.state) {
+      case MQTT_QOS2_AWAITING_PUBREC:
+        // Same packet id, flagged as a duplicate.
+        slot.packet[0] |= 0x08;
+        this->sendPacket(slot.packet, slot.len);
+        return true;
+      case MQTT_QOS2_AWAITING_PUBCOMP:
+        this->sendAck(MQTT_CTRL_PUBREL << 4 | 0x2, slot.packet_id);
+        return true;
+      case MQTT_QOS2_AWAITING_PUBREL:
+        this->sendAck(MQTT_CTRL_PUBREC << 4, slot.packet_id);
+        return true;
     }
   }
+  return false;
+}
 
+bool MQTT_Looped::sendAck(uint8_t header, uint16_t packet_id) {
+  uint8_t ackpacket[4];
+  ackpacket[0] = header;
+  ackpacket[1] = 2;
+  ackpacket[2] = packet_id >> 8;
+  ackpacket[3] = packet_id;
+  if (!this->sendPacket(ackpacket, 4)) {
+    DEBUG_PRINT(F("Failed"));
+    return false;
+  }
   return true;
 }
 
-bool MQTT_Looped::sendPacket(uint8_t *buf, uint16_t len) {
-  uint16_t ret = 0;
-  uint16_t offset = 0;
+bool MQTT_Looped::sendPacket(uint8_t *buf, uint16_t len, const char* tail, uint16_t tail_len) {
   DEBUG_PRINTLN(F("Sending packet"));
-  while (len > 0) {
-    // Check we haven't timed out.
-    this->send_packet_timer = millis();
-    if (millis() - this->send_packet_timer > MQTT_SEND_PACKET_TIMEOUT) {
-      DEBUG_PRINT(F("sending packet timed out.."));
-      // If offline, flag to connect; if connected, flag to reset connection.
-      if (!this->wifiClient->connected()) {
-        DEBUG_PRINT(F("offline.."));
-        this->status = MQTT_LOOPED_STATUS_MQTT_OFFLINE;
-      } else {
-        DEBUG_PRINT(F("errors?.."));
-        this->status = MQTT_LOOPED_STATUS_MQTT_ERRORS;
-      }
-      return false;
+  this->send_packet_timer.start();
+  this->send_buf = buf;
+  this->send_len = len;
+  this->send_tail = tail;
+  this->send_tail_len = tail_len;
+  if (!this->continueSend()) {
+    return false;
+  }
+  // The rest is sent from the buffer, which nothing else uses until it's gone, see loop().
+  if (this->send_len > 0 && (this->send_buf < this->buffer || this->send_buf >= this->buffer + sizeof(this->buffer))) {
+    memmove(this->buffer, this->send_buf, this->send_len);
+    this->send_buf = this->buffer;
+  }
+  return true;
+}
+
+bool MQTT_Looped::continueSend(void) {
+  while (this->sendPending()) {
+    // Stream the rest of a flash payload through the buffer.
+    if (this->send_len == 0) {
+      uint16_t n = this->send_tail_len < sizeof(this->buffer) ? this->send_tail_len : sizeof(this->buffer);
+      memcpy_P(this->buffer, this->send_tail, n);
+      this->send_buf = this->buffer;
+      this->send_len = n;
+      this->send_tail += n;
+      this->send_tail_len -= n;
     }
     // send 250 bytes at most at a time, can adjust this later based on Client
-    uint16_t sendlen = len > 250 ? 250 : len;
-    ret = this->wifiClient->write(buf + offset, sendlen);
+    uint16_t sendlen = this->send_len > 250 ? 250 : this->send_len;
+    uint16_t ret = this->transport->write(this->send_buf, sendlen);
     DEBUG_PRINT(F("Client sendPacket returned: "));
     DEBUG_PRINTLN(ret);
-    if (ret != sendlen) {
-      DEBUG_PRINTLN(F("Failed to send packet."));
+    if (ret == 0) {
+      // Nothing written is either a lost connection or a full send buffer. A full buffer is
+      // tried again next loop, until the timeout.
+      if (!this->transport->connected()) {
+        DEBUG_PRINTLN(F("Failed to send packet."));
+        this->status = MQTT_LOOPED_STATUS_MQTT_OFFLINE;
+      } else if (this->send_packet_timer.expired(MQTT_SEND_PACKET_TIMEOUT)) {
+        // Connected but not taking anything, so reset the connection.
+        DEBUG_PRINTLN(F("sending packet timed out.."));
+        this->status = MQTT_LOOPED_STATUS_MQTT_ERRORS;
+      } else {
+        return true;
+      }
+      this->send_len = 0;
+      this->send_tail_len = 0;
       return false;
     }
-    len -= ret;
-    offset += ret;
+    this->send_buf += ret;
+    this->send_len -= ret;
   }
-  this->last_con_verify = millis();
+  this->last_con_verify.start();
   return true;
 }
 
@@ -1017,6 +2751,7 @@ uint8_t MQTT_Looped::connectPacket(void) {
   p++;
 
   // always clean the session
+  uint8_t* flags = p;
   p[0] = MQTT_CONN_CLEANSESSION;
 
   // set the will flags if needed
@@ -1042,6 +2777,15 @@ uint8_t MQTT_Looped::connectPacket(void) {
   p[0] = MQTT_CONN_KEEPALIVE & 0xFF;
   p++;
 
+#if MQTT_PROTOCOL_LEVEL == 5
+  // properties: accept topic aliases from the broker
+  p[0] = 3;
+  p[1] = MQTT_PROP_TOPIC_ALIAS_MAXIMUM;
+  p[2] = MQTT_TOPIC_ALIAS_MAX >> 8;
+  p[3] = MQTT_TOPIC_ALIAS_MAX & 0xFF;
+  p += 4;
+#endif
+
   if (MQTT_PROTOCOL_LEVEL == 3) {
     p = stringprint(p, this->mqtt_client_id, 23); // Limit client ID to first 23 characters.
   } else {
@@ -1057,8 +2801,37 @@ uint8_t MQTT_Looped::connectPacket(void) {
   }
 
   if (this->will.topic) {
-    p = stringprint(p, this->will.topic);
-    p = stringprint(p, this->will.payload);
+    uint16_t willlen;
+    if (this->will.progmem) {
+      willlen = strlen_P(this->will.topic) + strlen_P(this->will.payload);
+    } else {
+      willlen = strlen(this->will.topic) + strlen(this->will.payload);
+    }
+    // Will and credentials, each with a 2 byte length.
+    uint16_t needed = 8 + willlen + strlen(this->mqtt_user) + strlen(this->mqtt_pass);
+#if MQTT_PROTOCOL_LEVEL == 5
+    needed++;
+#endif
+    if (needed > this->buffer + sizeof(this->buffer) - p) {
+      // Better to connect without the will than not at all.
+      LOG_PRINTLN(F("Error: will too long for the buffer, connecting without it"));
+      flags[0] &= ~(MQTT_CONN_WILLFLAG | MQTT_CONN_WILLQOS_1 | MQTT_CONN_WILLQOS_2 | MQTT_CONN_WILLRETAIN);
+    }
+  }
+
+  if (flags[0] & MQTT_CONN_WILLFLAG) {
+#if MQTT_PROTOCOL_LEVEL == 5
+    // no will properties
+    p[0] = 0;
+    p++;
+#endif
+    if (this->will.progmem) {
+      p = stringprint(p, (const __FlashStringHelper*)this->will.topic);
+      p = stringprint(p, (const __FlashStringHelper*)this->will.payload);
+    } else {
+      p = stringprint(p, this->will.topic);
+      p = stringprint(p, this->will.payload);
+    }
   }
 
   p = stringprint(p, this->mqtt_user);
@@ -1073,39 +2846,100 @@ uint8_t MQTT_Looped::connectPacket(void) {
 }
 
 uint16_t MQTT_Looped::publishPacket(const char *topic, uint8_t *data, uint16_t bLen, uint8_t qos, bool retain) {
-  uint8_t *p = this->buffer;
-  uint16_t len = 0;
-  uint16_t maxPacketLen = (uint16_t)sizeof(this->buffer);
-
-  // calc length of non-header data
-  len += 2;             // two bytes to set the topic size
-  len += strlen(topic); // topic length
-  if (qos > 0) {
-    len += 2; // qos packet id
+  mqtt_topic_ref_t ref = topicRef(topic, false);
+  uint8_t* payload = this->publishPayload(ref.len, qos);
+  if (payload == nullptr) {
+    return 0;
   }
-  // Calculate additional bytes for length field (if any)
-  uint16_t additionalLen = packetAdditionalLen(len + bLen);
-
-  // Payload remaining length. When maxPacketLen provided is 0, let's
-  // assume buffer is big enough. Fingers crossed.
-  // 2 + additionalLen: header byte + remaining length field (from 1 to 4 bytes)
-  // len = topic size field + value (string)
-  // bLen = buffer size
-  if (!(maxPacketLen == 0 || (len + bLen + 2 + additionalLen <= maxPacketLen))) {
+  uint16_t room = this->buffer + sizeof(this->buffer) - payload;
+  if (bLen > room) {
     // If we make it here, we got a pickle: the payload is not going
     // to fit in the packet buffer. Instead of corrupting memory, let's
     // do something less damaging by reducing the bLen to what we are
-    // able to accomodate. Alternatively, consider using a bigger
-    // maxPacketLen.
-    bLen = maxPacketLen - (len + 2 + packetAdditionalLen(maxPacketLen));
+    // able to accomodate.
+    bLen = room;
+  }
+  memmove(payload, data, bLen);
+  return this->publishHeaders(ref, payload, bLen, qos, retain);
+}
+
+uint8_t* MQTT_Looped::publishPayload(uint16_t topiclen, uint8_t qos) {
+  uint16_t headers = MQTT_PUBLISH_HEADER_RESERVE;
+  headers += 2;        // two bytes to set the topic size
+  headers += topiclen; // topic length
+  if (qos > 0) {
+    headers += 2; // qos packet id
+  }
+#if MQTT_PROTOCOL_LEVEL == 5
+  headers += 4; // properties, at most a topic alias
+#endif
+  if (headers > sizeof(this->buffer)) {
+    return nullptr;
+  }
+  return this->buffer + headers;
+}
+
+uint16_t MQTT_Looped::publishHeaders(const mqtt_topic_ref_t& topic, uint8_t* payload, uint16_t bLen, uint8_t qos, bool retain) {
+  // Everything is written backwards from the payload.
+  uint8_t *p = payload;
+  uint16_t topiclen = topic.len;
+
+#if MQTT_PROTOCOL_LEVEL == 5
+  // Replace the topic with an alias once the broker knows it.
+  bool send_topic;
+  uint16_t alias = this->topicAlias(topic, &send_topic);
+  if (!send_topic) {
+    topiclen = 0;
+  }
+
+  // properties
+  if (alias) {
+    p -= 4;
+    p[0] = 3;
+    p[1] = MQTT_PROP_TOPIC_ALIAS;
+    p[2] = alias >> 8;
+    p[3] = alias & 0xFF;
+  } else {
+    p--;
+    p[0] = 0;
+  }
+#endif
+
+  // add packet identifier. used for checking PUBACK in QOS > 0
+  if (qos > 0) {
+    p -= 2;
+    p[0] = (this->packet_id_counter >> 8) & 0xFF;
+    p[1] = this->packet_id_counter & 0xFF;
+
+    // increment the packet id, skipping 0
+    this->packet_id_counter = this->packet_id_counter + 1 + (this->packet_id_counter + 1 == 0);
+  }
+
+  // topic comes before packet identifier
+  if (topic.encoded && topiclen > 0) {
+    // already length prefixed
+    p -= 2 + topiclen;
+    memcpy(p, topic.encoded, 2 + topiclen);
+  } else {
+    p -= topiclen;
+    if (topic.progmem) {
+      memcpy_P(p, topic.topic, topiclen);
+    } else {
+      memcpy(p, topic.topic, topiclen);
+    }
+    p -= 2;
+    p[0] = topiclen >> 8;
+    p[1] = topiclen & 0xFF;
   }
-  len += bLen; // remaining len excludes header byte & length field
+
+  // remaining len excludes header byte & length field
+  uint32_t len = payload + bLen - p;
+  p -= 2 + packetAdditionalLen(len);
+  this->publish_start = p;
 
   // Now you can start generating the packet!
   p[0] = MQTT_CTRL_PUBLISH << 4 | qos << 1 | (retain ? 1 : 0);
   p++;
-
-  // fill in packet[1] last
   do {
     uint8_t encodedByte = len % 128;
     len /= 128;
@@ -1117,26 +2951,62 @@ uint16_t MQTT_Looped::publishPacket(const char *topic, uint8_t *data, uint16_t b
     p++;
   } while (len > 0);
 
-  // topic comes before packet identifier
-  p = stringprint(p, topic);
+  len = payload + bLen - this->publish_start;
+  DEBUG_PRINTLN(F("MQTT publish packet:"));
+#ifdef MQTT_DEBUG
+  // A payload streamed from flash runs past the buffer.
+  uint16_t inbuffer = this->buffer + sizeof(this->buffer) - this->publish_start;
+  DEBUG_PRINTBUFFER(this->publish_start, len < inbuffer ? len : inbuffer);
+#endif
+  return len;
+}
 
-  // add packet identifier. used for checking PUBACK in QOS > 0
-  if (qos > 0) {
-    p[0] = (this->packet_id_counter >> 8) & 0xFF;
-    p[1] = this->packet_id_counter & 0xFF;
-    p += 2;
+#if MQTT_PROTOCOL_LEVEL == 5
+uint16_t MQTT_Looped::topicAlias(const mqtt_topic_ref_t& topic, bool* send_topic) {
+  uint16_t topiclen = topic.len;
+  *send_topic = true;
+  this->alias_pending = 0;
+  if (topiclen == 0 || topiclen >= MQTT_TOPIC_ALIAS_LEN) {
+    return 0;
+  }
+  // Aliases are assigned in order and never reassigned during a connection.
+  for (uint16_t i = 0; i < this->alias_out_max; i++) {
+    char* a = this->alias_out[i];
+    if (a[0] == '\0') {
+      // First use: the topic goes along with the alias, until a packet with both is written.
+      this->alias_pending = i + 1;
+      return i + 1;
+    }
+    int cmp = topic.progmem ? strncmp_P(a, topic.topic, topiclen) : strncmp(a, topic.topic, topiclen);
+    if (cmp == 0 && a[topiclen] == '\0') {
+      *send_topic = false;
+      return i + 1;
+    }
+  }
+  return 0;
+}
 
-    // increment the packet id, skipping 0
-    this->packet_id_counter = this->packet_id_counter + 1 + (this->packet_id_counter + 1 == 0);
+void MQTT_Looped::registerTopicAlias(const mqtt_topic_ref_t& topic) {
+  if (this->alias_pending == 0) {
+    return;
+  }
+  char* a = this->alias_out[this->alias_pending - 1];
+  if (topic.progmem) {
+    memcpy_P(a, topic.topic, topic.len);
+  } else {
+    memcpy(a, topic.topic, topic.len);
   }
+  a[topic.len] = '\0';
+  this->alias_pending = 0;
+}
 
-  memmove(p, data, bLen);
-  p += bLen;
-  len = p - this->buffer;
-  DEBUG_PRINTLN(F("MQTT publish packet:"));
-  DEBUG_PRINTBUFFER(this->buffer, len);
-  return len;
+void MQTT_Looped::resetTopicAliases(void) {
+  memset(this->alias_out, 0, sizeof(this->alias_out));
+  memset(this->alias_in, 0, sizeof(this->alias_in));
+  this->alias_out_max = 0;
+  this->alias_pending = 0;
 }
+#endif
 
 uint8_t MQTT_Looped::subscribePacket(const char *topic, uint8_t qos) {
   uint8_t *p = this->buffer;
@@ -1154,6 +3024,12 @@ uint8_t MQTT_Looped::subscribePacket(const char *topic, uint8_t qos) {
   // increment the packet id, skipping 0
   this->packet_id_counter = this->packet_id_counter + 1 + (this->packet_id_counter + 1 == 0);
 
+#if MQTT_PROTOCOL_LEVEL == 5
+  // no properties
+  p[0] = 0;
+  p++;
+#endif
+
   p = stringprint(p, topic);
 
   p[0] = qos;
@@ -1166,7 +3042,38 @@ uint8_t MQTT_Looped::subscribePacket(const char *topic, uint8_t qos) {
   return len;
 }
 
-static uint8_t *stringprint(uint8_t *p, const char *s, uint16_t maxlen) {
+uint8_t MQTT_Looped::unsubscribePacket(const char *topic) {
+  uint8_t *p = this->buffer;
+  uint16_t len;
+
+  p[0] = MQTT_CTRL_UNSUBSCRIBE << 4 | MQTT_QOS_1 << 1;
+  // fill in packet[1] last
+  p += 2;
+
+  // packet identifier. used for checking UNSUBACK
+  p[0] = (this->packet_id_counter >> 8) & 0xFF;
+  p[1] = this->packet_id_counter & 0xFF;
+  p += 2;
+
+  // increment the packet id, skipping 0
+  this->packet_id_counter = this->packet_id_counter + 1 + (this->packet_id_counter + 1 == 0);
+
+#if MQTT_PROTOCOL_LEVEL == 5
+  // no properties
+  p[0] = 0;
+  p++;
+#endif
+
+  p = stringprint(p, topic);
+
+  len = p - this->buffer;
+  this->buffer[1] = len - 2; // don't include the 2 bytes of fixed header data
+  DEBUG_PRINTLN(F("..unsubscribe packet:"));
+  DEBUG_PRINTBUFFER(this->buffer, len);
+  return len;
+}
+
+uint8_t *stringprint(uint8_t *p, const char *s, uint16_t maxlen) {
   // If maxlen is specified (has a non-zero value) then use it as the maximum
   // length of the source string to write to the buffer.  Otherwise write
   // the entire source string.
@@ -1182,7 +3089,112 @@ static uint8_t *stringprint(uint8_t *p, const char *s, uint16_t maxlen) {
   return p + len;
 }
 
-static uint16_t packetAdditionalLen(uint32_t currLen) {
+uint8_t *stringprint(uint8_t *p, const __FlashStringHelper *s) {
+  uint16_t len = strlen_P((const char *)s);
+  p[0] = len >> 8;
+  p++;
+  p[0] = len & 0xFF;
+  p++;
+  memcpy_P(p, s, len);
+  return p + len;
+}
+
+bool topicMatches(const char* filter, const char* topic, uint16_t topiclen) {
+  uint16_t i = 0;
+  while (*filter) {
+    if (*filter == '#') {
+      // Matches the rest, including the parent level ("a/#" matches "a").
+      return true;
+    }
+    if (*filter == '+') {
+      // Consume one level.
+      while (i < topiclen && topic[i] != '/') {
+        i++;
+      }
+      filter++;
+    } else {
+      if (i >= topiclen || tolower(*filter) != tolower(topic[i])) {
+        // "a/#" also matches "a": filter is at "/#" with the topic consumed.
+        return i == topiclen && filter[0] == '/' && filter[1] == '#' && filter[2] == '\0';
+      }
+      filter++;
+      i++;
+    }
+  }
+  return i == topiclen;
+}
+
+const uint8_t* decodeVarint(const uint8_t* p, const uint8_t* end, uint32_t* value) {
+  uint32_t multiplier = 1;
+  *value = 0;
+  for (uint8_t i = 0; i < 4 && p < end; i++) {
+    uint8_t encodedByte = *p++;
+    *value += (encodedByte & 0x7F) * multiplier;
+    if (!(encodedByte & 0x80)) {
+      return p;
+    }
+    multiplier *= 128;
+  }
+  return nullptr; // malformed
+}
+
+bool findProperty(const uint8_t* p, uint32_t len, uint8_t id, uint16_t* value) {
+  const uint8_t* end = p + len;
+  while (p < end) {
+    uint8_t prop = *p++;
+    uint32_t size;
+    switch (prop) {
+      case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2A:
+        size = 1; // byte
+        break;
+      case 0x13: case 0x21: case 0x22: case 0x23:
+        size = 2; // two byte integer
+        break;
+      case 0x02: case 0x11: case 0x18: case 0x27:
+        size = 4; // four byte integer
+        break;
+      case 0x0B: {
+        uint32_t v; // variable byte integer
+        const uint8_t* next = decodeVarint(p, end, &v);
+        if (next == nullptr) {
+          return false;
+        }
+        size = next - p;
+        break;
+      }
+      case 0x03: case 0x08: case 0x09: case 0x12: case 0x15: case 0x16: case 0x1A: case 0x1C: case 0x1F:
+        if (end - p < 2) {
+          return false;
+        }
+        size = 2 + (p[0] << 8 | p[1]); // string or binary data
+        break;
+      case 0x26: {
+        if (end - p < 2) {
+          return false;
+        }
+        uint32_t k = 2 + (p[0] << 8 | p[1]); // string pair
+        if ((uint32_t)(end - p) < k + 2) {
+          return false;
+        }
+        size = k + 2 + (p[k] << 8 | p[k + 1]);
+        break;
+      }
+      default:
+        return false; // unknown, can't skip it
+    }
+    if ((uint32_t)(end - p) < size) {
+      return false;
+    }
+    if (prop == id && size == 2) {
+      *value = p[0] << 8 | p[1];
+      return true;
+    }
+    p += size;
+  }
+  return false;
+}
+
+uint16_t packetAdditionalLen(uint32_t currLen) {
   /* Increase length field based on current length */
   if (currLen < 128) // 7-bits
     return 0;
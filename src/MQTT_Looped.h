@@ -1,13 +1,20 @@
 #ifndef MQTT_LOOPED_LIB_H
 #define MQTT_LOOPED_LIB_H
 
+#include <Arduino.h>
 #include <functional>
 #include <vector>
 using namespace std;
 
-#include <utility/wifi_drv.h>
-#include <utility/server_drv.h>
-#include <utility/WiFiSocketBuffer.h>
+#include "MQTT_Looped_Transport.h"
+#include "MQTT_Looped_LastValue.h"
+#include "MQTT_Looped_Cbor.h"
+#include "MQTT_Looped_Json.h"
+#include "MQTT_Looped_Coro.h"
+#include "MQTT_Looped_Static.h"
+#include "MQTT_Looped_Offline.h"
+#include "MQTT_Looped_Ring.h"
+#include "MQTT_Looped_Clock.h"
 
 // ---------------------------------------- TIMING CONFIG ------------------------------------------
 
@@ -29,10 +36,48 @@ using namespace std;
 // Interval for sending MQTT status.
 #define MQTT_STATUS_UPDATE_INTERVAL 30000
 
+// Time to wait on the next QoS 2 handshake packet before resending our last one.
+#define MQTT_QOS2_RETRY_TIMEOUT 5000
+
+// Time to wait on a SUBACK or UNSUBACK for a change made while connected before resending.
+#define MQTT_SUBSCRIBE_RETRY_TIMEOUT 5000
+
+// Timeout for opening a connection to the broker, including the TLS handshake with MQTT_TLS. A
+// full handshake takes seconds on slow boards.
+#ifndef MQTT_CONNECT_TIMEOUT
+#if MQTT_TLS
+#define MQTT_CONNECT_TIMEOUT 15000
+#else
+#define MQTT_CONNECT_TIMEOUT 4000
+#endif
+#endif
+
+// Time to let a new connection settle before sending the CONNECT packet.
+#define MQTT_CONNECTION_WAIT 3000
+
+// Consecutive failures before a broker endpoint is skipped in favor of the next one.
+#define MQTT_FAILOVER_THRESHOLD 2
+
+// How long a failed broker endpoint is skipped before it is tried again.
+#define MQTT_FAILOVER_RECOVERY 300000
+
 // --------------------------------------------- DEFS ----------------------------------------------
 
-// Use 3 (MQTT 3.0) or 4 (MQTT 3.1.1).
+// Use 3 (MQTT 3.0), 4 (MQTT 3.1.1) or 5 (MQTT 5.0).
+#ifndef MQTT_PROTOCOL_LEVEL
 #define MQTT_PROTOCOL_LEVEL 4
+#endif
+
+// MQTT 5 topic aliases per direction. Outbound, a topic sent once is replaced by a 2 byte alias
+// on every later publish. Each alias costs MQTT_TOPIC_ALIAS_LEN bytes of RAM per direction.
+#define MQTT_TOPIC_ALIAS_MAX 8
+
+// Longest topic that can be aliased, including null terminator.
+#define MQTT_TOPIC_ALIAS_LEN 64
+
+// MQTT 5 property identifiers used.
+#define MQTT_PROP_TOPIC_ALIAS_MAXIMUM 0x22
+#define MQTT_PROP_TOPIC_ALIAS 0x23
 
 // Packet types.
 #define MQTT_CTRL_CONNECT 0x1
@@ -50,10 +95,24 @@ using namespace std;
 #define MQTT_CTRL_PINGRESP 0xD
 #define MQTT_CTRL_DISCONNECT 0xE
 
-// QOS 2 not supported.
+// Quality of Service levels.
+#define MQTT_QOS_2 0x2
 #define MQTT_QOS_1 0x1
 #define MQTT_QOS_0 0x0
 
+// Number of QoS 2 packet ids that can be mid-handshake at once, inbound and outbound combined.
+#define MQTT_QOS2_INFLIGHT 4
+
+// Longest outbound QoS 2 PUBLISH packet, kept in its slot to resend until the PUBREC comes in.
+// Longer QoS 2 publishes are refused. Costs MQTT_QOS2_INFLIGHT times this in RAM.
+#ifndef MQTT_QOS2_PACKET_LEN
+#if defined(ARDUINO_ARCH_AVR)
+#define MQTT_QOS2_PACKET_LEN 32
+#else
+#define MQTT_QOS2_PACKET_LEN 128
+#endif
+#endif
+
 // Flags for connection packet.
 #define MQTT_CONN_USERNAMEFLAG 0x80
 #define MQTT_CONN_PASSWORDFLAG 0x40
@@ -72,14 +131,68 @@ using namespace std;
 #define MAXBUFFERSIZE (150)
 #endif
 
-// If WiFi library differs.
-#ifndef WL_SUCCESS
-#define WL_SUCCESS 1
+// Keep encoded CONNECT and SUBSCRIBE packets between reconnects, so reconnecting only sends them.
+// Costs their size in RAM, so off by default on AVR. Also off with MQTT_STATIC_ALLOC, since the
+// packets are allocated on first connect.
+#ifndef MQTT_PACKET_CACHE
+#if defined(ARDUINO_ARCH_AVR) || MQTT_STATIC_ALLOC
+#define MQTT_PACKET_CACHE 0
+#else
+#define MQTT_PACKET_CACHE 1
+#endif
+#endif
+
+// Publishes held back by the rate limiter, one per topic, the newest value replacing older ones.
+// 0 drops publishes over the limit instead. Costs MQTT_RATE_TOPIC_LEN + MQTT_RATE_PAYLOAD_LEN
+// bytes of RAM each, so off by default on AVR.
+#ifndef MQTT_RATE_QUEUE_LEN
+#if defined(ARDUINO_ARCH_AVR)
+#define MQTT_RATE_QUEUE_LEN 0
+#else
+#define MQTT_RATE_QUEUE_LEN 4
+#endif
+#endif
+
+// Longest topic held back by the rate limiter, including null terminator. Longer topics are dropped.
+#ifndef MQTT_RATE_TOPIC_LEN
+#define MQTT_RATE_TOPIC_LEN 64
+#endif
+
+// Longest payload held back by the rate limiter. Longer payloads are dropped.
+#ifndef MQTT_RATE_PAYLOAD_LEN
+#define MQTT_RATE_PAYLOAD_LEN 64
+#endif
+
+// Publishes queued with mqttQueueMessage() from interrupt handlers and other tasks, waiting for
+// loop(). A power of 2; 0 leaves the queue out. Needs lock-free std::atomic, so off where it's
+// missing or takes a lock.
+#ifndef MQTT_PUBLISH_QUEUE_LEN
+#if MQTT_ATOMIC_LOCK_FREE
+#define MQTT_PUBLISH_QUEUE_LEN 8
+#else
+#define MQTT_PUBLISH_QUEUE_LEN 0
+#endif
+#endif
+
+// Longest payload queued with mqttQueueMessage(). Longer payloads are refused.
+#ifndef MQTT_PUBLISH_QUEUE_PAYLOAD_LEN
+#define MQTT_PUBLISH_QUEUE_PAYLOAD_LEN 32
+#endif
+
+// Subscription callbacks run away from loop() by an MQTTExecutor, see setExecutor(). Needs
+// std::atomic, so off where it's missing.
+#ifndef MQTT_EXECUTOR
+#if __has_include(<atomic>)
+#define MQTT_EXECUTOR 1
+#else
+#define MQTT_EXECUTOR 0
 #endif
-#ifndef WL_FAILURE
-#define WL_FAILURE -1
 #endif
 
+// Room for a publish packet's fixed header. Payloads streamed from flash can be larger than the
+// buffer, so leave room for a remaining length of up to 3 bytes whatever the buffer size.
+#define MQTT_PUBLISH_HEADER_RESERVE 4
+
 // ------------------------------------------- DEBUGGERY -------------------------------------------
 
 // Uncomment/comment to turn on/off debug output messages.
@@ -121,6 +234,26 @@ void printBuffer(uint8_t *buffer, uint16_t len);
 #define DEBUG_PRINTBUFFER(buffer, len) {}
 #endif
 
+// ------------------------------------------ TRANSPORTS ------------------------------------------
+
+// WiFiNINA transport, when the WiFiNINA library is available.
+#if __has_include(<utility/wifi_drv.h>) && __has_include(<utility/WiFiSocketBuffer.h>)
+#define MQTT_LOOPED_WIFININA
+#include "MQTT_Looped_WiFiNINA.h"
+#endif
+
+// BSD socket transport on ESP32 (lwIP) and host builds.
+#if defined(ARDUINO_ARCH_ESP32) || defined(__linux__) || defined(__APPLE__)
+#define MQTT_LOOPED_POSIX
+#include "MQTT_Looped_Posix.h"
+#endif
+
+// TLS over any of the above, with MQTT_TLS.
+#include "MQTT_Looped_Tls.h"
+
+// Recording any of the above to a storage, and playing recordings back.
+#include "MQTT_Looped_Capture.h"
+
 // -------------------------------------------- TYPEDEF --------------------------------------------
 
 /**
@@ -176,13 +309,275 @@ typedef struct mqtt_message_t {
   const char* payload;
   uint8_t qos;
   bool retain;
+  // Topic and payload are in flash (PROGMEM).
+  bool progmem;
 } mqtt_message_t;
 
+/**
+ * @brief Topic as handed to the publish internals.
+ */
+typedef struct mqtt_topic_ref_t {
+  const char* topic;
+  uint16_t len;
+  // Topic is in flash (PROGMEM).
+  bool progmem;
+  // Topic preceded by its 2 byte length as it goes in a packet, or nullptr.
+  const uint8_t* encoded;
+} mqtt_topic_ref_t;
+
+/**
+ * @brief Token bucket limiting publishes.
+ */
+typedef struct mqtt_rate_limit_t {
+  // A token is added every interval ms, 0 if unlimited.
+  uint32_t interval;
+  // Most tokens kept, i.e. the largest burst.
+  uint8_t burst;
+  uint8_t tokens;
+  // When the last token was added.
+  uint32_t refilled;
+} mqtt_rate_limit_t;
+
+/**
+ * @brief Value a numeric payload was formatted from, compared by change filters. Whole numbers are
+ *        kept exact, as a float can't hold every uint32_t.
+ */
+typedef struct mqtt_number_t {
+  bool integer;
+  float number;
+  uint32_t uint;
+} mqtt_number_t;
+
+/**
+ * @brief Publish options for a single topic: rate limit, change filter and offline compaction.
+ */
+typedef struct mqtt_topic_options_t {
+  const char* topic;
+  uint16_t topiclen;
+  mqtt_rate_limit_t limit;
+  // Suppress publishes that don't change the value.
+  bool filter;
+  // Numeric values within this much of the last one published count as unchanged.
+  float absolute;
+  // Numeric values within this fraction of the last one published count as unchanged.
+  float relative;
+  // Publish even an unchanged value this many ms after the last publish, 0 for never.
+  uint32_t heartbeat;
+  // Last value published: a number from the numeric overloads, else the payload's hash and length.
+  mqtt_number_t last_number;
+  uint32_t last_hash;
+  uint16_t last_len;
+  bool has_last;
+  bool last_numeric;
+  // When the last value was published.
+  uint32_t last_at;
+  // Publishes suppressed as unchanged.
+  uint32_t suppressed;
+  // Only keep the newest value stored while offline.
+  bool compact;
+} mqtt_topic_options_t;
+
+/**
+ * @brief Publish held back by the rate limiter.
+ */
+typedef struct mqtt_queued_t {
+  char topic[MQTT_RATE_TOPIC_LEN];
+  uint8_t payload[MQTT_RATE_PAYLOAD_LEN];
+  uint16_t topiclen;
+  uint16_t len;
+  uint8_t qos;
+  bool retain;
+  // Index of the topic's rate limit, -1 if none.
+  int16_t limit;
+  // Order queued in, 0 if the slot is free.
+  uint32_t seq;
+} mqtt_queued_t;
+
+class MQTTTopic;
+class MQTTExecutor;
+
+/**
+ * @brief Kind of payload queued with mqttQueueMessage().
+ */
+typedef enum {
+  MQTT_PENDING_BYTES = 0,
+  MQTT_PENDING_FLOAT = 1,
+  MQTT_PENDING_UINT = 2,
+} mqtt_pending_type_t;
+
+/**
+ * @brief Publish queued with mqttQueueMessage(), waiting for loop(). Numbers are kept as is and
+ *        formatted by loop(), so queueing them costs no more than a copy.
+ */
+typedef struct mqtt_pending_t {
+  // One or the other.
+  const char* topic;
+  const MQTTTopic* registered;
+  union {
+    float number;
+    uint32_t integer;
+  };
+  uint8_t payload[MQTT_PUBLISH_QUEUE_PAYLOAD_LEN];
+  uint16_t len;
+  uint8_t type;
+  uint8_t qos;
+  bool retain;
+} mqtt_pending_t;
+
+/**
+ * @brief Counters of publishes the application asked for but that weren't sent as is.
+ */
+typedef struct mqtt_publish_stats_t {
+  // Held back by the rate limiter.
+  uint32_t rate_queued;
+  // Held back values replaced by a newer value on the same topic.
+  uint32_t rate_coalesced;
+  // Over the rate limit, or behind held back publishes, and couldn't be held back; or held back
+  // and then failed to publish.
+  uint32_t rate_dropped;
+  // Suppressed by a change filter, value unchanged.
+  uint32_t suppressed;
+  // Refused by mqttQueueMessage() because the queue was full.
+  uint32_t queue_full;
+  // Queued with mqttQueueMessage() and then failed to publish, e.g. too long for the buffer.
+  uint32_t queue_dropped;
+} mqtt_publish_stats_t;
+
+/**
+ * @brief Step of a QoS 2 handshake.
+ */
+typedef enum {
+  MQTT_QOS2_FREE = 0,
+  // Outbound: PUBLISH sent.
+  MQTT_QOS2_AWAITING_PUBREC = 1,
+  // Outbound: PUBREL sent.
+  MQTT_QOS2_AWAITING_PUBCOMP = 2,
+  // Inbound: PUBLISH delivered, PUBREC sent.
+  MQTT_QOS2_AWAITING_PUBREL = 3,
+} mqtt_qos2_state_t;
+
+/**
+ * @brief Change to a subscription made while connected, not yet acknowledged by the broker.
+ */
+typedef enum {
+  MQTT_SUB_IDLE = 0,
+  MQTT_SUB_SUBSCRIBE = 1,
+  MQTT_SUB_UNSUBSCRIBE = 2,
+  // Unsubscribed before the SUBSCRIBE went out, freed without telling the broker.
+  MQTT_SUB_REMOVE = 3,
+} mqtt_sub_op_t;
+
+/**
+ * @brief QoS 2 packet id in flight.
+ */
+typedef struct mqtt_inflight_t {
+  uint16_t packet_id;
+  uint8_t state;
+  // Time the last handshake packet was sent.
+  uint32_t timer;
+  // Outbound: the PUBLISH packet, resent with DUP set until the PUBREC comes in.
+  uint16_t len;
+  uint8_t packet[MQTT_QOS2_PACKET_LEN];
+} mqtt_inflight_t;
+
+/**
+ * @brief MQTT broker endpoint and its health.
+ */
+typedef struct mqtt_endpoint_t {
+  IPAddress* address;
+  uint16_t port;
+  // Consecutive failed connection attempts.
+  uint8_t failures;
+  // When failures last reached the failover threshold.
+  uint32_t failed_at;
+  // Smoothed CONNECT to CONNACK time in ms, 0 if never connected.
+  uint32_t conack_latency;
+} mqtt_endpoint_t;
+
 /**
  * @brief MQTT subscription callback function.
  */
 typedef std::function<void(char*,uint16_t)> mqttcallback_t;
 
+/**
+ * @brief Writes a payload straight into the outgoing publish packet.
+ *        Gets where the payload goes and how much room there is; returns bytes written, or -1 if
+ *        the payload doesn't fit, in which case nothing is sent.
+ */
+typedef std::function<int32_t(uint8_t*,uint16_t)> mqttpayload_t;
+
+/**
+ * @brief Builds a JSON payload in place.
+ */
+typedef std::function<void(MQTTJsonWriter&)> mqttjson_t;
+
+/**
+ * @brief Discovery message, either fixed or built on demand each time it is sent.
+ */
+typedef struct mqtt_discovery_t {
+  const char* topic;
+  // Fixed payload, or nullptr if built.
+  const char* payload;
+  // Builds the payload if there's no fixed one.
+  mqttjson_t build;
+  uint8_t qos;
+  bool retain;
+  // Topic and fixed payload are in flash (PROGMEM).
+  bool progmem;
+} mqtt_discovery_t;
+
+// ----------------------------------------- TIMER CLASS -------------------------------------------
+
+/**
+ * @brief Time left until a timeout measured from `since` runs out. Timeouts run out once more than
+ *        `timeout` ms have passed, as checked with `mqttMillis() - since > timeout`.
+ *
+ * @param since
+ * @param timeout
+ * @return ms, 0 if already out
+ */
+inline uint32_t mqttRemaining(uint32_t since, uint32_t timeout) {
+  uint32_t elapsed = mqttMillis() - since;
+  return elapsed > timeout ? 0 : timeout - elapsed + 1;
+}
+
+/**
+ * @brief Start time of something loop() times out on.
+ */
+class MQTTTimer {
+  public:
+    /**
+     * @brief Start, or restart, timing.
+     */
+    void start(void) { this->since = mqttMillis(); }
+
+    /**
+     * @brief Time since start().
+     *
+     * @return ms
+     */
+    uint32_t elapsed(void) const { return mqttMillis() - this->since; }
+
+    /**
+     * @brief Whether more than `timeout` ms passed since start().
+     *
+     * @param timeout
+     * @return expired
+     */
+    bool expired(uint32_t timeout) const { return this->elapsed() > timeout; }
+
+    /**
+     * @brief Time left until expired(timeout).
+     *
+     * @param timeout
+     * @return ms, 0 if expired
+     */
+    uint32_t remaining(uint32_t timeout) const { return mqttRemaining(this->since, timeout); }
+
+  private:
+    uint32_t since = 0;
+};
+
 // -------------------------------------- SUBSCRIPTION CLASS ---------------------------------------
 
 /**
@@ -198,6 +593,10 @@ class MQTTSubscribe {
      */
     MQTTSubscribe(const char* topic, uint8_t qos = 0);
 
+#if MQTT_PACKET_CACHE
+    ~MQTTSubscribe();
+#endif
+
     /**
      * @brief Set a callback for the subscription.
      * 
@@ -215,11 +614,33 @@ class MQTTSubscribe {
      */
     const char* topic;
 
+    /**
+     * @brief Length of topic.
+     */
+    uint16_t topiclen;
+
+    /**
+     * @brief Whether topic contains a `+` or `#` wildcard.
+     */
+    bool wildcard;
+
     /**
      * @brief Quality of Service level.
      */
     uint8_t qos = 0;
 
+#if MQTT_PACKET_CACHE
+    /**
+     * @brief Encoded SUBSCRIBE packet, nullptr until first sent. Only the packet id changes.
+     */
+    uint8_t* packet = nullptr;
+
+    /**
+     * @brief Length of packet.
+     */
+    uint8_t packet_len = 0;
+#endif
+
     /**
      * @brief Last data read from this subscription.
      */
@@ -235,35 +656,91 @@ class MQTTSubscribe {
      * @brief Whether this subscription has a new message that should be processed.
      */
     bool new_message = false;
-};
 
-// -------------------------------------------- ROBBERY --------------------------------------------
-// Rob a pointer to a private property of an object.
+    /**
+     * @brief SUBSCRIBE or UNSUBSCRIBE to send while connected, or waiting to be acknowledged.
+     */
+    mqtt_sub_op_t op = MQTT_SUB_IDLE;
 
-// Struct to hold the stolen pointer (ptr).
-template<typename Tag>
-struct robbed {
-  typedef typename Tag::type type;
-  static type ptr;
-};
-template<typename Tag>
-typename robbed<Tag>::type robbed<Tag>::ptr;
-
-// Struct to rob a pointer.
-template<typename Tag, typename Tag::type p>
-struct rob : robbed<Tag> {
-  struct filler {
-    filler() { robbed<Tag>::ptr = p; }
-  };
-  static filler filler_obj;
+    /**
+     * @brief Packet id op was sent with, 0 if not sent yet.
+     */
+    uint16_t op_packet_id = 0;
+
+    /**
+     * @brief Timing since op was sent.
+     */
+    MQTTTimer op_sent_at;
+
+#if MQTT_EXECUTOR
+    /**
+     * @brief Messages handed to the executor whose callback hasn't run yet. The subscription
+     *        isn't freed until they have.
+     */
+    std::atomic<uint16_t> deferred{0};
+#endif
 };
-template<typename Tag, typename Tag::type p>
-typename rob<Tag, p>::filler rob<Tag, p>::filler_obj;
 
-// (uint8_t) &WiFiClient::_sock
-// wifiClientObj->_sock <=> &(wifiClientObj->*robbed<WiFiClientSock>::ptr);
-struct WiFiClientSock { typedef uint8_t WiFiClient::*type; };
-template class rob<WiFiClientSock, &WiFiClient::_sock>;
+// ----------------------------------------- TOPIC CLASS -------------------------------------------
+
+/**
+ * @brief Topic registered with MQTT_Looped::registerTopic(). The full topic is built and encoded
+ *        once, so publishing to it copies it as is.
+ */
+class MQTTTopic {
+  public:
+    /**
+     * @brief Constructor
+     *
+     * @param prefix may be empty
+     * @param suffix
+     */
+    MQTTTopic(const char* prefix, const char* suffix);
+
+    /**
+     * @brief Length of the topic prefix and suffix join to.
+     *
+     * @param prefix
+     * @param suffix
+     * @return length
+     */
+    static uint16_t length(const char* prefix, const char* suffix);
+
+    /**
+     * @brief Topic.
+     *
+     * @return null terminated topic
+     */
+    const char* c_str(void) const { return (const char*)this->encoded + 2; }
+
+    /**
+     * @brief Topic as handed to the publish internals.
+     *
+     * @return reference
+     */
+    mqtt_topic_ref_t ref(void) const {
+      return {
+        .topic = this->c_str(),
+        .len = this->topiclen,
+        .progmem = false,
+        .encoded = this->encoded,
+      };
+    }
+
+    /**
+     * @brief Topic preceded by its 2 byte length, as it goes in a packet, null terminated.
+     */
+#if MQTT_STATIC_ALLOC
+    uint8_t encoded[2 + MQTT_MAX_TOPIC_LEN];
+#else
+    uint8_t* encoded;
+#endif
+
+    /**
+     * @brief Length of topic.
+     */
+    uint16_t topiclen;
+};
 
 // ------------------------------------------ MAIN CLASS -------------------------------------------
 
@@ -272,12 +749,39 @@ template class rob<WiFiClientSock, &WiFiClient::_sock>;
  *        as handles MQTT subscription callbacks.
  */
 class MQTT_Looped {
+  // Benchmark sketch (examples/benchmark) times the private packet builders and parsers.
+  friend class MQTT_LoopedBenchmark;
+  // MQTTThreaded (MQTT_Looped_Thread.h) only hands publishes over when mqttCanSend().
+  friend class MQTTThreaded;
+#if MQTT_COROUTINES
+  // Frames of its coroutines come from frame_pool.
+  friend struct MQTTTask::promise_type;
+#endif
+
   public:
+    /**
+     * @brief Constructor.
+     *
+     * @param transport connection to the broker, see MQTT_Looped_Transport.h
+     * @param mqtt_server
+     * @param port
+     * @param mqtt_user
+     * @param mqtt_pass
+     * @param mqtt_client_id
+     */
+    MQTT_Looped(MQTTTransport* transport, IPAddress* mqtt_server,
+      uint16_t port = 1883, const char* mqtt_user = "", const char* mqtt_pass = "", const char* mqtt_client_id = "Arduino");
+
+#ifdef MQTT_LOOPED_WIFININA
     /**
      * @brief Constructor.
      */
     MQTT_Looped(WiFiClient* client, const char* ssid, const char* wifi_pass, IPAddress* mqtt_server,
-      uint16_t port = 1883, const char* mqtt_user = "", const char* mqtt_pass = "", const char* mqtt_client_id = "Arduino");
+      uint16_t port = 1883, const char* mqtt_user = "", const char* mqtt_pass = "", const char* mqtt_client_id = "Arduino")
+        : MQTT_Looped(new MQTTTransportWiFiNINA(client, ssid, wifi_pass), mqtt_server, port, mqtt_user, mqtt_pass, mqtt_client_id)
+    {
+      this->owns_transport = true;
+    }
 
     /**
      * @brief Constructor.
@@ -291,14 +795,50 @@ class MQTT_Looped {
      */
     MQTT_Looped(WiFiClient* client, const char* ssid, IPAddress* mqtt_server,
       uint16_t port = 1883, const char* mqtt_user = "", const char* mqtt_pass = "", const char* mqtt_client_id = "Arduino")
-        : MQTT_Looped(client, ssid, wifi_pass, mqtt_server, port, mqtt_user, mqtt_pass, mqtt_client_id) {}
+        : MQTT_Looped(client, ssid, "", mqtt_server, port, mqtt_user, mqtt_pass, mqtt_client_id) {}
 
     /**
      * @brief Constructor.
      */
     MQTT_Looped(WiFiClient* client, const char* ssid, IPAddress* mqtt_server,
       const char* mqtt_user = "", const char* mqtt_pass = "", const char* mqtt_client_id = "Arduino")
-        : MQTT_Looped(client, ssid, wifi_pass, mqtt_server, 1883, mqtt_user, mqtt_pass, mqtt_client_id) {}
+        : MQTT_Looped(client, ssid, "", mqtt_server, 1883, mqtt_user, mqtt_pass, mqtt_client_id) {}
+#endif
+
+    /**
+     * @brief Destructor. Deletes the transport if the client made it.
+     */
+    ~MQTT_Looped();
+
+    // Owns its transport, so not copied.
+    MQTT_Looped(const MQTT_Looped&) = delete;
+    MQTT_Looped& operator=(const MQTT_Looped&) = delete;
+
+    /**
+     * @brief Add a fallback broker endpoint. The endpoint given to the constructor is tried
+     *        first; after MQTT_FAILOVER_THRESHOLD consecutive failures the next healthy endpoint
+     *        is used, preferring the one with the lowest observed CONNACK latency.
+     *        Set before connecting.
+     *
+     * @param mqtt_server
+     * @param port
+     * @return success, false if MQTT_MAX_BROKERS are already set
+     */
+    bool addBroker(IPAddress* mqtt_server, uint16_t port = 1883);
+
+    /**
+     * @brief Set how many consecutive failures mark a broker endpoint unhealthy.
+     *
+     * @param failures
+     */
+    void setFailoverThreshold(uint8_t failures);
+
+    /**
+     * @brief Get the broker endpoint currently in use.
+     *
+     * @return endpoint
+     */
+    const mqtt_endpoint_t* getBroker(void);
 
     /**
      * @brief Get status.
@@ -337,6 +877,21 @@ class MQTT_Looped {
      */
     bool verifyConnection(void);
 
+    /**
+     * @brief How long loop() has nothing to do unless data arrives, so the caller can sleep
+     *        instead of calling it. Check ioPending() too, or wake on incoming data.
+     *
+     * @return ms, 0 to call loop() again right away
+     */
+    uint32_t msUntilNextDeadline(void);
+
+    /**
+     * @brief Whether data from the broker is waiting to be read by loop().
+     *
+     * @return pending
+     */
+    bool ioPending(void);
+
     // ----------------------------------------- MAIN LOOP -----------------------------------------
 
     /**
@@ -356,8 +911,18 @@ class MQTT_Looped {
     void setBirth(const char* topic, const char* payload);
 
     /**
-     * @brief Set the last will and testament.
+     * @brief Set the birth topic, from flash.
      *        Set before connecting.
+     *
+     * @param topic
+     * @param payload
+     */
+    void setBirth(const __FlashStringHelper* topic, const __FlashStringHelper* payload);
+
+    /**
+     * @brief Set the last will and testament.
+     *        Set before connecting. Left out of CONNECT, with an error logged, if it doesn't fit
+     *        in the buffer along with the credentials.
      * 
      * @param topic 
      * @param payload 
@@ -367,6 +932,19 @@ class MQTT_Looped {
      */
     bool setWill(const char* topic, const char* payload, uint8_t qos = 0, bool retain = false);
 
+    /**
+     * @brief Set the last will and testament, from flash.
+     *        Set before connecting. Left out of CONNECT, with an error logged, if it doesn't fit
+     *        in the buffer along with the credentials.
+     *
+     * @param topic
+     * @param payload
+     * @param qos
+     * @param retain
+     * @return success
+     */
+    bool setWill(const __FlashStringHelper* topic, const __FlashStringHelper* payload, uint8_t qos = 0, bool retain = false);
+
     /**
      * @brief Add a discovery message to send when connected or reconnected to the MQTT broker.
      *        Set before connecting.
@@ -375,264 +953,1134 @@ class MQTT_Looped {
      * @param payload 
      * @param qos 
      * @param retain 
+     * @return success, false if MQTT_MAX_DISCOVERIES are already set
+     */
+    bool addDiscovery(const char* topic, const char* payload, uint8_t qos = 0, bool retain = false);
+
+    /**
+     * @brief Add a discovery message whose JSON payload is built in place each time it is sent,
+     *        so no copy of it stays in RAM. Set before connecting.
+     *
+     * @param topic
+     * @param build
+     * @param qos
+     * @param retain
      * @return success
      */
-    void addDiscovery(const char* topic, const char* payload, uint8_t qos = 0, bool retain = false);
+    bool addDiscovery(const char* topic, mqttjson_t build, uint8_t qos = 0, bool retain = false);
+
+    /**
+     * @brief Add a discovery message from flash. Payloads larger than the buffer are streamed
+     *        out of flash in chunks. Set before connecting.
+     *
+     * @param topic
+     * @param payload
+     * @param qos
+     * @param retain
+     * @return success
+     */
+    bool addDiscovery(const __FlashStringHelper* topic, const __FlashStringHelper* payload, uint8_t qos = 0, bool retain = false);
+
+    /**
+     * @brief Add a discovery message with its topic in flash and its JSON payload built in place.
+     *        Set before connecting.
+     *
+     * @param topic
+     * @param build
+     * @param qos
+     * @param retain
+     * @return success
+     */
+    bool addDiscovery(const __FlashStringHelper* topic, mqttjson_t build, uint8_t qos = 0, bool retain = false);
+
+    /**
+     * @brief Loop for sending MQTT discovery messages.
+     * 
+     * @return success
+     */
+    bool sendDiscoveries(void);
+
+    /**
+     * @brief MQTT hook, same as subscribe().
+     *
+     * @param topic
+     * @param callback
+     * @param qos maximum QoS the broker should deliver with
+     * @return success, false if MQTT_MAX_SUBSCRIPTIONS are already set or the callback can't be
+     *         replaced yet
+     */
+    bool onMqtt(const char* topic, mqttcallback_t callback, uint8_t qos = 0);
+
+    /**
+     * @brief Subscribe to a topic. Before connecting, the subscription is sent on connect. While
+     *        connected, messages are routed to it right away and the SUBSCRIBE goes out from
+     *        loop() without waiting on the SUBACK. Subscribing to a topic again replaces its
+     *        callback and QoS, unless the executor still has messages of it to run; try again
+     *        once it has. Subscriptions are sent again on every reconnect. Can be called from
+     *        a callback run by loop(), or by an executor drained on the thread running loop().
+     *
+     * @param topic kept as a pointer until unsubscribed
+     * @param callback
+     * @param qos maximum QoS the broker should deliver with
+     * @return success, false if MQTT_MAX_SUBSCRIPTIONS are already set or the callback can't be
+     *         replaced yet
+     */
+    bool subscribe(const char* topic, mqttcallback_t callback, uint8_t qos = 0);
+
+    /**
+     * @brief Unsubscribe from a topic. Its messages stop being routed right away. The
+     *        UNSUBSCRIBE goes out from loop() and the subscription is freed once the broker
+     *        acknowledges it, or on the next connect if offline. Can be called from a callback
+     *        run by loop(), or by an executor drained on the thread running loop().
+     *
+     * @param topic same as subscribed to
+     * @return found
+     */
+    bool unsubscribe(const char* topic);
+
+    /**
+     * @brief Whether subscription changes made while connected are still waiting to be sent
+     *        or acknowledged.
+     *
+     * @return pending
+     */
+    bool subscriptionsPending(void);
+
+#if MQTT_EXECUTOR
+    /**
+     * @brief Hand received messages to an executor instead of running their callbacks in
+     *        loop(). Messages the executor can't take wait in loop() for room.
+     *
+     * @param executor or nullptr to run callbacks in loop() again
+     */
+    void setExecutor(MQTTExecutor* executor);
+#endif
+
+    /**
+     * @brief Register a topic to publish to. Prefix and suffix are joined with a `/` once, so
+     *        publishing to the handle needs no string building or measuring.
+     *
+     * @param prefix e.g. a device's base topic, may be empty
+     * @param suffix
+     * @return handle, lives as long as the program, or nullptr if MQTT_MAX_TOPICS are already
+     *         registered or the topic is longer than MQTT_MAX_TOPIC_LEN
+     */
+    const MQTTTopic* registerTopic(const char* prefix, const char* suffix);
+
+    /**
+     * @brief Limit publishes made with mqttSendMessage() and friends to a burst of `burst`, then
+     *        one every `interval` ms. Publishes over the limit wait in a queue holding the newest
+     *        value per topic, and are sent from loop() as the limit allows.
+     *
+     * @param interval ms, 0 for no limit
+     * @param burst
+     */
+    void setRateLimit(uint32_t interval, uint8_t burst = 1);
+
+    /**
+     * @brief Limit publishes to a single topic, on top of the overall limit.
+     *
+     * @param topic exact topic, kept as a pointer
+     * @param interval ms, 0 for no limit
+     * @param burst
+     * @return success, false if MQTT_MAX_TOPIC_OPTIONS topics already have options
+     */
+    bool setRateLimit(const char* topic, uint32_t interval, uint8_t burst = 1);
+
+    /**
+     * @brief Limit publishes to a registered topic, on top of the overall limit.
+     *
+     * @param topic
+     * @param interval ms, 0 for no limit
+     * @param burst
+     * @return success
+     */
+    bool setRateLimit(const MQTTTopic* topic, uint32_t interval, uint8_t burst = 1);
+
+    /**
+     * @brief Only publish to a topic when its value changes. String payloads must differ from
+     *        the last one published. Numbers published with the float and uint32_t overloads
+     *        must move out of a deadband around the last one: more than `absolute`, and more
+     *        than `relative` times the last value. Skipped publishes are counted.
+     *
+     * @param topic exact topic, kept as a pointer
+     * @param heartbeat publish even an unchanged value after this many ms, 0 for never
+     * @param absolute
+     * @param relative e.g. 0.01 for 1%
+     * @return success, false if MQTT_MAX_TOPIC_OPTIONS topics already have options
+     */
+    bool setChangeFilter(const char* topic, uint32_t heartbeat = 0, float absolute = 0, float relative = 0);
+
+    /**
+     * @brief Only publish to a registered topic when its value changes, see above.
+     *
+     * @param topic
+     * @param heartbeat publish even an unchanged value after this many ms, 0 for never
+     * @param absolute
+     * @param relative e.g. 0.01 for 1%
+     * @return success
+     */
+    bool setChangeFilter(const MQTTTopic* topic, uint32_t heartbeat = 0, float absolute = 0, float relative = 0);
+
+    /**
+     * @brief Store publishes made while not connected, instead of dropping them, and replay
+     *        them in order once connected and done with discoveries. When the storage is full,
+     *        the oldest publishes are pushed out. A persistent storage, e.g. MQTTStorageFile,
+     *        keeps them across resets too.
+     *
+     * @param storage or nullptr to stop storing
+     * @param interval ms between publishes replayed
+     */
+    void setOfflineStorage(MQTTStorage* storage, uint32_t interval = MQTT_OFFLINE_REPLAY_INTERVAL);
+
+    /**
+     * @brief Only keep the newest value of a topic stored while offline, e.g. for state that's
+     *        replaced rather than added to.
+     *
+     * @param topic exact topic, kept as a pointer
+     * @return success, false if MQTT_MAX_TOPIC_OPTIONS topics already have options
+     */
+    bool setOfflineCompact(const char* topic);
+
+    /**
+     * @brief Only keep the newest value of a registered topic stored while offline.
+     *
+     * @param topic
+     * @return success
+     */
+    bool setOfflineCompact(const MQTTTopic* topic);
+
+    /**
+     * @brief Get counters of publishes stored, compacted, dropped and replayed while offline.
+     *
+     * @return stats
+     */
+    const mqtt_offline_stats_t* getOfflineStats(void);
+
+    /**
+     * @brief Get a topic's rate limit and change filter, including its suppressed counter.
+     *
+     * @param topic
+     * @return options or nullptr if none are set
+     */
+    const mqtt_topic_options_t* getTopicOptions(const char* topic);
+
+    /**
+     * @brief Get counters of publishes held back, dropped or suppressed.
+     *
+     * @return stats
+     */
+    const mqtt_publish_stats_t* getPublishStats(void);
+
+#if MQTT_LAST_VALUE_SLOTS > 0
+    /**
+     * @brief Get the last value received on a subscribed topic, including topics matched by
+     *        wildcard subscriptions. Poll `seq` to detect changes.
+     *
+     * @param topic exact topic, no wildcards
+     * @return value or nullptr if none is cached
+     */
+    const mqtt_last_value_t* getLastValue(const char* topic);
+#endif
+
+    /**
+     * @brief Send MQTT message. Verifies connection before sending.
+     *
+     * @param topic
+     * @param payload
+     * @param retain
+     * @param qos
+     * @return false if it could be neither sent, held back nor stored
+     */
+    bool mqttSendMessage(const char* topic, const char* payload, bool retain = false, uint8_t qos = 0);
+
+    /**
+     * @brief Send MQTT message. Verifies connection before sending.
+     *
+     * @param topic
+     * @param payload
+     * @param retain
+     * @param qos
+     * @return false if it could be neither sent, held back nor stored
+     */
+    bool mqttSendMessage(const char* topic, String payload, bool retain = false, uint8_t qos = 0);
+
+    /**
+     * @brief Send MQTT message. Verifies connection before sending.
+     *
+     * @param topic
+     * @param payload
+     * @param retain
+     * @param qos
+     * @return false if it could be neither sent, held back nor stored
+     */
+    bool mqttSendMessage(const char* topic, float payload, bool retain = false, uint8_t qos = 0);
+
+    /**
+     * @brief Send MQTT message. Verifies connection before sending.
+     *
+     * @param topic
+     * @param payload
+     * @param retain
+     * @param qos
+     * @return false if it could be neither sent, held back nor stored
+     */
+    bool mqttSendMessage(const char* topic, uint32_t payload, bool retain = false, uint8_t qos = 0);
+
+    /**
+     * @brief Send MQTT message, its payload written in place by `payload`. Verifies connection
+     *        before sending.
+     *
+     * @param topic
+     * @param payload
+     * @param retain
+     * @param qos
+     * @return false if it could be neither sent, held back nor stored
+     */
+    bool mqttSendMessage(const char* topic, mqttpayload_t payload, bool retain = false, uint8_t qos = 0);
+
+    /**
+     * @brief Send MQTT message from flash. Payloads larger than the buffer are streamed out of
+     *        flash in chunks. Verifies connection before sending.
+     *
+     * @param topic
+     * @param payload
+     * @param retain
+     * @param qos
+     * @return false if it could be neither sent, held back nor stored
+     */
+    bool mqttSendMessage(const __FlashStringHelper* topic, const __FlashStringHelper* payload, bool retain = false, uint8_t qos = 0);
+
+    /**
+     * @brief Send MQTT message with its topic in flash. Verifies connection before sending.
+     *
+     * @param topic
+     * @param payload
+     * @param retain
+     * @param qos
+     * @return false if it could be neither sent, held back nor stored
+     */
+    bool mqttSendMessage(const __FlashStringHelper* topic, const char* payload, bool retain = false, uint8_t qos = 0);
+
+    /**
+     * @brief Send MQTT message to a registered topic. Verifies connection before sending.
+     *
+     * @param topic
+     * @param payload
+     * @param retain
+     * @param qos
+     * @return false if it could be neither sent, held back nor stored
+     */
+    bool mqttSendMessage(const MQTTTopic* topic, const char* payload, bool retain = false, uint8_t qos = 0);
+
+    /**
+     * @brief Send MQTT message to a registered topic. Verifies connection before sending.
+     *
+     * @param topic
+     * @param payload
+     * @param retain
+     * @param qos
+     * @return false if it could be neither sent, held back nor stored
+     */
+    bool mqttSendMessage(const MQTTTopic* topic, String payload, bool retain = false, uint8_t qos = 0);
+
+    /**
+     * @brief Send MQTT message to a registered topic. Verifies connection before sending.
+     *
+     * @param topic
+     * @param payload
+     * @param retain
+     * @param qos
+     * @return false if it could be neither sent, held back nor stored
+     */
+    bool mqttSendMessage(const MQTTTopic* topic, float payload, bool retain = false, uint8_t qos = 0);
+
+    /**
+     * @brief Send MQTT message to a registered topic. Verifies connection before sending.
+     *
+     * @param topic
+     * @param payload
+     * @param retain
+     * @param qos
+     * @return false if it could be neither sent, held back nor stored
+     */
+    bool mqttSendMessage(const MQTTTopic* topic, uint32_t payload, bool retain = false, uint8_t qos = 0);
+
+    /**
+     * @brief Send MQTT message to a registered topic, its payload written in place by `payload`.
+     *        Verifies connection before sending.
+     *
+     * @param topic
+     * @param payload
+     * @param retain
+     * @param qos
+     * @return false if it could be neither sent, held back nor stored
+     */
+    bool mqttSendMessage(const MQTTTopic* topic, mqttpayload_t payload, bool retain = false, uint8_t qos = 0);
+
+    /**
+     * @brief Send a JSON payload, written in place by `build`, a callable taking an
+     *        MQTTJsonWriter&. Nothing is sent if it doesn't fit. Verifies connection before
+     *        sending.
+     *
+     * @param topic topic or registered topic
+     * @param build
+     * @param retain
+     * @param qos
+     */
+    template<typename T, typename F>
+    void mqttSendJson(T topic, F build, bool retain = false, uint8_t qos = 0) {
+      // Captures a single reference, so std::function doesn't allocate.
+      this->mqttSendMessage(topic, [&build](uint8_t* buf, uint16_t size) -> int32_t {
+        MQTTJsonWriter json(buf, size);
+        build(json);
+        return json.overflow() ? -1 : json.length();
+      }, retain, qos);
+    }
+
+    /**
+     * @brief Send a CBOR payload, encoded in place by `build`, a callable taking an
+     *        MQTTCborWriter&. Nothing is sent if it doesn't fit. Verifies connection before
+     *        sending.
+     *
+     * @param topic topic or registered topic
+     * @param build
+     * @param retain
+     * @param qos
+     */
+    template<typename T, typename F>
+    void mqttSendCbor(T topic, F build, bool retain = false, uint8_t qos = 0) {
+      // Captures a single reference, so std::function doesn't allocate.
+      this->mqttSendMessage(topic, [&build](uint8_t* buf, uint16_t size) -> int32_t {
+        MQTTCborWriter cbor(buf, size);
+        build(cbor);
+        return cbor.overflow() ? -1 : cbor.length();
+      }, retain, qos);
+    }
+
+#if MQTT_PUBLISH_QUEUE_LEN > 0
+    /**
+     * @brief Queue a message for loop() to send, from anywhere: interrupt handlers, other tasks
+     *        or cores. Never allocates or waits, and copies at most
+     *        MQTT_PUBLISH_QUEUE_PAYLOAD_LEN bytes. Sent in order once connected, through the
+     *        rate limits and change filters like mqttSendMessage().
+     *
+     * @param topic kept as a pointer until sent
+     * @param payload
+     * @param len
+     * @param retain
+     * @param qos
+     * @return queued, false if the queue is full or the payload too long
+     */
+    bool mqttQueueMessage(const char* topic, const uint8_t* payload, uint16_t len, bool retain = false, uint8_t qos = 0);
+
+    /**
+     * @brief Queue a message for loop() to send, from anywhere.
+     *
+     * @param topic kept as a pointer until sent
+     * @param payload
+     * @param retain
+     * @param qos
+     * @return queued, false if the queue is full or the payload too long
+     */
+    bool mqttQueueMessage(const char* topic, const char* payload, bool retain = false, uint8_t qos = 0);
+
+    /**
+     * @brief Queue a number for loop() to send, from anywhere.
+     *
+     * @param topic kept as a pointer until sent
+     * @param payload
+     * @param retain
+     * @param qos
+     * @return queued, false if the queue is full
+     */
+    bool mqttQueueMessage(const char* topic, float payload, bool retain = false, uint8_t qos = 0);
+
+    /**
+     * @brief Queue a number for loop() to send, from anywhere.
+     *
+     * @param topic kept as a pointer until sent
+     * @param payload
+     * @param retain
+     * @param qos
+     * @return queued, false if the queue is full
+     */
+    bool mqttQueueMessage(const char* topic, uint32_t payload, bool retain = false, uint8_t qos = 0);
+
+    /**
+     * @brief Queue a message to a registered topic for loop() to send, from anywhere.
+     *
+     * @param topic
+     * @param payload
+     * @param retain
+     * @param qos
+     * @return queued, false if the queue is full or the payload too long
+     */
+    bool mqttQueueMessage(const MQTTTopic* topic, const char* payload, bool retain = false, uint8_t qos = 0);
+
+    /**
+     * @brief Queue a number to a registered topic for loop() to send, from anywhere.
+     *
+     * @param topic
+     * @param payload
+     * @param retain
+     * @param qos
+     * @return queued, false if the queue is full
+     */
+    bool mqttQueueMessage(const MQTTTopic* topic, float payload, bool retain = false, uint8_t qos = 0);
+
+    /**
+     * @brief Queue a number to a registered topic for loop() to send, from anywhere.
+     *
+     * @param topic
+     * @param payload
+     * @param retain
+     * @param qos
+     * @return queued, false if the queue is full
+     */
+    bool mqttQueueMessage(const MQTTTopic* topic, uint32_t payload, bool retain = false, uint8_t qos = 0);
+#endif
+
+  // --------------------##-------------------- PRIVATE ---------------------##---------------------
+
+  private:
+    // ------------------------------------- GENERAL PROPS -----------------------------------------
+
+    /**
+     * @brief Current status of MQTT_Looped connections.
+     */
+    mqtt_looped_status_t status = MQTT_LOOPED_STATUS_INIT;
+
+    /**
+     * @brief Timer for waiting.
+     */
+    MQTTTimer timer;
+
+    /**
+     * @brief Counter for attempting tasks.
+     */
+    uint32_t attempts = 0;
+
+    // ------------------------------------- TRANSPORT PROPS ---------------------------------------
+
+    /**
+     * @brief Connection to the broker.
+     */
+    MQTTTransport* transport;
+
+    /**
+     * @brief Whether transport was made by a convenience constructor, and is deleted with the
+     *        client.
+     */
+    bool owns_transport = false;
+
+    // --------------------------------------- MQTT PROPS ------------------------------------------
+
+    /**
+     * @brief MQTT broker endpoints, in order of preference.
+     */
+    MQTTList<mqtt_endpoint_t, MQTT_MAX_BROKERS> endpoints;
+
+    /**
+     * @brief Index of the endpoint in use.
+     */
+    uint8_t endpoint = 0;
+
+    /**
+     * @brief Consecutive failures before failing over.
+     */
+    uint8_t failover_threshold = MQTT_FAILOVER_THRESHOLD;
+
+    /**
+     * @brief Client ID for MQTT.
+     */
+    const char* mqtt_client_id;
+
+    /**
+     * @brief Username for MQTT broker.
+     */
+    const char* mqtt_user;
+
+    /**
+     * @brief Password for MQTT broker.
+     */
+    const char* mqtt_pass;
+
+    /**
+     * @brief Last will and testament.
+     */
+    mqtt_message_t will = {};
+
+#if MQTT_PACKET_CACHE
+    /**
+     * @brief Encoded CONNECT packet, nullptr until first sent or after its inputs change.
+     */
+    uint8_t* connect_packet = nullptr;
+
+    /**
+     * @brief Length of connect_packet.
+     */
+    uint8_t connect_packet_len = 0;
+#endif
+
+    /**
+     * @brief General buffer used for MQTT in/out.
+     */
+    uint8_t buffer[MAXBUFFERSIZE];
+
+    /**
+     * @brief Flag for whether we are currently reading part of a packet.
+     */
+    bool reading_packet = false;
+
+    /**
+     * @brief Iterator for process of reading full packet.
+     *        -1 sets a timer for a new loop.
+     *        0 is the start of the loop.
+     */
+    int8_t read_packet_jump_to = -1;
+
+    /**
+     * @brief Timer for reading a packet. Controls timeout.
+     */
+    MQTTTimer read_packet_timer;
+
+    /**
+     * @brief Timer for reading a packet in a loop. Controls timeout.
+     */
+    MQTTTimer read_packet_search_timer;
+
+    /**
+     * @brief Whether we're looking for a packet.
+     */
+    bool read_packet_search = false;
+
+    /**
+     * @brief ID for counting packets.
+     */
+    uint16_t packet_id_counter = 1;
+
+    /**
+     * @brief Buffer for processing packet.
+     */
+    uint8_t* read_packet_pbuf;
+
+    /**
+     * @brief Buffer for reading packet.
+     */
+    uint8_t* read_packet_buf;
+
+    /**
+     * @brief Intermediate data while reading packet.
+     */
+    uint32_t read_packet_value;
+
+    /**
+     * @brief Intermediate helper while reading packet.
+     */
+    uint32_t read_packet_multiplier;
+
+    /**
+     * @brief Max length of packet being read.
+     */
+    uint16_t read_packet_maxlen;
+
+    /**
+     * @brief Length of packet being read.
+     */
+    uint16_t read_packet_len;
+
+    /**
+     * @brief Length of full packet read.
+     */
+    uint16_t full_packet_len;
+
+#if MQTT_COROUTINES
+    /**
+     * @brief Frames for the coroutines below.
+     */
+    MQTTFramePool frame_pool;
+
+    /**
+     * @brief Packet read in progress, see readFullPacketTask().
+     */
+    MQTTTask read_task;
+#endif
+
+    /**
+     * @brief Timer for sending a packet. Controls timeout.
+     */
+    MQTTTimer send_packet_timer;
+
+    /**
+     * @brief Rest of the packet being sent: bytes in the buffer, then bytes in flash.
+     */
+    const uint8_t* send_buf = nullptr;
+    uint16_t send_len = 0;
+    const char* send_tail = nullptr;
+    uint16_t send_tail_len = 0;
+
+    /**
+     * @brief Time the last packet was successfully sent or received.
+     */
+    MQTTTimer last_con_verify;
+
+    /**
+     * @brief Vector of pointers for subscriptions.
+     */
+    MQTTList<MQTTSubscribe*, MQTT_MAX_SUBSCRIPTIONS> mqttSubs;
+
+    /**
+     * @brief Where subscriptions are allocated.
+     */
+    MQTTPool<MQTTSubscribe, MQTT_MAX_SUBSCRIPTIONS> sub_pool;
+
+#if MQTT_EXECUTOR
+    /**
+     * @brief Where callbacks run, nullptr for loop().
+     */
+    MQTTExecutor* executor = nullptr;
+#endif
+
+    /**
+     * @brief Vector of pointers for discovery messages.
+     */
+    MQTTList<mqtt_discovery_t*, MQTT_MAX_DISCOVERIES> discoveries;
+
+    /**
+     * @brief Where discovery messages are allocated.
+     */
+    MQTTPool<mqtt_discovery_t, MQTT_MAX_DISCOVERIES> discovery_pool;
+
+    /**
+     * @brief Where registered topics are allocated.
+     */
+    MQTTPool<MQTTTopic, MQTT_MAX_TOPICS> topic_pool;
+
+    /**
+     * @brief Count up the number of subscriptions.
+     */
+    uint8_t subscription_counter = 0;
+
+    /**
+     * @brief Packet id of the last subscribe sent while connecting, the SUBACK waited on.
+     */
+    uint16_t subscribe_packet_id = 0;
+
+    /**
+     * @brief Count up the number of discovery messages.
+     */
+    uint8_t discovery_counter = 0;
+
+    /**
+     * @brief Birth message, no topic if none.
+     */
+    mqtt_message_t birth = {};
+
+#if MQTT_LAST_VALUE_SLOTS > 0
+    /**
+     * @brief Last value received per topic.
+     */
+    MQTTLastValueCache<MQTT_LAST_VALUE_SLOTS> last_values;
+#endif
+
+#if MQTT_PROTOCOL_LEVEL == 5
+    /**
+     * @brief Topics assigned to outbound aliases 1..MQTT_TOPIC_ALIAS_MAX, empty if unassigned.
+     */
+    char alias_out[MQTT_TOPIC_ALIAS_MAX][MQTT_TOPIC_ALIAS_LEN] = {};
+
+    /**
+     * @brief Number of outbound aliases the broker accepts (Topic Alias Maximum in CONNACK).
+     */
+    uint16_t alias_out_max = 0;
+
+    /**
+     * @brief Outbound alias sent with its topic in the publish being sent, registered in
+     *        alias_out once the whole packet is written. 0 if none.
+     */
+    uint16_t alias_pending = 0;
+
+    /**
+     * @brief Topics the broker assigned to inbound aliases 1..MQTT_TOPIC_ALIAS_MAX.
+     */
+    char alias_in[MQTT_TOPIC_ALIAS_MAX][MQTT_TOPIC_ALIAS_LEN] = {};
+#endif
+
+    /**
+     * @brief Start of the last publish packet built in buffer. Its headers are written backwards
+     *        from the payload, so it doesn't always start at the beginning of buffer.
+     */
+    uint8_t* publish_start = this->buffer;
+
+    /**
+     * @brief Rest of a flash payload that didn't fit in buffer, streamed out after the packet.
+     */
+    const char* publish_tail = nullptr;
+
+    /**
+     * @brief Length of publish_tail.
+     */
+    uint16_t publish_tail_len = 0;
+
+    /**
+     * @brief QoS 2 handshakes in progress, both directions.
+     */
+    mqtt_inflight_t qos2_inflight[MQTT_QOS2_INFLIGHT] = {};
+
+    /**
+     * @brief Overall publish rate limit.
+     */
+    mqtt_rate_limit_t rate_limit = {};
+
+    /**
+     * @brief Per topic publish options.
+     */
+    MQTTList<mqtt_topic_options_t, MQTT_MAX_TOPIC_OPTIONS> topic_options;
+
+#if MQTT_RATE_QUEUE_LEN > 0
+    /**
+     * @brief Publishes held back by the rate limiter.
+     */
+    mqtt_queued_t rate_queue[MQTT_RATE_QUEUE_LEN] = {};
+
+    /**
+     * @brief Sequence number of the last publish queued.
+     */
+    uint32_t rate_queue_seq = 0;
+#endif
+
+#if MQTT_PUBLISH_QUEUE_LEN > 0
+    /**
+     * @brief Publishes queued with mqttQueueMessage().
+     */
+    MQTTMpscQueue<mqtt_pending_t, MQTT_PUBLISH_QUEUE_LEN> publish_queue;
+#endif
+
+    /**
+     * @brief Publish counters.
+     */
+    mqtt_publish_stats_t publish_stats = {};
+
+    /**
+     * @brief Publishes stored while offline.
+     */
+    MQTTOfflineQueue offline;
+
+    /**
+     * @brief Time between stored publishes replayed.
+     */
+    uint32_t offline_interval = MQTT_OFFLINE_REPLAY_INTERVAL;
 
     /**
-     * @brief Loop for sending MQTT discovery messages.
-     * 
-     * @return success
+     * @brief Time since the last stored publish was replayed.
      */
-    bool sendDiscoveries(void);
+    MQTTTimer offline_timer;
 
     /**
-     * @brief MQTT hook.
-     *        Set before connecting.
-     *
-     * @param topic
-     * @param callback
+     * @brief Packet id of the replayed publish waiting on its PUBACK, or PUBREC for QoS 2, 0 if
+     *        none. It stays stored until then.
      */
-    void onMqtt(const char* topic, mqttcallback_t callback);
+    uint16_t offline_acking = 0;
+
+    // ----------------------------------------- MESSAGING -----------------------------------------
 
     /**
-     * @brief Send MQTT message. Verifies connection before sending.
-     *
+     * @brief Publish a MQTT message.
+     * 
      * @param topic
      * @param payload
      * @param retain
      * @param qos
+     * @return success
      */
-    void mqttSendMessage(const char* topic, const char* payload, bool retain = false, uint8_t qos = 0);
+    bool mqttPublish(const char* topic, const char* payload, bool retain = false, uint8_t qos = 0);
 
     /**
-     * @brief Send MQTT message. Verifies connection before sending.
+     * @brief Publish a MQTT message from flash.
      *
      * @param topic
      * @param payload
      * @param retain
      * @param qos
+     * @return success
      */
-    void mqttSendMessage(const char* topic, String payload, bool retain = false, uint8_t qos = 0);
+    bool mqttPublish(const __FlashStringHelper* topic, const __FlashStringHelper* payload, bool retain = false, uint8_t qos = 0);
 
     /**
-     * @brief Send MQTT message. Verifies connection before sending.
+     * @brief Publish a MQTT message, its payload written in place.
      *
      * @param topic
      * @param payload
      * @param retain
      * @param qos
+     * @param progmem topic is in flash
+     * @return success
      */
-    void mqttSendMessage(const char* topic, float payload, bool retain = false, uint8_t qos = 0);
+    bool mqttPublish(const char* topic, mqttpayload_t payload, bool retain, uint8_t qos, bool progmem = false);
 
     /**
-     * @brief Send MQTT message. Verifies connection before sending.
+     * @brief Publish a MQTT message, its payload written in place.
      *
      * @param topic
      * @param payload
      * @param retain
      * @param qos
+     * @return success
      */
-    void mqttSendMessage(const char* topic, uint32_t payload, bool retain = false, uint8_t qos = 0);
-
-  // --------------------##-------------------- PRIVATE ---------------------##---------------------
-
-  private:
-    // ------------------------------------- GENERAL PROPS -----------------------------------------
-
-    /**
-     * @brief Current status of MQTT_Looped connections.
-     */
-    mqtt_looped_status_t status = MQTT_LOOPED_STATUS_INIT;
-
-    /**
-     * @brief Timer for waiting.
-     */
-    uint32_t timer = 0;
-
-    /**
-     * @brief Counter for attempting tasks.
-     */
-    uint32_t attempts = 0;
-
-    // --------------------------------------- WIFI PROPS ------------------------------------------
-
-    /**
-     * @brief The WiFi client.
-     */
-    WiFiClient* wifiClient;
-
-    /**
-     * @brief WiFi network name.
-     */
-    const char* ssid;
-
-    /**
-     * @brief Password for WiFi.
-     */
-    const char* wifi_pass;
-
-    /**
-     * @brief Pointer to socket (private) of wifiClient.
-     */
-    uint8_t* _sock;
-
-    // --------------------------------------- MQTT PROPS ------------------------------------------
+    bool mqttPublish(const mqtt_topic_ref_t& topic, mqttpayload_t payload, bool retain, uint8_t qos);
 
     /**
-     * @brief MQTT server address.
+     * @brief Send a message for the application: check we can send, apply rate limits, publish.
+     *
+     * @param topic
+     * @param payload
+     * @param retain
+     * @param qos
+     * @param number value the payload was formatted from, for deadbands, or nullptr
+     * @return taken: sent, held back, stored, suppressed or dropped and counted
      */
-    IPAddress* mqtt_server;
+    bool mqttSend(const mqtt_topic_ref_t& topic, mqttpayload_t payload, bool retain, uint8_t qos, const mqtt_number_t* number = nullptr);
 
     /**
-     * @brief The port of the MQTT broker.
+     * @brief Apply change filters, then publish or store a message for mqttSend().
+     *
+     * @param topic
+     * @param payload
+     * @param retain
+     * @param qos
+     * @param number value the payload was formatted from, for deadbands, or nullptr
+     * @param store sizeof(buffer) bytes to write the payload to and store it offline, or nullptr
+     *        to publish it
+     * @return taken, see mqttSend()
      */
-    uint16_t port;
+    bool sendOrStore(const mqtt_topic_ref_t& topic, mqttpayload_t payload, bool retain, uint8_t qos, const mqtt_number_t* number, uint8_t* store);
 
     /**
-     * @brief Client ID for MQTT.
+     * @brief Add a discovery message.
+     *
+     * @param discovery copied
+     * @return success, false if there's no room
      */
-    const char* mqtt_client_id;
+    bool pushDiscovery(const mqtt_discovery_t& discovery);
 
     /**
-     * @brief Username for MQTT broker.
+     * @brief Payload writer copying a string from flash. Whatever doesn't fit is left in
+     *        publish_tail to be streamed out after the packet.
+     *
+     * @param payload
+     * @return writer
      */
-    const char* mqtt_user;
+    mqttpayload_t flashPayload(const char* payload);
 
     /**
-     * @brief Password for MQTT broker.
+     * @brief Find a topic's options.
+     *
+     * @param topic
+     * @return index into topic_options, -1 if none
      */
-    const char* mqtt_pass;
+    int16_t findTopicOptions(const mqtt_topic_ref_t& topic);
 
     /**
-     * @brief Last will and testament.
+     * @brief Find a topic's options, adding them if there are none.
+     *
+     * @param topic kept as a pointer
+     * @return options or nullptr if there's no room to add them
      */
-    mqtt_message_t will;
+    mqtt_topic_options_t* topicOptions(const char* topic);
 
     /**
-     * @brief General buffer used for MQTT in/out.
+     * @brief Whether a publish changes a filtered topic's value.
+     *
+     * @param options index into topic_options
+     * @param number value the payload was formatted from, or nullptr to compare the payload
+     * @param hash payload hash
+     * @param len payload length
+     * @return changed, or the heartbeat is due
      */
-    uint8_t buffer[MAXBUFFERSIZE];
+    bool valueChanged(int16_t options, const mqtt_number_t* number, uint32_t hash, uint16_t len);
 
     /**
-     * @brief Flag for whether we are currently reading part of a packet.
+     * @brief Remember a filtered topic's value, once it's been sent, queued or stored.
+     *
+     * @param options index into topic_options
+     * @param number value the payload was formatted from, or nullptr for the payload
+     * @param hash payload hash
+     * @param len payload length
      */
-    bool reading_packet = false;
+    void valuePublished(int16_t options, const mqtt_number_t* number, uint32_t hash, uint16_t len);
 
     /**
-     * @brief Iterator for process of reading full packet.
-     *        -1 sets a timer for a new loop.
-     *        0 is the start of the loop.
+     * @brief Whether both the overall limit and the topic's limit have a token to spend.
+     *
+     * @param limit index into topic_options, -1 if none
+     * @return within limits
      */
-    int8_t read_packet_jump_to = -1;
+    bool rateAvailable(int16_t limit);
 
     /**
-     * @brief Timer for reading a packet. Controls timeout.
+     * @brief Spend a token from the overall limit and the topic's limit.
+     *
+     * @param limit index into topic_options, -1 if none
      */
-    uint32_t read_packet_timer;
+    void rateTake(int16_t limit);
 
     /**
-     * @brief Timer for reading a packet in a loop. Controls timeout.
+     * @brief Time until both the overall limit and the topic's limit have a token to spend.
+     *
+     * @param limit index into topic_options, -1 if none
+     * @return ms
      */
-    uint32_t read_packet_search_timer;
+    uint32_t rateWait(int16_t limit);
 
     /**
-     * @brief Whether we're looking for a packet.
+     * @brief Whether any publish is held back by the rate limiter.
+     *
+     * @return queued
      */
-    bool read_packet_search = false;
+    bool rateQueued(void);
 
     /**
-     * @brief ID for counting packets.
+     * @brief Hold back a publish, replacing any value queued for the same topic.
+     *
+     * @param topic
+     * @param payload
+     * @param retain
+     * @param qos
+     * @param limit index into topic_options, -1 if none
+     * @return queued, false if there's no room or it's too large
      */
-    uint16_t packet_id_counter = 1;
+    bool rateEnqueue(const mqtt_topic_ref_t& topic, mqttpayload_t payload, bool retain, uint8_t qos, int16_t limit);
 
     /**
-     * @brief Buffer for processing packet.
+     * @brief Send the oldest held back publish the rate limits allow, if any.
+     *
+     * @return a publish was sent
      */
-    uint8_t* read_packet_pbuf;
+    bool flushRateQueue(void);
 
+#if MQTT_PUBLISH_QUEUE_LEN > 0
     /**
-     * @brief Buffer for reading packet.
+     * @brief Queue a publish from anywhere, see mqttQueueMessage().
+     *
+     * @param topic
+     * @param registered
+     * @param type mqtt_pending_type_t
+     * @param payload bytes, float or uint32_t
+     * @param len
+     * @param retain
+     * @param qos
+     * @return queued
      */
-    uint8_t* read_packet_buf;
+    bool queueMessage(const char* topic, const MQTTTopic* registered, uint8_t type, const void* payload, uint16_t len, bool retain, uint8_t qos);
+#endif
 
     /**
-     * @brief Intermediate data while reading packet.
+     * @brief Send the oldest publish queued with mqttQueueMessage(), if any.
+     *
+     * @return a publish was sent
      */
-    uint32_t read_packet_value;
+    bool drainPublishQueue(void);
 
     /**
-     * @brief Intermediate helper while reading packet.
+     * @brief Store a publish made while it can't be sent.
+     *
+     * @param topic
+     * @param payload
+     * @param retain
+     * @param qos
+     * @param options index into topic_options, -1 if none
+     * @param buf sizeof(buffer) bytes to write the payload to
+     * @return stored
      */
-    uint32_t read_packet_multiplier;
+    bool offlineStore(const mqtt_topic_ref_t& topic, mqttpayload_t payload, bool retain, uint8_t qos, int16_t options, uint8_t* buf);
 
     /**
-     * @brief Max length of packet being read.
+     * @brief Send the oldest publish stored while offline, if its turn has come.
+     *
+     * @return a publish was sent
      */
-    uint16_t read_packet_maxlen;
+    bool replayOffline(void);
 
     /**
-     * @brief Length of packet being read.
+     * @brief Drop the replayed publish the broker has just acknowledged, if it's this one.
+     *
+     * @param packet_id of the PUBACK or PUBREC
      */
-    uint16_t read_packet_len;
+    void offlineAcked(uint16_t packet_id);
 
     /**
-     * @brief Length of full packet read.
+     * @brief Check we're connected and not in the middle of something before sending a message.
+     *
+     * @return ready to send
      */
-    uint16_t full_packet_len;
+    bool mqttCanSend(void);
 
     /**
-     * @brief Timer for sending a packet. Controls timeout.
+     * @brief Drop the cached CONNECT packet, so it's rebuilt on the next connect.
      */
-    uint32_t send_packet_timer;
+    void forgetConnectPacket(void);
 
     /**
-     * @brief Time the last packet was successfully received.
+     * @brief Find a QoS 2 handshake in progress.
+     *
+     * @param packet_id
+     * @param state
+     * @return slot or nullptr
      */
-    uint32_t last_con_verify;
+    mqtt_inflight_t* findQos2(uint16_t packet_id, mqtt_qos2_state_t state);
 
     /**
-     * @brief Vector of pointers for subscriptions.
+     * @brief Resend the last packet of one stalled QoS 2 handshake, if any.
+     *
+     * @return a packet was sent
      */
-    std::vector<MQTTSubscribe*> mqttSubs;
+    bool retryQos2(void);
 
     /**
-     * @brief Vector of pointers for discovery messages.
+     * @brief Send the next subscription change made while connected, or resend one that
+     *        wasn't acknowledged in time.
+     *
+     * @return a packet was sent or a subscription freed
      */
-    std::vector<mqtt_message_t*> discoveries;
+    bool sendSubscriptionOps(void);
 
     /**
-     * @brief Count up the number of subscriptions.
+     * @brief Handle the SUBACK or UNSUBACK for a subscription change made while connected.
+     *
+     * @param len
+     * @return matched a change
      */
-    uint8_t subscription_counter = 0;
+    bool handleSubAck(uint16_t len);
 
     /**
-     * @brief Count up the number of discovery messages.
+     * @brief After connecting with a clean session, the broker has none of our subscriptions:
+     *        drop those being unsubscribed, and leave the rest to be sent by mqttSubscribe().
      */
-    uint8_t discovery_counter = 0;
+    void resetSubscriptionOps(void);
 
     /**
-     * @brief Birth topic.
+     * @brief Find a subscription by its exact topic.
+     *
+     * @param topic
+     * @return index into mqttSubs, -1 if none
      */
-    std::pair<const char*, const char*> birth_msg;
-
-    // ----------------------------------------- MESSAGING -----------------------------------------
+    int16_t findSubscription(const char* topic);
 
     /**
-     * @brief Publish a MQTT message.
-     * 
-     * @param topic
-     * @param payload
-     * @param retain
-     * @param qos
-     * @return success
+     * @brief Remove a subscription and free it. Only from loop(), never while its callback runs.
+     *        While the executor still has messages for it, it's marked MQTT_SUB_REMOVE instead,
+     *        and freed by sendSubscriptionOps() once they've run.
+     *
+     * @param i index into mqttSubs
+     * @return freed
      */
-    bool mqttPublish(const char* topic, const char* payload, bool retain = false, uint8_t qos = 0);
+    bool removeSubscription(uint16_t i);
 
     /**
      * @brief Process a single subscription flagged as having a new message.
      *
-     * @return subscription processed
+     * @return subscription processed, or waiting for room in the executor
      */
     bool processSubscriptionQueue(void);
 
@@ -679,6 +2127,17 @@ class MQTT_Looped {
      */
     bool mqttConnect(void);
 
+    /**
+     * @brief Choose the endpoint to connect to: the healthy endpoint with the lowest CONNACK
+     *        latency, keeping the current one on ties.
+     */
+    void selectEndpoint(void);
+
+    /**
+     * @brief Record a failed connection attempt on the current endpoint.
+     */
+    void endpointFailed(void);
+
     /**
      * @brief Wait on connection to server.
      *
@@ -745,6 +2204,11 @@ class MQTT_Looped {
      */
     void readFullPacket(void);
 
+    /**
+     * @brief Stepped loop for reading a full packet, as a switch based state machine.
+     */
+    void readFullPacketSteps(void);
+
     /**
      * @brief Read MQTT packet from the server. Will read up to maxlen bytes and store
      *        the data in the provided buffer. Waits up to the specified timeout (in
@@ -755,6 +2219,26 @@ class MQTT_Looped {
      */
     bool readPacket(void);
 
+#if MQTT_COROUTINES
+    /**
+     * @brief Read a full packet into buffer, as a coroutine resumed once per readFullPacket().
+     *        Sets full_packet_len, 0 if nothing was read before timing out.
+     *
+     * @return task
+     */
+    MQTTTask readFullPacketTask(void);
+
+    /**
+     * @brief Read what's available of the next `len` bytes, restarting read_packet_timer on data.
+     *
+     * @param p where the bytes go
+     * @param len
+     * @param got bytes read so far, updated
+     * @return 1 once all are read, 0 to wait for more, -1 if timed out
+     */
+    int8_t readBytes(uint8_t* p, uint16_t len, uint16_t* got);
+#endif
+
     /**
      * @brief Set current status based on packet type received.
      *
@@ -763,15 +2247,34 @@ class MQTT_Looped {
     void setStatusByPacket(uint8_t packetType);
 
     /**
-     * @brief Send data to the server specified by the buffer and length of data.
+     * @brief Send data to the server specified by the buffer and length of data. Whatever the
+     *        transport can't take right away is kept in the buffer and sent from later loops,
+     *        see continueSend().
      * 
      * @param buffer 
      * @param len 
-     * @return success
+     * @param tail flash bytes to stream out after it, if any
+     * @param tail_len
+     * @return success, sent or on its way
      *
      * @see https://github.com/adafruit/Adafruit_MQTT_Library
      */
-    bool sendPacket(uint8_t *buffer, uint16_t len);
+    bool sendPacket(uint8_t *buffer, uint16_t len, const char* tail = nullptr, uint16_t tail_len = 0);
+
+    /**
+     * @brief Write as much of the packet being sent as the transport takes without waiting.
+     *        Gives up once MQTT_SEND_PACKET_TIMEOUT has passed since sendPacket().
+     *
+     * @return success, sent or still on its way
+     */
+    bool continueSend(void);
+
+    /**
+     * @brief Whether part of a packet is still to be sent.
+     *
+     * @return pending
+     */
+    bool sendPending(void) const { return this->send_len > 0 || this->send_tail_len > 0; }
 
     /**
      * @brief Handles a single subscription packet received.
@@ -782,6 +2285,32 @@ class MQTT_Looped {
      */
     bool handleSubscriptionPacket(void);
 
+    /**
+     * @brief Handles a PUBREC, PUBREL or PUBCOMP packet, replying with the next step of the
+     *        QoS 2 handshake.
+     *
+     * @param len packet length
+     * @return success
+     */
+    bool handleQos2Packet(uint16_t len);
+
+    /**
+     * @brief Check the PUBACK for a QoS 1 publish, or its absence, then go back to sending
+     *        discoveries if that's what published, else to OKAY.
+     *
+     * @return the PUBACK was read
+     */
+    bool handlePubAck(void);
+
+    /**
+     * @brief Send a 4 byte acknowledgement (PUBACK, PUBREC, PUBREL, PUBCOMP).
+     *
+     * @param header first byte of the fixed header
+     * @param packet_id
+     * @return success
+     */
+    bool sendAck(uint8_t header, uint16_t packet_id);
+
     /**
      * @brief Generate a connection packet.
      *        This connect packet and code follows the MQTT 3.1 spec (some small differences
@@ -795,21 +2324,67 @@ class MQTT_Looped {
     uint8_t connectPacket(void);
 
     /**
-     * @brief Generate a publish packet.
+     * @brief Generate a publish packet, starting at publish_start.
      * 
      * @param topic 
      * @param data 
      * @param bLen 
      * @param qos 
-     * @param maxPacketLen 
      * @param retain 
-     * @return packet length
+     * @return packet length, 0 if the topic doesn't fit
      *
      * @see https://github.com/adafruit/Adafruit_MQTT_Library
      * @see http://docs.oasis-open.org/mqtt/mqtt/v3.1.1/os/mqtt-v3.1.1-os.html#_Toc398718040
      */
     uint16_t publishPacket(const char *topic, uint8_t *data, uint16_t bLen, uint8_t qos, bool retain);
 
+    /**
+     * @brief Where a publish packet's payload goes in buffer. Room is left in front for the
+     *        largest headers the packet may need.
+     *
+     * @param topiclen
+     * @param qos
+     * @return payload position, nullptr if the topic doesn't fit
+     */
+    uint8_t* publishPayload(uint16_t topiclen, uint8_t qos);
+
+    /**
+     * @brief Write the variable and fixed headers of a publish packet backwards from its payload,
+     *        and set publish_start.
+     *
+     * @param topic
+     * @param payload as returned by publishPayload()
+     * @param bLen
+     * @param qos
+     * @param retain
+     * @return packet length
+     */
+    uint16_t publishHeaders(const mqtt_topic_ref_t& topic, uint8_t* payload, uint16_t bLen, uint8_t qos, bool retain);
+
+#if MQTT_PROTOCOL_LEVEL == 5
+    /**
+     * @brief Find or assign the outbound alias for a topic.
+     *
+     * @param topic
+     * @param send_topic set to whether the topic must be sent along with the alias
+     * @return alias or 0 if none
+     */
+    uint16_t topicAlias(const mqtt_topic_ref_t& topic, bool* send_topic);
+
+    /**
+     * @brief Register the alias assigned by topicAlias(), once the publish carrying its topic has
+     *        been written.
+     *
+     * @param topic
+     */
+    void registerTopicAlias(const mqtt_topic_ref_t& topic);
+
+    /**
+     * @brief Forget topic aliases, which only live as long as a connection.
+     */
+    void resetTopicAliases(void);
+#endif
+
     /**
      * @brief Generate a subscriptiong packet.
      *
@@ -820,6 +2395,14 @@ class MQTT_Looped {
      * @see https://github.com/adafruit/Adafruit_MQTT_Library
      */
     uint8_t subscribePacket(const char *topic, uint8_t qos);
+
+    /**
+     * @brief Generate an unsubscribe packet.
+     *
+     * @param topic
+     * @return packet length
+     */
+    uint8_t unsubscribePacket(const char *topic);
 };
 
 
@@ -833,7 +2416,48 @@ class MQTT_Looped {
  *
  * @see https://github.com/adafruit/Adafruit_MQTT_Library
  */
-static uint8_t* stringprint(uint8_t *p, const char *s, uint16_t maxlen = 0);
+uint8_t* stringprint(uint8_t *p, const char *s, uint16_t maxlen = 0);
+
+/**
+ * @brief Print a string from flash to a buffer.
+ *
+ * @param p
+ * @param s
+ * @return pointer after the copy
+ */
+uint8_t* stringprint(uint8_t *p, const __FlashStringHelper *s);
+
+/**
+ * @brief Match a topic against a subscription filter, which may contain `+` (one level) and
+ *        `#` (all remaining levels) wildcards. Case insensitive, like exact subscriptions.
+ *
+ * @param filter subscription topic
+ * @param topic received topic, not null terminated
+ * @param topiclen
+ * @return matches
+ */
+bool topicMatches(const char* filter, const char* topic, uint16_t topiclen);
+
+/**
+ * @brief Decode a variable byte integer (remaining length, MQTT 5 property length).
+ *
+ * @param p start of the integer
+ * @param end end of valid data
+ * @param value decoded value
+ * @return pointer past the integer or nullptr if malformed
+ */
+const uint8_t* decodeVarint(const uint8_t* p, const uint8_t* end, uint32_t* value);
+
+/**
+ * @brief Find an MQTT 5 property with a two byte integer value.
+ *
+ * @param p start of the properties, past their length
+ * @param len length of the properties
+ * @param id property identifier
+ * @param value found value
+ * @return found
+ */
+bool findProperty(const uint8_t* p, uint32_t len, uint8_t id, uint16_t* value);
 
 /**
  * @brief Helper function used to figure out how much bigger the payload needs to be
@@ -845,6 +2469,24 @@ static uint8_t* stringprint(uint8_t *p, const char *s, uint16_t maxlen = 0);
  * @see https://github.com/adafruit/Adafruit_MQTT_Library
  * @see http://docs.oasis-open.org/mqtt/mqtt/v3.1.1/os/mqtt-v3.1.1-os.html#_Table_2.4_Size
  */
-static uint16_t packetAdditionalLen(uint32_t currLen);
+uint16_t packetAdditionalLen(uint32_t currLen);
+
+/**
+ * @brief Defined by the library only for the sizes it was built with. The settings above change
+ *        the layout of MQTT_Looped, so they have to be build flags, the same for the library and the
+ *        sketch; a sketch built with other values fails to link with an undefined reference to this.
+ *
+ * @return true
+ */
+template <size_t looped, size_t subscribe>
+bool mqttLayoutMatchesLibrary(void);
+
+// Called from every file that includes this header, kept even when nothing else is used.
+static const bool mqtt_layout_checked __attribute__((unused)) =
+  mqttLayoutMatchesLibrary<sizeof(MQTT_Looped), sizeof(MQTTSubscribe)>();
+
+// Engine on its own thread or core, and callbacks away from loop(), once MQTT_Looped is complete.
+#include "MQTT_Looped_Thread.h"
+#include "MQTT_Looped_Executor.h"
 
 #endif
@@ -0,0 +1,354 @@
+#include "MQTT_Looped_Capture.h"
+
+// "MQC1", then the bytes used, little endian.
+#define MQTT_CAPTURE_HEADER 8
+
+static const uint8_t capture_magic[4] = { 'M', 'Q', 'C', '1' };
+
+/**
+ * @brief Encode a varint, 7 bits per byte, lowest first.
+ *
+ * @param value
+ * @param buf room for 5 bytes
+ * @return bytes written
+ */
+static uint8_t captureVarint(uint32_t value, uint8_t* buf) {
+  uint8_t n = 0;
+  do {
+    buf[n] = value & 0x7F;
+    value >>= 7;
+    if (value > 0) {
+      buf[n] |= 0x80;
+    }
+    n++;
+  } while (value > 0);
+  return n;
+}
+
+/**
+ * @brief Decode a varint from storage.
+ *
+ * @param storage
+ * @param pos moved past the varint
+ * @param end
+ * @param value
+ * @return decoded, false if cut short
+ */
+static bool captureVarint(MQTTStorage* storage, uint32_t* pos, uint32_t end, uint32_t* value) {
+  *value = 0;
+  for (uint8_t shift = 0; shift < 35 && *pos < end; shift += 7) {
+    uint8_t b;
+    if (!storage->read((*pos)++, &b, 1)) {
+      return false;
+    }
+    *value |= (uint32_t)(b & 0x7F) << shift;
+    if (!(b & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// ------------------------------------------- CAPTURE ---------------------------------------------
+
+bool MQTTTransportCapture::connect(IPAddress address, uint16_t port) {
+  if (this->end == 0) {
+    this->end = MQTT_CAPTURE_HEADER;
+    this->last_time = mqttMillis();
+    // An empty capture until the first flush(), whatever the storage held before.
+    this->overflow = !this->log->write(0, capture_magic, sizeof(capture_magic)) || !this->writeUsed();
+  }
+  this->was_connected = false;
+  this->record(MQTT_CAPTURE_CONNECT, nullptr, 0);
+  return this->inner->connect(address, port);
+}
+
+bool MQTTTransportCapture::connected(void) {
+  bool connected = this->inner->connected();
+  if (connected) {
+    this->was_connected = true;
+  } else if (this->was_connected) {
+    this->was_connected = false;
+    this->record(MQTT_CAPTURE_DROP, nullptr, 0);
+    this->flush();
+  }
+  return connected;
+}
+
+int MQTTTransportCapture::read(uint8_t* buf, size_t len) {
+  int n = this->inner->read(buf, len);
+  if (n > 0) {
+    this->record(MQTT_CAPTURE_IN, buf, n);
+  }
+  return n;
+}
+
+size_t MQTTTransportCapture::write(const uint8_t* buf, size_t len) {
+  size_t n = this->inner->write(buf, len);
+  if (n > 0) {
+    this->record(MQTT_CAPTURE_OUT, buf, n);
+  }
+  return n;
+}
+
+void MQTTTransportCapture::close(void) {
+  this->was_connected = false;
+  this->record(MQTT_CAPTURE_CLOSE, nullptr, 0);
+  this->flush();
+  this->inner->close();
+}
+
+void MQTTTransportCapture::flush(void) {
+  this->writePending();
+  if (this->end != 0 && !this->writeUsed()) {
+    this->overflow = true;
+  }
+  this->log->sync();
+}
+
+void MQTTTransportCapture::record(uint8_t kind, const uint8_t* buf, size_t len) {
+  if (this->end == 0 || this->overflow) {
+    return;
+  }
+  uint32_t now = mqttMillis();
+  do {
+    // Bytes only merge with bytes of the same kind, in the same ms.
+    if (kind != this->pending_kind || now != this->pending_time || len == 0 || this->pending_len == MQTT_CAPTURE_BUFFER) {
+      this->writePending();
+      this->pending_kind = kind;
+      this->pending_time = now;
+    }
+    size_t n = MQTT_CAPTURE_BUFFER - this->pending_len;
+    n = len < n ? len : n;
+    if (n > 0) {
+      memcpy(this->pending + this->pending_len, buf, n);
+      this->pending_len += n;
+      buf += n;
+      len -= n;
+    }
+  } while (len > 0);
+}
+
+void MQTTTransportCapture::writePending(void) {
+  if (this->pending_kind == MQTT_CAPTURE_END) {
+    return;
+  }
+  uint8_t head[11];
+  head[0] = this->pending_kind;
+  uint8_t n = 1 + captureVarint(this->pending_time - this->last_time, head + 1);
+  n += captureVarint(this->pending_len, head + n);
+  // The bytes used are only updated by flush(), so a failed write is past the end of the capture.
+  if (this->overflow || this->end + n + this->pending_len > this->log->size() ||
+      !this->log->write(this->end, head, n) ||
+      (this->pending_len > 0 && !this->log->write(this->end + n, this->pending, this->pending_len))) {
+    this->overflow = true;
+  } else {
+    this->end += n + this->pending_len;
+    this->last_time = this->pending_time;
+  }
+  this->pending_kind = MQTT_CAPTURE_END;
+  this->pending_len = 0;
+}
+
+bool MQTTTransportCapture::writeUsed(void) {
+  uint8_t used[4] = {
+    (uint8_t)this->end,
+    (uint8_t)(this->end >> 8),
+    (uint8_t)(this->end >> 16),
+    (uint8_t)(this->end >> 24),
+  };
+  return this->log->write(sizeof(capture_magic), used, sizeof(used));
+}
+
+// -------------------------------------------- REPLAY ---------------------------------------------
+
+bool MQTTTransportReplay::connect(IPAddress, uint16_t) {
+  this->load();
+  // Whatever's left of the connection being played is skipped.
+  uint32_t pos = this->next;
+  if (this->kind != MQTT_CAPTURE_CONNECT) {
+    uint8_t kind;
+    uint32_t delta, len;
+    do {
+      if (!this->header(&pos, &kind, &delta, &len)) {
+        this->kind = MQTT_CAPTURE_END;
+        this->next = this->end;
+        return false;
+      }
+      pos += len;
+    } while (kind != MQTT_CAPTURE_CONNECT);
+  }
+  this->next = pos;
+  this->out_next = pos;
+  this->out_left = 0;
+  this->trace_time = 0;
+  this->trace_out = 0;
+  this->written = 0;
+  this->connected_at = mqttMillis();
+  this->idle_polls = 0;
+  this->released = false;
+  this->dropped = false;
+  this->open = true;
+  this->stats.connections++;
+  this->advance();
+  return true;
+}
+
+bool MQTTTransportReplay::connected(void) {
+  if (!this->open) {
+    return false;
+  }
+  // Anything but bytes to read ends the connection, once it's due.
+  if (!this->dropped && this->kind != MQTT_CAPTURE_IN && this->release()) {
+    this->dropped = true;
+  }
+  return !this->dropped;
+}
+
+int MQTTTransportReplay::available(void) {
+  if (!this->open || this->kind != MQTT_CAPTURE_IN || !this->release()) {
+    return 0;
+  }
+  return this->left;
+}
+
+int MQTTTransportReplay::read(uint8_t* buf, size_t len) {
+  uint32_t n = this->available();
+  n = len < n ? len : n;
+  if (n == 0 || !this->capture->read(this->at, buf, n)) {
+    return 0;
+  }
+  this->at += n;
+  this->left -= n;
+  this->stats.in_bytes += n;
+  if (this->left == 0) {
+    uint32_t latency = micros() - this->released_at;
+    this->stats.records++;
+    this->stats.latency_total += latency;
+    this->stats.latency_max = latency > this->stats.latency_max ? latency : this->stats.latency_max;
+    this->trace_time = this->due;
+    this->released = false;
+    this->advance();
+  }
+  return n;
+}
+
+size_t MQTTTransportReplay::write(const uint8_t* buf, size_t len) {
+  if (!this->open || this->dropped) {
+    return 0;
+  }
+  this->written += len;
+  this->idle_polls = 0;
+  this->stats.out_bytes += len;
+  // Compared with the capture's outbound bytes in order, whatever records they were written in.
+  size_t i = 0;
+  while (i < len) {
+    if (this->out_left == 0 && !this->advanceOut()) {
+      this->stats.mismatched += len - i;
+      break;
+    }
+    uint8_t chunk[32];
+    uint32_t n = len - i;
+    n = n < this->out_left ? n : this->out_left;
+    n = n < sizeof(chunk) ? n : sizeof(chunk);
+    this->capture->read(this->out_at, chunk, n);
+    for (uint32_t j = 0; j < n; j++) {
+      this->stats.mismatched += chunk[j] != buf[i + j];
+    }
+    this->out_at += n;
+    this->out_left -= n;
+    i += n;
+  }
+  return len;
+}
+
+bool MQTTTransportReplay::done(void) {
+  this->load();
+  // A capture ending where the connection was lost is done once the loss is played.
+  return (this->kind == MQTT_CAPTURE_END || this->dropped) && this->next >= this->end;
+}
+
+void MQTTTransportReplay::load(void) {
+  if (this->end != 0) {
+    return;
+  }
+  uint8_t head[MQTT_CAPTURE_HEADER];
+  this->end = MQTT_CAPTURE_HEADER;
+  if (this->capture->size() >= MQTT_CAPTURE_HEADER && this->capture->read(0, head, sizeof(head)) && memcmp(head, capture_magic, sizeof(capture_magic)) == 0) {
+    uint32_t used = head[4] | head[5] << 8 | head[6] << 16 | (uint32_t)head[7] << 24;
+    if (used >= MQTT_CAPTURE_HEADER && used <= this->capture->size()) {
+      this->end = used;
+    }
+  }
+  this->next = MQTT_CAPTURE_HEADER;
+}
+
+bool MQTTTransportReplay::header(uint32_t* pos, uint8_t* kind, uint32_t* delta, uint32_t* len) {
+  if (*pos >= this->end || !this->capture->read(*pos, kind, 1)) {
+    return false;
+  }
+  (*pos)++;
+  return captureVarint(this->capture, pos, this->end, delta) && captureVarint(this->capture, pos, this->end, len) && *pos + *len <= this->end;
+}
+
+void MQTTTransportReplay::advance(void) {
+  uint32_t pos = this->next;
+  uint8_t kind;
+  uint32_t delta, len;
+  while (this->header(&pos, &kind, &delta, &len)) {
+    if (kind == MQTT_CAPTURE_OUT || kind == MQTT_CAPTURE_CLOSE) {
+      // Written by the client, not played.
+      this->trace_out += kind == MQTT_CAPTURE_OUT ? len : 0;
+      this->trace_time += delta;
+      pos += len;
+      continue;
+    }
+    this->kind = kind;
+    this->at = pos;
+    this->left = len;
+    this->due = this->trace_time + delta;
+    this->next = pos + len;
+    return;
+  }
+  this->kind = MQTT_CAPTURE_END;
+  this->left = 0;
+  this->due = this->trace_time;
+  this->next = this->end;
+}
+
+bool MQTTTransportReplay::advanceOut(void) {
+  uint32_t pos = this->out_next;
+  uint8_t kind;
+  uint32_t delta, len;
+  while (this->header(&pos, &kind, &delta, &len)) {
+    if (kind == MQTT_CAPTURE_CONNECT) {
+      return false; // next connection's
+    }
+    if (kind == MQTT_CAPTURE_OUT) {
+      this->out_at = pos;
+      this->out_left = len;
+      this->out_next = pos + len;
+      return true;
+    }
+    pos += len;
+  }
+  return false;
+}
+
+bool MQTTTransportReplay::release(void) {
+  if (this->released) {
+    return true;
+  }
+  if (this->timed && mqttMillis() - this->connected_at < this->due) {
+    return false;
+  }
+  if (this->written < this->trace_out) {
+    if (++this->idle_polls < MQTT_REPLAY_STALL) {
+      return false;
+    }
+    this->stats.stalls++;
+  }
+  this->released = true;
+  this->released_at = micros();
+  return true;
+}
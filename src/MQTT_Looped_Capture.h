@@ -0,0 +1,293 @@
+#ifndef MQTT_LOOPED_CAPTURE_H
+#define MQTT_LOOPED_CAPTURE_H
+
+#include "MQTT_Looped_Clock.h"
+#include "MQTT_Looped_Transport.h"
+#include "MQTT_Looped_Offline.h"
+
+// Bytes read or written within the same ms are merged into one record of up to this many.
+#ifndef MQTT_CAPTURE_BUFFER
+#define MQTT_CAPTURE_BUFFER 256
+#endif
+
+// Polls for data with nothing written after which a replay lets the next inbound record through
+// even though the client hasn't written everything the capture had before it, e.g. publishes the
+// application made, which the replay doesn't.
+#ifndef MQTT_REPLAY_STALL
+#define MQTT_REPLAY_STALL 16
+#endif
+
+// -------------------------------------------- TYPEDEF --------------------------------------------
+
+/**
+ * @brief Kind of capture record.
+ */
+typedef enum {
+  MQTT_CAPTURE_END = 0,
+  // connect() called, no bytes.
+  MQTT_CAPTURE_CONNECT = 1,
+  // Bytes read from the broker.
+  MQTT_CAPTURE_IN = 2,
+  // Bytes written to the broker.
+  MQTT_CAPTURE_OUT = 3,
+  // close() called, no bytes.
+  MQTT_CAPTURE_CLOSE = 4,
+  // Connection lost, no bytes.
+  MQTT_CAPTURE_DROP = 5,
+} mqtt_capture_kind_t;
+
+/**
+ * @brief Counters of a replay.
+ */
+typedef struct mqtt_replay_stats_t {
+  // Connections replayed.
+  uint32_t connections;
+  // Bytes handed to the client, and written by it.
+  uint32_t in_bytes;
+  uint32_t out_bytes;
+  // Bytes written that differ from the capture, or that it doesn't have.
+  uint32_t mismatched;
+  // Inbound records let through because the client stopped writing, see MQTT_REPLAY_STALL.
+  uint32_t stalls;
+  // Inbound records read in full, and the time from each being let through to being read, us.
+  uint32_t records;
+  uint32_t latency_total;
+  uint32_t latency_max;
+} mqtt_replay_stats_t;
+
+// -------------------------------------------- CAPTURE --------------------------------------------
+
+/**
+ * @brief Records the traffic of another transport into an MQTTStorage, to be replayed with
+ *        MQTTTransportReplay. Recording stops when the storage is full or a write to it fails.
+ *
+ *        The capture is an 8 byte header, "MQC1" and the bytes used, then records: kind, ms
+ *        since the previous record and length as varints, and the bytes. The bytes used are
+ *        updated by flush(), and on close() or a lost connection, so a capture plays up to the
+ *        last of those.
+ */
+class MQTTTransportCapture : public MQTTTransport {
+  public:
+    /**
+     * @brief Constructor
+     *
+     * @param inner transport to the broker
+     * @param log overwritten from the start on the first connect
+     */
+    MQTTTransportCapture(MQTTTransport* inner, MQTTStorage* log) : inner(inner), log(log) {}
+
+    bool linkBegin(void) override { return this->inner->linkBegin(); }
+    mqtt_transport_link_t linkStatus(void) override { return this->inner->linkStatus(); }
+    bool connect(IPAddress address, uint16_t port) override;
+    bool connected(void) override;
+    uint8_t status(void) override { return this->inner->status(); }
+    int available(void) override { return this->inner->available(); }
+    int read(uint8_t* buf, size_t len) override;
+    size_t write(const uint8_t* buf, size_t len) override;
+    bool isOpen(void) override { return this->inner->isOpen(); }
+    void close(void) override;
+    bool closed(void) override { return this->inner->closed(); }
+
+    /**
+     * @brief Write out the record being merged and the bytes used, and make the capture survive
+     *        a reset.
+     */
+    void flush(void);
+
+    /**
+     * @brief Bytes of the storage used so far.
+     *
+     * @return bytes
+     */
+    uint32_t used(void) const { return this->end; }
+
+    /**
+     * @brief Whether recording stopped because the storage is full or failed.
+     *
+     * @return full
+     */
+    bool full(void) const { return this->overflow; }
+
+  private:
+    MQTTTransport* inner;
+    MQTTStorage* log;
+
+    /**
+     * @brief End of the capture in the storage, 0 before the first connect.
+     */
+    uint32_t end = 0;
+    bool overflow = false;
+    bool was_connected = false;
+
+    /**
+     * @brief Time of the last record written.
+     */
+    uint32_t last_time = 0;
+
+    /**
+     * @brief Record being merged.
+     */
+    uint8_t pending[MQTT_CAPTURE_BUFFER];
+    uint16_t pending_len = 0;
+    uint8_t pending_kind = MQTT_CAPTURE_END;
+    uint32_t pending_time = 0;
+
+    /**
+     * @brief Add bytes to the capture, merged with the record before if they can be.
+     *
+     * @param kind
+     * @param buf
+     * @param len
+     */
+    void record(uint8_t kind, const uint8_t* buf, size_t len);
+
+    /**
+     * @brief Write the record being merged to the storage.
+     */
+    void writePending(void);
+
+    /**
+     * @brief Write the bytes used to the header.
+     *
+     * @return success
+     */
+    bool writeUsed(void);
+};
+
+// -------------------------------------------- REPLAY ---------------------------------------------
+
+/**
+ * @brief Plays a capture back to MQTT_Looped, standing in for the broker. Inbound bytes are let
+ *        through once the client has written what it had written before them in the capture,
+ *        and, when timed, as long after connecting as they came originally. Written bytes are
+ *        compared with the capture. A connection ends where the captured one was lost, and the
+ *        replay where the capture ends.
+ */
+class MQTTTransportReplay : public MQTTTransport {
+  public:
+    /**
+     * @brief Constructor
+     *
+     * @param capture written by MQTTTransportCapture
+     * @param timed keep the original timing, or go as fast as the client reads
+     */
+    MQTTTransportReplay(MQTTStorage* capture, bool timed = true) : capture(capture), timed(timed) {}
+
+    bool connect(IPAddress address, uint16_t port) override;
+    bool connected(void) override;
+    uint8_t status(void) override { return this->open; }
+    int available(void) override;
+    int read(uint8_t* buf, size_t len) override;
+    size_t write(const uint8_t* buf, size_t len) override;
+    bool isOpen(void) override { return this->open; }
+    void close(void) override { this->open = false; }
+    bool closed(void) override { return true; }
+
+    /**
+     * @brief Whether the whole capture has been played, or it isn't one.
+     *
+     * @return done
+     */
+    bool done(void);
+
+    /**
+     * @brief Counters.
+     *
+     * @return stats
+     */
+    const mqtt_replay_stats_t* getStats(void) { return &this->stats; }
+
+  private:
+    MQTTStorage* capture;
+    bool timed;
+    bool open = false;
+
+    /**
+     * @brief End of the capture, 0 until its header is read. A storage without a capture plays
+     *        as an empty one.
+     */
+    uint32_t end = 0;
+
+    /**
+     * @brief Record being played: its kind, where its bytes are and how many are left, and its
+     *        time since its connection's CONNECT. `next` is the record after it.
+     */
+    uint8_t kind = MQTT_CAPTURE_END;
+    uint32_t at = 0;
+    uint32_t left = 0;
+    uint32_t due = 0;
+    uint32_t next = 0;
+
+    /**
+     * @brief Time of the record before it, since its connection's CONNECT.
+     */
+    uint32_t trace_time = 0;
+
+    /**
+     * @brief Bytes the capture had written before it, and the client has written, since
+     *        connecting.
+     */
+    uint32_t trace_out = 0;
+    uint32_t written = 0;
+
+    /**
+     * @brief Outbound record being compared with what the client writes: where its bytes are
+     *        and how many are left. `out_next` is the record after it.
+     */
+    uint32_t out_at = 0;
+    uint32_t out_left = 0;
+    uint32_t out_next = 0;
+
+    /**
+     * @brief When the replay connected, and the record being played was let through.
+     */
+    uint32_t connected_at = 0;
+    uint32_t released_at = 0;
+
+    /**
+     * @brief Polls for data since the client last wrote.
+     */
+    uint16_t idle_polls = 0;
+    bool released = false;
+    bool dropped = false;
+
+    mqtt_replay_stats_t stats = {};
+
+    /**
+     * @brief Read the capture's header, once.
+     */
+    void load(void);
+
+    /**
+     * @brief Read a record header.
+     *
+     * @param pos moved past the header
+     * @param kind
+     * @param delta ms since the previous record
+     * @param len
+     * @return read, false at the end of the capture
+     */
+    bool header(uint32_t* pos, uint8_t* kind, uint32_t* delta, uint32_t* len);
+
+    /**
+     * @brief Move on to the next record that isn't outbound or a close, adding up the outbound
+     *        bytes and time passed on the way.
+     */
+    void advance(void);
+
+    /**
+     * @brief Move on to the next outbound record of this connection.
+     *
+     * @return found
+     */
+    bool advanceOut(void);
+
+    /**
+     * @brief Whether the record being played can be, letting it through if so.
+     *
+     * @return let through
+     */
+    bool release(void);
+};
+
+#endif
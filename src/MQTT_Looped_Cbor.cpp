@@ -0,0 +1,375 @@
+#include "MQTT_Looped_Cbor.h"
+#include <math.h>
+
+// -------------------------------------------- WRITER ---------------------------------------------
+
+uint8_t* MQTTCborWriter::reserve(uint16_t n) {
+  if (this->overflowed || this->size - this->len < n) {
+    this->overflowed = true;
+    return nullptr;
+  }
+  uint8_t* p = this->buf + this->len;
+  this->len += n;
+  return p;
+}
+
+bool MQTTCborWriter::head(uint8_t major, uint32_t value) {
+  uint8_t n = value < 24 ? 0 : value <= 0xFF ? 1 : value <= 0xFFFF ? 2 : 4;
+  uint8_t* p = this->reserve(1 + n);
+  if (p == nullptr) {
+    return false;
+  }
+  p[0] = major << 5 | (n == 0 ? value : n == 1 ? 24 : n == 2 ? 25 : 26);
+  // big endian argument
+  for (uint8_t i = n; i > 0; i--) {
+    p[i] = value & 0xFF;
+    value >>= 8;
+  }
+  return true;
+}
+
+bool MQTTCborWriter::map(uint16_t pairs) {
+  return this->head(MQTT_CBOR_MAP, pairs);
+}
+
+bool MQTTCborWriter::array(uint16_t items) {
+  return this->head(MQTT_CBOR_ARRAY, items);
+}
+
+bool MQTTCborWriter::uint(uint32_t value) {
+  return this->head(MQTT_CBOR_UINT, value);
+}
+
+bool MQTTCborWriter::integer(int32_t value) {
+  if (value < 0) {
+    // -1 - n, without overflowing on INT32_MIN
+    return this->head(MQTT_CBOR_NEGINT, (uint32_t)(-(value + 1)));
+  }
+  return this->head(MQTT_CBOR_UINT, value);
+}
+
+bool MQTTCborWriter::number(float value) {
+  if (value >= -2147483648.0f && value < 2147483648.0f && (float)(int32_t)value == value) {
+    return this->integer((int32_t)value);
+  }
+  uint32_t bits;
+  memcpy(&bits, &value, 4);
+  // Half precision if nothing is lost: normal range, low 13 mantissa bits clear.
+  int16_t exponent = (int16_t)((bits >> 23) & 0xFF) - 127 + 15;
+  if (exponent > 0 && exponent < 31 && (bits & 0x1FFF) == 0) {
+    uint16_t half = ((bits >> 16) & 0x8000) | exponent << 10 | ((bits >> 13) & 0x3FF);
+    uint8_t* p = this->reserve(3);
+    if (p == nullptr) {
+      return false;
+    }
+    p[0] = 0xF9;
+    p[1] = half >> 8;
+    p[2] = half & 0xFF;
+    return true;
+  }
+  uint8_t* p = this->reserve(5);
+  if (p == nullptr) {
+    return false;
+  }
+  p[0] = 0xFA;
+  p[1] = bits >> 24;
+  p[2] = (bits >> 16) & 0xFF;
+  p[3] = (bits >> 8) & 0xFF;
+  p[4] = bits & 0xFF;
+  return true;
+}
+
+bool MQTTCborWriter::boolean(bool value) {
+  uint8_t* p = this->reserve(1);
+  if (p == nullptr) {
+    return false;
+  }
+  p[0] = value ? 0xF5 : 0xF4;
+  return true;
+}
+
+bool MQTTCborWriter::null(void) {
+  uint8_t* p = this->reserve(1);
+  if (p == nullptr) {
+    return false;
+  }
+  p[0] = 0xF6;
+  return true;
+}
+
+bool MQTTCborWriter::text(const char* s) {
+  return this->text(s, strlen(s));
+}
+
+bool MQTTCborWriter::text(const char* s, uint16_t len) {
+  if (!this->head(MQTT_CBOR_TEXT, len)) {
+    return false;
+  }
+  uint8_t* p = this->reserve(len);
+  if (p == nullptr) {
+    return false;
+  }
+  memcpy(p, s, len);
+  return true;
+}
+
+bool MQTTCborWriter::bytes(const uint8_t* data, uint16_t len) {
+  if (!this->head(MQTT_CBOR_BYTES, len)) {
+    return false;
+  }
+  uint8_t* p = this->reserve(len);
+  if (p == nullptr) {
+    return false;
+  }
+  memcpy(p, data, len);
+  return true;
+}
+
+// -------------------------------------------- READER ---------------------------------------------
+
+mqtt_cbor_type_t MQTTCborReader::type(void) {
+  if (this->p >= this->end) {
+    return MQTT_CBOR_END;
+  }
+  uint8_t major = this->p[0] >> 5;
+  uint8_t info = this->p[0] & 0x1F;
+  if (major == MQTT_CBOR_SIMPLE) {
+    return info >= 25 && info <= 27 ? MQTT_CBOR_FLOAT : MQTT_CBOR_SIMPLE;
+  }
+  return (mqtt_cbor_type_t)major;
+}
+
+bool MQTTCborReader::head(uint8_t* major, uint32_t* value, uint8_t* info) {
+  if (this->p >= this->end) {
+    return false;
+  }
+  *major = this->p[0] >> 5;
+  *info = this->p[0] & 0x1F;
+  uint8_t n;
+  if (*info < 24) {
+    n = 0;
+  } else if (*info <= 26) {
+    n = 1 << (*info - 24);
+  } else {
+    return false; // 64 bit or indefinite length
+  }
+  if (this->end - this->p < 1 + n) {
+    return false;
+  }
+  *value = n == 0 ? *info : 0;
+  for (uint8_t i = 1; i <= n; i++) {
+    *value = *value << 8 | this->p[i];
+  }
+  this->p += 1 + n;
+  return true;
+}
+
+bool MQTTCborReader::readMap(uint16_t* pairs) {
+  const uint8_t* start = this->p;
+  uint8_t major, info;
+  uint32_t value;
+  if (!this->head(&major, &value, &info) || major != MQTT_CBOR_MAP || value > 0xFFFF) {
+    this->p = start;
+    return false;
+  }
+  *pairs = value;
+  return true;
+}
+
+bool MQTTCborReader::readArray(uint16_t* items) {
+  const uint8_t* start = this->p;
+  uint8_t major, info;
+  uint32_t value;
+  if (!this->head(&major, &value, &info) || major != MQTT_CBOR_ARRAY || value > 0xFFFF) {
+    this->p = start;
+    return false;
+  }
+  *items = value;
+  return true;
+}
+
+bool MQTTCborReader::readInt(int32_t* value) {
+  const uint8_t* start = this->p;
+  uint8_t major, info;
+  uint32_t arg;
+  if (!this->head(&major, &arg, &info) || (major != MQTT_CBOR_UINT && major != MQTT_CBOR_NEGINT) || arg > 0x7FFFFFFF) {
+    this->p = start;
+    return false;
+  }
+  *value = major == MQTT_CBOR_UINT ? (int32_t)arg : -1 - (int32_t)arg;
+  return true;
+}
+
+bool MQTTCborReader::readFloat(float* value) {
+  int32_t i;
+  if (this->readInt(&i)) {
+    *value = i;
+    return true;
+  }
+  if (this->type() != MQTT_CBOR_FLOAT) {
+    return false;
+  }
+  uint8_t info = this->p[0] & 0x1F;
+  uint8_t n = 1 << (info - 24);
+  if (this->end - this->p < 1 + n) {
+    return false;
+  }
+  const uint8_t* b = this->p + 1;
+  if (info == 25) {
+    // half precision
+    uint16_t half = b[0] << 8 | b[1];
+    uint8_t exponent = (half >> 10) & 0x1F;
+    uint16_t mantissa = half & 0x3FF;
+    if (exponent == 0) {
+      *value = ldexpf(mantissa, -24);
+    } else if (exponent == 31) {
+      *value = mantissa ? NAN : INFINITY;
+    } else {
+      *value = ldexpf(mantissa + 1024, exponent - 25);
+    }
+    if (half & 0x8000) {
+      *value = -*value;
+    }
+  } else if (info == 26) {
+    uint32_t bits = (uint32_t)b[0] << 24 | (uint32_t)b[1] << 16 | (uint32_t)b[2] << 8 | b[3];
+    memcpy(value, &bits, 4);
+  } else {
+    // Double precision, narrowed by hand since double is 32 bits on some boards (AVR).
+    uint32_t hi = (uint32_t)b[0] << 24 | (uint32_t)b[1] << 16 | (uint32_t)b[2] << 8 | b[3];
+    int16_t exponent = (hi >> 20) & 0x7FF;
+    uint32_t mantissa = hi & 0xFFFFF;
+    if (exponent == 0) {
+      *value = 0; // zero, or subnormal and far below float range
+    } else if (exponent == 0x7FF) {
+      *value = mantissa || b[4] || b[5] || b[6] || b[7] ? NAN : INFINITY;
+    } else {
+      // 20 + 8 mantissa bits is more than float keeps.
+      mantissa = mantissa << 8 | b[4];
+      *value = ldexpf((float)(mantissa | 0x10000000UL), exponent - 1023 - 28);
+    }
+    if (hi & 0x80000000UL) {
+      *value = -*value;
+    }
+  }
+  this->p += 1 + n;
+  return true;
+}
+
+bool MQTTCborReader::readBool(bool* value) {
+  if (this->p >= this->end || (this->p[0] != 0xF4 && this->p[0] != 0xF5)) {
+    return false;
+  }
+  *value = this->p[0] == 0xF5;
+  this->p++;
+  return true;
+}
+
+bool MQTTCborReader::readNull(void) {
+  if (this->p >= this->end || this->p[0] != 0xF6) {
+    return false;
+  }
+  this->p++;
+  return true;
+}
+
+bool MQTTCborReader::readText(const char** s, uint16_t* len) {
+  const uint8_t* start = this->p;
+  uint8_t major, info;
+  uint32_t value;
+  if (!this->head(&major, &value, &info) || major != MQTT_CBOR_TEXT || value > (uint32_t)(this->end - this->p)) {
+    this->p = start;
+    return false;
+  }
+  *s = (const char*)this->p;
+  *len = value;
+  this->p += value;
+  return true;
+}
+
+bool MQTTCborReader::readBytes(const uint8_t** data, uint16_t* len) {
+  const uint8_t* start = this->p;
+  uint8_t major, info;
+  uint32_t value;
+  if (!this->head(&major, &value, &info) || major != MQTT_CBOR_BYTES || value > (uint32_t)(this->end - this->p)) {
+    this->p = start;
+    return false;
+  }
+  *data = this->p;
+  *len = value;
+  this->p += value;
+  return true;
+}
+
+bool MQTTCborReader::skip(void) {
+  const uint8_t* start = this->p;
+  if (!this->skip(0)) {
+    this->p = start;
+    return false;
+  }
+  return true;
+}
+
+bool MQTTCborReader::skip(uint8_t depth) {
+  if (depth > MQTT_CBOR_MAX_DEPTH) {
+    return false;
+  }
+  // Doubles don't fit head(), but need no more than their size.
+  if (this->p < this->end && this->p[0] == 0xFB) {
+    if (this->end - this->p < 9) {
+      return false;
+    }
+    this->p += 9;
+    return true;
+  }
+  uint8_t major, info;
+  uint32_t value;
+  if (!this->head(&major, &value, &info)) {
+    return false;
+  }
+  switch (major) {
+    case MQTT_CBOR_BYTES:
+    case MQTT_CBOR_TEXT:
+      if (value > (uint32_t)(this->end - this->p)) {
+        return false;
+      }
+      this->p += value;
+      return true;
+    case MQTT_CBOR_MAP:
+      if (value > 0x7FFFFFFF) {
+        return false;
+      }
+      value *= 2;
+      // fall through
+    case MQTT_CBOR_ARRAY:
+      for (uint32_t i = 0; i < value; i++) {
+        if (!this->skip(depth + 1)) {
+          return false;
+        }
+      }
+      return true;
+    case MQTT_CBOR_TAG:
+      return this->skip(depth + 1);
+    default:
+      return true; // integers, floats and simple values are all in the head
+  }
+}
+
+bool MQTTCborReader::find(const char* key, uint16_t* pairs) {
+  uint16_t keylen = strlen(key);
+  while (*pairs > 0) {
+    (*pairs)--;
+    const char* k;
+    uint16_t klen;
+    if (this->readText(&k, &klen)) {
+      if (klen == keylen && memcmp(k, key, klen) == 0) {
+        return true;
+      }
+    } else if (!this->skip()) {
+      return false; // non-text key we couldn't skip
+    }
+    if (!this->skip()) {
+      return false;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,304 @@
+#ifndef MQTT_LOOPED_CBOR_H
+#define MQTT_LOOPED_CBOR_H
+
+#include <Arduino.h>
+
+// Deepest nesting of arrays and maps MQTTCborReader::skip() will walk.
+#define MQTT_CBOR_MAX_DEPTH 8
+
+// -------------------------------------------- TYPEDEF --------------------------------------------
+
+/**
+ * @brief CBOR major types, plus floats and simple values split out of major type 7.
+ */
+typedef enum {
+  MQTT_CBOR_UINT = 0,
+  MQTT_CBOR_NEGINT = 1,
+  MQTT_CBOR_BYTES = 2,
+  MQTT_CBOR_TEXT = 3,
+  MQTT_CBOR_ARRAY = 4,
+  MQTT_CBOR_MAP = 5,
+  MQTT_CBOR_TAG = 6,
+  MQTT_CBOR_SIMPLE = 7, // false, true, null, undefined
+  MQTT_CBOR_FLOAT = 8,
+  MQTT_CBOR_END = 0xFE, // nothing left to read
+  MQTT_CBOR_INVALID = 0xFF,
+} mqtt_cbor_type_t;
+
+// -------------------------------------------- WRITER ---------------------------------------------
+
+/**
+ * @brief Encodes CBOR (RFC 8949) straight into a caller's buffer, e.g. the payload area of an
+ *        outgoing publish packet. Arrays and maps are definite length: pass the item count up
+ *        front. Once something doesn't fit, further writes are dropped and overflow() is set.
+ */
+class MQTTCborWriter {
+  public:
+    /**
+     * @brief Constructor
+     *
+     * @param buf
+     * @param size
+     */
+    MQTTCborWriter(uint8_t* buf, uint16_t size) : buf(buf), size(size) {}
+
+    /**
+     * @brief Start a map, followed by `pairs` keys each followed by a value.
+     *
+     * @param pairs
+     * @return success
+     */
+    bool map(uint16_t pairs);
+
+    /**
+     * @brief Start an array, followed by `items` values.
+     *
+     * @param items
+     * @return success
+     */
+    bool array(uint16_t items);
+
+    /**
+     * @brief Write an unsigned integer, in as few bytes as it fits.
+     *
+     * @param value
+     * @return success
+     */
+    bool uint(uint32_t value);
+
+    /**
+     * @brief Write a signed integer, in as few bytes as it fits.
+     *
+     * @param value
+     * @return success
+     */
+    bool integer(int32_t value);
+
+    /**
+     * @brief Write a number. Whole numbers are written as integers, and floats that survive the
+     *        trip as half precision (3 bytes), single precision (5 bytes) otherwise.
+     *
+     * @param value
+     * @return success
+     */
+    bool number(float value);
+
+    /**
+     * @brief Write a boolean.
+     *
+     * @param value
+     * @return success
+     */
+    bool boolean(bool value);
+
+    /**
+     * @brief Write null.
+     *
+     * @return success
+     */
+    bool null(void);
+
+    /**
+     * @brief Write a text string.
+     *
+     * @param s null terminated
+     * @return success
+     */
+    bool text(const char* s);
+
+    /**
+     * @brief Write a text string.
+     *
+     * @param s
+     * @param len
+     * @return success
+     */
+    bool text(const char* s, uint16_t len);
+
+    /**
+     * @brief Write a byte string.
+     *
+     * @param data
+     * @param len
+     * @return success
+     */
+    bool bytes(const uint8_t* data, uint16_t len);
+
+    /**
+     * @brief Write a map key, same as text().
+     *
+     * @param k
+     * @return success
+     */
+    bool key(const char* k) { return this->text(k); }
+
+    /**
+     * @brief Bytes written.
+     *
+     * @return length
+     */
+    uint16_t length(void) const { return this->len; }
+
+    /**
+     * @brief Whether a write didn't fit.
+     *
+     * @return overflowed
+     */
+    bool overflow(void) const { return this->overflowed; }
+
+  private:
+    uint8_t* buf;
+    uint16_t size;
+    uint16_t len = 0;
+    bool overflowed = false;
+
+    /**
+     * @brief Reserve bytes, or flag an overflow.
+     *
+     * @param n
+     * @return where to write, or nullptr
+     */
+    uint8_t* reserve(uint16_t n);
+
+    /**
+     * @brief Write an initial byte and its argument.
+     *
+     * @param major
+     * @param value
+     * @return success
+     */
+    bool head(uint8_t major, uint32_t value);
+};
+
+// -------------------------------------------- READER ---------------------------------------------
+
+/**
+ * @brief Decodes CBOR in place, e.g. from a subscription callback's payload. Strings are
+ *        returned as views into the payload, nothing is copied. Indefinite length items and
+ *        integers over 32 bits aren't supported and read as invalid.
+ *
+ *        A reader is cheap to copy, so keep a copy to go back to an earlier position.
+ */
+class MQTTCborReader {
+  public:
+    /**
+     * @brief Constructor
+     *
+     * @param buf
+     * @param len
+     */
+    MQTTCborReader(const uint8_t* buf, uint16_t len) : p(buf), end(buf + len) {}
+
+    /**
+     * @brief Type of the next item.
+     *
+     * @return type
+     */
+    mqtt_cbor_type_t type(void);
+
+    /**
+     * @brief Read the start of a map.
+     *
+     * @param pairs set to the number of key/value pairs that follow
+     * @return success
+     */
+    bool readMap(uint16_t* pairs);
+
+    /**
+     * @brief Read the start of an array.
+     *
+     * @param items set to the number of items that follow
+     * @return success
+     */
+    bool readArray(uint16_t* items);
+
+    /**
+     * @brief Read a signed or unsigned integer.
+     *
+     * @param value
+     * @return success, false if not an integer or out of range
+     */
+    bool readInt(int32_t* value);
+
+    /**
+     * @brief Read a number, integer or float of any precision.
+     *
+     * @param value
+     * @return success
+     */
+    bool readFloat(float* value);
+
+    /**
+     * @brief Read a boolean.
+     *
+     * @param value
+     * @return success
+     */
+    bool readBool(bool* value);
+
+    /**
+     * @brief Read null.
+     *
+     * @return success
+     */
+    bool readNull(void);
+
+    /**
+     * @brief Read a text string, not null terminated.
+     *
+     * @param s set to point into the payload
+     * @param len
+     * @return success
+     */
+    bool readText(const char** s, uint16_t* len);
+
+    /**
+     * @brief Read a byte string.
+     *
+     * @param data set to point into the payload
+     * @param len
+     * @return success
+     */
+    bool readBytes(const uint8_t** data, uint16_t* len);
+
+    /**
+     * @brief Skip the next item, including everything nested in it.
+     *
+     * @return success
+     */
+    bool skip(void);
+
+    /**
+     * @brief Search the remaining pairs of a map for a text key, leaving the reader on its value.
+     *        Call right after readMap(); pairs is updated to what's left after the value.
+     *
+     * @param key
+     * @param pairs
+     * @return found
+     */
+    bool find(const char* key, uint16_t* pairs);
+
+  private:
+    const uint8_t* p;
+    const uint8_t* end;
+
+    /**
+     * @brief Read an initial byte and its argument.
+     *
+     * @param major set to the major type
+     * @param value set to the argument
+     * @param info set to the additional information, to tell floats and simple values apart
+     * @return success
+     */
+    bool head(uint8_t* major, uint32_t* value, uint8_t* info);
+
+    /**
+     * @brief Skip an item, recursively.
+     *
+     * @param depth
+     * @return success
+     */
+    bool skip(uint8_t depth);
+};
+
+#endif
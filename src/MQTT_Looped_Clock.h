@@ -0,0 +1,94 @@
+#ifndef MQTT_LOOPED_CLOCK_H
+#define MQTT_LOOPED_CLOCK_H
+
+#include <Arduino.h>
+
+// Read time through an MQTTClock that can be swapped, see mqttSetClock(). On by default on hosts,
+// where simulations run; elsewhere every timeout reads millis() directly.
+#ifndef MQTT_CLOCK
+#if defined(__linux__) || defined(__APPLE__)
+#define MQTT_CLOCK 1
+#else
+#define MQTT_CLOCK 0
+#endif
+#endif
+
+#if MQTT_CLOCK
+
+// --------------------------------------------- CLOCK ---------------------------------------------
+
+/**
+ * @brief Source of the time every timeout, backoff and keepalive is measured with.
+ */
+class MQTTClock {
+  public:
+    virtual ~MQTTClock() {}
+
+    /**
+     * @brief Time since some start, wrapping like millis().
+     *
+     * @return ms
+     */
+    virtual uint32_t millis(void) = 0;
+};
+
+/**
+ * @brief Clock that only moves when told to, so hours of keepalives, backoff and reconnects can be
+ *        simulated in as many loops as they take, with the same result every run.
+ *
+ *        Drive it from the thread calling loop(), moving it to the next thing due when the client
+ *        has nothing to do:
+ *
+ *        clock.advance(mqttLooped.ioPending() ? 0 : mqttLooped.msUntilNextDeadline());
+ */
+class MQTTVirtualClock : public MQTTClock {
+  public:
+    /**
+     * @brief Constructor
+     *
+     * @param start ms
+     */
+    MQTTVirtualClock(uint32_t start = 0) : now(start) {}
+
+    uint32_t millis(void) override { return this->now; }
+
+    /**
+     * @brief Move time forward.
+     *
+     * @param ms
+     */
+    void advance(uint32_t ms) { this->now += ms; }
+
+  private:
+    uint32_t now;
+};
+
+extern MQTTClock* mqtt_clock;
+
+/**
+ * @brief Make every client and transport read time from a clock.
+ *
+ * @param clock nullptr for millis()
+ */
+inline void mqttSetClock(MQTTClock* clock) {
+  mqtt_clock = clock;
+}
+
+/**
+ * @brief Current time of the clock set, millis() if none.
+ *
+ * @return ms
+ */
+inline uint32_t mqttMillis(void) {
+  return mqtt_clock != nullptr ? mqtt_clock->millis() : millis();
+}
+
+#else
+
+inline uint32_t mqttMillis(void) {
+  return millis();
+}
+
+#endif
+
+#endif
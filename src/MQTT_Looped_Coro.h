@@ -0,0 +1,169 @@
+#ifndef MQTT_LOOPED_CORO_H
+#define MQTT_LOOPED_CORO_H
+
+#include <Arduino.h>
+
+// Read packets with a C++20 coroutine instead of the switch based state machine. Needs a
+// toolchain with coroutines, e.g. building with -std=gnu++20.
+#ifndef MQTT_COROUTINES
+#define MQTT_COROUTINES 0
+#endif
+
+#if MQTT_COROUTINES
+
+#if !defined(__cpp_impl_coroutine) || !__has_include(<coroutine>)
+#error "MQTT_COROUTINES needs C++20 coroutines, e.g. build with -std=gnu++20"
+#endif
+
+#include <coroutine>
+#include <stddef.h>
+
+// Coroutine frames per client, i.e. how many flows can be in progress at once.
+#ifndef MQTT_CORO_FRAMES
+#define MQTT_CORO_FRAMES 2
+#endif
+
+// Largest coroutine frame in bytes. A flow whose frame doesn't fit isn't started.
+#ifndef MQTT_CORO_FRAME_SIZE
+#define MQTT_CORO_FRAME_SIZE 192
+#endif
+
+/**
+ * @brief Fixed pool of coroutine frames, so starting a flow never touches the heap.
+ */
+class MQTTFramePool {
+  public:
+    /**
+     * @brief Take a free frame.
+     *
+     * @param size
+     * @return frame or nullptr if none is free or size is too large
+     */
+    void* alloc(size_t size) {
+      if (size > MQTT_CORO_FRAME_SIZE) {
+        return nullptr;
+      }
+      for (auto & b : this->blocks) {
+        if (!b.used) {
+          b.used = true;
+          return b.frame;
+        }
+      }
+      return nullptr;
+    }
+
+    /**
+     * @brief Give a frame back to whichever pool it came from.
+     *
+     * @param frame
+     */
+    static void release(void* frame) {
+      // The frame is the first member of its block.
+      ((block_t*)frame)->used = false;
+    }
+
+  private:
+    typedef struct block_t {
+      alignas(max_align_t) uint8_t frame[MQTT_CORO_FRAME_SIZE];
+      bool used;
+    } block_t;
+
+    block_t blocks[MQTT_CORO_FRAMES] = {};
+};
+
+class MQTT_Looped;
+
+/**
+ * @brief Resumable flow, written as a coroutine. It starts suspended and runs up to its next
+ *        `co_await MQTTYield{}` each time it is resumed.
+ *
+ *        Flows must be member functions of MQTT_Looped without parameters; their frames are
+ *        taken from its `frame_pool`. If the pool is out of frames, the task is empty: check it
+ *        before resuming.
+ */
+class MQTTTask {
+  public:
+    struct promise_type {
+      MQTTTask get_return_object(void) {
+        return MQTTTask(std::coroutine_handle<promise_type>::from_promise(*this));
+      }
+      static MQTTTask get_return_object_on_allocation_failure(void) { return MQTTTask(); }
+      std::suspend_always initial_suspend(void) noexcept { return {}; }
+      std::suspend_always final_suspend(void) noexcept { return {}; }
+      void return_void(void) {}
+      void unhandled_exception(void) {}
+
+      /**
+       * @brief Frames of member coroutines come from their object's pool. Not a template, which
+       *        GCC takes for a mismatch with the operator delete below (-Wmismatched-new-delete).
+       */
+      static void* operator new(size_t size, MQTT_Looped& owner) noexcept;
+
+      /**
+       * @brief Other coroutines have no pool to use.
+       */
+      static void* operator new(size_t) noexcept { return nullptr; }
+
+      static void operator delete(void* frame) { MQTTFramePool::release(frame); }
+
+      /**
+       * @brief Sized form of the above, which the compiler prefers for frames.
+       */
+      static void operator delete(void* frame, size_t) { MQTTFramePool::release(frame); }
+    };
+
+    MQTTTask(void) {}
+    MQTTTask(const MQTTTask&) = delete;
+    MQTTTask& operator=(const MQTTTask&) = delete;
+    MQTTTask(MQTTTask&& other) : handle(other.handle) { other.handle = nullptr; }
+    MQTTTask& operator=(MQTTTask&& other) {
+      if (this != &other) {
+        this->reset();
+        this->handle = other.handle;
+        other.handle = nullptr;
+      }
+      return *this;
+    }
+    ~MQTTTask(void) { this->reset(); }
+
+    /**
+     * @brief Whether there is a flow, finished or not.
+     */
+    explicit operator bool(void) const { return (bool)this->handle; }
+
+    /**
+     * @brief Run the flow up to its next yield.
+     */
+    void resume(void) { this->handle.resume(); }
+
+    /**
+     * @brief Whether the flow ran to the end.
+     *
+     * @return done
+     */
+    bool done(void) const { return this->handle.done(); }
+
+    /**
+     * @brief Destroy the flow, finished or not, returning its frame to the pool.
+     */
+    void reset(void) {
+      if (this->handle) {
+        this->handle.destroy();
+        this->handle = nullptr;
+      }
+    }
+
+  private:
+    explicit MQTTTask(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+
+    std::coroutine_handle<promise_type> handle = nullptr;
+};
+
+/**
+ * @brief Hand control back to loop() until the flow is resumed.
+ */
+typedef std::suspend_always MQTTYield;
+
+#endif
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef MQTT_LOOPED_EXECUTOR_H
+#define MQTT_LOOPED_EXECUTOR_H
+
+#include "MQTT_Looped.h"
+
+#if MQTT_EXECUTOR
+
+// Bytes of received messages waiting in an MQTTDeferredExecutor, each taking its payload and the
+// size of a pointer plus 3 bytes.
+#ifndef MQTT_EXECUTOR_RING
+#define MQTT_EXECUTOR_RING 2048
+#endif
+
+// ------------------------------------------- EXECUTOR --------------------------------------------
+
+/**
+ * @brief Runs subscription callbacks away from loop(), so a slow one, e.g. writing to flash or
+ *        driving a display, doesn't hold up pings, acks and reads. Set with
+ *        MQTT_Looped::setExecutor().
+ *
+ *        loop() hands each received message to post(), which copies it and returns; callbacks are
+ *        run later with run(), by whatever the executor is: a worker task, or the application
+ *        draining it when it has time.
+ */
+class MQTTExecutor {
+  public:
+    virtual ~MQTTExecutor() {}
+
+    /**
+     * @brief Take a received message, to run its callback later with run(). The payload is only
+     *        valid during the call, so copy it.
+     *
+     * @param sub
+     * @param payload
+     * @param len
+     * @return taken, false to have loop() offer it again on a later loop
+     */
+    virtual bool post(MQTTSubscribe* sub, const char* payload, uint16_t len) = 0;
+
+  protected:
+    /**
+     * @brief Run a posted message's callback, once for each message taken. The subscription isn't
+     *        freed until all its messages are run.
+     *
+     * @param sub
+     * @param payload null terminated copy
+     * @param len
+     */
+    static void run(MQTTSubscribe* sub, char* payload, uint16_t len) {
+      sub->callback(payload, len);
+      sub->deferred.fetch_sub(1, std::memory_order_release);
+    }
+};
+
+/**
+ * @brief Executor keeping copies of received messages in a lock-free ring, for drain() to run
+ *        from a single worker task or core, or from the application's loop at a convenient time.
+ *
+ * @tparam Size ring bytes
+ */
+template<uint16_t Size = MQTT_EXECUTOR_RING>
+class MQTTDeferredExecutor : public MQTTExecutor {
+  public:
+    bool post(MQTTSubscribe* sub, const char* payload, uint16_t len) override {
+      uint32_t need = sizeof(sub) + (uint32_t)len + 1;
+      uint8_t* rec = need + 2 < Size ? this->ring.reserve(need) : nullptr;
+      if (rec == nullptr) {
+        return false;
+      }
+      memcpy(rec, &sub, sizeof(sub));
+      memcpy(rec + sizeof(sub), payload, len);
+      rec[sizeof(sub) + len] = '\0';
+      this->ring.commit();
+      return true;
+    }
+
+    /**
+     * @brief Run callbacks of messages posted so far, oldest first. Always from the same thread.
+     *
+     * @param max most callbacks to run
+     * @return callbacks run
+     */
+    uint16_t drain(uint16_t max = 8) {
+      uint16_t ran = 0;
+      uint16_t len;
+      uint8_t* rec;
+      while (ran < max && (rec = this->ring.front(&len)) != nullptr) {
+        MQTTSubscribe* sub;
+        memcpy(&sub, rec, sizeof(sub));
+        // Run in place, the ring keeps the record until the callback returns.
+        run(sub, (char*)rec + sizeof(sub), len - sizeof(sub) - 1);
+        this->ring.pop();
+        ran++;
+      }
+      return ran;
+    }
+
+    /**
+     * @brief Whether there's nothing to drain.
+     *
+     * @return empty
+     */
+    bool empty(void) const { return this->ring.empty(); }
+
+  private:
+    /**
+     * @brief Messages: subscription, payload with null terminator.
+     */
+    MQTTSpscRing<Size> ring;
+};
+
+#endif
+
+#endif
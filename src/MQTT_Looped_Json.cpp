@@ -0,0 +1,193 @@
+#include "MQTT_Looped_Json.h"
+#include <math.h>
+
+bool MQTTJsonWriter::put(const char* s, uint16_t n) {
+  if (this->overflowed || this->size - this->len < n) {
+    this->overflowed = true;
+    return false;
+  }
+  memcpy(this->buf + this->len, s, n);
+  this->len += n;
+  return true;
+}
+
+bool MQTTJsonWriter::separator(void) {
+  if (this->after_key) {
+    this->after_key = false;
+    return !this->overflowed;
+  }
+  if (this->depth == 0) {
+    return !this->overflowed;
+  }
+  uint16_t bit = 1U << (this->depth - 1);
+  if (this->has_items & bit) {
+    return this->put(',');
+  }
+  this->has_items |= bit;
+  return !this->overflowed;
+}
+
+bool MQTTJsonWriter::beginObject(void) {
+  if (this->depth >= MQTT_JSON_MAX_DEPTH) {
+    this->overflowed = true;
+    return false;
+  }
+  if (!this->separator() || !this->put('{')) {
+    return false;
+  }
+  this->depth++;
+  this->has_items &= ~(1U << (this->depth - 1));
+  return true;
+}
+
+bool MQTTJsonWriter::beginArray(void) {
+  if (this->depth >= MQTT_JSON_MAX_DEPTH) {
+    this->overflowed = true;
+    return false;
+  }
+  if (!this->separator() || !this->put('[')) {
+    return false;
+  }
+  this->depth++;
+  this->has_items &= ~(1U << (this->depth - 1));
+  return true;
+}
+
+bool MQTTJsonWriter::close(char c) {
+  if (this->depth == 0) {
+    this->overflowed = true;
+    return false;
+  }
+  this->depth--;
+  return this->put(c);
+}
+
+bool MQTTJsonWriter::endObject(void) {
+  return this->close('}');
+}
+
+bool MQTTJsonWriter::endArray(void) {
+  return this->close(']');
+}
+
+bool MQTTJsonWriter::key(const char* k) {
+  if (!this->string(k) || !this->put(':')) {
+    return false;
+  }
+  this->after_key = true;
+  return true;
+}
+
+bool MQTTJsonWriter::string(const char* s) {
+  return this->string(s, strlen(s));
+}
+
+bool MQTTJsonWriter::string(const char* s, uint16_t len) {
+  if (!this->separator() || !this->put('"')) {
+    return false;
+  }
+  uint16_t run = 0; // bytes that need no escaping, copied in one go
+  for (uint16_t i = 0; i < len; i++) {
+    uint8_t c = s[i];
+    if (c >= 0x20 && c != '"' && c != '\\') {
+      run++;
+      continue;
+    }
+    this->put(s + i - run, run);
+    run = 0;
+    switch (c) {
+      case '"':  this->put("\\\"", 2); break;
+      case '\\': this->put("\\\\", 2); break;
+      case '\n': this->put("\\n", 2); break;
+      case '\r': this->put("\\r", 2); break;
+      case '\t': this->put("\\t", 2); break;
+      default: {
+        const char* hex = "0123456789abcdef";
+        char u[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF] };
+        this->put(u, 6);
+      }
+    }
+  }
+  this->put(s + len - run, run);
+  return this->put('"');
+}
+
+bool MQTTJsonWriter::digits(uint32_t value, uint8_t width) {
+  char d[10];
+  uint8_t n = 0;
+  do {
+    d[sizeof(d) - 1 - n++] = '0' + value % 10;
+    value /= 10;
+  } while (value > 0 || n < width);
+  return this->put(d + sizeof(d) - n, n);
+}
+
+bool MQTTJsonWriter::integer(int32_t value) {
+  if (!this->separator()) {
+    return false;
+  }
+  if (value < 0) {
+    this->put('-');
+    return this->digits(-(uint32_t)value);
+  }
+  return this->digits(value);
+}
+
+bool MQTTJsonWriter::uint(uint32_t value) {
+  return this->separator() && this->digits(value);
+}
+
+bool MQTTJsonWriter::number(float value, uint8_t decimals) {
+  if (isnan(value) || isinf(value)) {
+    return this->null();
+  }
+  if (!this->separator()) {
+    return false;
+  }
+  if (decimals > 6) {
+    decimals = 6;
+  }
+  if (value < 0) {
+    this->put('-');
+    value = -value;
+  }
+  // Too large for the integer part: scale down and add an exponent.
+  int8_t exponent = 0;
+  while (value >= 4e9f) {
+    value /= 10;
+    exponent++;
+  }
+  uint32_t scale = 1;
+  for (uint8_t i = 0; i < decimals; i++) {
+    scale *= 10;
+  }
+  uint32_t whole = value;
+  uint32_t fraction = (value - whole) * scale + 0.5f;
+  if (fraction >= scale) {
+    // rounded up into the integer part
+    whole++;
+    fraction -= scale;
+  }
+  this->digits(whole);
+  if (decimals > 0) {
+    this->put('.');
+    this->digits(fraction, decimals);
+  }
+  if (exponent > 0) {
+    this->put('e');
+    this->digits(exponent);
+  }
+  return !this->overflowed;
+}
+
+bool MQTTJsonWriter::boolean(bool value) {
+  return this->separator() && (value ? this->put("true", 4) : this->put("false", 5));
+}
+
+bool MQTTJsonWriter::null(void) {
+  return this->separator() && this->put("null", 4);
+}
+
+bool MQTTJsonWriter::raw(const char* json) {
+  return this->separator() && this->put(json, strlen(json));
+}
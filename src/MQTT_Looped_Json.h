@@ -0,0 +1,205 @@
+#ifndef MQTT_LOOPED_JSON_H
+#define MQTT_LOOPED_JSON_H
+
+#include <Arduino.h>
+
+// Deepest nesting of objects and arrays.
+#define MQTT_JSON_MAX_DEPTH 16
+
+/**
+ * @brief Writes JSON straight into a caller's buffer, e.g. the payload area of an outgoing
+ *        publish packet, taking care of commas, colons and string escaping. Numbers are
+ *        formatted without printf or String. Once something doesn't fit, further writes are
+ *        dropped and overflow() is set.
+ *
+ *        In an object, call key() before each value.
+ */
+class MQTTJsonWriter {
+  public:
+    /**
+     * @brief Constructor
+     *
+     * @param buf
+     * @param size
+     */
+    MQTTJsonWriter(uint8_t* buf, uint16_t size) : buf(buf), size(size) {}
+
+    /**
+     * @brief Start an object.
+     *
+     * @return success
+     */
+    bool beginObject(void);
+
+    /**
+     * @brief End an object.
+     *
+     * @return success
+     */
+    bool endObject(void);
+
+    /**
+     * @brief Start an array.
+     *
+     * @return success
+     */
+    bool beginArray(void);
+
+    /**
+     * @brief End an array.
+     *
+     * @return success
+     */
+    bool endArray(void);
+
+    /**
+     * @brief Write an object key.
+     *
+     * @param k
+     * @return success
+     */
+    bool key(const char* k);
+
+    /**
+     * @brief Write a string, escaped.
+     *
+     * @param s null terminated
+     * @return success
+     */
+    bool string(const char* s);
+
+    /**
+     * @brief Write a string, escaped.
+     *
+     * @param s
+     * @param len
+     * @return success
+     */
+    bool string(const char* s, uint16_t len);
+
+    /**
+     * @brief Write a signed integer.
+     *
+     * @param value
+     * @return success
+     */
+    bool integer(int32_t value);
+
+    /**
+     * @brief Write an unsigned integer.
+     *
+     * @param value
+     * @return success
+     */
+    bool uint(uint32_t value);
+
+    /**
+     * @brief Write a number with a fixed number of decimals. NaN and infinity are written as null.
+     *
+     * @param value
+     * @param decimals 0 to 6
+     * @return success
+     */
+    bool number(float value, uint8_t decimals = 2);
+
+    /**
+     * @brief Write a boolean.
+     *
+     * @param value
+     * @return success
+     */
+    bool boolean(bool value);
+
+    /**
+     * @brief Write null.
+     *
+     * @return success
+     */
+    bool null(void);
+
+    /**
+     * @brief Write a value that's already JSON, as is.
+     *
+     * @param json
+     * @return success
+     */
+    bool raw(const char* json);
+
+    /**
+     * @brief Bytes written.
+     *
+     * @return length
+     */
+    uint16_t length(void) const { return this->len; }
+
+    /**
+     * @brief Whether a write didn't fit, or objects and arrays were nested too deep.
+     *
+     * @return overflowed
+     */
+    bool overflow(void) const { return this->overflowed; }
+
+  private:
+    uint8_t* buf;
+    uint16_t size;
+    uint16_t len = 0;
+    bool overflowed = false;
+
+    /**
+     * @brief Current nesting depth.
+     */
+    uint8_t depth = 0;
+
+    /**
+     * @brief Bit per depth, set once the object or array at that depth has an item.
+     */
+    uint16_t has_items = 0;
+
+    /**
+     * @brief A key was just written, so the value takes no comma.
+     */
+    bool after_key = false;
+
+    /**
+     * @brief Append bytes, or flag an overflow.
+     *
+     * @param s
+     * @param n
+     * @return success
+     */
+    bool put(const char* s, uint16_t n);
+
+    /**
+     * @brief Append a byte, or flag an overflow.
+     *
+     * @param c
+     * @return success
+     */
+    bool put(char c) { return this->put(&c, 1); }
+
+    /**
+     * @brief Write the comma owed before the next key or value, if any.
+     *
+     * @return success
+     */
+    bool separator(void);
+
+    /**
+     * @brief Close an object or array.
+     *
+     * @param c
+     * @return success
+     */
+    bool close(char c);
+
+    /**
+     * @brief Append digits of an unsigned integer.
+     *
+     * @param value
+     * @param width minimum digits, zero padded
+     * @return success
+     */
+    bool digits(uint32_t value, uint8_t width = 1);
+};
+
+#endif
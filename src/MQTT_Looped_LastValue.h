@@ -0,0 +1,152 @@
+#ifndef MQTT_LOOPED_LAST_VALUE_H
+#define MQTT_LOOPED_LAST_VALUE_H
+
+#include <Arduino.h>
+
+// Number of topics kept in the last-value cache, a power of 2. 0 disables the cache.
+#ifndef MQTT_LAST_VALUE_SLOTS
+#define MQTT_LAST_VALUE_SLOTS 0
+#endif
+
+// Longest topic cached, including null terminator. Longer topics aren't cached.
+#ifndef MQTT_LAST_VALUE_TOPIC_LEN
+#define MQTT_LAST_VALUE_TOPIC_LEN 64
+#endif
+
+// Longest payload cached, including null terminator. Longer payloads are cut off.
+#ifndef MQTT_LAST_VALUE_PAYLOAD_LEN
+#define MQTT_LAST_VALUE_PAYLOAD_LEN 32
+#endif
+
+// Slots searched per lookup. Bounds both lookup time and which entry is evicted when full.
+#define MQTT_LAST_VALUE_PROBE 4
+
+/**
+ * @brief Last value received on a topic.
+ */
+typedef struct mqtt_last_value_t {
+  // Exact topic received, wildcards resolved.
+  char topic[MQTT_LAST_VALUE_TOPIC_LEN];
+  // Payload, null terminated.
+  uint8_t payload[MQTT_LAST_VALUE_PAYLOAD_LEN];
+  // Payload length.
+  uint16_t len;
+  // Sequence number of the last change, increasing across the cache. 0 if unused.
+  uint32_t seq;
+  // Hash of topic.
+  uint32_t hash;
+} mqtt_last_value_t;
+
+/**
+ * @brief Fixed-size cache of the last payload per topic. Open addressing with a bounded probe,
+ *        so lookups touch at most MQTT_LAST_VALUE_PROBE slots. When all probed slots are taken,
+ *        the one changed least recently is evicted.
+ */
+template<uint16_t Slots>
+class MQTTLastValueCache {
+  public:
+    /**
+     * @brief Store a value.
+     *
+     * @param topic
+     * @param topiclen
+     * @param payload
+     * @param len
+     * @return stored entry or nullptr if the topic is too long
+     */
+    const mqtt_last_value_t* put(const char* topic, uint16_t topiclen, const uint8_t* payload, uint16_t len);
+
+    /**
+     * @brief Find the value last received on topic.
+     *
+     * @param topic
+     * @return entry or nullptr
+     */
+    const mqtt_last_value_t* get(const char* topic) const;
+
+    /**
+     * @brief Sequence number of the latest change to any topic.
+     *
+     * @return seq
+     */
+    uint32_t sequence(void) const { return this->seq; }
+
+  private:
+    static_assert((Slots & (Slots - 1)) == 0, "MQTT_LAST_VALUE_SLOTS must be a power of 2");
+
+    mqtt_last_value_t entries[Slots] = {};
+    uint32_t seq = 0;
+
+    static uint32_t hash(const char* topic, uint16_t len);
+};
+
+// ------------------------------------------------------------------------------------------------
+
+template<uint16_t Slots>
+uint32_t MQTTLastValueCache<Slots>::hash(const char* topic, uint16_t len) {
+  // FNV-1a
+  uint32_t h = 2166136261UL;
+  for (uint16_t i = 0; i < len; i++) {
+    h ^= (uint8_t)topic[i];
+    h *= 16777619UL;
+  }
+  return h;
+}
+
+template<uint16_t Slots>
+const mqtt_last_value_t* MQTTLastValueCache<Slots>::put(const char* topic, uint16_t topiclen, const uint8_t* payload, uint16_t len) {
+  if (topiclen >= MQTT_LAST_VALUE_TOPIC_LEN) {
+    return nullptr;
+  }
+  if (len >= MQTT_LAST_VALUE_PAYLOAD_LEN) {
+    len = MQTT_LAST_VALUE_PAYLOAD_LEN - 1; // cut it off
+  }
+  uint32_t h = hash(topic, topiclen);
+  mqtt_last_value_t* victim = nullptr;
+  for (uint16_t i = 0; i < MQTT_LAST_VALUE_PROBE && i < Slots; i++) {
+    mqtt_last_value_t* e = &this->entries[(h + i) & (Slots - 1)];
+    if (e->seq == 0) {
+      victim = e;
+      break; // end of probe sequence
+    }
+    if (e->hash == h && strncmp(e->topic, topic, topiclen) == 0 && e->topic[topiclen] == '\0') {
+      // Only a change moves the sequence number.
+      if (e->len != len || memcmp(e->payload, payload, len) != 0) {
+        memcpy(e->payload, payload, len);
+        e->payload[len] = 0;
+        e->len = len;
+        e->seq = ++this->seq;
+      }
+      return e;
+    }
+    if (victim == nullptr || e->seq < victim->seq) {
+      victim = e;
+    }
+  }
+  memcpy(victim->topic, topic, topiclen);
+  victim->topic[topiclen] = '\0';
+  memcpy(victim->payload, payload, len);
+  victim->payload[len] = 0;
+  victim->len = len;
+  victim->hash = h;
+  victim->seq = ++this->seq;
+  return victim;
+}
+
+template<uint16_t Slots>
+const mqtt_last_value_t* MQTTLastValueCache<Slots>::get(const char* topic) const {
+  uint16_t topiclen = strlen(topic);
+  uint32_t h = hash(topic, topiclen);
+  for (uint16_t i = 0; i < MQTT_LAST_VALUE_PROBE && i < Slots; i++) {
+    const mqtt_last_value_t* e = &this->entries[(h + i) & (Slots - 1)];
+    if (e->seq == 0) {
+      return nullptr;
+    }
+    if (e->hash == h && strcmp(e->topic, topic) == 0) {
+      return e;
+    }
+  }
+  return nullptr;
+}
+
+#endif
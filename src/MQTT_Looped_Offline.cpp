@@ -0,0 +1,230 @@
+#include "MQTT_Looped_Offline.h"
+
+// Storage header: magic, capacity, head, used.
+#define MQTT_OFFLINE_MAGIC 0x4D514F31UL
+#define MQTT_OFFLINE_HEADER 16
+
+// Record header: length (2 bytes), flags, topic length.
+#define MQTT_OFFLINE_RECORD_HEADER 4
+#define MQTT_OFFLINE_FLAG_QOS 0x03
+#define MQTT_OFFLINE_FLAG_RETAIN 0x04
+#define MQTT_OFFLINE_FLAG_DEAD 0x80
+
+// -------------------------------------------- STORAGE --------------------------------------------
+
+#ifdef MQTT_STORAGE_FILE
+
+MQTTStorageFile::~MQTTStorageFile() {
+  if (this->file != nullptr) {
+    fclose(this->file);
+  }
+}
+
+bool MQTTStorageFile::open(void) {
+  if (this->file == nullptr) {
+    this->file = fopen(this->path, "r+b");
+  }
+  if (this->file == nullptr) {
+    this->file = fopen(this->path, "w+b");
+  }
+  return this->file != nullptr;
+}
+
+bool MQTTStorageFile::read(uint32_t address, uint8_t* buf, uint16_t len) {
+  if (!this->open() || fseek(this->file, address, SEEK_SET) != 0) {
+    return false;
+  }
+  // Past the end of a new file, nothing has been written yet.
+  size_t n = fread(buf, 1, len, this->file);
+  memset(buf + n, 0, len - n);
+  return true;
+}
+
+bool MQTTStorageFile::write(uint32_t address, const uint8_t* buf, uint16_t len) {
+  if (!this->open() || fseek(this->file, address, SEEK_SET) != 0) {
+    return false;
+  }
+  return fwrite(buf, 1, len, this->file) == len;
+}
+
+void MQTTStorageFile::sync(void) {
+  if (this->file != nullptr) {
+    fflush(this->file);
+  }
+}
+
+#endif
+
+// --------------------------------------------- QUEUE ---------------------------------------------
+
+void MQTTOfflineQueue::begin(MQTTStorage* storage) {
+  this->storage = storage;
+  this->head = 0;
+  this->used = 0;
+  if (storage == nullptr || storage->size() <= MQTT_OFFLINE_HEADER + MQTT_OFFLINE_RECORD_HEADER) {
+    this->storage = nullptr;
+    return;
+  }
+  this->capacity = storage->size() - MQTT_OFFLINE_HEADER;
+  uint32_t header[4];
+  if (storage->read(0, (uint8_t*)header, sizeof(header)) && header[0] == MQTT_OFFLINE_MAGIC
+      && header[1] == this->capacity && header[2] < this->capacity && header[3] <= this->capacity) {
+    this->head = header[2];
+    this->used = header[3];
+    return;
+  }
+  this->save();
+}
+
+void MQTTOfflineQueue::clear(void) {
+  this->head = 0;
+  this->used = 0;
+  if (this->storage != nullptr) {
+    this->save();
+  }
+}
+
+void MQTTOfflineQueue::save(void) {
+  uint32_t header[4] = { MQTT_OFFLINE_MAGIC, this->capacity, this->head, this->used };
+  this->storage->write(0, (const uint8_t*)header, sizeof(header));
+  this->storage->sync();
+}
+
+bool MQTTOfflineQueue::ringRead(uint32_t pos, uint8_t* buf, uint16_t len) {
+  pos %= this->capacity;
+  uint32_t first = this->capacity - pos < len ? this->capacity - pos : len;
+  if (!this->storage->read(MQTT_OFFLINE_HEADER + pos, buf, first)) {
+    return false;
+  }
+  return first == len || this->storage->read(MQTT_OFFLINE_HEADER, buf + first, len - first);
+}
+
+bool MQTTOfflineQueue::ringWrite(uint32_t pos, const uint8_t* buf, uint16_t len) {
+  pos %= this->capacity;
+  uint32_t first = this->capacity - pos < len ? this->capacity - pos : len;
+  if (!this->storage->write(MQTT_OFFLINE_HEADER + pos, buf, first)) {
+    return false;
+  }
+  return first == len || this->storage->write(MQTT_OFFLINE_HEADER, buf + first, len - first);
+}
+
+void MQTTOfflineQueue::compact(const char* topic, uint8_t topiclen) {
+  uint32_t pos = this->head;
+  uint32_t left = this->used;
+  while (left >= MQTT_OFFLINE_RECORD_HEADER) {
+    uint8_t h[MQTT_OFFLINE_RECORD_HEADER];
+    if (!this->ringRead(pos, h, sizeof(h))) {
+      return;
+    }
+    uint16_t len = h[0] | h[1] << 8;
+    if (len < MQTT_OFFLINE_RECORD_HEADER || len > left) {
+      return;
+    }
+    if (!(h[2] & MQTT_OFFLINE_FLAG_DEAD) && h[3] == topiclen) {
+      char t[MQTT_OFFLINE_TOPIC_LEN];
+      if (this->ringRead(pos + MQTT_OFFLINE_RECORD_HEADER, (uint8_t*)t, topiclen) && memcmp(t, topic, topiclen) == 0) {
+        uint8_t flags = h[2] | MQTT_OFFLINE_FLAG_DEAD;
+        this->ringWrite(pos + 2, &flags, 1);
+        this->stats.compacted++;
+      }
+    }
+    pos += len;
+    left -= len;
+  }
+}
+
+bool MQTTOfflineQueue::push(const char* topic, uint8_t topiclen, const uint8_t* payload, uint16_t len, uint8_t qos, bool retain, bool compact) {
+  uint32_t reclen = (uint32_t)MQTT_OFFLINE_RECORD_HEADER + topiclen + len;
+  if (this->storage == nullptr || topiclen >= MQTT_OFFLINE_TOPIC_LEN || reclen > this->capacity || reclen > 0xFFFF) {
+    this->stats.dropped++;
+    return false;
+  }
+  if (compact) {
+    this->compact(topic, topiclen);
+  }
+  // Push out the oldest records until it fits.
+  while (this->capacity - this->used < reclen) {
+    uint8_t h[MQTT_OFFLINE_RECORD_HEADER];
+    uint16_t oldest = 0;
+    if (this->ringRead(this->head, h, sizeof(h))) {
+      oldest = h[0] | h[1] << 8;
+    }
+    if (oldest < MQTT_OFFLINE_RECORD_HEADER || oldest > this->used) {
+      // Unreadable, start over.
+      this->head = 0;
+      this->used = 0;
+      break;
+    }
+    if (!(h[2] & MQTT_OFFLINE_FLAG_DEAD)) {
+      this->stats.dropped++;
+    }
+    this->head = (this->head + oldest) % this->capacity;
+    this->used -= oldest;
+  }
+  uint8_t h[MQTT_OFFLINE_RECORD_HEADER] = {
+    (uint8_t)(reclen & 0xFF),
+    (uint8_t)(reclen >> 8),
+    (uint8_t)((qos & MQTT_OFFLINE_FLAG_QOS) | (retain ? MQTT_OFFLINE_FLAG_RETAIN : 0)),
+    topiclen,
+  };
+  uint32_t pos = this->head + this->used;
+  if (!this->ringWrite(pos, h, sizeof(h))
+      || !this->ringWrite(pos + sizeof(h), (const uint8_t*)topic, topiclen)
+      || !this->ringWrite(pos + sizeof(h) + topiclen, payload, len)) {
+    this->stats.dropped++;
+    return false;
+  }
+  this->used += reclen;
+  this->save();
+  this->stats.stored++;
+  return true;
+}
+
+bool MQTTOfflineQueue::front(mqtt_offline_record_t* rec) {
+  while (this->storage != nullptr && this->used >= MQTT_OFFLINE_RECORD_HEADER) {
+    uint8_t h[MQTT_OFFLINE_RECORD_HEADER];
+    if (!this->ringRead(this->head, h, sizeof(h))) {
+      return false;
+    }
+    uint16_t len = h[0] | h[1] << 8;
+    if (len < MQTT_OFFLINE_RECORD_HEADER + h[3] || len > this->used || h[3] >= MQTT_OFFLINE_TOPIC_LEN) {
+      // Corrupt, nothing after this can be trusted.
+      this->clear();
+      return false;
+    }
+    if (h[2] & MQTT_OFFLINE_FLAG_DEAD) {
+      this->pop();
+      continue;
+    }
+    if (!this->ringRead(this->head + MQTT_OFFLINE_RECORD_HEADER, (uint8_t*)rec->topic, h[3])) {
+      return false;
+    }
+    rec->topic[h[3]] = '\0';
+    rec->topiclen = h[3];
+    rec->len = len - MQTT_OFFLINE_RECORD_HEADER - h[3];
+    rec->qos = h[2] & MQTT_OFFLINE_FLAG_QOS;
+    rec->retain = h[2] & MQTT_OFFLINE_FLAG_RETAIN;
+    rec->payload_at = this->head + MQTT_OFFLINE_RECORD_HEADER + h[3];
+    return true;
+  }
+  return false;
+}
+
+bool MQTTOfflineQueue::readPayload(const mqtt_offline_record_t& rec, uint8_t* buf) {
+  return this->ringRead(rec.payload_at, buf, rec.len);
+}
+
+void MQTTOfflineQueue::pop(void) {
+  uint8_t h[MQTT_OFFLINE_RECORD_HEADER];
+  if (this->used < MQTT_OFFLINE_RECORD_HEADER || !this->ringRead(this->head, h, sizeof(h))) {
+    return;
+  }
+  uint16_t len = h[0] | h[1] << 8;
+  if (len < MQTT_OFFLINE_RECORD_HEADER || len > this->used) {
+    this->clear();
+    return;
+  }
+  this->head = (this->head + len) % this->capacity;
+  this->used -= len;
+  this->save();
+}
@@ -0,0 +1,287 @@
+#ifndef MQTT_LOOPED_OFFLINE_H
+#define MQTT_LOOPED_OFFLINE_H
+
+#include <Arduino.h>
+
+// Longest topic stored while offline, including null terminator. Longer topics are dropped.
+#ifndef MQTT_OFFLINE_TOPIC_LEN
+#define MQTT_OFFLINE_TOPIC_LEN 64
+#endif
+
+// Time between stored publishes replayed once back online.
+#ifndef MQTT_OFFLINE_REPLAY_INTERVAL
+#define MQTT_OFFLINE_REPLAY_INTERVAL 100
+#endif
+
+// -------------------------------------------- TYPEDEF --------------------------------------------
+
+/**
+ * @brief Counters of publishes captured while offline.
+ */
+typedef struct mqtt_offline_stats_t {
+  // Stored while offline.
+  uint32_t stored;
+  // Stored values replaced by a newer value on the same compacted topic.
+  uint32_t compacted;
+  // Oldest publishes pushed out to make room, or too large to store at all.
+  uint32_t dropped;
+  // Sent once back online.
+  uint32_t replayed;
+} mqtt_offline_stats_t;
+
+/**
+ * @brief Oldest publish in the store, as read by MQTTOfflineQueue::front().
+ */
+typedef struct mqtt_offline_record_t {
+  char topic[MQTT_OFFLINE_TOPIC_LEN];
+  uint8_t topiclen;
+  uint16_t len;
+  uint8_t qos;
+  bool retain;
+  // Where the payload starts in the store.
+  uint32_t payload_at;
+} mqtt_offline_record_t;
+
+// -------------------------------------------- STORAGE --------------------------------------------
+
+/**
+ * @brief Byte addressable region publishes are stored in while offline: RAM or a file.
+ *        Addresses run from 0 to size() - 1 and are never read or written past the end.
+ *
+ *        Bytes are rewritten in place, the queue's header on every push and pop, so raw flash,
+ *        which has to be erased first, and EEPROM, which wears out, need a file system such as
+ *        LittleFS on top that spreads the writes out.
+ */
+class MQTTStorage {
+  public:
+    virtual ~MQTTStorage() {}
+
+    /**
+     * @brief Size of the region in bytes.
+     *
+     * @return size
+     */
+    virtual uint32_t size(void) = 0;
+
+    /**
+     * @brief Read bytes. Bytes never written may read as anything.
+     *
+     * @param address
+     * @param buf
+     * @param len
+     * @return success
+     */
+    virtual bool read(uint32_t address, uint8_t* buf, uint16_t len) = 0;
+
+    /**
+     * @brief Write bytes.
+     *
+     * @param address
+     * @param buf
+     * @param len
+     * @return success
+     */
+    virtual bool write(uint32_t address, const uint8_t* buf, uint16_t len) = 0;
+
+    /**
+     * @brief Make what's been written so far survive a reset, if the region can.
+     */
+    virtual void sync(void) {}
+};
+
+/**
+ * @brief Storage in RAM, lost on reset.
+ *
+ * @tparam Size bytes
+ */
+template<uint32_t Size>
+class MQTTStorageRam : public MQTTStorage {
+  public:
+    uint32_t size(void) override { return Size; }
+
+    bool read(uint32_t address, uint8_t* buf, uint16_t len) override {
+      memcpy(buf, this->data + address, len);
+      return true;
+    }
+
+    bool write(uint32_t address, const uint8_t* buf, uint16_t len) override {
+      memcpy(this->data + address, buf, len);
+      return true;
+    }
+
+  private:
+    uint8_t data[Size] = {};
+};
+
+#if defined(ARDUINO_ARCH_ESP32) || defined(__linux__) || defined(__APPLE__)
+#define MQTT_STORAGE_FILE
+#include <stdio.h>
+
+/**
+ * @brief Storage in a file, kept across resets. Works with any file system mounted in the VFS,
+ *        e.g. SPIFFS or LittleFS on ESP32, or a regular file on host builds.
+ */
+class MQTTStorageFile : public MQTTStorage {
+  public:
+    /**
+     * @brief Constructor
+     *
+     * @param path kept as a pointer, the file is created on first use
+     * @param size bytes
+     */
+    MQTTStorageFile(const char* path, uint32_t size) : path(path), bytes(size) {}
+    ~MQTTStorageFile();
+
+    uint32_t size(void) override { return this->bytes; }
+    bool read(uint32_t address, uint8_t* buf, uint16_t len) override;
+    bool write(uint32_t address, const uint8_t* buf, uint16_t len) override;
+    void sync(void) override;
+
+  private:
+    const char* path;
+    uint32_t bytes;
+    FILE* file = nullptr;
+
+    /**
+     * @brief Open the file, creating it if need be.
+     *
+     * @return success
+     */
+    bool open(void);
+};
+#endif
+
+// --------------------------------------------- QUEUE ---------------------------------------------
+
+/**
+ * @brief Ring of publishes in an MQTTStorage, oldest first. When full, the oldest publishes
+ *        are pushed out to make room. Where the ring starts and how much of it is in use are
+ *        kept in the storage too, so a persistent storage picks up where it left off after a
+ *        reset.
+ *
+ *        Each record is a 4 byte header (length, flags, topic length), the topic, and the
+ *        payload. Records replaced by compaction are flagged dead in place and skipped.
+ */
+class MQTTOfflineQueue {
+  public:
+    /**
+     * @brief Counters.
+     */
+    mqtt_offline_stats_t stats = {};
+
+    /**
+     * @brief Start using a storage, picking up what it holds, or clearing it if it holds
+     *        nothing valid.
+     *
+     * @param storage or nullptr to stop storing
+     */
+    void begin(MQTTStorage* storage);
+
+    /**
+     * @brief Whether there's a storage to use.
+     *
+     * @return enabled
+     */
+    bool enabled(void) const { return this->storage != nullptr; }
+
+    /**
+     * @brief Whether nothing is stored.
+     *
+     * @return empty
+     */
+    bool empty(void) const { return this->used == 0; }
+
+    /**
+     * @brief Store a publish, pushing out the oldest ones if need be.
+     *
+     * @param topic
+     * @param topiclen
+     * @param payload
+     * @param len
+     * @param qos
+     * @param retain
+     * @param compact drop values already stored for the same topic
+     * @return stored
+     */
+    bool push(const char* topic, uint8_t topiclen, const uint8_t* payload, uint16_t len, uint8_t qos, bool retain, bool compact);
+
+    /**
+     * @brief Read the oldest publish, leaving it stored.
+     *
+     * @param rec
+     * @return a publish is stored
+     */
+    bool front(mqtt_offline_record_t* rec);
+
+    /**
+     * @brief Read the payload of the publish read by front().
+     *
+     * @param rec
+     * @param buf at least rec.len bytes
+     * @return success
+     */
+    bool readPayload(const mqtt_offline_record_t& rec, uint8_t* buf);
+
+    /**
+     * @brief Remove the oldest publish.
+     */
+    void pop(void);
+
+    /**
+     * @brief Remove everything.
+     */
+    void clear(void);
+
+  private:
+    MQTTStorage* storage = nullptr;
+
+    /**
+     * @brief Bytes of the storage records can use, after the header.
+     */
+    uint32_t capacity = 0;
+
+    /**
+     * @brief Position of the oldest record in the ring.
+     */
+    uint32_t head = 0;
+
+    /**
+     * @brief Bytes of the ring in use, from head on.
+     */
+    uint32_t used = 0;
+
+    /**
+     * @brief Read from the ring, wrapping around its end.
+     *
+     * @param pos
+     * @param buf
+     * @param len
+     * @return success
+     */
+    bool ringRead(uint32_t pos, uint8_t* buf, uint16_t len);
+
+    /**
+     * @brief Write to the ring, wrapping around its end.
+     *
+     * @param pos
+     * @param buf
+     * @param len
+     * @return success
+     */
+    bool ringWrite(uint32_t pos, const uint8_t* buf, uint16_t len);
+
+    /**
+     * @brief Save head and used to the storage.
+     */
+    void save(void);
+
+    /**
+     * @brief Flag records for a topic dead.
+     *
+     * @param topic
+     * @param topiclen
+     */
+    void compact(const char* topic, uint8_t topiclen);
+};
+
+#endif
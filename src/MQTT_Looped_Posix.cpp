@@ -0,0 +1,134 @@
+#include "MQTT_Looped.h"
+
+#ifdef MQTT_LOOPED_POSIX
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+MQTTTransportPosix::~MQTTTransportPosix() {
+  this->close();
+}
+
+bool MQTTTransportPosix::connect(IPAddress address, uint16_t port) {
+  this->sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (this->sock < 0) {
+    this->sock = -1;
+    return false;
+  }
+  fcntl(this->sock, F_SETFL, fcntl(this->sock, F_GETFL, 0) | O_NONBLOCK);
+  int one = 1;
+  setsockopt(this->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  // IPAddress stores octets in network order.
+  addr.sin_addr.s_addr = uint32_t(address);
+  if (::connect(this->sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+    DEBUG_PRINT(F("connect() failed: "));
+    DEBUG_PRINTLN(errno);
+    ::close(this->sock);
+    this->sock = -1;
+    return false;
+  }
+  DEBUG_PRINT(F("Connecting on fd "));
+  DEBUG_PRINTLN(this->sock);
+  this->state = MQTT_POSIX_CONNECTING;
+  return true;
+}
+
+bool MQTTTransportPosix::connected(void) {
+  if (this->sock < 0) {
+    return false;
+  }
+  if (this->state == MQTT_POSIX_CONNECTING) {
+    // Poll for the non-blocking connect to finish.
+    fd_set wfds;
+    FD_ZERO(&wfds);
+    FD_SET(this->sock, &wfds);
+    struct timeval tv = { 0, 0 };
+    if (select(this->sock + 1, nullptr, &wfds, nullptr, &tv) <= 0) {
+      return false;
+    }
+    int err = 0;
+    socklen_t errlen = sizeof(err);
+    getsockopt(this->sock, SOL_SOCKET, SO_ERROR, &err, &errlen);
+    this->state = err == 0 ? MQTT_POSIX_ESTABLISHED : MQTT_POSIX_FAILED;
+  }
+  return this->state == MQTT_POSIX_ESTABLISHED;
+}
+
+uint8_t MQTTTransportPosix::status(void) {
+  return this->state;
+}
+
+int MQTTTransportPosix::available(void) {
+  if (this->state != MQTT_POSIX_ESTABLISHED) {
+    return 0;
+  }
+  int count = 0;
+  if (ioctl(this->sock, FIONREAD, &count) < 0) {
+    return 0;
+  }
+  return count;
+}
+
+int MQTTTransportPosix::read(uint8_t* buf, size_t len) {
+  if (this->state != MQTT_POSIX_ESTABLISHED) {
+    return -1;
+  }
+  ssize_t n = recv(this->sock, buf, len, 0);
+  if (n > 0) {
+    return n;
+  }
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return 0;
+  }
+  // Orderly shutdown by the peer or a socket error.
+  this->state = MQTT_POSIX_FAILED;
+  return -1;
+}
+
+size_t MQTTTransportPosix::write(const uint8_t* buf, size_t len) {
+  if (this->state != MQTT_POSIX_ESTABLISHED) {
+    return 0;
+  }
+  ssize_t n = send(this->sock, buf, len, MSG_NOSIGNAL);
+  if (n >= 0) {
+    return n;
+  }
+  if (errno != EAGAIN && errno != EWOULDBLOCK) {
+    this->state = MQTT_POSIX_FAILED;
+  }
+  return 0;
+}
+
+bool MQTTTransportPosix::isOpen(void) {
+  return this->sock >= 0;
+}
+
+void MQTTTransportPosix::close(void) {
+  if (this->sock >= 0) {
+    ::close(this->sock);
+    this->sock = -1;
+  }
+  this->state = MQTT_POSIX_CLOSED;
+}
+
+bool MQTTTransportPosix::closed(void) {
+  // close() releases the descriptor immediately; the stack finishes the shutdown.
+  return this->sock < 0;
+}
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef MQTT_LOOPED_POSIX_H
+#define MQTT_LOOPED_POSIX_H
+
+#include "MQTT_Looped_Transport.h"
+
+/**
+ * @brief Connection states reported by MQTTTransportPosix::status().
+ */
+typedef enum {
+  MQTT_POSIX_CLOSED = 0,
+  MQTT_POSIX_CONNECTING = 1,
+  MQTT_POSIX_ESTABLISHED = 2,
+  MQTT_POSIX_FAILED = 3,
+} mqtt_posix_state_t;
+
+/**
+ * @brief Transport over a non-blocking BSD socket. Works with lwIP on ESP32 and with the
+ *        native stack on Linux and macOS. The network link is assumed to be managed elsewhere
+ *        (e.g. WiFi.begin() on ESP32), so the link is always reported as up.
+ */
+class MQTTTransportPosix : public MQTTTransport {
+  public:
+    MQTTTransportPosix(void) {}
+    ~MQTTTransportPosix();
+
+    bool connect(IPAddress address, uint16_t port) override;
+    bool connected(void) override;
+    uint8_t status(void) override;
+    int available(void) override;
+    int read(uint8_t* buf, size_t len) override;
+    size_t write(const uint8_t* buf, size_t len) override;
+    bool isOpen(void) override;
+    void close(void) override;
+    bool closed(void) override;
+
+    /**
+     * @brief The socket file descriptor, -1 if none, for use with select()/poll().
+     *
+     * @return fd
+     */
+    int fd(void) { return this->sock; }
+
+  private:
+    /**
+     * @brief Socket file descriptor.
+     */
+    int sock = -1;
+
+    /**
+     * @brief Connection state.
+     */
+    mqtt_posix_state_t state = MQTT_POSIX_CLOSED;
+};
+
+#endif
@@ -0,0 +1,256 @@
+#ifndef MQTT_LOOPED_RING_H
+#define MQTT_LOOPED_RING_H
+
+#include <Arduino.h>
+
+// Functions safe to call from interrupt handlers, kept in RAM on boards that run code from flash
+// that can be unavailable while an interrupt is handled.
+#if defined(ARDUINO_ARCH_ESP32) || defined(ARDUINO_ARCH_ESP8266)
+#define MQTT_ISR_ATTR IRAM_ATTR
+#else
+#define MQTT_ISR_ATTR
+#endif
+
+#if __has_include(<atomic>)
+#include <atomic>
+
+// Whether 32 bit atomics are lock-free, so safe to use from interrupt handlers. Cores without
+// atomic instructions, e.g. Cortex-M0 or the ESP8266, emulate them with a lock or by turning
+// interrupts off.
+#if ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LONG_LOCK_FREE == 2
+#define MQTT_ATOMIC_LOCK_FREE 1
+#else
+#define MQTT_ATOMIC_LOCK_FREE 0
+#endif
+
+/**
+ * @brief Lock-free ring of variable length records between one producer and one consumer, e.g.
+ *        two threads or two cores. Records are stored whole, never split across the end, so
+ *        both sides work on them in place.
+ *
+ *        Each record is a 2 byte length and its bytes. When a record doesn't fit before the end,
+ *        a 0xFFFF marker sends the consumer back to the start.
+ *
+ * @tparam Size bytes
+ */
+template<uint16_t Size>
+class MQTTSpscRing {
+  static_assert(Size > 2 && Size < 0xFFFF, "ring size out of range");
+
+  public:
+    /**
+     * @brief Producer: make room for a record. Nothing is visible to the consumer until
+     *        commit().
+     *
+     * @param len
+     * @return where to write the record, nullptr if full
+     */
+    uint8_t* reserve(uint16_t len) {
+      uint32_t need = (uint32_t)len + 2;
+      uint32_t h = this->head.load(std::memory_order_relaxed);
+      uint32_t t = this->tail.load(std::memory_order_acquire);
+      uint32_t at;
+      // Head catching up to tail would look empty, so there's always a byte between them.
+      if (h >= t) {
+        if (Size - h > need || (Size - h == need && t != 0)) {
+          at = h;
+        } else if (t > need) {
+          if (Size - h >= 2) {
+            this->data[h] = 0xFF;
+            this->data[h + 1] = 0xFF;
+          }
+          at = 0;
+        } else {
+          return nullptr;
+        }
+      } else if (t - h > need) {
+        at = h;
+      } else {
+        return nullptr;
+      }
+      this->data[at] = len & 0xFF;
+      this->data[at + 1] = len >> 8;
+      this->reserved = (at + need) % Size;
+      return this->data + at + 2;
+    }
+
+    /**
+     * @brief Producer: hand the reserved record to the consumer.
+     */
+    void commit(void) {
+      this->head.store(this->reserved, std::memory_order_release);
+    }
+
+    /**
+     * @brief Consumer: oldest record, left in the ring until pop().
+     *
+     * @param len
+     * @return record or nullptr if empty
+     */
+    uint8_t* front(uint16_t* len) {
+      uint32_t t = this->tail.load(std::memory_order_relaxed);
+      uint32_t h = this->head.load(std::memory_order_acquire);
+      if (t == h) {
+        return nullptr;
+      }
+      if (Size - t < 2 || (this->data[t] == 0xFF && this->data[t + 1] == 0xFF)) {
+        t = 0;
+        this->tail.store(0, std::memory_order_release);
+      }
+      *len = this->data[t] | this->data[t + 1] << 8;
+      return this->data + t + 2;
+    }
+
+    /**
+     * @brief Consumer: drop the record read by front().
+     */
+    void pop(void) {
+      uint32_t t = this->tail.load(std::memory_order_relaxed);
+      uint32_t len = this->data[t] | this->data[t + 1] << 8;
+      this->tail.store((t + 2 + len) % Size, std::memory_order_release);
+    }
+
+    /**
+     * @brief Whether there are no records, as last seen by the caller.
+     *
+     * @return empty
+     */
+    bool empty(void) const {
+      return this->head.load(std::memory_order_acquire) == this->tail.load(std::memory_order_acquire);
+    }
+
+  private:
+    /**
+     * @brief Where the producer writes next, written by the producer only.
+     */
+    std::atomic<uint32_t> head{0};
+
+    /**
+     * @brief Where the consumer reads next, written by the consumer only.
+     */
+    std::atomic<uint32_t> tail{0};
+
+    /**
+     * @brief Head after the reserved record, producer only.
+     */
+    uint32_t reserved = 0;
+
+    uint8_t data[Size];
+};
+
+/**
+ * @brief Lock-free queue of fixed size slots between any number of producers, e.g. interrupt
+ *        handlers and other tasks, and one consumer. A producer claims a slot with a single
+ *        compare-and-swap and never waits on the others or the consumer; when every slot is
+ *        taken, it's turned away.
+ *
+ *        Each slot has a sequence number saying whose turn it is: a producer's when it equals
+ *        the claim position, the consumer's when it's one past it.
+ *
+ * @tparam T slot contents
+ * @tparam Size slots, a power of 2
+ */
+template<typename T, uint16_t Size>
+class MQTTMpscQueue {
+  static_assert(Size > 0 && (Size & (Size - 1)) == 0, "queue size must be a power of 2");
+#ifdef __cpp_lib_atomic_is_always_lock_free
+  static_assert(std::atomic<uint32_t>::is_always_lock_free, "producers can be interrupt handlers, which need lock-free atomics");
+#endif
+
+  public:
+    MQTTMpscQueue() {
+      for (uint16_t i = 0; i < Size; i++) {
+        this->slots[i].seq.store(i, std::memory_order_relaxed);
+      }
+    }
+
+    /**
+     * @brief Producer: claim a slot. Nothing is visible to the consumer until commit().
+     *
+     * @param ticket to pass to commit()
+     * @return slot to fill, nullptr if full
+     */
+    MQTT_ISR_ATTR T* reserve(uint32_t* ticket) {
+      uint32_t pos = this->claim.load(std::memory_order_relaxed);
+      while (true) {
+        slot_t* s = &this->slots[pos & (Size - 1)];
+        int32_t diff = (int32_t)(s->seq.load(std::memory_order_acquire) - pos);
+        if (diff == 0) {
+          // On failure pos is reloaded, try again from there.
+          if (this->claim.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+            *ticket = pos;
+            return &s->item;
+          }
+        } else if (diff < 0) {
+          this->full.fetch_add(1, std::memory_order_relaxed);
+          return nullptr;
+        } else {
+          pos = this->claim.load(std::memory_order_relaxed);
+        }
+      }
+    }
+
+    /**
+     * @brief Producer: hand the filled slot to the consumer.
+     *
+     * @param ticket from reserve()
+     */
+    MQTT_ISR_ATTR void commit(uint32_t ticket) {
+      this->slots[ticket & (Size - 1)].seq.store(ticket + 1, std::memory_order_release);
+    }
+
+    /**
+     * @brief Consumer: oldest slot, left in the queue until pop(). A slot claimed but not yet
+     *        committed holds up the ones behind it.
+     *
+     * @return slot or nullptr if empty
+     */
+    T* front(void) {
+      slot_t* s = &this->slots[this->next & (Size - 1)];
+      if (s->seq.load(std::memory_order_acquire) != this->next + 1) {
+        return nullptr;
+      }
+      return &s->item;
+    }
+
+    /**
+     * @brief Consumer: free the slot read by front() for producers.
+     */
+    void pop(void) {
+      this->slots[this->next & (Size - 1)].seq.store(this->next + Size, std::memory_order_release);
+      this->next++;
+    }
+
+    /**
+     * @brief Producers turned away because the queue was full.
+     *
+     * @return count
+     */
+    uint32_t dropped(void) const {
+      return this->full.load(std::memory_order_relaxed);
+    }
+
+  private:
+    typedef struct slot_t {
+      std::atomic<uint32_t> seq;
+      T item;
+    } slot_t;
+
+    slot_t slots[Size];
+
+    /**
+     * @brief Next position to claim, shared by the producers.
+     */
+    std::atomic<uint32_t> claim{0};
+
+    /**
+     * @brief Next position to read, consumer only.
+     */
+    uint32_t next = 0;
+
+    std::atomic<uint32_t> full{0};
+};
+
+#endif
+
+#endif
@@ -0,0 +1,210 @@
+#ifndef MQTT_LOOPED_STATIC_H
+#define MQTT_LOOPED_STATIC_H
+
+#include <Arduino.h>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Keep subscriptions, discoveries, brokers, topic options and registered topics in fixed storage
+// inside MQTT_Looped instead of on the heap, so nothing is allocated after setup. Each has a
+// capacity below, and registering more than it holds fails.
+#ifndef MQTT_STATIC_ALLOC
+#define MQTT_STATIC_ALLOC 0
+#endif
+
+#if MQTT_STATIC_ALLOC
+
+// Most subscriptions, see subscribe().
+#ifndef MQTT_MAX_SUBSCRIPTIONS
+#define MQTT_MAX_SUBSCRIPTIONS 8
+#endif
+
+// Most discoveries, see addDiscovery().
+#ifndef MQTT_MAX_DISCOVERIES
+#define MQTT_MAX_DISCOVERIES 8
+#endif
+
+// Most broker endpoints, see addBroker().
+#ifndef MQTT_MAX_BROKERS
+#define MQTT_MAX_BROKERS 2
+#endif
+
+// Most topics with a rate limit, change filter or offline compaction.
+#ifndef MQTT_MAX_TOPIC_OPTIONS
+#define MQTT_MAX_TOPIC_OPTIONS 8
+#endif
+
+// Most registered topics, see registerTopic().
+#ifndef MQTT_MAX_TOPICS
+#define MQTT_MAX_TOPICS 8
+#endif
+
+// Longest registered topic, including null terminator.
+#ifndef MQTT_MAX_TOPIC_LEN
+#define MQTT_MAX_TOPIC_LEN 64
+#endif
+
+#else
+
+// Capacities only apply with MQTT_STATIC_ALLOC.
+#define MQTT_MAX_SUBSCRIPTIONS 0
+#define MQTT_MAX_DISCOVERIES 0
+#define MQTT_MAX_BROKERS 0
+#define MQTT_MAX_TOPIC_OPTIONS 0
+#define MQTT_MAX_TOPICS 0
+
+#endif
+
+/**
+ * @brief List of up to N items. With MQTT_STATIC_ALLOC the items are stored inline and adding
+ *        one to a full list fails, else it's a std::vector and N is ignored.
+ *
+ * @tparam T item, copied in
+ * @tparam N capacity
+ */
+template<typename T, uint16_t N>
+class MQTTList {
+  public:
+    /**
+     * @brief Add an item at the end.
+     *
+     * @param item
+     * @return added, false if full
+     */
+    bool push_back(const T& item) {
+#if MQTT_STATIC_ALLOC
+      if (this->count >= N) {
+        return false;
+      }
+      this->items[this->count++] = item;
+#else
+      this->items.push_back(item);
+#endif
+      return true;
+    }
+
+    /**
+     * @brief Remove an item, moving the ones after it down.
+     *
+     * @param i
+     */
+    void erase(uint16_t i) {
+#if MQTT_STATIC_ALLOC
+      for (; i + 1 < this->count; i++) {
+        this->items[i] = this->items[i + 1];
+      }
+      this->count--;
+#else
+      this->items.erase(this->items.begin() + i);
+#endif
+    }
+
+    /**
+     * @brief Number of items.
+     *
+     * @return size
+     */
+    uint16_t size(void) const {
+#if MQTT_STATIC_ALLOC
+      return this->count;
+#else
+      return this->items.size();
+#endif
+    }
+
+    /**
+     * @brief Whether another item can be added.
+     *
+     * @return full
+     */
+    bool full(void) const {
+#if MQTT_STATIC_ALLOC
+      return this->count >= N;
+#else
+      return false;
+#endif
+    }
+
+    T& at(uint16_t i) { return this->begin()[i]; }
+    T& operator[](uint16_t i) { return this->begin()[i]; }
+    const T& operator[](uint16_t i) const { return this->begin()[i]; }
+    T& back(void) { return this->begin()[this->size() - 1]; }
+
+#if MQTT_STATIC_ALLOC
+    T* begin(void) { return this->items; }
+    const T* begin(void) const { return this->items; }
+#else
+    T* begin(void) { return this->items.data(); }
+    const T* begin(void) const { return this->items.data(); }
+#endif
+    T* end(void) { return this->begin() + this->size(); }
+    const T* end(void) const { return this->begin() + this->size(); }
+
+  private:
+#if MQTT_STATIC_ALLOC
+    T items[N] = {};
+    uint16_t count = 0;
+#else
+    std::vector<T> items;
+#endif
+};
+
+/**
+ * @brief Where long lived objects come from. With MQTT_STATIC_ALLOC they take one of N inline
+ *        slots, else they're allocated with new and N is ignored.
+ *
+ * @tparam T
+ * @tparam N capacity
+ */
+template<typename T, uint16_t N>
+class MQTTPool {
+  public:
+    /**
+     * @brief Construct an object.
+     *
+     * @param args constructor arguments, or members of an aggregate
+     * @return object or nullptr if the pool is full
+     */
+    template<typename... Args>
+    T* create(Args&&... args) {
+#if MQTT_STATIC_ALLOC
+      for (auto & slot : this->slots) {
+        if (!slot.used) {
+          slot.used = true;
+          return new (slot.bytes) T{std::forward<Args>(args)...};
+        }
+      }
+      return nullptr;
+#else
+      return new T{std::forward<Args>(args)...};
+#endif
+    }
+
+    /**
+     * @brief Destroy an object made by create(), freeing its slot.
+     *
+     * @param item
+     */
+    void destroy(T* item) {
+#if MQTT_STATIC_ALLOC
+      item->~T();
+      // The object is at the start of its slot.
+      ((slot_t*)item)->used = false;
+#else
+      delete item;
+#endif
+    }
+
+  private:
+#if MQTT_STATIC_ALLOC
+    typedef struct slot_t {
+      alignas(T) uint8_t bytes[sizeof(T)];
+      bool used;
+    } slot_t;
+
+    slot_t slots[N] = {};
+#endif
+};
+
+#endif
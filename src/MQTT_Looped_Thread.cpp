@@ -0,0 +1,162 @@
+#include "MQTT_Looped_Thread.h"
+
+#if MQTT_THREADED
+
+// Publish record flags.
+#define MQTT_THREAD_FLAG_QOS 0x03
+#define MQTT_THREAD_FLAG_RETAIN 0x04
+
+MQTTThreaded::~MQTTThreaded() {
+#if defined(__linux__) || defined(__APPLE__)
+  this->stop();
+#endif
+}
+
+// ------------------------------------------ APPLICATION ------------------------------------------
+
+bool MQTTThreaded::onMqtt(const char* topic, mqttcallback_t callback, uint8_t qos) {
+  uint8_t handler = this->handlers.size();
+  if (handler == 0xFF || !this->handlers.push_back(callback)) {
+    return false;
+  }
+  return this->mqtt->subscribe(topic, [this, handler](char* payload, uint16_t len) {
+    this->receive(handler, payload, len);
+  }, qos);
+}
+
+bool MQTTThreaded::publish(const char* topic, const uint8_t* payload, uint16_t len, bool retain, uint8_t qos) {
+  size_t topiclen = strlen(topic);
+  uint8_t* rec = nullptr;
+  if (topiclen < 0xFF && (uint32_t)len + topiclen + 3 < MQTT_THREAD_OUT_RING) {
+    rec = this->out.reserve(len + topiclen + 3);
+  }
+  if (rec == nullptr) {
+    this->queue_full.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  rec[0] = (qos & MQTT_THREAD_FLAG_QOS) | (retain ? MQTT_THREAD_FLAG_RETAIN : 0);
+  rec[1] = topiclen;
+  memcpy(rec + 2, topic, topiclen + 1);
+  memcpy(rec + 3 + topiclen, payload, len);
+  this->out.commit();
+  this->queued.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+bool MQTTThreaded::publish(const char* topic, const char* payload, bool retain, uint8_t qos) {
+  return this->publish(topic, (const uint8_t*)payload, strlen(payload), retain, qos);
+}
+
+void MQTTThreaded::begin(void) {
+  this->started.store(true, std::memory_order_release);
+}
+
+uint16_t MQTTThreaded::poll(uint16_t max) {
+  uint16_t handled = 0;
+  uint16_t len;
+  uint8_t* rec;
+  while (handled < max && (rec = this->in.front(&len)) != nullptr) {
+    // Handled in place, the ring keeps the record until the callback returns.
+    if (rec[0] < this->handlers.size()) {
+      this->handlers[rec[0]]((char*)rec + 1, len - 2);
+    }
+    this->in.pop();
+    handled++;
+  }
+  return handled;
+}
+
+void MQTTThreaded::getStats(mqtt_thread_stats_t* stats) {
+  *stats = {
+    .queued = this->queued.load(std::memory_order_relaxed),
+    .queue_full = this->queue_full.load(std::memory_order_relaxed),
+    .sent = this->sent.load(std::memory_order_relaxed),
+    .send_failed = this->send_failed.load(std::memory_order_relaxed),
+    .received = this->received.load(std::memory_order_relaxed),
+    .receive_full = this->receive_full.load(std::memory_order_relaxed),
+  };
+}
+
+// -------------------------------------------- ENGINE ---------------------------------------------
+
+bool MQTTThreaded::run(void) {
+  if (!this->started.load(std::memory_order_acquire)) {
+    return false; // the application is still setting up
+  }
+  uint16_t len;
+  uint8_t* rec = this->out.front(&len);
+  // Offline or mid-exchange, e.g. waiting on a PUBACK, publishing waits its turn in the ring.
+  bool handed = rec != nullptr && this->mqtt->mqttCanSend();
+  if (handed) {
+    uint8_t topiclen = rec[1];
+    struct { const uint8_t* data; uint16_t len; } payload = { rec + 3 + topiclen, (uint16_t)(len - 3 - topiclen) };
+    bool taken = this->mqtt->mqttSendMessage((const char*)rec + 2, [&payload](uint8_t* buf, uint16_t size) -> int32_t {
+      if (payload.len > size) {
+        return -1;
+      }
+      memcpy(buf, payload.data, payload.len);
+      return payload.len;
+    }, rec[0] & MQTT_THREAD_FLAG_RETAIN, rec[0] & MQTT_THREAD_FLAG_QOS);
+    if (taken) {
+      this->out.pop();
+      this->sent.fetch_add(1, std::memory_order_relaxed);
+    } else if (this->mqtt->mqttIsConnected()) {
+      // Would only fail again, e.g. too long for the buffer.
+      this->out.pop();
+      this->send_failed.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      handed = false; // lost with the connection, sent on the next one
+    }
+  }
+  this->mqtt->loop();
+  this->online.store(this->mqtt->mqttIsConnected(), std::memory_order_relaxed);
+  return handed && !this->out.empty();
+}
+
+void MQTTThreaded::receive(uint8_t handler, const char* payload, uint16_t len) {
+  uint8_t* rec = (uint32_t)len + 2 < MQTT_THREAD_IN_RING ? this->in.reserve(len + 2) : nullptr;
+  if (rec == nullptr) {
+    this->receive_full.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  rec[0] = handler;
+  memcpy(rec + 1, payload, len);
+  rec[1 + len] = '\0';
+  this->in.commit();
+  this->received.fetch_add(1, std::memory_order_relaxed);
+}
+
+#if defined(__linux__) || defined(__APPLE__)
+void MQTTThreaded::start(void) {
+  if (this->running.exchange(true)) {
+    return;
+  }
+  this->begin();
+  this->engine = std::thread([this]() {
+    while (this->running.load(std::memory_order_relaxed)) {
+      if (this->run() || this->mqtt->ioPending()) {
+        continue;
+      }
+      // Nothing to hand over and nothing arrived: sleep until the next deadline, waking often
+      // enough to pick up new publishes and data from the broker. No time left means more work,
+      // except while connecting, when loop() mostly polls the transport; that still sleeps a
+      // little, or the thread would spin.
+      uint32_t idle = this->mqtt->msUntilNextDeadline();
+      if (idle == 0 && this->mqtt->mqttIsConnected()) {
+        continue;
+      }
+      idle = idle > MQTT_THREAD_MAX_IDLE ? MQTT_THREAD_MAX_IDLE : idle;
+      idle = idle < MQTT_THREAD_MIN_IDLE ? MQTT_THREAD_MIN_IDLE : idle;
+      std::this_thread::sleep_for(std::chrono::milliseconds(idle));
+    }
+  });
+}
+
+void MQTTThreaded::stop(void) {
+  if (this->running.exchange(false)) {
+    this->engine.join();
+  }
+}
+#endif
+
+#endif
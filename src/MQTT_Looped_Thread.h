@@ -0,0 +1,223 @@
+#ifndef MQTT_LOOPED_THREAD_H
+#define MQTT_LOOPED_THREAD_H
+
+#include "MQTT_Looped.h"
+
+// Run MQTT_Looped on a thread or core of its own, see MQTTThreaded. Needs std::atomic.
+#ifndef MQTT_THREADED
+#if __has_include(<atomic>)
+#define MQTT_THREADED 1
+#else
+#define MQTT_THREADED 0
+#endif
+#endif
+
+#if MQTT_THREADED
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <chrono>
+#include <thread>
+#endif
+
+// Bytes of publishes waiting for the engine, each taking its topic, payload and 4 bytes.
+#ifndef MQTT_THREAD_OUT_RING
+#define MQTT_THREAD_OUT_RING 2048
+#endif
+
+// Bytes of received messages waiting for the application, each taking its payload and 4 bytes.
+#ifndef MQTT_THREAD_IN_RING
+#define MQTT_THREAD_IN_RING 2048
+#endif
+
+// Longest and shortest the engine started by start() sleeps when idle, ms. New publishes and data
+// from the broker wait up to the longest.
+#ifndef MQTT_THREAD_MAX_IDLE
+#define MQTT_THREAD_MAX_IDLE 1
+#endif
+#ifndef MQTT_THREAD_MIN_IDLE
+#define MQTT_THREAD_MIN_IDLE 1
+#endif
+
+// -------------------------------------------- TYPEDEF --------------------------------------------
+
+/**
+ * @brief Counters of messages passed between the application and the engine.
+ */
+typedef struct mqtt_thread_stats_t {
+  // Publishes queued by the application.
+  uint32_t queued;
+  // Publishes refused because the outbound ring was full.
+  uint32_t queue_full;
+  // Publishes sent, held back or stored by MQTT_Looped, handed over by the engine once connected
+  // and not mid-exchange.
+  uint32_t sent;
+  // Publishes MQTT_Looped failed to send while connected, e.g. too long for its buffer.
+  uint32_t send_failed;
+  // Messages received and queued for the application.
+  uint32_t received;
+  // Messages dropped because the application wasn't polling fast enough.
+  uint32_t receive_full;
+} mqtt_thread_stats_t;
+
+// ------------------------------------------- THREADED --------------------------------------------
+
+/**
+ * @brief Runs an MQTT_Looped on its own thread or core, the engine, so nothing the network does
+ *        stalls the application, and the other way around. The two only meet in a lock-free ring
+ *        each way: publishes out, received messages in.
+ *
+ *        Set up the MQTT_Looped and call onMqtt() here, then begin(); after that, the engine owns
+ *        it. The engine is whatever calls run() in a loop: start() on Linux and macOS, a task
+ *        pinned to the other core on ESP32, or loop1() on RP2040. run() does nothing until
+ *        begin(), so an engine already running, like loop1() alongside setup(), waits for it.
+ *
+ *        The application calls publish() and poll(); received messages are handed to their
+ *        callbacks from poll(), on the application's thread.
+ */
+class MQTTThreaded {
+  public:
+    /**
+     * @brief Constructor
+     *
+     * @param mqtt
+     */
+    MQTTThreaded(MQTT_Looped* mqtt) : mqtt(mqtt) {}
+    ~MQTTThreaded();
+
+    // ----- APPLICATION -----
+
+    /**
+     * @brief Subscribe, with callback called from poll(). Before begin().
+     *
+     * @param topic
+     * @param callback
+     * @param qos
+     * @return success
+     */
+    bool onMqtt(const char* topic, mqttcallback_t callback, uint8_t qos = 0);
+
+    /**
+     * @brief Queue a publish for the engine. Never waits on the network.
+     *
+     * @param topic
+     * @param payload
+     * @param len
+     * @param retain
+     * @param qos
+     * @return queued, false if the ring is full or the topic too long
+     */
+    bool publish(const char* topic, const uint8_t* payload, uint16_t len, bool retain = false, uint8_t qos = 0);
+
+    /**
+     * @brief Queue a publish for the engine. Never waits on the network.
+     *
+     * @param topic
+     * @param payload
+     * @param retain
+     * @param qos
+     * @return queued, false if the ring is full or the topic too long
+     */
+    bool publish(const char* topic, const char* payload, bool retain = false, uint8_t qos = 0);
+
+    /**
+     * @brief Let the engine start, once set up with onMqtt().
+     */
+    void begin(void);
+
+    /**
+     * @brief Hand received messages to their callbacks.
+     *
+     * @param max most messages to handle
+     * @return messages handled
+     */
+    uint16_t poll(uint16_t max = 8);
+
+    /**
+     * @brief Whether the engine is connected to the broker, as of its last loop.
+     *
+     * @return connected
+     */
+    bool connected(void) { return this->online.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Counters.
+     *
+     * @param stats
+     */
+    void getStats(mqtt_thread_stats_t* stats);
+
+    // ----- ENGINE -----
+
+    /**
+     * @brief One engine loop: hand over a queued publish if it can be sent, then
+     *        MQTT_Looped::loop(). Nothing until begin().
+     *
+     * @return a publish was handed over and more are queued
+     */
+    bool run(void);
+
+#if defined(__linux__) || defined(__APPLE__)
+    /**
+     * @brief begin() and run the engine on a std::thread until stop().
+     */
+    void start(void);
+
+    /**
+     * @brief Stop the engine started by start() and wait for it to finish.
+     */
+    void stop(void);
+#endif
+
+  private:
+    MQTT_Looped* mqtt;
+
+    /**
+     * @brief Application callbacks, by index.
+     */
+    MQTTList<mqttcallback_t, MQTT_MAX_SUBSCRIPTIONS> handlers;
+
+    /**
+     * @brief Publishes, application to engine: flags, topic length, topic with null terminator,
+     *        payload.
+     */
+    MQTTSpscRing<MQTT_THREAD_OUT_RING> out;
+
+    /**
+     * @brief Received messages, engine to application: handler index, payload with null
+     *        terminator.
+     */
+    MQTTSpscRing<MQTT_THREAD_IN_RING> in;
+
+    std::atomic<bool> online{false};
+
+    /**
+     * @brief Set by begin(), run() waits on it.
+     */
+    std::atomic<bool> started{false};
+
+    // Each written by one side only.
+    std::atomic<uint32_t> queued{0};
+    std::atomic<uint32_t> queue_full{0};
+    std::atomic<uint32_t> sent{0};
+    std::atomic<uint32_t> send_failed{0};
+    std::atomic<uint32_t> received{0};
+    std::atomic<uint32_t> receive_full{0};
+
+#if defined(__linux__) || defined(__APPLE__)
+    std::thread engine;
+    std::atomic<bool> running{false};
+#endif
+
+    /**
+     * @brief Engine: queue a received message for the application.
+     *
+     * @param handler
+     * @param payload
+     * @param len
+     */
+    void receive(uint8_t handler, const char* payload, uint16_t len);
+};
+
+#endif
+
+#endif
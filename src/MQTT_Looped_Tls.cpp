@@ -0,0 +1,330 @@
+#include "MQTT_Looped.h"
+
+#if MQTT_TLS
+
+#include <mbedtls/net_sockets.h>
+#include <mbedtls/version.h>
+
+// mbedTLS 3 marks the handshake state private, but it's the only way to see how a handshake went.
+#if MBEDTLS_VERSION_MAJOR >= 3
+#define MQTT_TLS_PRIVATE(member) MBEDTLS_PRIVATE(member)
+#else
+#define MQTT_TLS_PRIVATE(member) member
+#endif
+
+// -------------------------------------------- CONFIG ---------------------------------------------
+
+MQTTTlsConfig::MQTTTlsConfig(void) {
+  mbedtls_ssl_config_init(&this->conf);
+  mbedtls_entropy_init(&this->entropy);
+  mbedtls_ctr_drbg_init(&this->rng);
+  mbedtls_x509_crt_init(&this->ca);
+  mbedtls_x509_crt_init(&this->cert);
+  mbedtls_pk_init(&this->key);
+}
+
+MQTTTlsConfig::~MQTTTlsConfig() {
+  mbedtls_pk_free(&this->key);
+  mbedtls_x509_crt_free(&this->cert);
+  mbedtls_x509_crt_free(&this->ca);
+  mbedtls_ctr_drbg_free(&this->rng);
+  mbedtls_entropy_free(&this->entropy);
+  mbedtls_ssl_config_free(&this->conf);
+}
+
+bool MQTTTlsConfig::begin(const char* ca_pem) {
+  static const char pers[] = "MQTT_Looped";
+  int ret = mbedtls_ctr_drbg_seed(&this->rng, mbedtls_entropy_func, &this->entropy, (const unsigned char*)pers, sizeof(pers) - 1);
+  if (ret == 0) {
+    ret = mbedtls_ssl_config_defaults(&this->conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+  }
+  if (ret != 0) {
+    LOG_PRINT(F("TLS setup failed: "));
+    LOG_PRINTLN(ret);
+    return false;
+  }
+  mbedtls_ssl_conf_rng(&this->conf, mbedtls_ctr_drbg_random, &this->rng);
+  // TLS 1.2, where a resumed handshake skips the certificate exchange entirely.
+#if MBEDTLS_VERSION_NUMBER >= 0x03020000
+  mbedtls_ssl_conf_max_tls_version(&this->conf, MBEDTLS_SSL_VERSION_TLS1_2);
+#else
+  mbedtls_ssl_conf_max_version(&this->conf, MBEDTLS_SSL_MAJOR_VERSION_3, MBEDTLS_SSL_MINOR_VERSION_3);
+#endif
+#ifdef MBEDTLS_SSL_SESSION_TICKETS
+  mbedtls_ssl_conf_session_tickets(&this->conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+  if (ca_pem == nullptr) {
+    LOG_PRINTLN(F("TLS: not verifying the broker's certificate"));
+    mbedtls_ssl_conf_authmode(&this->conf, MBEDTLS_SSL_VERIFY_NONE);
+    return true;
+  }
+  // PEM lengths include the null terminator.
+  ret = mbedtls_x509_crt_parse(&this->ca, (const unsigned char*)ca_pem, strlen(ca_pem) + 1);
+  if (ret != 0) {
+    LOG_PRINT(F("TLS CA certificate invalid: "));
+    LOG_PRINTLN(ret);
+    return false;
+  }
+  mbedtls_ssl_conf_ca_chain(&this->conf, &this->ca, nullptr);
+  mbedtls_ssl_conf_authmode(&this->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+  return true;
+}
+
+bool MQTTTlsConfig::setClientCert(const char* cert_pem, const char* key_pem) {
+  int ret = mbedtls_x509_crt_parse(&this->cert, (const unsigned char*)cert_pem, strlen(cert_pem) + 1);
+  if (ret == 0) {
+#if MBEDTLS_VERSION_MAJOR >= 3
+    ret = mbedtls_pk_parse_key(&this->key, (const unsigned char*)key_pem, strlen(key_pem) + 1, nullptr, 0, mbedtls_ctr_drbg_random, &this->rng);
+#else
+    ret = mbedtls_pk_parse_key(&this->key, (const unsigned char*)key_pem, strlen(key_pem) + 1, nullptr, 0);
+#endif
+  }
+  if (ret == 0) {
+    ret = mbedtls_ssl_conf_own_cert(&this->conf, &this->cert, &this->key);
+  }
+  if (ret != 0) {
+    LOG_PRINT(F("TLS client certificate invalid: "));
+    LOG_PRINTLN(ret);
+    return false;
+  }
+  return true;
+}
+
+// ------------------------------------------- TRANSPORT -------------------------------------------
+
+MQTTTransportTls::MQTTTransportTls(MQTTTransport* inner, MQTTTlsConfig* config, const char* hostname)
+  : inner(inner),
+    config(config),
+    hostname(hostname)
+{
+  mbedtls_ssl_init(&this->ssl);
+  mbedtls_ssl_session_init(&this->session);
+}
+
+MQTTTransportTls::~MQTTTransportTls() {
+  this->close();
+  mbedtls_ssl_session_free(&this->session);
+  mbedtls_ssl_free(&this->ssl);
+}
+
+bool MQTTTransportTls::connect(IPAddress address, uint16_t port) {
+  this->out_len = 0;
+  if (!this->inner->connect(address, port)) {
+    return false;
+  }
+  this->state = MQTT_TLS_CONNECTING;
+  return true;
+}
+
+bool MQTTTransportTls::connected(void) {
+  switch (this->state) {
+    case MQTT_TLS_CONNECTING:
+      if (!this->inner->connected()) {
+        return false;
+      }
+      if (!this->startHandshake()) {
+        this->state = MQTT_TLS_FAILED;
+        return false;
+      }
+      return this->stepHandshake();
+    case MQTT_TLS_HANDSHAKE:
+      return this->stepHandshake();
+    case MQTT_TLS_ESTABLISHED:
+      this->flush();
+      return this->state == MQTT_TLS_ESTABLISHED && this->inner->connected();
+    default:
+      return false;
+  }
+}
+
+bool MQTTTransportTls::startHandshake(void) {
+  if (!this->ssl_ready) {
+    if (mbedtls_ssl_setup(&this->ssl, &this->config->conf) != 0) {
+      LOG_PRINTLN(F("TLS setup failed, config not begun?"));
+      return false;
+    }
+    mbedtls_ssl_set_bio(&this->ssl, this, bioSend, bioRecv, nullptr);
+    this->ssl_ready = true;
+  } else if (mbedtls_ssl_session_reset(&this->ssl) != 0) {
+    return false;
+  }
+  // nullptr turns off the name check, which mbedTLS otherwise insists on.
+  if (mbedtls_ssl_set_hostname(&this->ssl, this->hostname) != 0) {
+    return false;
+  }
+  this->session_offered = this->session_saved && mbedtls_ssl_set_session(&this->ssl, &this->session) == 0;
+  this->saw_certificate = false;
+  this->handshake_start = millis();
+  this->state = MQTT_TLS_HANDSHAKE;
+  DEBUG_PRINTLN(this->session_offered ? F("TLS handshake, resuming") : F("TLS handshake"));
+  return true;
+}
+
+bool MQTTTransportTls::stepHandshake(void) {
+  this->flush();
+  while (this->ssl.MQTT_TLS_PRIVATE(state) != MBEDTLS_SSL_HANDSHAKE_OVER) {
+    // The broker only sends its certificate in a full handshake.
+    if (this->ssl.MQTT_TLS_PRIVATE(state) == MBEDTLS_SSL_SERVER_CERTIFICATE) {
+      this->saw_certificate = true;
+    }
+    int ret = mbedtls_ssl_handshake_step(&this->ssl);
+    if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+      return false;
+    }
+    if (ret != 0 || this->state != MQTT_TLS_HANDSHAKE) {
+      LOG_PRINT(F("TLS handshake failed: "));
+      LOG_PRINTLN(ret);
+      this->stats.failed++;
+      this->forgetSession();
+      this->state = MQTT_TLS_FAILED;
+      return false;
+    }
+  }
+
+  uint32_t ms = millis() - this->handshake_start;
+  bool resumed = this->session_offered && !this->saw_certificate;
+  this->stats.last_ms = ms;
+  if (resumed) {
+    this->stats.resumed++;
+    this->stats.resumed_ms += ms;
+  } else {
+    this->stats.full++;
+    this->stats.full_ms += ms;
+  }
+  LOG_PRINT(resumed ? F("TLS session resumed, ms: ") : F("TLS full handshake, ms: "));
+  LOG_PRINTLN(ms);
+  // Keep the session to offer next time.
+  mbedtls_ssl_session_free(&this->session);
+  mbedtls_ssl_session_init(&this->session);
+  this->session_saved = mbedtls_ssl_get_session(&this->ssl, &this->session) == 0;
+  this->state = MQTT_TLS_ESTABLISHED;
+  return true;
+}
+
+void MQTTTransportTls::forgetSession(void) {
+  mbedtls_ssl_session_free(&this->session);
+  mbedtls_ssl_session_init(&this->session);
+  this->session_saved = false;
+}
+
+uint8_t MQTTTransportTls::status(void) {
+  return this->state;
+}
+
+int MQTTTransportTls::available(void) {
+  if (this->state != MQTT_TLS_ESTABLISHED) {
+    return 0;
+  }
+  this->flush();
+  size_t n = mbedtls_ssl_get_bytes_avail(&this->ssl);
+  if (n == 0 && this->inner->available() > 0) {
+    // Decrypt the next record, if it has all arrived, without taking anything from it.
+    uint8_t none;
+    int ret = mbedtls_ssl_read(&this->ssl, &none, 0);
+    if (ret < 0 && ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+      this->state = MQTT_TLS_FAILED;
+      return 0;
+    }
+    n = mbedtls_ssl_get_bytes_avail(&this->ssl);
+  }
+  return n;
+}
+
+int MQTTTransportTls::read(uint8_t* buf, size_t len) {
+  if (this->state != MQTT_TLS_ESTABLISHED) {
+    return -1;
+  }
+  this->flush();
+  int ret = mbedtls_ssl_read(&this->ssl, buf, len);
+  if (ret > 0) {
+    return ret;
+  }
+  if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+    return 0;
+  }
+  // Close notify, end of stream or an error.
+  this->state = MQTT_TLS_FAILED;
+  return -1;
+}
+
+size_t MQTTTransportTls::write(const uint8_t* buf, size_t len) {
+  // Like a full socket buffer, wait on what's already waiting.
+  if (this->state != MQTT_TLS_ESTABLISHED || !this->flush()) {
+    return 0;
+  }
+  int ret = mbedtls_ssl_write(&this->ssl, buf, len);
+  if (ret > 0) {
+    return ret;
+  }
+  // bioSend() only asks to wait when out is full. mbedTLS then holds half a record that it
+  // would need the exact same write to finish, so the stream can't go on.
+  DEBUG_PRINT(F("TLS write failed: "));
+  DEBUG_PRINTLN(ret);
+  this->state = MQTT_TLS_FAILED;
+  return 0;
+}
+
+bool MQTTTransportTls::isOpen(void) {
+  return this->inner->isOpen();
+}
+
+void MQTTTransportTls::close(void) {
+  if (this->state == MQTT_TLS_ESTABLISHED) {
+    // Best effort, the session is kept either way.
+    mbedtls_ssl_close_notify(&this->ssl);
+    this->flush();
+  }
+  this->out_len = 0;
+  this->state = MQTT_TLS_CLOSED;
+  this->inner->close();
+}
+
+bool MQTTTransportTls::closed(void) {
+  return this->inner->closed();
+}
+
+bool MQTTTransportTls::flush(void) {
+  while (this->out_len > 0) {
+    size_t n = this->inner->write(this->out, this->out_len);
+    if (n == 0) {
+      if (!this->inner->connected()) {
+        this->state = MQTT_TLS_FAILED;
+      }
+      return false;
+    }
+    memmove(this->out, this->out + n, this->out_len - n);
+    this->out_len -= n;
+  }
+  return true;
+}
+
+int MQTTTransportTls::bioSend(void* ctx, const unsigned char* buf, size_t len) {
+  MQTTTransportTls* t = (MQTTTransportTls*)ctx;
+  size_t sent = 0;
+  if (t->flush()) {
+    sent = t->inner->write(buf, len);
+    if (sent == 0 && !t->inner->connected()) {
+      return MBEDTLS_ERR_NET_SEND_FAILED;
+    }
+  }
+  // Hold the rest, so a write never has to be repeated.
+  if (len - sent > sizeof(t->out) - t->out_len) {
+    return sent > 0 ? (int)sent : MBEDTLS_ERR_SSL_WANT_WRITE;
+  }
+  memcpy(t->out + t->out_len, buf + sent, len - sent);
+  t->out_len += len - sent;
+  return len;
+}
+
+int MQTTTransportTls::bioRecv(void* ctx, unsigned char* buf, size_t len) {
+  MQTTTransportTls* t = (MQTTTransportTls*)ctx;
+  // Anything we said has to go out before an answer can come back.
+  t->flush();
+  int n = t->inner->read(buf, len);
+  if (n > 0) {
+    return n;
+  }
+  return n == 0 ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_NET_CONN_RESET;
+}
+
+#endif
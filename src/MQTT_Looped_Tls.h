@@ -0,0 +1,208 @@
+#ifndef MQTT_LOOPED_TLS_H
+#define MQTT_LOOPED_TLS_H
+
+#include "MQTT_Looped_Transport.h"
+
+// TLS over any transport with mbedTLS, which ESP32 cores ship with and host builds link with
+// -lmbedtls -lmbedx509 -lmbedcrypto.
+#ifndef MQTT_TLS
+#define MQTT_TLS 0
+#endif
+
+#if MQTT_TLS
+
+#if !__has_include(<mbedtls/ssl.h>)
+#error "MQTT_TLS needs mbedTLS"
+#endif
+
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/pk.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/x509_crt.h>
+
+// Encrypted bytes the inner transport couldn't take yet, held until it can. Needs to fit the
+// largest record sent at once: a handshake message or a packet from sendPacket() plus ~30 bytes.
+#ifndef MQTT_TLS_OUT_BUFFER
+#define MQTT_TLS_OUT_BUFFER 1024
+#endif
+
+// -------------------------------------------- TYPEDEF --------------------------------------------
+
+/**
+ * @brief Connection states reported by MQTTTransportTls::status().
+ */
+typedef enum {
+  MQTT_TLS_CLOSED = 0,
+  MQTT_TLS_CONNECTING = 1,
+  MQTT_TLS_HANDSHAKE = 2,
+  MQTT_TLS_ESTABLISHED = 3,
+  MQTT_TLS_FAILED = 4,
+} mqtt_tls_state_t;
+
+/**
+ * @brief Handshake counters and times, to see what session resumption saves.
+ */
+typedef struct mqtt_tls_stats_t {
+  // Full handshakes, with certificate exchange and key agreement.
+  uint32_t full;
+  // Handshakes that resumed the previous session.
+  uint32_t resumed;
+  // Handshakes that failed, e.g. the certificate didn't verify.
+  uint32_t failed;
+  // Total ms spent in full and resumed handshakes, for averages.
+  uint32_t full_ms;
+  uint32_t resumed_ms;
+  // Last handshake, ms.
+  uint32_t last_ms;
+} mqtt_tls_stats_t;
+
+// -------------------------------------------- CONFIG ---------------------------------------------
+
+/**
+ * @brief Settings, certificates and random number generator shared by TLS connections. Not
+ *        thread safe: connections driven from different threads need their own.
+ */
+class MQTTTlsConfig {
+  public:
+    MQTTTlsConfig(void);
+    ~MQTTTlsConfig();
+
+    /**
+     * @brief Set up, trusting the given CA certificates.
+     *
+     * @param ca_pem PEM certificates the broker's is checked against, or nullptr to skip
+     *               verification (testing only)
+     * @return success
+     */
+    bool begin(const char* ca_pem);
+
+    /**
+     * @brief Present a client certificate, for brokers that authenticate clients by
+     *        certificate. Call after begin().
+     *
+     * @param cert_pem
+     * @param key_pem
+     * @return success
+     */
+    bool setClientCert(const char* cert_pem, const char* key_pem);
+
+  private:
+    friend class MQTTTransportTls;
+
+    mbedtls_ssl_config conf;
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context rng;
+    mbedtls_x509_crt ca;
+    mbedtls_x509_crt cert;
+    mbedtls_pk_context key;
+};
+
+// ------------------------------------------- TRANSPORT -------------------------------------------
+
+/**
+ * @brief TLS 1.2 over another transport. The handshake runs in steps from connected(), so it
+ *        never blocks, and has MQTT_CONNECT_TIMEOUT to finish.
+ *
+ *        The session from each handshake is kept and offered on the next connect. If the broker
+ *        still has it (session ID or ticket), the handshake is resumed: no certificates, no key
+ *        agreement, a round trip shorter, and a fraction of the CPU time of a full handshake.
+ */
+class MQTTTransportTls : public MQTTTransport {
+  public:
+    /**
+     * @brief Constructor
+     *
+     * @param inner plain transport to the broker, e.g. MQTTTransportPosix
+     * @param config begun before connecting
+     * @param hostname broker name checked against its certificate and sent as SNI, or nullptr
+     */
+    MQTTTransportTls(MQTTTransport* inner, MQTTTlsConfig* config, const char* hostname = nullptr);
+    ~MQTTTransportTls();
+
+    bool linkBegin(void) override { return this->inner->linkBegin(); }
+    mqtt_transport_link_t linkStatus(void) override { return this->inner->linkStatus(); }
+    bool connect(IPAddress address, uint16_t port) override;
+    bool connected(void) override;
+    uint8_t status(void) override;
+    int available(void) override;
+    int read(uint8_t* buf, size_t len) override;
+    size_t write(const uint8_t* buf, size_t len) override;
+    bool isOpen(void) override;
+    void close(void) override;
+    bool closed(void) override;
+
+    /**
+     * @brief Handshake counters and times.
+     *
+     * @return stats
+     */
+    const mqtt_tls_stats_t* getStats(void) { return &this->stats; }
+
+    /**
+     * @brief Drop the kept session, so the next handshake is a full one.
+     */
+    void forgetSession(void);
+
+  private:
+    MQTTTransport* inner;
+    MQTTTlsConfig* config;
+    const char* hostname;
+
+    mbedtls_ssl_context ssl;
+    bool ssl_ready = false;
+    mqtt_tls_state_t state = MQTT_TLS_CLOSED;
+
+    /**
+     * @brief Session from the last handshake, offered on the next one.
+     */
+    mbedtls_ssl_session session;
+    bool session_saved = false;
+
+    /**
+     * @brief Current handshake: when it started, whether a session was offered, and whether the
+     *        broker sent its certificate, which it only does for a full handshake.
+     */
+    uint32_t handshake_start = 0;
+    bool session_offered = false;
+    bool saw_certificate = false;
+
+    mqtt_tls_stats_t stats = {};
+
+    /**
+     * @brief Encrypted bytes waiting on the inner transport.
+     */
+    uint8_t out[MQTT_TLS_OUT_BUFFER];
+    uint16_t out_len = 0;
+
+    /**
+     * @brief Start the handshake once the inner transport is connected.
+     *
+     * @return success
+     */
+    bool startHandshake(void);
+
+    /**
+     * @brief Run handshake steps until it needs the network or is done.
+     *
+     * @return handshake done
+     */
+    bool stepHandshake(void);
+
+    /**
+     * @brief Send what's waiting in out.
+     *
+     * @return nothing left waiting
+     */
+    bool flush(void);
+
+    /**
+     * @brief mbedTLS callbacks onto the inner transport.
+     */
+    static int bioSend(void* ctx, const unsigned char* buf, size_t len);
+    static int bioRecv(void* ctx, unsigned char* buf, size_t len);
+};
+
+#endif
+
+#endif
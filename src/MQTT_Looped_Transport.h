@@ -0,0 +1,113 @@
+#ifndef MQTT_LOOPED_TRANSPORT_H
+#define MQTT_LOOPED_TRANSPORT_H
+
+#include <Arduino.h>
+
+// -------------------------------------------- TYPEDEF --------------------------------------------
+
+/**
+ * @brief State of the network link underneath a transport (e.g. WiFi association).
+ */
+typedef enum {
+  MQTT_TRANSPORT_LINK_WAITING = 0,
+  MQTT_TRANSPORT_LINK_UP = 1,
+  MQTT_TRANSPORT_LINK_FAILED = 2,
+} mqtt_transport_link_t;
+
+// ------------------------------------------- TRANSPORT -------------------------------------------
+
+/**
+ * @brief Byte stream used by MQTT_Looped to reach the broker.
+ *        Every method must return without blocking for long; MQTT_Looped calls them once per
+ *        loop and waits across loops.
+ */
+class MQTTTransport {
+  public:
+    virtual ~MQTTTransport() {}
+
+    /**
+     * @brief Start bringing up the network link. Links that are always up (Ethernet, host
+     *        sockets) can rely on the default.
+     *
+     * @return ready to connect the link
+     */
+    virtual bool linkBegin(void) { return true; }
+
+    /**
+     * @brief Poll the state of the network link.
+     *
+     * @return link status
+     */
+    virtual mqtt_transport_link_t linkStatus(void) { return MQTT_TRANSPORT_LINK_UP; }
+
+    /**
+     * @brief Start opening a connection. Completion is polled via connected().
+     *
+     * @param address
+     * @param port
+     * @return a socket was available and the connection was started
+     */
+    virtual bool connect(IPAddress address, uint16_t port) = 0;
+
+    /**
+     * @brief Whether the connection is established.
+     *
+     * @return connected
+     */
+    virtual bool connected(void) = 0;
+
+    /**
+     * @brief Driver-specific connection state, for logging only.
+     *
+     * @return status
+     */
+    virtual uint8_t status(void) = 0;
+
+    /**
+     * @brief Number of bytes that can be read without waiting.
+     *
+     * @return bytes available
+     */
+    virtual int available(void) = 0;
+
+    /**
+     * @brief Read up to len bytes.
+     *
+     * @param buf
+     * @param len
+     * @return bytes read, 0 if none are available, negative on error
+     */
+    virtual int read(uint8_t* buf, size_t len) = 0;
+
+    /**
+     * @brief Write up to len bytes, without waiting for room. What isn't taken is written again
+     *        from a later loop().
+     *
+     * @param buf
+     * @param len
+     * @return bytes written, 0 if none can be written now; connected() tells a full send buffer
+     *         from a failure
+     */
+    virtual size_t write(const uint8_t* buf, size_t len) = 0;
+
+    /**
+     * @brief Whether a socket is currently held, connected or not.
+     *
+     * @return socket is open
+     */
+    virtual bool isOpen(void) = 0;
+
+    /**
+     * @brief Start closing the socket. Completion is polled via closed().
+     */
+    virtual void close(void) = 0;
+
+    /**
+     * @brief Poll a close started by close(), releasing the socket once it has closed.
+     *
+     * @return socket closed and released
+     */
+    virtual bool closed(void) = 0;
+};
+
+#endif
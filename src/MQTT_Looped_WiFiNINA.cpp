@@ -0,0 +1,100 @@
+#include "MQTT_Looped.h"
+
+#ifdef MQTT_LOOPED_WIFININA
+
+MQTTTransportWiFiNINA::MQTTTransportWiFiNINA(WiFiClient* client, const char* ssid, const char* wifi_pass)
+  : wifiClient(client),
+    ssid(ssid),
+    wifi_pass(wifi_pass)
+{
+  // Create a pointer to `_sock` private property of wifiClient.
+  this->_sock = &(this->wifiClient->*robbed<WiFiClientSock>::ptr);
+}
+
+bool MQTTTransportWiFiNINA::linkBegin(void) {
+  LOG_PRINT(this->ssid);
+  int8_t ret;
+  if (this->wifi_pass == nullptr || this->wifi_pass[0] == '\0') {
+    ret = WiFiDrv::wifiSetNetwork(this->ssid, strlen(this->ssid));
+  } else {
+    ret = WiFiDrv::wifiSetPassphrase(this->ssid, strlen(this->ssid), this->wifi_pass, strlen(this->wifi_pass));
+  }
+  return ret == WL_SUCCESS;
+}
+
+mqtt_transport_link_t MQTTTransportWiFiNINA::linkStatus(void) {
+  int8_t wifiStatus = WiFiDrv::getConnectionStatus();
+  switch (wifiStatus) {
+    case WL_CONNECTED:
+      return MQTT_TRANSPORT_LINK_UP;
+    case WL_IDLE_STATUS:
+    case WL_NO_SSID_AVAIL:
+    case WL_SCAN_COMPLETED:
+      // do nothing, wait...we might be here a few seconds...
+      return MQTT_TRANSPORT_LINK_WAITING;
+    case WL_FAILURE:
+    case WL_AP_FAILED:
+    case WL_CONNECT_FAILED:
+    case WL_CONNECTION_LOST:
+      return MQTT_TRANSPORT_LINK_FAILED;
+    default:
+      LOG_PRINT(F("Unknown WiFi status: "));
+      LOG_PRINTLN(String(wifiStatus));
+      return MQTT_TRANSPORT_LINK_FAILED;
+  }
+}
+
+bool MQTTTransportWiFiNINA::connect(IPAddress address, uint16_t port) {
+  // Get a socket and confirm or restart.
+  *this->_sock = ServerDrv::getSocket();
+  if (*this->_sock == NO_SOCKET_AVAIL) {
+    return false;
+  }
+  DEBUG_PRINT(F("Connecting on socket "));
+  DEBUG_PRINTLN(*this->_sock);
+  ServerDrv::startClient(uint32_t(address), port, *this->_sock);
+  return true;
+}
+
+bool MQTTTransportWiFiNINA::connected(void) {
+  return this->wifiClient->connected();
+}
+
+uint8_t MQTTTransportWiFiNINA::status(void) {
+  return this->wifiClient->status();
+}
+
+int MQTTTransportWiFiNINA::available(void) {
+  return this->wifiClient->available();
+}
+
+int MQTTTransportWiFiNINA::read(uint8_t* buf, size_t len) {
+  // WiFiClient returns -1 for no data too, only a lost connection is an error.
+  if (this->wifiClient->available() <= 0) {
+    return this->wifiClient->connected() ? 0 : -1;
+  }
+  return this->wifiClient->read(buf, len);
+}
+
+size_t MQTTTransportWiFiNINA::write(const uint8_t* buf, size_t len) {
+  return this->wifiClient->write(buf, len);
+}
+
+bool MQTTTransportWiFiNINA::isOpen(void) {
+  return *this->_sock != NO_SOCKET_AVAIL;
+}
+
+void MQTTTransportWiFiNINA::close(void) {
+  ServerDrv::stopClient(*this->_sock);
+}
+
+bool MQTTTransportWiFiNINA::closed(void) {
+  if (this->wifiClient->status() != CLOSED) {
+    return false;
+  }
+  WiFiSocketBuffer.close(*this->_sock);
+  *this->_sock = NO_SOCKET_AVAIL;
+  return true;
+}
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef MQTT_LOOPED_WIFININA_H
+#define MQTT_LOOPED_WIFININA_H
+
+#include "MQTT_Looped_Transport.h"
+
+#include <utility/wifi_drv.h>
+#include <utility/server_drv.h>
+#include <utility/WiFiSocketBuffer.h>
+
+// If WiFi library differs.
+#ifndef WL_SUCCESS
+#define WL_SUCCESS 1
+#endif
+#ifndef WL_FAILURE
+#define WL_FAILURE -1
+#endif
+
+// -------------------------------------------- ROBBERY --------------------------------------------
+// Rob a pointer to a private property of an object.
+
+// Struct to hold the stolen pointer (ptr).
+template<typename Tag>
+struct robbed {
+  typedef typename Tag::type type;
+  static type ptr;
+};
+template<typename Tag>
+typename robbed<Tag>::type robbed<Tag>::ptr;
+
+// Struct to rob a pointer.
+template<typename Tag, typename Tag::type p>
+struct rob : robbed<Tag> {
+  struct filler {
+    filler() { robbed<Tag>::ptr = p; }
+  };
+  static filler filler_obj;
+};
+template<typename Tag, typename Tag::type p>
+typename rob<Tag, p>::filler rob<Tag, p>::filler_obj;
+
+// (uint8_t) &WiFiClient::_sock
+// wifiClientObj->_sock <=> &(wifiClientObj->*robbed<WiFiClientSock>::ptr);
+struct WiFiClientSock { typedef uint8_t WiFiClient::*type; };
+template class rob<WiFiClientSock, &WiFiClient::_sock>;
+
+// ------------------------------------------- TRANSPORT -------------------------------------------
+
+/**
+ * @brief Transport over a WiFiNINA WiFiClient, driving the NINA socket directly so that
+ *        connecting and closing never block.
+ */
+class MQTTTransportWiFiNINA : public MQTTTransport {
+  public:
+    /**
+     * @brief Constructor.
+     *
+     * @param client
+     * @param ssid
+     * @param wifi_pass empty for open networks
+     */
+    MQTTTransportWiFiNINA(WiFiClient* client, const char* ssid, const char* wifi_pass = "");
+
+    bool linkBegin(void) override;
+    mqtt_transport_link_t linkStatus(void) override;
+    bool connect(IPAddress address, uint16_t port) override;
+    bool connected(void) override;
+    uint8_t status(void) override;
+    int available(void) override;
+    int read(uint8_t* buf, size_t len) override;
+    size_t write(const uint8_t* buf, size_t len) override;
+    bool isOpen(void) override;
+    void close(void) override;
+    bool closed(void) override;
+
+  private:
+    /**
+     * @brief The WiFi client.
+     */
+    WiFiClient* wifiClient;
+
+    /**
+     * @brief WiFi network name.
+     */
+    const char* ssid;
+
+    /**
+     * @brief Password for WiFi.
+     */
+    const char* wifi_pass;
+
+    /**
+     * @brief Pointer to socket (private) of wifiClient.
+     */
+    uint8_t* _sock;
+};
+
+#endif